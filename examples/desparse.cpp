@@ -113,6 +113,8 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    sparseSetVerifyCrc32(sparseCtx.get(), true);
+
     if (!sparseOpen(sparseCtx.get(), &cbOpen, &cbClose, &cbRead, &cbSeek,
                     nullptr, &ctx)) {
         return EXIT_FAILURE;
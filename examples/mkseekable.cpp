@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+#include <string>
+
+#include <cstdlib>
+#include <cstdio>
+
+#include "mbcommon/file/filename.h"
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_seekable.h"
+
+typedef std::unique_ptr<MbFile, int (*)(MbFile *)> ScopedMbFile;
+typedef std::unique_ptr<SparseCtx, bool (*)(SparseCtx *)> ScopedSparseCtx;
+
+struct Context
+{
+    std::string path;
+    ScopedMbFile file{nullptr, &mb_file_free};
+};
+
+bool cbOpen(void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    if (mb_file_open_filename(ctx->file.get(), ctx->path.c_str(),
+            MB_FILE_OPEN_READ_ONLY) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    return true;
+}
+
+bool cbClose(void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    if (mb_file_close(ctx->file.get()) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to close: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    return true;
+}
+
+bool cbRead(void *buf, uint64_t size, uint64_t *bytesRead, void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    size_t total = 0;
+    while (size > 0) {
+        size_t partial;
+        if (mb_file_read(ctx->file.get(), buf, size, &partial) != MB_FILE_OK) {
+            fprintf(stderr, "%s: Failed to read: %s\n",
+                    ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+            return false;
+        }
+        size -= partial;
+        total += partial;
+        buf = static_cast<char *>(buf) + partial;
+    }
+    *bytesRead = total;
+    return true;
+}
+
+bool cbSeek(int64_t offset, int whence, void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    if (mb_file_seek(ctx->file.get(), offset, whence, nullptr) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to seek: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    return true;
+}
+
+bool cbWrite(const void *buf, uint64_t size, uint64_t *bytesWritten,
+             void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    size_t n;
+    if (mb_file_write(ctx->file.get(), buf, size, &n) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to write: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    *bytesWritten = n;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        std::fprintf(stderr, "Usage: %s <sparse file> <output file>"
+                     " [frame size]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *inputFile = argv[1];
+    const char *outputFile = argv[2];
+    uint32_t frameSize = 0;
+
+    if (argc == 4) {
+        char *end;
+        frameSize = strtoul(argv[3], &end, 10);
+        if (!*argv[3] || *end) {
+            fprintf(stderr, "Invalid frame size: %s\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    Context input;
+    input.path = inputFile;
+    input.file.reset(mb_file_new());
+
+    Context output;
+    output.path = outputFile;
+    output.file.reset(mb_file_new());
+
+    if (!input.file || !output.file) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    ScopedSparseCtx sparseCtx(sparseCtxNew(), &sparseCtxFree);
+    if (!sparseCtx) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    sparseSetVerifyCrc32(sparseCtx.get(), true);
+
+    if (!sparseOpen(sparseCtx.get(), &cbOpen, &cbClose, &cbRead, &cbSeek,
+                    nullptr, &input)) {
+        return EXIT_FAILURE;
+    }
+
+    if (mb_file_open_filename(output.file.get(), outputFile,
+                              MB_FILE_OPEN_WRITE_ONLY) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                outputFile, mb_file_error_string(output.file.get()));
+        return EXIT_FAILURE;
+    }
+
+    // Compress frames using all CPUs
+    if (!sparseSeekableCompress(sparseCtx.get(), &cbWrite, frameSize, 0,
+                                &output)) {
+        fprintf(stderr, "Failed to create seekable container\n");
+        return EXIT_FAILURE;
+    }
+
+    return mb_file_close(output.file.get()) == MB_FILE_OK
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+}
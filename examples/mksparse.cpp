@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+#include <string>
+
+#include <cstdlib>
+#include <cstdio>
+
+#include "mbcommon/file/filename.h"
+#include "mbsparse/sparse_writer.h"
+
+typedef std::unique_ptr<MbFile, int (*)(MbFile *)> ScopedMbFile;
+typedef std::unique_ptr<SparseWriterCtx, bool (*)(SparseWriterCtx *)>
+        ScopedSparseWriterCtx;
+
+struct Context
+{
+    std::string path;
+    ScopedMbFile file{nullptr, &mb_file_free};
+};
+
+bool cbOpen(void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    if (mb_file_open_filename(ctx->file.get(), ctx->path.c_str(),
+            MB_FILE_OPEN_WRITE_ONLY) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    return true;
+}
+
+bool cbClose(void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    if (mb_file_close(ctx->file.get()) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to close: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    return true;
+}
+
+bool cbWrite(const void *buf, uint64_t size, uint64_t *bytesWritten,
+             void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    size_t n;
+    if (mb_file_write(ctx->file.get(), buf, size, &n) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to write: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    *bytesWritten = n;
+    return true;
+}
+
+bool cbSeek(int64_t offset, int whence, void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    if (mb_file_seek(ctx->file.get(), offset, whence, nullptr) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to seek: %s\n",
+                ctx->path.c_str(), mb_file_error_string(ctx->file.get()));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        std::fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *inputFile = argv[1];
+    const char *outputFile = argv[2];
+
+    ScopedMbFile file(mb_file_new(), &mb_file_free);
+    if (!file) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (mb_file_open_filename(file.get(), inputFile, MB_FILE_OPEN_READ_ONLY)
+            != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                inputFile, mb_file_error_string(file.get()));
+        return EXIT_FAILURE;
+    }
+
+    Context ctx;
+    ctx.path = outputFile;
+    ctx.file.reset(mb_file_new());
+
+    if (!ctx.file) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    ScopedSparseWriterCtx sparseCtx(sparseWriterCtxNew(), &sparseWriterCtxFree);
+    if (!sparseCtx) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sparseWriterSetCrc32(sparseCtx.get(), true)
+            || !sparseWriterOpen(sparseCtx.get(), &cbOpen, &cbClose, &cbWrite,
+                                 &cbSeek, &ctx)) {
+        return EXIT_FAILURE;
+    }
+
+    size_t bytesRead;
+    static char buf[1024 * 1024];
+    int ret;
+    while ((ret = mb_file_read(file.get(), buf, sizeof(buf), &bytesRead))
+            == MB_FILE_OK && bytesRead > 0) {
+        if (!sparseWriterWrite(sparseCtx.get(), buf, bytesRead)) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (ret != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to read: %s\n",
+                inputFile, mb_file_error_string(file.get()));
+        return EXIT_FAILURE;
+    }
+
+    return sparseWriterClose(sparseCtx.get()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Throughput benchmark for the boot image readers and writers.
+//
+// For each format, a synthetic image is generated in memory and the following
+// operations are timed:
+//
+//   open      - mb_bi_reader_open() with all formats enabled (bidding)
+//   header    - open + mb_bi_reader_read_header()
+//   entries   - open + header + reading all entry data
+//   write     - writing the image with the format's writer
+//   write+sha - same as above, but also computing a SHA1 digest of each entry
+//               on the caller side (like mbtool does for checksums)
+//
+// The open and header stages only parse the headers and do not read the
+// payload, so only their time per operation is reported. Throughput for the
+// other stages is based on the entry data read or the image size written.
+//
+// Allocation counts are collected by interposing malloc() on glibc.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include <openssl/sha.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/defs.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/format/mtk_defs.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+#define DEFAULT_KERNEL_SIZE     (8 * 1024 * 1024)
+#define DEFAULT_RAMDISK_SIZE    (4 * 1024 * 1024)
+#define DEFAULT_ITERATIONS      10
+#define IO_BUF_SIZE             (64 * 1024)
+
+// Fake aboot image that the Loki patcher will match against the first target
+// (AT&T Galaxy S4): aboot_base + offset of PATTERN1 == check_sigs
+#define FAKE_ABOOT_SIZE         0x2000
+#define FAKE_ABOOT_PATTERN_OFF  0x800
+#define FAKE_ABOOT_CHECK_SIGS   0x88e0ff98
+#define FAKE_ABOOT_PATTERN      "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7"
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation counting
+////////////////////////////////////////////////////////////////////////////////
+
+static std::atomic<uint64_t> g_alloc_count(0);
+static std::atomic<uint64_t> g_alloc_bytes(0);
+
+#ifdef __GLIBC__
+#  define HAVE_ALLOC_COUNTING 1
+
+extern "C" {
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void *ptr, size_t size);
+
+void * malloc(size_t size)
+{
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(nmemb * size, std::memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void *ptr, size_t size)
+{
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+}
+#else
+#  define HAVE_ALLOC_COUNTING 0
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Image generation
+////////////////////////////////////////////////////////////////////////////////
+
+struct BenchFormat
+{
+    int code;
+    const char *name;
+};
+
+static BenchFormat bench_formats[] = {
+    { MB_BI_FORMAT_ANDROID,  MB_BI_FORMAT_NAME_ANDROID },
+    { MB_BI_FORMAT_BUMP,     MB_BI_FORMAT_NAME_BUMP },
+    { MB_BI_FORMAT_LOKI,     MB_BI_FORMAT_NAME_LOKI },
+    { MB_BI_FORMAT_MTK,      MB_BI_FORMAT_NAME_MTK },
+    { MB_BI_FORMAT_SONY_ELF, MB_BI_FORMAT_NAME_SONY_ELF },
+};
+
+struct BenchInput
+{
+    std::vector<unsigned char> kernel;
+    std::vector<unsigned char> ramdisk;
+    std::vector<unsigned char> aboot;
+    std::vector<unsigned char> mtk_kernel_header;
+    std::vector<unsigned char> mtk_ramdisk_header;
+};
+
+static void fill_random(std::vector<unsigned char> &data, uint32_t seed)
+{
+    for (auto &c : data) {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<unsigned char>(seed >> 16);
+    }
+}
+
+static void make_mtk_header(std::vector<unsigned char> &data,
+                            const char *type)
+{
+    // The writer fills in the size field when the image is closed
+    data.assign(MTK_MAGIC_SIZE + sizeof(uint32_t), 0);
+    memcpy(data.data(), MTK_MAGIC, MTK_MAGIC_SIZE);
+    data.resize(data.size() + MTK_TYPE_SIZE, 0);
+    memcpy(data.data() + MTK_MAGIC_SIZE + sizeof(uint32_t), type, strlen(type));
+    data.resize(data.size() + MTK_UNUSED_SIZE, 0xff);
+}
+
+static void make_input(BenchInput &input, size_t kernel_size,
+                       size_t ramdisk_size)
+{
+    input.kernel.resize(kernel_size);
+    input.ramdisk.resize(ramdisk_size);
+    fill_random(input.kernel, 1);
+    fill_random(input.ramdisk, 2);
+
+    uint32_t le32_base = mb_htole32(
+            FAKE_ABOOT_CHECK_SIGS - FAKE_ABOOT_PATTERN_OFF + 0x28);
+
+    input.aboot.assign(FAKE_ABOOT_SIZE, 0);
+    memcpy(input.aboot.data() + 12, &le32_base, sizeof(le32_base));
+    memcpy(input.aboot.data() + FAKE_ABOOT_PATTERN_OFF, FAKE_ABOOT_PATTERN, 8);
+
+    make_mtk_header(input.mtk_kernel_header, "KERNEL");
+    make_mtk_header(input.mtk_ramdisk_header, "ROOTFS");
+}
+
+static const std::vector<unsigned char> * entry_data(const BenchInput &input,
+                                                     int type)
+{
+    switch (type) {
+    case MB_BI_ENTRY_KERNEL:
+        return &input.kernel;
+    case MB_BI_ENTRY_RAMDISK:
+        return &input.ramdisk;
+    case MB_BI_ENTRY_ABOOT:
+        return &input.aboot;
+    case MB_BI_ENTRY_MTK_KERNEL_HEADER:
+        return &input.mtk_kernel_header;
+    case MB_BI_ENTRY_MTK_RAMDISK_HEADER:
+        return &input.mtk_ramdisk_header;
+    default:
+        return nullptr;
+    }
+}
+
+static bool write_image(int format, const BenchInput &input, bool hash,
+                        void **buf, size_t *buf_size)
+{
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!file || !biw) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    *buf = nullptr;
+    *buf_size = 0;
+
+    if (mb_file_open_memory_dynamic(file.get(), buf, buf_size)
+            != MB_FILE_OK) {
+        fprintf(stderr, "Failed to open memory file: %s\n",
+                mb_file_error_string(file.get()));
+        return false;
+    }
+
+    if (mb_bi_writer_set_format_by_code(biw.get(), format) != MB_BI_OK
+            || mb_bi_writer_open(biw.get(), file.get(), false) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &header) != MB_BI_OK) {
+        goto error;
+    }
+
+    // Only fields supported by the format will be set
+    mb_bi_header_set_page_size(header, 2048);
+    mb_bi_header_set_kernel_address(header, 0x10008000);
+    mb_bi_header_set_ramdisk_address(header, 0x11000000);
+    mb_bi_header_set_secondboot_address(header, 0x10f00000);
+    mb_bi_header_set_kernel_tags_address(header, 0x10000100);
+    mb_bi_header_set_sony_ipl_address(header, 0x12000000);
+    mb_bi_header_set_sony_rpm_address(header, 0x13000000);
+    mb_bi_header_set_sony_appsbl_address(header, 0x14000000);
+    mb_bi_header_set_entrypoint_address(header, 0x10008000);
+    mb_bi_header_set_board_name(header, "bench");
+    mb_bi_header_set_kernel_cmdline(header, "console=null androidboot.hardware=bench");
+
+    if (mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        goto error;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        if (mb_bi_writer_write_entry(biw.get(), entry) != MB_BI_OK) {
+            goto error;
+        }
+
+        auto data = entry_data(input, mb_bi_entry_type(entry));
+        if (!data) {
+            continue;
+        }
+
+        SHA_CTX sha_ctx;
+        if (hash) {
+            SHA1_Init(&sha_ctx);
+        }
+
+        for (size_t offset = 0; offset < data->size(); ) {
+            size_t to_write = std::min<size_t>(IO_BUF_SIZE,
+                                               data->size() - offset);
+            size_t n;
+
+            if (mb_bi_writer_write_data(biw.get(), data->data() + offset,
+                                        to_write, &n) != MB_BI_OK) {
+                goto error;
+            }
+            if (hash) {
+                SHA1_Update(&sha_ctx, data->data() + offset, n);
+            }
+            offset += n;
+        }
+
+        if (hash) {
+            unsigned char digest[SHA_DIGEST_LENGTH];
+            SHA1_Final(digest, &sha_ctx);
+        }
+    }
+    if (ret != MB_BI_EOF) {
+        goto error;
+    }
+
+    if (mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        goto error;
+    }
+
+    mb_file_close(file.get());
+    return true;
+
+error:
+    fprintf(stderr, "Failed to write %s image: %s\n",
+            mb_bi_writer_format_name(biw.get()),
+            mb_bi_writer_error_string(biw.get()));
+    biw.reset();
+    file.reset();
+    free(*buf);
+    *buf = nullptr;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+////////////////////////////////////////////////////////////////////////////////
+
+enum class ReadStage
+{
+    Open,
+    Header,
+    Entries,
+};
+
+static bool read_image(const void *buf, size_t buf_size, ReadStage stage,
+                       uint64_t *bytes_read)
+{
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!file || !bir) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    *bytes_read = 0;
+
+    if (mb_file_open_memory_static(file.get(), buf, buf_size) != MB_FILE_OK) {
+        fprintf(stderr, "Failed to open memory file: %s\n",
+                mb_file_error_string(file.get()));
+        return false;
+    }
+
+    if (mb_bi_reader_enable_format_all(bir.get()) != MB_BI_OK
+            || mb_bi_reader_open(bir.get(), file.get(), false) != MB_BI_OK) {
+        goto error;
+    }
+
+    if (stage == ReadStage::Open) {
+        return true;
+    }
+
+    if (mb_bi_reader_read_header(bir.get(), &header) != MB_BI_OK) {
+        goto error;
+    }
+
+    // Touch the parsed fields
+    mb_bi_header_kernel_cmdline(header);
+    mb_bi_header_board_name(header);
+    mb_bi_header_page_size(header);
+    mb_bi_header_kernel_address(header);
+    mb_bi_header_ramdisk_address(header);
+
+    if (stage == ReadStage::Header) {
+        return true;
+    }
+
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        char data[IO_BUF_SIZE];
+        size_t n;
+
+        while ((ret = mb_bi_reader_read_data(bir.get(), data, sizeof(data),
+                                             &n)) == MB_BI_OK) {
+            *bytes_read += n;
+        }
+        if (ret != MB_BI_EOF) {
+            goto error;
+        }
+    }
+    if (ret != MB_BI_EOF) {
+        goto error;
+    }
+
+    return true;
+
+error:
+    fprintf(stderr, "Failed to read image: %s\n",
+            mb_bi_reader_error_string(bir.get()));
+    return false;
+}
+
+struct BenchResult
+{
+    double seconds;
+    uint64_t bytes;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+};
+
+template<typename F>
+static bool run_bench(unsigned int iterations, BenchResult &result, F func)
+{
+    result = {};
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        uint64_t bytes = 0;
+        uint64_t allocs = g_alloc_count.load();
+        uint64_t alloc_bytes = g_alloc_bytes.load();
+        auto start = std::chrono::steady_clock::now();
+
+        if (!func(&bytes)) {
+            return false;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        result.seconds += std::chrono::duration<double>(end - start).count();
+        result.bytes += bytes;
+        result.allocs += g_alloc_count.load() - allocs;
+        result.alloc_bytes += g_alloc_bytes.load() - alloc_bytes;
+    }
+
+    return true;
+}
+
+static void print_result(const char *format, const char *stage,
+                         unsigned int iterations, const BenchResult &result)
+{
+    double mib = static_cast<double>(result.bytes) / (1024 * 1024);
+    double per_op_us = result.seconds * 1e6 / iterations;
+
+    printf("%-10s %-10s %12.1f", format, stage, per_op_us);
+    if (result.bytes > 0 && result.seconds > 0) {
+        printf(" %12.1f", mib / result.seconds);
+    } else {
+        printf(" %12s", "-");
+    }
+    if (HAVE_ALLOC_COUNTING) {
+        printf(" %10" PRIu64 " %14" PRIu64 "\n",
+               result.allocs / iterations, result.alloc_bytes / iterations);
+    } else {
+        printf(" %10s %14s\n", "n/a", "n/a");
+    }
+}
+
+static bool bench_format(const BenchFormat &format, const BenchInput &input,
+                         unsigned int iterations)
+{
+    void *image;
+    size_t image_size;
+    BenchResult result;
+
+    if (!write_image(format.code, input, false, &image, &image_size)) {
+        return false;
+    }
+
+    std::unique_ptr<void, decltype(free) *> image_holder(image, free);
+
+    auto read_stage = [&](ReadStage stage, uint64_t *bytes) {
+        uint64_t entry_bytes;
+        if (!read_image(image, image_size, stage, &entry_bytes)) {
+            return false;
+        }
+        // Open and header don't touch the payload, so there's no meaningful
+        // throughput to report for them
+        *bytes = entry_bytes;
+        return true;
+    };
+
+    auto write_stage = [&](bool hash, uint64_t *bytes) {
+        void *buf;
+        size_t buf_size;
+        if (!write_image(format.code, input, hash, &buf, &buf_size)) {
+            return false;
+        }
+        free(buf);
+        *bytes = buf_size;
+        return true;
+    };
+
+    if (!run_bench(iterations, result, [&](uint64_t *bytes) {
+        return read_stage(ReadStage::Open, bytes);
+    })) {
+        return false;
+    }
+    print_result(format.name, "open", iterations, result);
+
+    if (!run_bench(iterations, result, [&](uint64_t *bytes) {
+        return read_stage(ReadStage::Header, bytes);
+    })) {
+        return false;
+    }
+    print_result(format.name, "header", iterations, result);
+
+    if (!run_bench(iterations, result, [&](uint64_t *bytes) {
+        return read_stage(ReadStage::Entries, bytes);
+    })) {
+        return false;
+    }
+    print_result(format.name, "entries", iterations, result);
+
+    if (!run_bench(iterations, result, [&](uint64_t *bytes) {
+        return write_stage(false, bytes);
+    })) {
+        return false;
+    }
+    print_result(format.name, "write", iterations, result);
+
+    if (!run_bench(iterations, result, [&](uint64_t *bytes) {
+        return write_stage(true, bytes);
+    })) {
+        return false;
+    }
+    print_result(format.name, "write+sha", iterations, result);
+
+    return true;
+}
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream,
+            "Usage: %s [option...]\n\n"
+            "Options:\n"
+            "  -f, --format <name>   Only benchmark the specified format\n"
+            "                        (can be specified multiple times)\n"
+            "  -k, --kernel <size>   Kernel size in KiB (default: %d)\n"
+            "  -r, --ramdisk <size>  Ramdisk size in KiB (default: %d)\n"
+            "  -n, --iterations <n>  Iterations per benchmark (default: %d)\n"
+            "  -h, --help            Display this help message\n",
+            prog_name, DEFAULT_KERNEL_SIZE / 1024,
+            DEFAULT_RAMDISK_SIZE / 1024, DEFAULT_ITERATIONS);
+}
+
+static bool parse_uint(const char *str, unsigned long *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (errno || *str == '\0' || *end != '\0') {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> formats;
+    unsigned long kernel_kib = DEFAULT_KERNEL_SIZE / 1024;
+    unsigned long ramdisk_kib = DEFAULT_RAMDISK_SIZE / 1024;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    int opt;
+
+    static const char short_options[] = "f:k:r:n:h";
+
+    static struct option long_options[] = {
+        {"format",     required_argument, 0, 'f'},
+        {"kernel",     required_argument, 0, 'k'},
+        {"ramdisk",    required_argument, 0, 'r'},
+        {"iterations", required_argument, 0, 'n'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'f':
+            formats.push_back(optarg);
+            break;
+        case 'k':
+            if (!parse_uint(optarg, &kernel_kib)) {
+                fprintf(stderr, "Invalid kernel size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if (!parse_uint(optarg, &ramdisk_kib)) {
+                fprintf(stderr, "Invalid ramdisk size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if (!parse_uint(optarg, &iterations) || iterations == 0) {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 0) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    BenchInput input;
+    make_input(input, kernel_kib * 1024, ramdisk_kib * 1024);
+
+    printf("Kernel: %lu KiB, ramdisk: %lu KiB, iterations: %lu\n\n",
+           kernel_kib, ramdisk_kib, iterations);
+    printf("%-10s %-10s %12s %12s %10s %14s\n",
+           "Format", "Stage", "us/op", "MiB/s", "Allocs/op", "AllocBytes/op");
+
+    bool ret = true;
+
+    for (auto const &format : bench_formats) {
+        if (!formats.empty()) {
+            bool found = false;
+            for (auto const &name : formats) {
+                if (name == format.name) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                continue;
+            }
+        }
+
+        if (!bench_format(format, input, iterations)) {
+            ret = false;
+        }
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
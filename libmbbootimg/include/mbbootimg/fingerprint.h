@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#  include <cstddef>
+#  include <cstdint>
+#else
+#  include <stdbool.h>
+#  include <stddef.h>
+#  include <stdint.h>
+#endif
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+#define MB_BI_FINGERPRINT_DIGEST_SIZE   32
+#define MB_BI_FINGERPRINT_MAX_ENTRIES   16
+
+MB_BEGIN_C_DECLS
+
+struct MbBiReader;
+
+struct MbBiFingerprintEntry
+{
+    // Entry type (MB_BI_ENTRY_*)
+    int type;
+    // Size of entry data
+    uint64_t size;
+    // SHA256 digest of entry data
+    unsigned char digest[MB_BI_FINGERPRINT_DIGEST_SIZE];
+};
+
+struct MbBiFingerprint
+{
+    // Format code of the boot image
+    int format;
+    // SHA256 digest of the canonical header
+    unsigned char header_digest[MB_BI_FINGERPRINT_DIGEST_SIZE];
+    // Entries in the order they appear in the boot image
+    size_t entries_len;
+    struct MbBiFingerprintEntry entries[MB_BI_FINGERPRINT_MAX_ENTRIES];
+};
+
+MB_EXPORT int mb_bi_fingerprint_compute(struct MbBiReader *bir,
+                                        struct MbBiFingerprint *fp);
+MB_EXPORT int mb_bi_fingerprint_compute_filename(struct MbBiReader *bir,
+                                                 const char *filename,
+                                                 struct MbBiFingerprint *fp);
+MB_EXPORT bool mb_bi_fingerprint_equal(const struct MbBiFingerprint *fp1,
+                                       const struct MbBiFingerprint *fp2);
+MB_EXPORT void mb_bi_fingerprint_cache_clear(void);
+
+MB_END_C_DECLS
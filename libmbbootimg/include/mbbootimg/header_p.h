@@ -23,6 +23,11 @@
 
 #include <cstdint>
 
+// Inline string field sizes (including the NULL terminator). These are larger
+// than what any of the supported formats can store.
+#define MB_BI_HEADER_BOARD_NAME_SIZE    64
+#define MB_BI_HEADER_CMDLINE_SIZE       4096
+
 struct MbBiHeader
 {
     // Bitmap of fields that are supported
@@ -41,8 +46,10 @@ struct MbBiHeader
         uint32_t rpm_addr;          // |         |      |      |     | X    |
         uint32_t appsbl_addr;       // |         |      |      |     | X    |
         uint32_t page_size;         // | X       | X    | X    | X   |      |
-        char *board_name;           // | X       | X    | X    | X   |      |
-        char *cmdline;              // | X       | X    | X    | X   |      |
+        char board_name[MB_BI_HEADER_BOARD_NAME_SIZE];
+                                    // | X       | X    | X    | X   |      |
+        char cmdline[MB_BI_HEADER_CMDLINE_SIZE];
+                                    // | X       | X    | X    | X   |      |
         // Raw header values           |---------|------|------|-----|------|
 
         // TODO TODO TODO
@@ -59,3 +59,18 @@
             UNSET_FIELD(STRUCT, FLAG, FIELD, nullptr); \
         } \
     } while (0)
+
+#define SET_STRING_BUF_FIELD(STRUCT, FLAG, FIELD, VALUE) \
+    do { \
+        if (VALUE) { \
+            size_t len = strlen(VALUE); \
+            if (len >= sizeof((STRUCT)->field.FIELD)) { \
+                return MB_BI_FAILED; \
+            } \
+            memmove((STRUCT)->field.FIELD, (VALUE), len + 1); \
+            (STRUCT)->fields_set |= (FLAG); \
+        } else { \
+            (STRUCT)->field.FIELD[0] = '\0'; \
+            (STRUCT)->fields_set &= ~(FLAG); \
+        } \
+    } while (0)
@@ -83,7 +83,8 @@ typedef int (*FormatReaderFree)(struct MbBiReader *bir, void *userdata);
 struct FormatReader
 {
     int type;
-    char *name;
+    // Static string (one of MB_BI_FORMAT_NAMES)
+    const char *name;
 
     // Callbacks
     FormatReaderBidder bidder_cb;
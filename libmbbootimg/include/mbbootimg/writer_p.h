@@ -85,7 +85,8 @@ typedef int (*FormatWriterFree)(struct MbBiWriter *biw, void *userdata);
 struct FormatWriter
 {
     int type;
-    char *name;
+    // Static string (one of MB_BI_FORMAT_NAMES)
+    const char *name;
 
     // Callbacks
     FormatWriterSetOption set_option_cb;
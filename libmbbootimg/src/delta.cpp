@@ -0,0 +1,887 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/delta.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+#include <openssl/sha.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file.h"
+#include "mbcommon/file_util.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/header_p.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+/*!
+ * \file mbbootimg/delta.h
+ * \brief Boot image delta API
+ *
+ * A boot image delta describes how to reconstruct a target boot image from a
+ * base boot image. Deltas are segment-aware: the header is stored as parsed
+ * field values and every entry (kernel, ramdisk, etc.) of the target image is
+ * encoded as a sequence of copy and insert operations against the entry of
+ * the same type in the base image. Since ROM updates usually only touch a few
+ * files in the ramdisk, the resulting delta is much smaller than the image.
+ *
+ * Entry data is diffed as it is stored in the boot image. libmbbootimg does
+ * not decompress ramdisks, so callers wanting better results for compressed
+ * ramdisks should diff images whose ramdisks use the same compression.
+ */
+
+#define DELTA_MAGIC             "MBBIDLT\0"
+#define DELTA_MAGIC_SIZE        8
+#define DELTA_VERSION           1
+
+#define DELTA_STRING_UNSET      UINT32_MAX
+
+#define DELTA_ENTRY_HAS_BASE    (1U << 0)
+
+#define DELTA_OP_COPY           1
+#define DELTA_OP_INSERT         2
+
+// Size of the blocks in the base entry that are indexed for matching
+#define DELTA_BLOCK_SIZE        32
+// Multiplier for the rolling hash
+#define DELTA_HASH_BASE         257U
+
+#define DELTA_BUF_SIZE          10240
+
+// Largest entry that can be stored in a delta. This is far larger than any
+// boot or recovery partition and keeps a corrupted delta from making us
+// allocate an absurd amount of memory.
+#define DELTA_MAX_ENTRY_SIZE    (512 * 1024 * 1024)
+
+struct DeltaOp
+{
+    uint8_t type;
+    // Offset in base entry (copy) or target entry (insert)
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct DeltaEntry
+{
+    int type;
+    uint32_t flags;
+    unsigned char base_digest[SHA_DIGEST_LENGTH];
+    unsigned char target_digest[SHA_DIGEST_LENGTH];
+    std::vector<DeltaOp> ops;
+    // Target data when creating, inserted data when applying
+    std::vector<unsigned char> data;
+};
+
+struct DeltaImageEntry
+{
+    int type;
+    std::vector<unsigned char> data;
+};
+
+MB_BEGIN_C_DECLS
+
+static uint32_t _delta_hash(const unsigned char *data, size_t size)
+{
+    uint32_t hash = 0;
+    for (size_t i = 0; i < size; ++i) {
+        hash = hash * DELTA_HASH_BASE + data[i];
+    }
+    return hash;
+}
+
+static void _delta_compute_ops(const std::vector<unsigned char> &base,
+                               const std::vector<unsigned char> &target,
+                               std::vector<DeltaOp> &ops)
+{
+    const unsigned char *b = base.data();
+    const unsigned char *t = target.data();
+    const uint64_t b_size = base.size();
+    const uint64_t t_size = target.size();
+    uint64_t pos = 0;
+    uint64_t literal = 0;
+
+    ops.clear();
+
+    if (b_size >= DELTA_BLOCK_SIZE && t_size >= DELTA_BLOCK_SIZE) {
+        // Index non-overlapping blocks of the base entry
+        std::unordered_map<uint32_t, uint64_t> index;
+        index.reserve(b_size / DELTA_BLOCK_SIZE);
+
+        for (uint64_t off = 0; off + DELTA_BLOCK_SIZE <= b_size;
+                off += DELTA_BLOCK_SIZE) {
+            index.emplace(_delta_hash(b + off, DELTA_BLOCK_SIZE), off);
+        }
+
+        // Weight of the byte leaving the rolling window
+        uint32_t out_weight = 1;
+        for (size_t i = 1; i < DELTA_BLOCK_SIZE; ++i) {
+            out_weight *= DELTA_HASH_BASE;
+        }
+
+        uint32_t hash = _delta_hash(t, DELTA_BLOCK_SIZE);
+
+        while (pos + DELTA_BLOCK_SIZE <= t_size) {
+            auto it = index.find(hash);
+            if (it != index.end()
+                    && memcmp(b + it->second, t + pos, DELTA_BLOCK_SIZE) == 0) {
+                uint64_t src = it->second;
+                uint64_t len = DELTA_BLOCK_SIZE;
+                uint64_t back = 0;
+
+                // Extend match forwards
+                while (pos + len < t_size && src + len < b_size
+                        && t[pos + len] == b[src + len]) {
+                    ++len;
+                }
+
+                // Extend match backwards into the pending literal
+                while (pos - back > literal && src - back > 0
+                        && t[pos - back - 1] == b[src - back - 1]) {
+                    ++back;
+                }
+
+                if (pos - back > literal) {
+                    ops.push_back({ DELTA_OP_INSERT, literal,
+                                    pos - back - literal });
+                }
+                ops.push_back({ DELTA_OP_COPY, src - back, len + back });
+
+                pos += len;
+                literal = pos;
+
+                if (pos + DELTA_BLOCK_SIZE <= t_size) {
+                    hash = _delta_hash(t + pos, DELTA_BLOCK_SIZE);
+                }
+                continue;
+            }
+
+            if (pos + DELTA_BLOCK_SIZE < t_size) {
+                hash = (hash - t[pos] * out_weight) * DELTA_HASH_BASE
+                        + t[pos + DELTA_BLOCK_SIZE];
+            }
+            ++pos;
+        }
+    }
+
+    if (t_size > literal) {
+        ops.push_back({ DELTA_OP_INSERT, literal, t_size - literal });
+    }
+}
+
+static void _delta_digest(const std::vector<unsigned char> &data,
+                          unsigned char digest[SHA_DIGEST_LENGTH])
+{
+    SHA1(data.data(), data.size(), digest);
+}
+
+static int _delta_read_image(MbBiReader *bir, MbBiHeader **header,
+                             std::vector<DeltaImageEntry> &entries)
+{
+    MbBiEntry *entry;
+    int ret;
+
+    ret = mb_bi_reader_read_header(bir, header);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        DeltaImageEntry image_entry;
+        image_entry.type = mb_bi_entry_type(entry);
+
+        unsigned char buf[DELTA_BUF_SIZE];
+        size_t n;
+
+        while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+                == MB_BI_OK) {
+            image_entry.data.insert(image_entry.data.end(), buf, buf + n);
+        }
+
+        if (ret != MB_BI_EOF) {
+            return ret;
+        }
+
+        entries.push_back(std::move(image_entry));
+    }
+
+    return ret == MB_BI_EOF ? MB_BI_OK : ret;
+}
+
+static DeltaImageEntry * _delta_find_image_entry(
+        std::vector<DeltaImageEntry> &entries, int type)
+{
+    auto it = std::find_if(entries.begin(), entries.end(),
+                           [&](const DeltaImageEntry &e) {
+        return e.type == type;
+    });
+    return it == entries.end() ? nullptr : &*it;
+}
+
+// Serialization helpers
+
+static int _delta_write(MbFile *file, const void *buf, size_t size)
+{
+    size_t n;
+
+    if (mb_file_write_fully(file, buf, size, &n) != MB_FILE_OK || n != size) {
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+static int _delta_write_u8(MbFile *file, uint8_t value)
+{
+    return _delta_write(file, &value, sizeof(value));
+}
+
+static int _delta_write_u32(MbFile *file, uint32_t value)
+{
+    value = mb_htole32(value);
+    return _delta_write(file, &value, sizeof(value));
+}
+
+static int _delta_write_u64(MbFile *file, uint64_t value)
+{
+    value = mb_htole64(value);
+    return _delta_write(file, &value, sizeof(value));
+}
+
+static int _delta_write_string(MbFile *file, const char *str)
+{
+    if (!str) {
+        return _delta_write_u32(file, DELTA_STRING_UNSET);
+    }
+
+    size_t len = strlen(str);
+    if (len >= DELTA_STRING_UNSET) {
+        return MB_BI_FAILED;
+    }
+
+    if (_delta_write_u32(file, static_cast<uint32_t>(len)) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+    return _delta_write(file, str, len);
+}
+
+static int _delta_read(MbFile *file, void *buf, size_t size)
+{
+    size_t n;
+
+    if (mb_file_read_fully(file, buf, size, &n) != MB_FILE_OK || n != size) {
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Read \p size bytes and append them to \p data
+ *
+ * The buffer only grows as data is actually read, so a bogus size in a
+ * corrupted delta cannot cause a huge allocation.
+ */
+static int _delta_read_append(MbFile *file, std::vector<unsigned char> &data,
+                              uint64_t size)
+{
+    unsigned char buf[DELTA_BUF_SIZE];
+
+    while (size > 0) {
+        size_t n = static_cast<size_t>(
+                std::min<uint64_t>(size, sizeof(buf)));
+
+        if (_delta_read(file, buf, n) != MB_BI_OK) {
+            return MB_BI_FAILED;
+        }
+
+        data.insert(data.end(), buf, buf + n);
+        size -= n;
+    }
+
+    return MB_BI_OK;
+}
+
+static int _delta_read_u8(MbFile *file, uint8_t *value)
+{
+    return _delta_read(file, value, sizeof(*value));
+}
+
+static int _delta_read_u32(MbFile *file, uint32_t *value)
+{
+    if (_delta_read(file, value, sizeof(*value)) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+    *value = mb_le32toh(*value);
+    return MB_BI_OK;
+}
+
+static int _delta_read_u64(MbFile *file, uint64_t *value)
+{
+    if (_delta_read(file, value, sizeof(*value)) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+    *value = mb_le64toh(*value);
+    return MB_BI_OK;
+}
+
+static int _delta_read_string(MbFile *file, char *buf, size_t size,
+                              bool *is_set)
+{
+    uint32_t len;
+
+    buf[0] = '\0';
+    *is_set = false;
+
+    if (_delta_read_u32(file, &len) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    } else if (len == DELTA_STRING_UNSET) {
+        return MB_BI_OK;
+    } else if (len >= size) {
+        return MB_BI_FAILED;
+    }
+
+    if (_delta_read(file, buf, len) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+    buf[len] = '\0';
+
+    *is_set = true;
+    return MB_BI_OK;
+}
+
+static int _delta_write_header(MbFile *file, MbBiHeader *header)
+{
+    const uint32_t values[] = {
+        header->field.kernel_addr,
+        header->field.ramdisk_addr,
+        header->field.second_addr,
+        header->field.tags_addr,
+        header->field.ipl_addr,
+        header->field.rpm_addr,
+        header->field.appsbl_addr,
+        header->field.page_size,
+        header->field.hdr_kernel_size,
+        header->field.hdr_ramdisk_size,
+        header->field.hdr_second_size,
+        header->field.hdr_dt_size,
+        header->field.hdr_unused,
+        header->field.hdr_entrypoint,
+    };
+
+    if (_delta_write_u64(file, header->fields_set) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+    for (uint32_t value : values) {
+        if (_delta_write_u32(file, value) != MB_BI_OK) {
+            return MB_BI_FAILED;
+        }
+    }
+    for (uint32_t value : header->field.hdr_id) {
+        if (_delta_write_u32(file, value) != MB_BI_OK) {
+            return MB_BI_FAILED;
+        }
+    }
+    if (_delta_write_string(file, mb_bi_header_board_name(header)) != MB_BI_OK
+            || _delta_write_string(file, mb_bi_header_kernel_cmdline(header))
+                    != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+static int _delta_read_header(MbFile *file, MbBiHeader *header)
+{
+    uint32_t *values[] = {
+        &header->field.kernel_addr,
+        &header->field.ramdisk_addr,
+        &header->field.second_addr,
+        &header->field.tags_addr,
+        &header->field.ipl_addr,
+        &header->field.rpm_addr,
+        &header->field.appsbl_addr,
+        &header->field.page_size,
+        &header->field.hdr_kernel_size,
+        &header->field.hdr_ramdisk_size,
+        &header->field.hdr_second_size,
+        &header->field.hdr_dt_size,
+        &header->field.hdr_unused,
+        &header->field.hdr_entrypoint,
+    };
+
+    mb_bi_header_clear(header);
+
+    if (_delta_read_u64(file, &header->fields_set) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+    header->fields_set &= MB_BI_HEADER_ALL_FIELDS;
+
+    for (uint32_t *value : values) {
+        if (_delta_read_u32(file, value) != MB_BI_OK) {
+            return MB_BI_FAILED;
+        }
+    }
+    for (uint32_t &value : header->field.hdr_id) {
+        if (_delta_read_u32(file, &value) != MB_BI_OK) {
+            return MB_BI_FAILED;
+        }
+    }
+    bool board_name_set;
+    bool cmdline_set;
+
+    if (_delta_read_string(file, header->field.board_name,
+                           sizeof(header->field.board_name),
+                           &board_name_set) != MB_BI_OK
+            || _delta_read_string(file, header->field.cmdline,
+                                  sizeof(header->field.cmdline),
+                                  &cmdline_set) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+
+    // The string fields are only valid if they were present in the delta
+    if (!board_name_set) {
+        header->fields_set &= ~MB_BI_HEADER_FIELD_BOARD_NAME;
+    }
+    if (!cmdline_set) {
+        header->fields_set &= ~MB_BI_HEADER_FIELD_KERNEL_CMDLINE;
+    }
+
+    return MB_BI_OK;
+}
+
+static int _delta_write_entry(MbFile *file, const DeltaEntry &entry)
+{
+    if (_delta_write_u32(file, static_cast<uint32_t>(entry.type)) != MB_BI_OK
+            || _delta_write_u32(file, entry.flags) != MB_BI_OK
+            || _delta_write_u64(file, entry.data.size()) != MB_BI_OK
+            || _delta_write(file, entry.base_digest,
+                            sizeof(entry.base_digest)) != MB_BI_OK
+            || _delta_write(file, entry.target_digest,
+                            sizeof(entry.target_digest)) != MB_BI_OK
+            || _delta_write_u64(file, entry.ops.size()) != MB_BI_OK) {
+        return MB_BI_FAILED;
+    }
+
+    for (const DeltaOp &op : entry.ops) {
+        if (_delta_write_u8(file, op.type) != MB_BI_OK) {
+            return MB_BI_FAILED;
+        }
+
+        if (op.type == DELTA_OP_COPY) {
+            if (_delta_write_u64(file, op.offset) != MB_BI_OK
+                    || _delta_write_u64(file, op.size) != MB_BI_OK) {
+                return MB_BI_FAILED;
+            }
+        } else {
+            if (_delta_write_u64(file, op.size) != MB_BI_OK
+                    || _delta_write(file, entry.data.data() + op.offset,
+                                    op.size) != MB_BI_OK) {
+                return MB_BI_FAILED;
+            }
+        }
+    }
+
+    return MB_BI_OK;
+}
+
+static int _delta_read_entry(MbFile *file, DeltaEntry &entry,
+                             uint64_t *target_size)
+{
+    uint32_t type;
+    uint64_t n_ops;
+
+    if (_delta_read_u32(file, &type) != MB_BI_OK
+            || _delta_read_u32(file, &entry.flags) != MB_BI_OK
+            || _delta_read_u64(file, target_size) != MB_BI_OK
+            || _delta_read(file, entry.base_digest,
+                           sizeof(entry.base_digest)) != MB_BI_OK
+            || _delta_read(file, entry.target_digest,
+                           sizeof(entry.target_digest)) != MB_BI_OK
+            || _delta_read_u64(file, &n_ops) != MB_BI_OK
+            || *target_size > DELTA_MAX_ENTRY_SIZE) {
+        return MB_BI_FAILED;
+    }
+
+    entry.type = static_cast<int>(type);
+    entry.ops.clear();
+    entry.data.clear();
+
+    uint64_t total = 0;
+
+    for (uint64_t i = 0; i < n_ops; ++i) {
+        DeltaOp op;
+
+        if (_delta_read_u8(file, &op.type) != MB_BI_OK) {
+            return MB_BI_FAILED;
+        }
+
+        if (op.type == DELTA_OP_COPY) {
+            if (_delta_read_u64(file, &op.offset) != MB_BI_OK
+                    || _delta_read_u64(file, &op.size) != MB_BI_OK) {
+                return MB_BI_FAILED;
+            }
+        } else if (op.type == DELTA_OP_INSERT) {
+            if (_delta_read_u64(file, &op.size) != MB_BI_OK
+                    || op.size > *target_size - total) {
+                return MB_BI_FAILED;
+            }
+
+            op.offset = entry.data.size();
+
+            if (_delta_read_append(file, entry.data, op.size) != MB_BI_OK) {
+                return MB_BI_FAILED;
+            }
+        } else {
+            return MB_BI_FAILED;
+        }
+
+        if (op.size > *target_size - total) {
+            return MB_BI_FAILED;
+        }
+        total += op.size;
+
+        entry.ops.push_back(op);
+    }
+
+    if (total != *target_size) {
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+static void _delta_copy_reader_error(MbBiReader *dest, MbBiReader *src)
+{
+    mb_bi_reader_set_error(dest, mb_bi_reader_error(src),
+                           "Failed to read base image: %s",
+                           mb_bi_reader_error_string(src));
+}
+
+/*!
+ * \brief Create boot image delta
+ *
+ * Both readers must be opened and not yet have read the header. The header and
+ * all entries will be read from both images. The delta is written to \p delta
+ * starting at the current file position.
+ *
+ * \param base MbBiReader for base boot image
+ * \param target MbBiReader for target boot image
+ * \param delta MbFile to write delta to
+ *
+ * \return
+ *   * #MB_BI_OK if the delta is successfully written
+ *   * \<= #MB_BI_WARN if an error occurs. The error will be set on \p target.
+ */
+int mb_bi_delta_create(MbBiReader *base, MbBiReader *target, MbFile *delta)
+{
+    MbBiHeader *base_header;
+    MbBiHeader *target_header;
+    std::vector<DeltaImageEntry> base_entries;
+    std::vector<DeltaImageEntry> target_entries;
+    int ret;
+
+    ret = _delta_read_image(base, &base_header, base_entries);
+    if (ret != MB_BI_OK) {
+        _delta_copy_reader_error(target, base);
+        return ret;
+    }
+
+    ret = _delta_read_image(target, &target_header, target_entries);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    if (_delta_write(delta, DELTA_MAGIC, DELTA_MAGIC_SIZE) != MB_BI_OK
+            || _delta_write_u32(delta, DELTA_VERSION) != MB_BI_OK
+            || _delta_write_u32(delta, static_cast<uint32_t>(
+                    mb_bi_reader_format_code(target))) != MB_BI_OK
+            || _delta_write_u32(delta, static_cast<uint32_t>(
+                    target_entries.size())) != MB_BI_OK
+            || _delta_write_header(delta, target_header) != MB_BI_OK) {
+        mb_bi_reader_set_error(target, mb_file_error(delta),
+                               "Failed to write delta header: %s",
+                               mb_file_error_string(delta));
+        return MB_BI_FAILED;
+    }
+
+    for (DeltaImageEntry &target_entry : target_entries) {
+        DeltaImageEntry *base_entry =
+                _delta_find_image_entry(base_entries, target_entry.type);
+        DeltaEntry entry;
+
+        if (target_entry.data.size() > DELTA_MAX_ENTRY_SIZE) {
+            mb_bi_reader_set_error(target, MB_BI_ERROR_UNSUPPORTED,
+                                   "Entry of type %d is too large for delta",
+                                   target_entry.type);
+            return MB_BI_FAILED;
+        }
+
+        entry.type = target_entry.type;
+        entry.flags = 0;
+        memset(entry.base_digest, 0, sizeof(entry.base_digest));
+
+        if (base_entry) {
+            entry.flags |= DELTA_ENTRY_HAS_BASE;
+            _delta_digest(base_entry->data, entry.base_digest);
+            _delta_compute_ops(base_entry->data, target_entry.data, entry.ops);
+        } else {
+            _delta_compute_ops({}, target_entry.data, entry.ops);
+        }
+
+        _delta_digest(target_entry.data, entry.target_digest);
+        entry.data = std::move(target_entry.data);
+
+        if (_delta_write_entry(delta, entry) != MB_BI_OK) {
+            mb_bi_reader_set_error(target, mb_file_error(delta),
+                                   "Failed to write delta entry: %s",
+                                   mb_file_error_string(delta));
+            return MB_BI_FAILED;
+        }
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Reconstruct boot image from base image and delta
+ *
+ * \p base must be opened and not yet have read the header. \p biw must be
+ * opened with the same format as the target image that the delta was created
+ * from. The header and entries will be written to \p biw, but the writer will
+ * not be closed.
+ *
+ * The data of every entry is verified against the digests recorded in the
+ * delta, so using the wrong base image is detected.
+ *
+ * \param base MbBiReader for base boot image
+ * \param delta MbFile to read delta from
+ * \param biw MbBiWriter for output boot image
+ *
+ * \return
+ *   * #MB_BI_OK if the boot image is successfully reconstructed
+ *   * \<= #MB_BI_WARN if an error occurs. The error will be set on \p biw.
+ */
+int mb_bi_delta_apply(MbBiReader *base, MbFile *delta, MbBiWriter *biw)
+{
+    MbBiHeader *base_header;
+    MbBiHeader *header = nullptr;
+    MbBiEntry *entry;
+    std::vector<DeltaImageEntry> base_entries;
+    std::vector<DeltaEntry> entries;
+    char magic[DELTA_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t format;
+    uint32_t n_entries;
+    int ret;
+
+    ret = _delta_read_image(base, &base_header, base_entries);
+    if (ret != MB_BI_OK) {
+        mb_bi_writer_set_error(biw, mb_bi_reader_error(base),
+                               "Failed to read base image: %s",
+                               mb_bi_reader_error_string(base));
+        return ret;
+    }
+
+    header = mb_bi_header_new();
+    if (!header) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to allocate header: %s",
+                               strerror(errno));
+        return MB_BI_FAILED;
+    }
+
+    if (_delta_read(delta, magic, sizeof(magic)) != MB_BI_OK
+            || _delta_read_u32(delta, &version) != MB_BI_OK
+            || _delta_read_u32(delta, &format) != MB_BI_OK
+            || _delta_read_u32(delta, &n_entries) != MB_BI_OK) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                               "Failed to read delta header: %s",
+                               mb_file_error_string(delta));
+        ret = MB_BI_FAILED;
+        goto done;
+    }
+
+    if (memcmp(magic, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0
+            || version != DELTA_VERSION) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                               "Invalid delta magic or version");
+        ret = MB_BI_FAILED;
+        goto done;
+    }
+
+    if (static_cast<int>(format) != mb_bi_writer_format_code(biw)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                               "Delta was created for format 0x%" PRIx32
+                               ", but writer uses format 0x%x",
+                               format, mb_bi_writer_format_code(biw));
+        ret = MB_BI_FAILED;
+        goto done;
+    }
+
+    if (_delta_read_header(delta, header) != MB_BI_OK) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                               "Failed to read delta boot image header");
+        ret = MB_BI_FAILED;
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < n_entries; ++i) {
+        DeltaEntry delta_entry;
+        uint64_t target_size;
+
+        if (_delta_read_entry(delta, delta_entry, &target_size) != MB_BI_OK) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                   "Failed to read delta entry %" PRIu32, i);
+            ret = MB_BI_FAILED;
+            goto done;
+        }
+
+        // Reconstruct entry data
+        DeltaImageEntry *base_entry =
+                _delta_find_image_entry(base_entries, delta_entry.type);
+        std::vector<unsigned char> data;
+        unsigned char digest[SHA_DIGEST_LENGTH];
+
+        if (delta_entry.flags & DELTA_ENTRY_HAS_BASE) {
+            if (!base_entry) {
+                mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                       "Base image has no entry of type %d",
+                                       delta_entry.type);
+                ret = MB_BI_FAILED;
+                goto done;
+            }
+
+            _delta_digest(base_entry->data, digest);
+            if (memcmp(digest, delta_entry.base_digest, sizeof(digest)) != 0) {
+                mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                       "Base image entry of type %d does not "
+                                       "match delta", delta_entry.type);
+                ret = MB_BI_FAILED;
+                goto done;
+            }
+        }
+
+        // Insert operations were bounds checked when they were read. Check the
+        // copy operations before reserving so that the target size is backed
+        // by actual data.
+        for (const DeltaOp &op : delta_entry.ops) {
+            if (op.type == DELTA_OP_COPY
+                    && (!base_entry || op.offset > base_entry->data.size()
+                    || op.size > base_entry->data.size() - op.offset)) {
+                mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                       "Delta copy operation is out of "
+                                       "bounds");
+                ret = MB_BI_FAILED;
+                goto done;
+            }
+        }
+
+        data.reserve(target_size);
+
+        for (const DeltaOp &op : delta_entry.ops) {
+            if (op.type == DELTA_OP_COPY) {
+                auto begin = base_entry->data.begin() + op.offset;
+                data.insert(data.end(), begin, begin + op.size);
+            } else {
+                auto begin = delta_entry.data.begin() + op.offset;
+                data.insert(data.end(), begin, begin + op.size);
+            }
+        }
+
+        _delta_digest(data, digest);
+        if (memcmp(digest, delta_entry.target_digest, sizeof(digest)) != 0) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                   "Reconstructed entry of type %d has "
+                                   "mismatched digest", delta_entry.type);
+            ret = MB_BI_FAILED;
+            goto done;
+        }
+
+        delta_entry.data = std::move(data);
+        delta_entry.ops.clear();
+        entries.push_back(std::move(delta_entry));
+    }
+
+    // Write header
+    ret = mb_bi_writer_write_header(biw, header);
+    if (ret != MB_BI_OK) {
+        goto done;
+    }
+
+    // Write entries in the order that the format requires
+    while ((ret = mb_bi_writer_get_entry(biw, &entry)) == MB_BI_OK) {
+        int type = mb_bi_entry_type(entry);
+
+        auto it = std::find_if(entries.begin(), entries.end(),
+                               [&](const DeltaEntry &e) {
+            return e.type == type;
+        });
+
+        if (it != entries.end()) {
+            mb_bi_entry_set_size(entry, it->data.size());
+        }
+
+        ret = mb_bi_writer_write_entry(biw, entry);
+        if (ret != MB_BI_OK) {
+            goto done;
+        }
+
+        if (it == entries.end()) {
+            continue;
+        }
+
+        const unsigned char *ptr = it->data.data();
+        size_t remain = it->data.size();
+
+        while (remain > 0) {
+            size_t n;
+
+            ret = mb_bi_writer_write_data(biw, ptr,
+                                          std::min<size_t>(remain,
+                                                           DELTA_BUF_SIZE),
+                                          &n);
+            if (ret != MB_BI_OK) {
+                goto done;
+            }
+
+            ptr += n;
+            remain -= n;
+        }
+    }
+
+    if (ret == MB_BI_EOF) {
+        ret = MB_BI_OK;
+    }
+
+done:
+    mb_bi_header_free(header);
+    return ret;
+}
+
+MB_END_C_DECLS
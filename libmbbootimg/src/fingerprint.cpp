@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/fingerprint.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <openssl/sha.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file.h"
+#include "mbcommon/file/fd.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+
+/*!
+ * \file mbbootimg/fingerprint.h
+ * \brief Boot image fingerprint API
+ *
+ * A fingerprint consists of a digest of the canonical header and a digest of
+ * every entry in the boot image. Two boot images are considered equal if their
+ * header values and entry data are equal. Values that are derived from the
+ * entries (eg. the sizes and the ID in the Android header) are not part of the
+ * canonical header. This makes the comparison independent of the container
+ * format.
+ *
+ * Fingerprints computed with mb_bi_fingerprint_compute_filename() are cached
+ * in memory, keyed by the path and the file's device, inode, modification time
+ * and size, so repeated comparisons against the same image are essentially
+ * free.
+ */
+
+// Maximum number of cached fingerprints
+#define FINGERPRINT_CACHE_MAX   32
+
+// Tags for the canonical header serialization. These must never change.
+#define HEADER_TAG_BOARD_NAME           1
+#define HEADER_TAG_KERNEL_CMDLINE       2
+#define HEADER_TAG_PAGE_SIZE            3
+#define HEADER_TAG_KERNEL_ADDRESS       4
+#define HEADER_TAG_RAMDISK_ADDRESS      5
+#define HEADER_TAG_SECONDBOOT_ADDRESS   6
+#define HEADER_TAG_KERNEL_TAGS_ADDRESS  7
+#define HEADER_TAG_SONY_IPL_ADDRESS     8
+#define HEADER_TAG_SONY_RPM_ADDRESS     9
+#define HEADER_TAG_SONY_APPSBL_ADDRESS  10
+#define HEADER_TAG_ENTRYPOINT_ADDRESS   11
+
+#define FINGERPRINT_BUF_SIZE    10240
+
+static_assert(MB_BI_FINGERPRINT_DIGEST_SIZE == SHA256_DIGEST_LENGTH,
+              "Fingerprint digest size does not match SHA256 size");
+
+struct FingerprintCacheEntry
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    MbBiFingerprint fp;
+};
+
+static std::mutex g_cache_lock;
+static std::unordered_map<std::string, FingerprintCacheEntry> g_cache;
+
+#ifndef _WIN32
+static bool _fingerprint_cache_key(int fd, FingerprintCacheEntry *key)
+{
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        return false;
+    }
+
+    key->dev = sb.st_dev;
+    key->ino = sb.st_ino;
+    key->mtime_sec = sb.st_mtim.tv_sec;
+    key->mtime_nsec = sb.st_mtim.tv_nsec;
+    key->size = static_cast<uint64_t>(sb.st_size);
+    return true;
+}
+
+static bool _fingerprint_cache_key_equal(const FingerprintCacheEntry &a,
+                                         const FingerprintCacheEntry &b)
+{
+    return a.dev == b.dev && a.ino == b.ino
+            && a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec
+            && a.size == b.size;
+}
+#endif
+
+MB_BEGIN_C_DECLS
+
+static void _fingerprint_hash_u32(SHA256_CTX *ctx, uint32_t tag,
+                                  uint32_t value)
+{
+    uint32_t buf[2] = { mb_htole32(tag), mb_htole32(value) };
+    SHA256_Update(ctx, buf, sizeof(buf));
+}
+
+static void _fingerprint_hash_string(SHA256_CTX *ctx, uint32_t tag,
+                                     const char *str)
+{
+    uint32_t len = static_cast<uint32_t>(strlen(str));
+    _fingerprint_hash_u32(ctx, tag, len);
+    SHA256_Update(ctx, str, len);
+}
+
+static void _fingerprint_hash_header(MbBiHeader *header,
+                                     unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    SHA256_CTX ctx;
+    const char *str;
+
+    SHA256_Init(&ctx);
+
+    // Only fields that are set are included, so an unset field and a field set
+    // to 0 are different
+    if ((str = mb_bi_header_board_name(header))) {
+        _fingerprint_hash_string(&ctx, HEADER_TAG_BOARD_NAME, str);
+    }
+    if ((str = mb_bi_header_kernel_cmdline(header))) {
+        _fingerprint_hash_string(&ctx, HEADER_TAG_KERNEL_CMDLINE, str);
+    }
+
+#define HASH_FIELD(TAG, NAME) \
+    do { \
+        if (mb_bi_header_ ## NAME ## _is_set(header)) { \
+            _fingerprint_hash_u32(&ctx, (TAG), mb_bi_header_ ## NAME(header)); \
+        } \
+    } while (0)
+
+    HASH_FIELD(HEADER_TAG_PAGE_SIZE, page_size);
+    HASH_FIELD(HEADER_TAG_KERNEL_ADDRESS, kernel_address);
+    HASH_FIELD(HEADER_TAG_RAMDISK_ADDRESS, ramdisk_address);
+    HASH_FIELD(HEADER_TAG_SECONDBOOT_ADDRESS, secondboot_address);
+    HASH_FIELD(HEADER_TAG_KERNEL_TAGS_ADDRESS, kernel_tags_address);
+    HASH_FIELD(HEADER_TAG_SONY_IPL_ADDRESS, sony_ipl_address);
+    HASH_FIELD(HEADER_TAG_SONY_RPM_ADDRESS, sony_rpm_address);
+    HASH_FIELD(HEADER_TAG_SONY_APPSBL_ADDRESS, sony_appsbl_address);
+    HASH_FIELD(HEADER_TAG_ENTRYPOINT_ADDRESS, entrypoint_address);
+
+#undef HASH_FIELD
+
+    SHA256_Final(digest, &ctx);
+}
+
+/*!
+ * \brief Compute fingerprint of a boot image
+ *
+ * \p bir must be opened and not yet have read the header. The header and all
+ * entries will be read.
+ *
+ * \param bir MbBiReader
+ * \param[out] fp Pointer to MbBiFingerprint for storing the fingerprint
+ *
+ * \return
+ *   * #MB_BI_OK if the fingerprint is successfully computed
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_fingerprint_compute(MbBiReader *bir, MbBiFingerprint *fp)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    char buf[FINGERPRINT_BUF_SIZE];
+    size_t n;
+    int ret;
+
+    memset(fp, 0, sizeof(*fp));
+
+    fp->format = mb_bi_reader_format_code(bir);
+
+    ret = mb_bi_reader_read_header(bir, &header);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    _fingerprint_hash_header(header, fp->header_digest);
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        if (fp->entries_len == MB_BI_FINGERPRINT_MAX_ENTRIES) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                                   "Too many entries in boot image");
+            return MB_BI_FAILED;
+        }
+
+        MbBiFingerprintEntry *fp_entry = &fp->entries[fp->entries_len];
+        SHA256_CTX ctx;
+
+        fp_entry->type = mb_bi_entry_type(entry);
+        SHA256_Init(&ctx);
+
+        while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+                == MB_BI_OK) {
+            SHA256_Update(&ctx, buf, n);
+            fp_entry->size += n;
+        }
+
+        if (ret != MB_BI_EOF) {
+            return ret;
+        }
+
+        SHA256_Final(fp_entry->digest, &ctx);
+        ++fp->entries_len;
+    }
+
+    return ret == MB_BI_EOF ? MB_BI_OK : ret;
+}
+
+/*!
+ * \brief Compute fingerprint of a boot image file, using the cache if possible
+ *
+ * If the fingerprint of \p filename was previously computed and the file's
+ * device, inode, modification time and size have not changed, the cached
+ * fingerprint is returned and \p bir is not used. Otherwise, \p bir is opened
+ * with the file and the fingerprint is computed with
+ * mb_bi_fingerprint_compute(). Only regular files are cached. The cache key is
+ * taken from the opened file, and the result is not cached if the file changes
+ * while it is being read.
+ *
+ * \param bir MbBiReader that has not been opened yet and has the desired
+ *            formats enabled
+ * \param filename Path to the boot image file (multi-byte string). Also used
+ *                 as the cache key, so the same file reached through different
+ *                 paths is cached separately.
+ * \param[out] fp Pointer to MbBiFingerprint for storing the fingerprint
+ *
+ * \return
+ *   * #MB_BI_OK if the fingerprint is successfully computed
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_fingerprint_compute_filename(MbBiReader *bir, const char *filename,
+                                       MbBiFingerprint *fp)
+{
+#ifdef _WIN32
+    int ret = mb_bi_reader_open_filename(bir, filename);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    return mb_bi_fingerprint_compute(bir, fp);
+#else
+    FingerprintCacheEntry key;
+    MbFile *file;
+    int fd;
+    int ret;
+
+    // The cache key is taken from the file that is actually read, so a file
+    // that is replaced after it is looked up cannot have its fingerprint
+    // cached under the wrong key
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        mb_bi_reader_set_error(bir, -errno, "Failed to open for reading: %s",
+                               strerror(errno));
+        return MB_BI_FAILED;
+    }
+
+    bool cacheable = _fingerprint_cache_key(fd, &key);
+
+    if (cacheable) {
+        std::lock_guard<std::mutex> lock(g_cache_lock);
+
+        auto it = g_cache.find(filename);
+        if (it != g_cache.end()) {
+            if (_fingerprint_cache_key_equal(it->second, key)) {
+                *fp = it->second.fp;
+                close(fd);
+                return MB_BI_OK;
+            }
+
+            g_cache.erase(it);
+        }
+    }
+
+    file = mb_file_new();
+    if (!file) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "%s", strerror(errno));
+        close(fd);
+        return MB_BI_FAILED;
+    }
+
+    ret = mb_file_open_fd(file, fd, true);
+    if (ret != MB_FILE_OK) {
+        mb_bi_reader_set_error(bir, mb_file_error(file),
+                               "Failed to open for reading: %s",
+                               mb_file_error_string(file));
+        mb_file_free(file);
+        return MB_BI_FAILED;
+    }
+
+    ret = mb_bi_reader_open(bir, file, true);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    ret = mb_bi_fingerprint_compute(bir, fp);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    // Don't cache the result if the file was modified while it was being read
+    FingerprintCacheEntry new_key;
+    if (cacheable && _fingerprint_cache_key(fd, &new_key)
+            && _fingerprint_cache_key_equal(key, new_key)) {
+        std::lock_guard<std::mutex> lock(g_cache_lock);
+
+        // The cache only needs to hold a handful of images (eg. the boot
+        // partition and the saved kernel for each ROM)
+        if (g_cache.size() >= FINGERPRINT_CACHE_MAX) {
+            g_cache.clear();
+        }
+
+        key.fp = *fp;
+        g_cache[filename] = key;
+    }
+
+    return MB_BI_OK;
+#endif
+}
+
+/*!
+ * \brief Check if two boot image fingerprints are equal
+ *
+ * The format of the boot images is not compared. Entries are compared by type,
+ * size, and digest, regardless of their order.
+ *
+ * \param fp1 First fingerprint
+ * \param fp2 Second fingerprint
+ *
+ * \return Whether the fingerprints are equal
+ */
+bool mb_bi_fingerprint_equal(const MbBiFingerprint *fp1,
+                             const MbBiFingerprint *fp2)
+{
+    if (memcmp(fp1->header_digest, fp2->header_digest,
+               sizeof(fp1->header_digest)) != 0
+            || fp1->entries_len != fp2->entries_len) {
+        return false;
+    }
+
+    for (size_t i = 0; i < fp2->entries_len; ++i) {
+        const MbBiFingerprintEntry *entry2 = &fp2->entries[i];
+        const MbBiFingerprintEntry *entry1 = nullptr;
+
+        for (size_t j = 0; j < fp1->entries_len; ++j) {
+            if (fp1->entries[j].type == entry2->type) {
+                entry1 = &fp1->entries[j];
+                break;
+            }
+        }
+
+        if (!entry1 || entry1->size != entry2->size
+                || memcmp(entry1->digest, entry2->digest,
+                          sizeof(entry1->digest)) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Clear cached fingerprints
+ */
+void mb_bi_fingerprint_cache_clear(void)
+{
+    std::lock_guard<std::mutex> lock(g_cache_lock);
+    g_cache.clear();
+}
+
+MB_END_C_DECLS
@@ -103,9 +103,89 @@ int find_loki_header(MbBiReader *bir, MbFile *file,
     return MB_BI_OK;
 }
 
+/*!
+ * \brief Compute range of the file that may contain the Loki shellcode
+ *
+ * Loki places the patched aboot function, which begins with the shellcode, at
+ * the (up to 15 byte) offset of the aboot signature check function within a
+ * 16-byte aligned block. For new-style images, this block immediately follows
+ * the page-aligned ramdisk. For old-style images, it is stored at the end of
+ * the file. If the page size is unknown, the entire file is searched.
+ *
+ * \pre The file position can be at any offset prior to calling this function.
+ *
+ * \post The file pointer position is undefined after this function returns.
+ *       Use mb_file_seek() to return to a known position.
+ *
+ * \param[in] bir MbBiReader to set error message
+ * \param[in] file MbFile handle
+ * \param[in] hdr Android header
+ * \param[in] loki_hdr Loki header
+ * \param[out] start_out Pointer to store start offset (or -1 for beginning)
+ * \param[out] end_out Pointer to store end offset (or -1 for EOF)
+ *
+ * \return
+ *   * #MB_BI_OK if the range is successfully computed
+ *   * #MB_BI_FAILED if any file operation fails non-fatally
+ *   * #MB_BI_FATAL if any file operation fails fatally
+ */
+static int loki_find_shellcode_range(MbBiReader *bir, MbFile *file,
+                                     const AndroidHeader *hdr,
+                                     const LokiHeader *loki_hdr,
+                                     int64_t *start_out, int64_t *end_out)
+{
+    // Maximum offset of the shellcode within the aboot block
+    static const uint64_t max_shellcode_offset = 0xf;
+    int ret;
+
+    *start_out = -1;
+    *end_out = -1;
+
+    if (hdr->page_size == 0) {
+        return MB_BI_OK;
+    }
+
+    if (loki_hdr->orig_kernel_size != 0 && loki_hdr->orig_ramdisk_size != 0) {
+        uint64_t aboot_offset = hdr->page_size;
+        aboot_offset += loki_hdr->orig_kernel_size;
+        aboot_offset += align_page_size<uint64_t>(aboot_offset, hdr->page_size);
+        aboot_offset += loki_hdr->orig_ramdisk_size;
+        aboot_offset += align_page_size<uint64_t>(aboot_offset, hdr->page_size);
+
+        *start_out = aboot_offset;
+        *end_out = aboot_offset + max_shellcode_offset + LOKI_SHELLCODE_SIZE;
+    } else {
+        uint64_t fake_size;
+        uint64_t file_size;
+
+        if (LOKI_IS_LG_RAMDISK_ADDR(hdr->ramdisk_addr)) {
+            fake_size = hdr->page_size;
+        } else {
+            fake_size = 0x200;
+        }
+
+        ret = mb_file_seek(file, 0, SEEK_END, &file_size);
+        if (ret != MB_FILE_OK) {
+            mb_bi_reader_set_error(bir, mb_file_error(file),
+                                   "Failed to seek to end of file: %s",
+                                   mb_file_error_string(file));
+            return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        if (file_size > fake_size) {
+            *start_out = file_size - fake_size;
+        }
+    }
+
+    return MB_BI_OK;
+}
+
 /*!
  * \brief Find and read Loki ramdisk address
  *
+ * The search for the shellcode is limited to the range permitted by the Loki
+ * image layout. See loki_find_shellcode_range().
+ *
  * \pre The file position can be at any offset prior to calling this function.
  *
  * \post The file pointer position is undefined after this function returns.
@@ -136,6 +216,8 @@ int loki_find_ramdisk_address(MbBiReader *bir, MbFile *file,
 
     if (loki_hdr->ramdisk_addr != 0) {
         uint64_t offset = 0;
+        int64_t start;
+        int64_t end;
 
         auto result_cb = [](MbFile *file, void *userdata,
                             uint64_t offset) -> int {
@@ -145,7 +227,13 @@ int loki_find_ramdisk_address(MbBiReader *bir, MbFile *file,
             return MB_FILE_OK;
         };
 
-        ret = mb_file_search(file, -1, -1, 0, LOKI_SHELLCODE,
+        ret = loki_find_shellcode_range(bir, file, hdr, loki_hdr,
+                                        &start, &end);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        ret = mb_file_search(file, start, end, 0, LOKI_SHELLCODE,
                              LOKI_SHELLCODE_SIZE - 9, 1, result_cb, &offset);
         if (ret < 0) {
             mb_bi_reader_set_error(bir, mb_file_error(file),
@@ -250,7 +338,8 @@ int loki_old_find_gzip_offset(MbBiReader *bir, MbFile *file,
     SearchResult result = {};
     int ret;
 
-    // Find first result with flags == 0x00 and flags == 0x08
+    // Find first result with flags == 0x00 and flags == 0x08, stopping at the
+    // latter
     auto result_cb = [](MbFile *file, void *userdata, uint64_t offset) -> int {
         SearchResult *result = static_cast<SearchResult *>(userdata);
         uint64_t orig_offset;
@@ -258,11 +347,6 @@ int loki_old_find_gzip_offset(MbBiReader *bir, MbFile *file,
         size_t n;
         int ret;
 
-        // Stop early if possible
-        if (result->have_flag0 && result->have_flag8) {
-            return MB_FILE_WARN;
-        }
-
         // Save original position
         ret = mb_file_seek(file, 0, SEEK_CUR, &orig_offset);
         if (ret != MB_FILE_OK) {
@@ -287,9 +371,11 @@ int loki_old_find_gzip_offset(MbBiReader *bir, MbFile *file,
         if (!result->have_flag0 && flags == 0x00) {
             result->have_flag0 = true;
             result->flag0_offset = offset;
-        } else if (!result->have_flag8 && flags == 0x08) {
+        } else if (flags == 0x08) {
+            // This takes precedence, so there is no need to keep searching
             result->have_flag8 = true;
             result->flag8_offset = offset;
+            return MB_FILE_WARN;
         }
 
         // Restore original position as per contract
@@ -801,7 +887,7 @@ int loki_reader_read_header(MbBiReader *bir, void *userdata,
     // format
     if (!ctx->have_loki_offset) {
         ret = find_loki_header(bir, bir->file, &ctx->loki_hdr,
-                               &ctx->header_offset);
+                               &ctx->loki_offset);
         if (ret < 0) {
             return ret;
         }
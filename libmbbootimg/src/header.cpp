@@ -49,8 +49,6 @@ void mb_bi_header_clear(MbBiHeader *header)
 {
     if (header) {
         uint64_t supported = header->fields_supported;
-        free(header->field.board_name);
-        free(header->field.cmdline);
         memset(header, 0, sizeof(*header));
         header->fields_supported = supported;
     }
@@ -65,39 +63,8 @@ MbBiHeader * mb_bi_header_clone(MbBiHeader *header)
         return nullptr;
     }
 
-    // Copy global options
-    dup->fields_supported = header->fields_supported;
-    dup->fields_set = header->fields_set;
-
-    // Shallow copy trivial fields
-    dup->field.kernel_addr = header->field.kernel_addr;
-    dup->field.ramdisk_addr = header->field.ramdisk_addr;
-    dup->field.second_addr = header->field.second_addr;
-    dup->field.tags_addr = header->field.tags_addr;
-    dup->field.ipl_addr = header->field.ipl_addr;
-    dup->field.rpm_addr = header->field.rpm_addr;
-    dup->field.appsbl_addr = header->field.appsbl_addr;
-    dup->field.page_size = header->field.page_size;
-    dup->field.hdr_kernel_size = header->field.hdr_kernel_size;
-    dup->field.hdr_ramdisk_size = header->field.hdr_ramdisk_size;
-    dup->field.hdr_second_size = header->field.hdr_second_size;
-    dup->field.hdr_dt_size = header->field.hdr_dt_size;
-    dup->field.hdr_unused = header->field.hdr_unused;
-    memcpy(dup->field.hdr_id, header->field.hdr_id,
-           sizeof(header->field.hdr_id));
-    dup->field.hdr_entrypoint = header->field.hdr_entrypoint;
-
-    // Deep copy strings
-    bool deep_copy_error =
-            (header->field.board_name
-                    && !(dup->field.board_name = strdup(header->field.board_name)))
-            || (header->field.cmdline
-                    && !(dup->field.cmdline = strdup(header->field.cmdline)));
-
-    if (deep_copy_error) {
-        mb_bi_header_free(dup);
-        return nullptr;
-    }
+    // Strings are stored inline, so a shallow copy is sufficient
+    *dup = *header;
 
     return dup;
 }
@@ -116,26 +83,29 @@ void mb_bi_header_set_supported_fields(MbBiHeader *header, uint64_t fields)
 
 const char * mb_bi_header_board_name(MbBiHeader *header)
 {
-    return header->field.board_name;
+    return IS_SET(header, MB_BI_HEADER_FIELD_BOARD_NAME)
+            ? header->field.board_name : nullptr;
 }
 
 int mb_bi_header_set_board_name(MbBiHeader *header, const char *name)
 {
     ENSURE_SUPPORTED(header, MB_BI_HEADER_FIELD_BOARD_NAME);
-    SET_STRING_FIELD(header, MB_BI_HEADER_FIELD_BOARD_NAME, board_name, name);
+    SET_STRING_BUF_FIELD(header, MB_BI_HEADER_FIELD_BOARD_NAME,
+                         board_name, name);
     return MB_BI_OK;
 }
 
 const char * mb_bi_header_kernel_cmdline(MbBiHeader *header)
 {
-    return header->field.cmdline;
+    return IS_SET(header, MB_BI_HEADER_FIELD_KERNEL_CMDLINE)
+            ? header->field.cmdline : nullptr;
 }
 
 int mb_bi_header_set_kernel_cmdline(MbBiHeader *header, const char *cmdline)
 {
     ENSURE_SUPPORTED(header, MB_BI_HEADER_FIELD_KERNEL_CMDLINE);
-    SET_STRING_FIELD(header, MB_BI_HEADER_FIELD_KERNEL_CMDLINE,
-                     cmdline, cmdline);
+    SET_STRING_BUF_FIELD(header, MB_BI_HEADER_FIELD_KERNEL_CMDLINE,
+                         cmdline, cmdline);
     return MB_BI_OK;
 }
 
@@ -258,7 +258,7 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
     READER_ENSURE_STATE_GOTO(bir, ReaderState::NEW, ret, done);
 
     format.type = type;
-    format.name = strdup(name);
+    format.name = name;
     format.bidder_cb = bidder_cb;
     format.set_option_cb = set_option_cb;
     format.read_header_cb = read_header_cb;
@@ -268,12 +268,6 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
     format.free_cb = free_cb;
     format.userdata = userdata;
 
-    if (!format.name) {
-        mb_bi_reader_set_error(bir, -errno, "%s", strerror(errno));
-        ret = MB_BI_FAILED;
-        goto done;
-    }
-
     if (bir->formats_len == MAX_FORMATS) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
                                "Too many formats enabled");
@@ -335,8 +329,6 @@ int _mb_bi_reader_free_format(MbBiReader *bir, FormatReader *format)
         if (format->free_cb) {
             ret = format->free_cb(bir, format->userdata);
         }
-
-        free(format->name);
     }
 
     return ret;
@@ -626,6 +618,10 @@ int mb_bi_reader_close(MbBiReader *bir)
  * should *never* be deallocated with mb_bi_header_free(). It is tracked
  * internally and will be freed when the MbBiReader is freed.
  *
+ * \note The same MbBiHeader instance is reused for every call, so this function
+ *       does not allocate memory. Use mb_bi_header_clone() to keep the values
+ *       around after the next call.
+ *
  * \param[in] bir MbBiReader
  * \param[out] header Pointer to store MbBiHeader reference
  *
@@ -701,6 +697,9 @@ int mb_bi_reader_read_header2(MbBiReader *bir, MbBiHeader *header)
  * function should *never* be deallocated with mb_bi_entry_free(). It is tracked
  * internally and will be freed when the MbBiReader is freed.
  *
+ * \note The same MbBiEntry instance is reused for every call, so iterating
+ *       through the entries does not allocate memory.
+ *
  * \param[in] bir MbBiReader
  * \param[out] entry Pointer to store MbBiEntry reference
  *
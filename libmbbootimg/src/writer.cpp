@@ -271,7 +271,7 @@ int _mb_bi_writer_register_format(MbBiWriter *biw,
     WRITER_ENSURE_STATE_GOTO(biw, WriterState::NEW, ret, done);
 
     format.type = type;
-    format.name = strdup(name);
+    format.name = name;
     format.set_option_cb = set_option_cb;
     format.get_header_cb = get_header_cb;
     format.write_header_cb = write_header_cb;
@@ -283,12 +283,6 @@ int _mb_bi_writer_register_format(MbBiWriter *biw,
     format.free_cb = free_cb;
     format.userdata = userdata;
 
-    if (!format.name) {
-        mb_bi_writer_set_error(biw, -errno, "%s", strerror(errno));
-        ret = MB_BI_FAILED;
-        goto done;
-    }
-
     // Clear old format
     if (biw->format_set) {
         _mb_bi_writer_free_format(biw, &biw->format);
@@ -338,8 +332,6 @@ int _mb_bi_writer_free_format(MbBiWriter *biw, FormatWriter *format)
         if (format->free_cb) {
             ret = format->free_cb(biw, format->userdata);
         }
-
-        free(format->name);
     }
 
     return ret;
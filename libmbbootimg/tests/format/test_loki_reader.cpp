@@ -234,6 +234,38 @@ TEST(LokiFindRamdiskAddressTest, NewImageTruncatedShellcodeShouldWarn)
                        "Unexpected EOF"));
 }
 
+TEST(LokiFindRamdiskAddressTest, NewImageShellcodeOutsideLayoutShouldWarn)
+{
+    ScopedFile file(mb_file_new(), &mb_file_free);
+    ASSERT_TRUE(!!file);
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    AndroidHeader ahdr = {};
+    ahdr.page_size = 2048;
+
+    LokiHeader lhdr = {};
+    lhdr.orig_kernel_size = ahdr.page_size;
+    lhdr.orig_ramdisk_size = ahdr.page_size;
+    lhdr.ramdisk_addr = 0x82200000;
+
+    uint32_t ramdisk_addr;
+
+    std::vector<unsigned char> data(3 * ahdr.page_size + 0x200);
+
+    // Shellcode in the kernel should not be found since the layout requires
+    // it to be after the ramdisk
+    memcpy(data.data() + ahdr.page_size, LOKI_SHELLCODE, LOKI_SHELLCODE_SIZE);
+
+    ASSERT_EQ(mb_file_open_memory_static(file.get(), data.data(), data.size()),
+              MB_FILE_OK);
+
+    ASSERT_EQ(loki_find_ramdisk_address(bir.get(), file.get(), &ahdr, &lhdr,
+                                        &ramdisk_addr), MB_BI_WARN);
+    ASSERT_TRUE(strstr(mb_bi_reader_error_string(bir.get()),
+                       "Loki shellcode not found"));
+}
+
 // Tests for loki_old_find_gzip_offset()
 
 TEST(LokiOldFindGzipOffsetTest, ZeroFlagHeaderFoundShouldSucceed)
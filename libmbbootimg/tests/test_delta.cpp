@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <cstring>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/delta.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct BootImgDeltaTest : public ::testing::Test
+{
+protected:
+    std::vector<void *> _bufs;
+
+    virtual ~BootImgDeltaTest()
+    {
+        for (void *buf : _bufs) {
+            free(buf);
+        }
+    }
+
+    void WriteImage(const std::vector<unsigned char> &kernel,
+                    const std::vector<unsigned char> &ramdisk,
+                    const char *cmdline,
+                    void **buf, size_t *buf_size)
+    {
+        ScopedFile file(mb_file_new(), mb_file_free);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+        size_t n;
+
+        ASSERT_TRUE(!!file);
+        ASSERT_TRUE(!!biw);
+
+        *buf = nullptr;
+        *buf_size = 0;
+
+        ASSERT_EQ(mb_file_open_memory_dynamic(file.get(), buf, buf_size),
+                  MB_FILE_OK);
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), file.get(), false), MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, cmdline), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+            ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+            const std::vector<unsigned char> *data = nullptr;
+            if (mb_bi_entry_type(entry) == MB_BI_ENTRY_KERNEL) {
+                data = &kernel;
+            } else if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+                data = &ramdisk;
+            }
+
+            if (data) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), data->data(),
+                                                  data->size(), &n), MB_BI_OK);
+                ASSERT_EQ(n, data->size());
+            }
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_file_close(file.get()), MB_FILE_OK);
+
+        _bufs.push_back(*buf);
+    }
+
+    void OpenReader(MbBiReader *bir, MbFile *file, void *buf, size_t size)
+    {
+        ASSERT_EQ(mb_file_open_memory_static(file, buf, size), MB_FILE_OK);
+        ASSERT_EQ(mb_bi_reader_enable_format_android(bir), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open(bir, file, false), MB_BI_OK);
+    }
+};
+
+TEST_F(BootImgDeltaTest, RoundTripReproducesTarget)
+{
+    std::vector<unsigned char> kernel(100000);
+    std::vector<unsigned char> ramdisk(200000);
+    uint32_t seed = 1;
+
+    for (auto &c : kernel) {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<unsigned char>(seed >> 16);
+    }
+    for (auto &c : ramdisk) {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<unsigned char>(seed >> 16);
+    }
+
+    // Target has a modified region and an insertion in the ramdisk
+    std::vector<unsigned char> new_ramdisk(ramdisk);
+    memset(new_ramdisk.data() + 5000, 0xaa, 300);
+    new_ramdisk.insert(new_ramdisk.begin() + 150000, 1000, 0x55);
+
+    void *base_buf;
+    size_t base_size;
+    void *target_buf;
+    size_t target_size;
+
+    WriteImage(kernel, ramdisk, "foo", &base_buf, &base_size);
+    WriteImage(kernel, new_ramdisk, "bar", &target_buf, &target_size);
+
+    // Create delta
+    void *delta_buf = nullptr;
+    size_t delta_size = 0;
+    {
+        ScopedFile base_file(mb_file_new(), mb_file_free);
+        ScopedFile target_file(mb_file_new(), mb_file_free);
+        ScopedFile delta_file(mb_file_new(), mb_file_free);
+        ScopedReader base(mb_bi_reader_new(), mb_bi_reader_free);
+        ScopedReader target(mb_bi_reader_new(), mb_bi_reader_free);
+
+        OpenReader(base.get(), base_file.get(), base_buf, base_size);
+        OpenReader(target.get(), target_file.get(), target_buf, target_size);
+        ASSERT_EQ(mb_file_open_memory_dynamic(delta_file.get(), &delta_buf,
+                                              &delta_size), MB_FILE_OK);
+
+        ASSERT_EQ(mb_bi_delta_create(base.get(), target.get(),
+                                     delta_file.get()), MB_BI_OK);
+        ASSERT_EQ(mb_file_close(delta_file.get()), MB_FILE_OK);
+    }
+    _bufs.push_back(delta_buf);
+
+    // Only the changed regions should be stored
+    ASSERT_LT(delta_size, 4096u);
+
+    // Apply delta
+    void *output_buf = nullptr;
+    size_t output_size = 0;
+    {
+        ScopedFile base_file(mb_file_new(), mb_file_free);
+        ScopedFile delta_file(mb_file_new(), mb_file_free);
+        ScopedFile output_file(mb_file_new(), mb_file_free);
+        ScopedReader base(mb_bi_reader_new(), mb_bi_reader_free);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+
+        OpenReader(base.get(), base_file.get(), base_buf, base_size);
+        ASSERT_EQ(mb_file_open_memory_static(delta_file.get(), delta_buf,
+                                             delta_size), MB_FILE_OK);
+        ASSERT_EQ(mb_file_open_memory_dynamic(output_file.get(), &output_buf,
+                                              &output_size), MB_FILE_OK);
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), output_file.get(), false),
+                  MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_delta_apply(base.get(), delta_file.get(), biw.get()),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_file_close(output_file.get()), MB_FILE_OK);
+    }
+    _bufs.push_back(output_buf);
+
+    ASSERT_EQ(output_size, target_size);
+    ASSERT_EQ(memcmp(output_buf, target_buf, target_size), 0);
+}
+
+TEST_F(BootImgDeltaTest, ApplyRejectsWrongBase)
+{
+    std::vector<unsigned char> kernel(10000, 'k');
+    std::vector<unsigned char> ramdisk(10000, 'r');
+    std::vector<unsigned char> other(10000, 'o');
+
+    void *base_buf;
+    size_t base_size;
+    void *other_buf;
+    size_t other_size;
+
+    WriteImage(kernel, ramdisk, "", &base_buf, &base_size);
+    WriteImage(kernel, other, "", &other_buf, &other_size);
+
+    void *delta_buf = nullptr;
+    size_t delta_size = 0;
+    {
+        ScopedFile base_file(mb_file_new(), mb_file_free);
+        ScopedFile target_file(mb_file_new(), mb_file_free);
+        ScopedFile delta_file(mb_file_new(), mb_file_free);
+        ScopedReader base(mb_bi_reader_new(), mb_bi_reader_free);
+        ScopedReader target(mb_bi_reader_new(), mb_bi_reader_free);
+
+        OpenReader(base.get(), base_file.get(), base_buf, base_size);
+        OpenReader(target.get(), target_file.get(), base_buf, base_size);
+        ASSERT_EQ(mb_file_open_memory_dynamic(delta_file.get(), &delta_buf,
+                                              &delta_size), MB_FILE_OK);
+
+        ASSERT_EQ(mb_bi_delta_create(base.get(), target.get(),
+                                     delta_file.get()), MB_BI_OK);
+        ASSERT_EQ(mb_file_close(delta_file.get()), MB_FILE_OK);
+    }
+    _bufs.push_back(delta_buf);
+
+    void *output_buf = nullptr;
+    size_t output_size = 0;
+    {
+        ScopedFile base_file(mb_file_new(), mb_file_free);
+        ScopedFile delta_file(mb_file_new(), mb_file_free);
+        ScopedFile output_file(mb_file_new(), mb_file_free);
+        ScopedReader base(mb_bi_reader_new(), mb_bi_reader_free);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+
+        OpenReader(base.get(), base_file.get(), other_buf, other_size);
+        ASSERT_EQ(mb_file_open_memory_static(delta_file.get(), delta_buf,
+                                             delta_size), MB_FILE_OK);
+        ASSERT_EQ(mb_file_open_memory_dynamic(output_file.get(), &output_buf,
+                                              &output_size), MB_FILE_OK);
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), output_file.get(), false),
+                  MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_delta_apply(base.get(), delta_file.get(), biw.get()),
+                  MB_BI_FAILED);
+    }
+    _bufs.push_back(output_buf);
+}
+
+TEST_F(BootImgDeltaTest, ApplyRejectsOversizedCopy)
+{
+    std::vector<unsigned char> kernel(10000, 'k');
+    std::vector<unsigned char> ramdisk(10000, 'r');
+
+    void *base_buf;
+    size_t base_size;
+
+    WriteImage(kernel, ramdisk, "", &base_buf, &base_size);
+
+    void *delta_buf = nullptr;
+    size_t delta_size = 0;
+    {
+        ScopedFile base_file(mb_file_new(), mb_file_free);
+        ScopedFile target_file(mb_file_new(), mb_file_free);
+        ScopedFile delta_file(mb_file_new(), mb_file_free);
+        ScopedReader base(mb_bi_reader_new(), mb_bi_reader_free);
+        ScopedReader target(mb_bi_reader_new(), mb_bi_reader_free);
+
+        OpenReader(base.get(), base_file.get(), base_buf, base_size);
+        OpenReader(target.get(), target_file.get(), base_buf, base_size);
+        ASSERT_EQ(mb_file_open_memory_dynamic(delta_file.get(), &delta_buf,
+                                              &delta_size), MB_FILE_OK);
+
+        ASSERT_EQ(mb_bi_delta_create(base.get(), target.get(),
+                                     delta_file.get()), MB_BI_OK);
+        ASSERT_EQ(mb_file_close(delta_file.get()), MB_FILE_OK);
+    }
+    _bufs.push_back(delta_buf);
+
+    // The unchanged kernel is stored as a single copy of the whole base entry:
+    // type, flags, size, 2 SHA1 digests, op count, op type, offset, size
+    const unsigned char entry_start[] = {
+        1, 0, 0, 0, 1, 0, 0, 0, 0x10, 0x27, 0, 0, 0, 0, 0, 0,
+    };
+    auto *ptr = static_cast<unsigned char *>(delta_buf);
+    auto *end = ptr + delta_size;
+    auto *entry = std::search(ptr, end, entry_start,
+                              entry_start + sizeof(entry_start));
+    ASSERT_NE(entry, end);
+    ASSERT_LE(entry + 16 + 40 + 8 + 1 + 8 + 8, end);
+    ASSERT_EQ(entry[16 + 40], 1);
+    ASSERT_EQ(entry[16 + 40 + 8], 1);
+
+    // Make both the entry and the copy claim 1 TiB
+    const unsigned char huge[] = { 0, 0, 0, 0, 0, 1, 0, 0 };
+    memcpy(entry + 8, huge, sizeof(huge));
+    memcpy(entry + 16 + 40 + 8 + 1 + 8, huge, sizeof(huge));
+
+    void *output_buf = nullptr;
+    size_t output_size = 0;
+    {
+        ScopedFile base_file(mb_file_new(), mb_file_free);
+        ScopedFile delta_file(mb_file_new(), mb_file_free);
+        ScopedFile output_file(mb_file_new(), mb_file_free);
+        ScopedReader base(mb_bi_reader_new(), mb_bi_reader_free);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+
+        OpenReader(base.get(), base_file.get(), base_buf, base_size);
+        ASSERT_EQ(mb_file_open_memory_static(delta_file.get(), delta_buf,
+                                             delta_size), MB_FILE_OK);
+        ASSERT_EQ(mb_file_open_memory_dynamic(output_file.get(), &output_buf,
+                                              &output_size), MB_FILE_OK);
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), output_file.get(), false),
+                  MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_delta_apply(base.get(), delta_file.get(), biw.get()),
+                  MB_BI_FAILED);
+    }
+    _bufs.push_back(output_buf);
+}
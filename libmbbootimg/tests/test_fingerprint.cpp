@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/fingerprint.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct BootImgFingerprintTest : public ::testing::Test
+{
+protected:
+    std::vector<void *> _bufs;
+
+    virtual void SetUp()
+    {
+        mb_bi_fingerprint_cache_clear();
+    }
+
+    virtual ~BootImgFingerprintTest()
+    {
+        for (void *buf : _bufs) {
+            free(buf);
+        }
+    }
+
+    void WriteImage(int format, const char *kernel, const char *cmdline,
+                    void **buf, size_t *buf_size)
+    {
+        ScopedFile file(mb_file_new(), mb_file_free);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+        size_t n;
+
+        ASSERT_TRUE(!!file);
+        ASSERT_TRUE(!!biw);
+
+        *buf = nullptr;
+        *buf_size = 0;
+
+        ASSERT_EQ(mb_file_open_memory_dynamic(file.get(), buf, buf_size),
+                  MB_FILE_OK);
+
+        ASSERT_EQ(mb_bi_writer_set_format_by_code(biw.get(), format),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), file.get(), false), MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, cmdline), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+            ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+            if (mb_bi_entry_type(entry) == MB_BI_ENTRY_KERNEL) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), kernel,
+                                                  strlen(kernel), &n),
+                          MB_BI_OK);
+            } else if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), "ramdisk", 7, &n),
+                          MB_BI_OK);
+            }
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_file_close(file.get()), MB_FILE_OK);
+
+        _bufs.push_back(*buf);
+    }
+
+    void Fingerprint(void *buf, size_t size, MbBiFingerprint *fp)
+    {
+        ScopedFile file(mb_file_new(), mb_file_free);
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+
+        ASSERT_EQ(mb_file_open_memory_static(file.get(), buf, size),
+                  MB_FILE_OK);
+        ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open(bir.get(), file.get(), false), MB_BI_OK);
+        ASSERT_EQ(mb_bi_fingerprint_compute(bir.get(), fp), MB_BI_OK);
+    }
+};
+
+TEST_F(BootImgFingerprintTest, EqualImagesHaveEqualFingerprints)
+{
+    void *buf1;
+    size_t size1;
+    void *buf2;
+    size_t size2;
+    MbBiFingerprint fp1;
+    MbBiFingerprint fp2;
+
+    WriteImage(MB_BI_FORMAT_ANDROID, "kernel", "foo", &buf1, &size1);
+    WriteImage(MB_BI_FORMAT_ANDROID, "kernel", "foo", &buf2, &size2);
+
+    Fingerprint(buf1, size1, &fp1);
+    Fingerprint(buf2, size2, &fp2);
+
+    ASSERT_EQ(fp1.format, MB_BI_FORMAT_ANDROID);
+    ASSERT_EQ(fp1.entries_len, 2u);
+    ASSERT_EQ(fp1.entries[0].type, MB_BI_ENTRY_KERNEL);
+    ASSERT_EQ(fp1.entries[0].size, 6u);
+    ASSERT_TRUE(mb_bi_fingerprint_equal(&fp1, &fp2));
+}
+
+TEST_F(BootImgFingerprintTest, FormatIsIgnored)
+{
+    void *buf1;
+    size_t size1;
+    void *buf2;
+    size_t size2;
+    MbBiFingerprint fp1;
+    MbBiFingerprint fp2;
+
+    WriteImage(MB_BI_FORMAT_ANDROID, "kernel", "foo", &buf1, &size1);
+    WriteImage(MB_BI_FORMAT_BUMP, "kernel", "foo", &buf2, &size2);
+
+    Fingerprint(buf1, size1, &fp1);
+    Fingerprint(buf2, size2, &fp2);
+
+    ASSERT_EQ(fp2.format, MB_BI_FORMAT_BUMP);
+    ASSERT_TRUE(mb_bi_fingerprint_equal(&fp1, &fp2));
+}
+
+TEST_F(BootImgFingerprintTest, DifferentImagesHaveDifferentFingerprints)
+{
+    void *buf1;
+    size_t size1;
+    void *buf2;
+    size_t size2;
+    void *buf3;
+    size_t size3;
+    MbBiFingerprint fp1;
+    MbBiFingerprint fp2;
+    MbBiFingerprint fp3;
+
+    WriteImage(MB_BI_FORMAT_ANDROID, "kernel", "foo", &buf1, &size1);
+    WriteImage(MB_BI_FORMAT_ANDROID, "kernel", "bar", &buf2, &size2);
+    WriteImage(MB_BI_FORMAT_ANDROID, "kernal", "foo", &buf3, &size3);
+
+    Fingerprint(buf1, size1, &fp1);
+    Fingerprint(buf2, size2, &fp2);
+    Fingerprint(buf3, size3, &fp3);
+
+    ASSERT_FALSE(mb_bi_fingerprint_equal(&fp1, &fp2));
+    ASSERT_FALSE(mb_bi_fingerprint_equal(&fp1, &fp3));
+    ASSERT_EQ(memcmp(fp1.header_digest, fp3.header_digest,
+                     sizeof(fp1.header_digest)), 0);
+}
+
+TEST_F(BootImgFingerprintTest, FilenameResultIsCached)
+{
+    void *buf;
+    size_t size;
+    MbBiFingerprint fp1;
+    MbBiFingerprint fp2;
+
+    WriteImage(MB_BI_FORMAT_ANDROID, "kernel", "foo", &buf, &size);
+
+    char path[] = "/tmp/mbbootimg_fingerprint_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(write(fd, buf, size), static_cast<ssize_t>(size));
+    close(fd);
+
+    {
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_fingerprint_compute_filename(bir.get(), path, &fp1),
+                  MB_BI_OK);
+    }
+
+    // A reader without any formats enabled can only succeed if the cached
+    // fingerprint is used
+    {
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        ASSERT_EQ(mb_bi_fingerprint_compute_filename(bir.get(), path, &fp2),
+                  MB_BI_OK);
+        ASSERT_TRUE(mb_bi_fingerprint_equal(&fp1, &fp2));
+    }
+
+    // Changing the file invalidates the cache entry
+    fd = open(path, O_WRONLY | O_APPEND);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(write(fd, "x", 1), 1);
+    close(fd);
+
+    {
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        ASSERT_NE(mb_bi_fingerprint_compute_filename(bir.get(), path, &fp2),
+                  MB_BI_OK);
+    }
+
+    unlink(path);
+}
@@ -20,6 +20,7 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <string>
 
 #include "mbbootimg/defs.h"
 #include "mbbootimg/header.h"
@@ -44,8 +45,8 @@ TEST(BootImgHeaderTest, CheckDefaultValues)
     ASSERT_EQ(header->field.rpm_addr, 0);
     ASSERT_EQ(header->field.appsbl_addr, 0);
     ASSERT_EQ(header->field.page_size, 0);
-    ASSERT_EQ(header->field.board_name, nullptr);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_STREQ(header->field.board_name, "");
+    ASSERT_STREQ(header->field.cmdline, "");
     ASSERT_EQ(header->field.hdr_kernel_size, 0);
     ASSERT_EQ(header->field.hdr_ramdisk_size, 0);
     ASSERT_EQ(header->field.hdr_second_size, 0);
@@ -98,7 +99,7 @@ TEST(BootImgHeaderTest, CheckGettersSetters)
 
     ASSERT_EQ(mb_bi_header_set_board_name(header.get(), nullptr), MB_BI_OK);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_BOARD_NAME);
-    ASSERT_EQ(header->field.board_name, nullptr);
+    ASSERT_STREQ(header->field.board_name, "");
     ASSERT_EQ(mb_bi_header_board_name(header.get()), nullptr);
 
     // Kernel cmdline field
@@ -110,7 +111,25 @@ TEST(BootImgHeaderTest, CheckGettersSetters)
 
     ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), nullptr), MB_BI_OK);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_KERNEL_CMDLINE);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_STREQ(header->field.cmdline, "");
+    ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), nullptr);
+
+    // Strings that do not fit in the inline buffers
+
+    std::string long_name(MB_BI_HEADER_BOARD_NAME_SIZE, 'a');
+    ASSERT_EQ(mb_bi_header_set_board_name(header.get(), long_name.c_str()),
+              MB_BI_FAILED);
+    ASSERT_EQ(mb_bi_header_board_name(header.get()), nullptr);
+    long_name.pop_back();
+    ASSERT_EQ(mb_bi_header_set_board_name(header.get(), long_name.c_str()),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_board_name(header.get()), long_name);
+    ASSERT_EQ(mb_bi_header_set_board_name(header.get(), nullptr), MB_BI_OK);
+
+    std::string long_cmdline(MB_BI_HEADER_CMDLINE_SIZE, 'a');
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(),
+                                              long_cmdline.c_str()),
+              MB_BI_FAILED);
     ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), nullptr);
 
     // Page size field
@@ -255,7 +274,7 @@ TEST(BootImgHeaderTest, CheckSettingUnsupported)
     ASSERT_EQ(mb_bi_header_set_board_name(header.get(), "test"),
               MB_BI_UNSUPPORTED);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_BOARD_NAME);
-    ASSERT_EQ(header->field.board_name, nullptr);
+    ASSERT_STREQ(header->field.board_name, "");
     ASSERT_EQ(mb_bi_header_board_name(header.get()), nullptr);
     ASSERT_EQ(mb_bi_header_set_board_name(header.get(), nullptr),
               MB_BI_UNSUPPORTED);
@@ -267,7 +286,7 @@ TEST(BootImgHeaderTest, CheckSettingUnsupported)
     ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "test"),
               MB_BI_UNSUPPORTED);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_KERNEL_CMDLINE);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_STREQ(header->field.cmdline, "");
     ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), nullptr);
     ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), nullptr),
               MB_BI_UNSUPPORTED);
@@ -404,10 +423,8 @@ TEST(BootImgHeaderTest, CheckClone)
     header->field.rpm_addr = 0x6000;
     header->field.appsbl_addr = 0x7000;
     header->field.page_size = 2048;
-    header->field.board_name = strdup("test");
-    ASSERT_NE(header->field.board_name, nullptr);
-    header->field.cmdline = strdup("test2");
-    ASSERT_NE(header->field.cmdline, nullptr);
+    strcpy(header->field.board_name, "test");
+    strcpy(header->field.cmdline, "test2");
     header->field.hdr_kernel_size = 1024;
     header->field.hdr_ramdisk_size = 2048;
     header->field.hdr_second_size = 4096;
@@ -472,10 +489,8 @@ TEST(BootImgHeaderTest, CheckClear)
     header->field.rpm_addr = 0x6000;
     header->field.appsbl_addr = 0x7000;
     header->field.page_size = 2048;
-    header->field.board_name = strdup("test");
-    ASSERT_NE(header->field.board_name, nullptr);
-    header->field.cmdline = strdup("test2");
-    ASSERT_NE(header->field.cmdline, nullptr);
+    strcpy(header->field.board_name, "test");
+    strcpy(header->field.cmdline, "test2");
     header->field.hdr_kernel_size = 1024;
     header->field.hdr_ramdisk_size = 2048;
     header->field.hdr_second_size = 4096;
@@ -504,8 +519,8 @@ TEST(BootImgHeaderTest, CheckClear)
     ASSERT_EQ(header->field.rpm_addr, 0);
     ASSERT_EQ(header->field.appsbl_addr, 0);
     ASSERT_EQ(header->field.page_size, 0);
-    ASSERT_EQ(header->field.board_name, nullptr);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_STREQ(header->field.board_name, "");
+    ASSERT_STREQ(header->field.cmdline, "");
     ASSERT_EQ(header->field.hdr_kernel_size, 0);
     ASSERT_EQ(header->field.hdr_ramdisk_size, 0);
     ASSERT_EQ(header->field.hdr_second_size, 0);
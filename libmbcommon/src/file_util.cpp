@@ -208,7 +208,8 @@ int mb_file_read_discard(struct MbFile *file, uint64_t size,
  * and set `errno` to `EINVAL`. If \p buf_size is zero, then the larger of 8 MiB
  * and 2 * \p pattern_size will be used. In the rare case that
  * 2 * \p pattern_size would exceed the maximum value of a `size_t`, `SIZE_MAX`
- * will be used.
+ * will be used. If \p end is specified, the automatically chosen size is capped
+ * to the size of the search window. Data past \p end is never read.
  *
  * If \p file does not support seeking, then the file position must be set to
  * the beginning of the file before calling this function. Instead of seeking,
@@ -277,6 +278,15 @@ int mb_file_search(struct MbFile *file, int64_t start, int64_t end,
         } else {
             buf_size = std::max(buf_size, pattern_size * 2);
         }
+
+        // Don't allocate more than what the search window can hold
+        if (end >= 0) {
+            uint64_t window = static_cast<uint64_t>(end)
+                    - static_cast<uint64_t>(std::max<int64_t>(start, 0));
+            if (window < buf_size) {
+                buf_size = std::max<size_t>(window, pattern_size);
+            }
+        }
     }
 
     // Ensure buffer is large enough
@@ -323,6 +333,17 @@ int mb_file_search(struct MbFile *file, int64_t start, int64_t end,
     ptr_remain = buf_size;
 
     while (true) {
+        // Don't read past the ending boundary
+        if (end >= 0) {
+            uint64_t buf_end = offset + (ptr - buf);
+            if (buf_end >= static_cast<uint64_t>(end)) {
+                ptr_remain = 0;
+            } else {
+                ptr_remain = std::min<uint64_t>(
+                        ptr_remain, static_cast<uint64_t>(end) - buf_end);
+            }
+        }
+
         ret = mb_file_read_fully(file, ptr, ptr_remain, &n);
         if (ret < 0) {
             goto done;
@@ -583,6 +583,21 @@ TEST_F(FileSearchTest, FindNormal)
                              &_result_cb, this), MB_FILE_OK);
 }
 
+TEST_F(FileSearchTest, FindWithinBoundaries)
+{
+    uint64_t pos;
+
+    ASSERT_EQ(mb_file_open_memory_static(_file, "abababaaaa", 10), MB_FILE_OK);
+
+    ASSERT_EQ(mb_file_search(_file, 2, 5, 0, "a", 1, -1,
+                             &_result_cb, this), MB_FILE_OK);
+    ASSERT_EQ(_n_result, 2);
+
+    // Data past the ending boundary should not have been read
+    ASSERT_EQ(mb_file_seek(_file, 0, SEEK_CUR, &pos), MB_FILE_OK);
+    ASSERT_LE(pos, 5u);
+}
+
 TEST(FileMoveTest, DegenerateCasesShouldSucceed)
 {
     char buf[] = "abcdef";
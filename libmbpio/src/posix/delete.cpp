@@ -49,7 +49,7 @@ static int deleteCbNftw(const char *fpath, const struct stat *sb,
 
 bool deleteRecursively(const std::string &path)
 {
-    return nftw(path.c_str(), deleteCbNftw, 64, FTW_DEPTH | FTW_PHYS);
+    return nftw(path.c_str(), deleteCbNftw, 64, FTW_DEPTH | FTW_PHYS) == 0;
 }
 
 }
@@ -0,0 +1,745 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Throughput benchmark for the sparse file reader and flasher.
+//
+// For each workload profile, a synthetic sparse image is generated in memory
+// from a seeded PRNG and the following operations are timed:
+//
+//   open       - sparseOpen(), which indexes all chunk headers
+//   lookup     - sparseSeek() to random 4 KiB aligned offsets. No data is read,
+//                so this is the cost of finding the chunk for an offset.
+//   rand4k     - sparseSeek() + sparseRead() of 4 KiB at random offsets
+//   readat4k   - sparseReadAt() of 4 KiB at random offsets
+//   seq        - sparseRead() of the entire image in 1 MiB reads
+//   expand     - sparseFlashCb() to a callback that discards the data
+//   expand+crc - same as above, but with CRC32 verification enabled
+//
+// The workload profiles are:
+//
+//   system     - many small raw chunks interleaved with short fill and don't
+//                care runs, like an ext4 system image
+//   fill       - huge fill runs separated by a few raw blocks
+//   raw        - large raw chunks, like a filesystem image with no free space
+//
+// Every profile has CRC32 chunks spread throughout the image.
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include "mbcommon/endian.h"
+
+#include "mblog/base_logger.h"
+#include "mblog/logging.h"
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_flash.h"
+
+#include "crc32_p.h"
+
+typedef std::unique_ptr<SparseCtx, decltype(sparseCtxFree) *> ScopedSparseCtx;
+
+#define DEFAULT_IMAGE_SIZE      (256 * 1024 * 1024)
+#define DEFAULT_ITERATIONS      3
+#define DEFAULT_RANDOM_OPS      100000
+#define DEFAULT_SEED            1
+#define BLOCK_SIZE              4096
+#define RANDOM_READ_SIZE        4096
+#define SEQ_READ_SIZE           (1024 * 1024)
+
+// The library logs every chunk header at the debug level, which would otherwise
+// dominate the open and sequential read timings
+class ErrorLogger : public mb::log::BaseLogger
+{
+public:
+    virtual void log(mb::log::LogLevel prio, const char *fmt,
+                     va_list ap) override
+    {
+        if (prio == mb::log::LogLevel::Error) {
+            vfprintf(stderr, fmt, ap);
+            fputc('\n', stderr);
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Image generation
+////////////////////////////////////////////////////////////////////////////////
+
+class Random
+{
+public:
+    explicit Random(uint32_t seed) : _state(seed)
+    {
+    }
+
+    uint32_t next()
+    {
+        _state = _state * 1103515245 + 12345;
+        return _state >> 16;
+    }
+
+    uint32_t next32()
+    {
+        uint32_t high = next();
+        return high << 16 | next();
+    }
+
+    // Random value in [min, max]
+    uint32_t range(uint32_t min, uint32_t max)
+    {
+        return min + next32() % (max - min + 1);
+    }
+
+private:
+    uint32_t _state;
+};
+
+struct ChunkCounts
+{
+    uint32_t raw = 0;
+    uint32_t fill = 0;
+    uint32_t dont_care = 0;
+    uint32_t crc32 = 0;
+};
+
+class ImageBuilder
+{
+public:
+    explicit ImageBuilder(uint32_t seed) : _random(seed)
+    {
+        // Space for the header, which is written when the image is finished
+        _data.resize(sizeof(SparseHeader));
+    }
+
+    uint64_t size() const
+    {
+        return static_cast<uint64_t>(_blocks) * BLOCK_SIZE;
+    }
+
+    void add_raw(uint32_t blocks)
+    {
+        add_chunk_header(CHUNK_TYPE_RAW, blocks, blocks * BLOCK_SIZE);
+
+        size_t offset = _data.size();
+        _data.resize(offset + blocks * BLOCK_SIZE);
+
+        for (size_t i = offset; i < _data.size(); i += sizeof(uint32_t)) {
+            uint32_t value = _random.next32();
+            memcpy(_data.data() + i, &value, sizeof(value));
+        }
+
+        _crc32 = sparseCrc32(_crc32, _data.data() + offset,
+                             _data.size() - offset);
+        _blocks += blocks;
+        ++_counts.raw;
+    }
+
+    void add_fill(uint32_t blocks, uint32_t value)
+    {
+        add_chunk_header(CHUNK_TYPE_FILL, blocks, sizeof(value));
+        add_le32(value);
+
+        _crc32 = sparseCrc32Repeat(_crc32, value,
+                                   static_cast<uint64_t>(blocks) * BLOCK_SIZE);
+        _blocks += blocks;
+        ++_counts.fill;
+    }
+
+    void add_dont_care(uint32_t blocks)
+    {
+        add_chunk_header(CHUNK_TYPE_DONT_CARE, blocks, 0);
+
+        // Don't care blocks count as zeros in the checksum
+        _crc32 = sparseCrc32Repeat(_crc32, 0,
+                                   static_cast<uint64_t>(blocks) * BLOCK_SIZE);
+        _blocks += blocks;
+        ++_counts.dont_care;
+    }
+
+    void add_crc32()
+    {
+        add_chunk_header(CHUNK_TYPE_CRC32, 0, sizeof(_crc32));
+        add_le32(_crc32);
+        ++_counts.crc32;
+    }
+
+    Random & random()
+    {
+        return _random;
+    }
+
+    std::vector<unsigned char> finish(ChunkCounts *counts)
+    {
+        SparseHeader shdr;
+        shdr.magic = mb_htole32(SPARSE_HEADER_MAGIC);
+        shdr.major_version = mb_htole16(SPARSE_HEADER_MAJOR_VER);
+        shdr.minor_version = mb_htole16(0);
+        shdr.file_hdr_sz = mb_htole16(sizeof(SparseHeader));
+        shdr.chunk_hdr_sz = mb_htole16(sizeof(ChunkHeader));
+        shdr.blk_sz = mb_htole32(BLOCK_SIZE);
+        shdr.total_blks = mb_htole32(_blocks);
+        shdr.total_chunks = mb_htole32(_chunks);
+        shdr.image_checksum = mb_htole32(_crc32);
+        memcpy(_data.data(), &shdr, sizeof(shdr));
+
+        *counts = _counts;
+        return std::move(_data);
+    }
+
+private:
+    void add_chunk_header(uint16_t type, uint32_t blocks, uint32_t data_size)
+    {
+        ChunkHeader chdr;
+        chdr.chunk_type = mb_htole16(type);
+        chdr.reserved1 = 0;
+        chdr.chunk_sz = mb_htole32(blocks);
+        chdr.total_sz = mb_htole32(sizeof(ChunkHeader) + data_size);
+
+        const unsigned char *ptr = reinterpret_cast<unsigned char *>(&chdr);
+        _data.insert(_data.end(), ptr, ptr + sizeof(chdr));
+        ++_chunks;
+    }
+
+    void add_le32(uint32_t value)
+    {
+        value = mb_htole32(value);
+        const unsigned char *ptr = reinterpret_cast<unsigned char *>(&value);
+        _data.insert(_data.end(), ptr, ptr + sizeof(value));
+    }
+
+    Random _random;
+    std::vector<unsigned char> _data;
+    uint32_t _blocks = 0;
+    uint32_t _chunks = 0;
+    uint32_t _crc32 = 0;
+    ChunkCounts _counts;
+};
+
+static void make_system_image(ImageBuilder &builder, uint64_t size)
+{
+    Random &random = builder.random();
+
+    for (uint32_t i = 1; builder.size() < size; ++i) {
+        uint32_t r = random.range(0, 99);
+
+        if (r < 60) {
+            builder.add_raw(random.range(1, 4));
+        } else if (r < 80) {
+            builder.add_dont_care(random.range(1, 8));
+        } else if (r < 95) {
+            builder.add_fill(random.range(1, 16), 0);
+        } else {
+            builder.add_fill(random.range(1, 4), random.next32());
+        }
+
+        if (i % 512 == 0) {
+            builder.add_crc32();
+        }
+    }
+
+    builder.add_crc32();
+}
+
+static void make_fill_image(ImageBuilder &builder, uint64_t size)
+{
+    Random &random = builder.random();
+
+    for (uint32_t i = 1; builder.size() < size; ++i) {
+        builder.add_fill(random.range(4096, 16384), random.next32());
+        builder.add_raw(random.range(1, 32));
+
+        if (i % 4 == 0) {
+            builder.add_crc32();
+        }
+    }
+
+    builder.add_crc32();
+}
+
+static void make_raw_image(ImageBuilder &builder, uint64_t size)
+{
+    Random &random = builder.random();
+
+    for (uint32_t i = 1; builder.size() < size; ++i) {
+        builder.add_raw(random.range(1024, 4096));
+
+        if (i % 4 == 0) {
+            builder.add_crc32();
+        }
+    }
+
+    builder.add_crc32();
+}
+
+struct BenchProfile
+{
+    const char *name;
+    void (*make)(ImageBuilder &builder, uint64_t size);
+};
+
+static BenchProfile bench_profiles[] = {
+    { "system", &make_system_image },
+    { "fill",   &make_fill_image },
+    { "raw",    &make_raw_image },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory source callbacks
+////////////////////////////////////////////////////////////////////////////////
+
+struct MemSource
+{
+    const std::vector<unsigned char> *data;
+    uint64_t pos;
+};
+
+static bool cb_read(void *buf, uint64_t size, uint64_t *bytes_read,
+                    void *user_data)
+{
+    MemSource *source = static_cast<MemSource *>(user_data);
+    uint64_t avail = source->pos < source->data->size()
+            ? source->data->size() - source->pos : 0;
+    uint64_t n = std::min(size, avail);
+    memcpy(buf, source->data->data() + source->pos, n);
+    source->pos += n;
+    *bytes_read = n;
+    return true;
+}
+
+static bool cb_seek(int64_t offset, int whence, void *user_data)
+{
+    MemSource *source = static_cast<MemSource *>(user_data);
+    switch (whence) {
+    case SEEK_SET:
+        source->pos = offset;
+        return true;
+    case SEEK_CUR:
+        source->pos += offset;
+        return true;
+    case SEEK_END:
+        source->pos = source->data->size() + offset;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool cb_pread(void *buf, uint64_t size, uint64_t offset,
+                     uint64_t *bytes_read, void *user_data)
+{
+    MemSource *source = static_cast<MemSource *>(user_data);
+    uint64_t avail = offset < source->data->size()
+            ? source->data->size() - offset : 0;
+    uint64_t n = std::min(size, avail);
+    memcpy(buf, source->data->data() + offset, n);
+    *bytes_read = n;
+    return true;
+}
+
+static bool cb_discard(const void *buf, uint64_t size, uint64_t offset,
+                       void *user_data)
+{
+    (void) buf;
+    (void) offset;
+    *static_cast<uint64_t *>(user_data) += size;
+    return true;
+}
+
+static bool open_image(ScopedSparseCtx &ctx, MemSource &source,
+                       const std::vector<unsigned char> &image, bool verify)
+{
+    ctx.reset(sparseCtxNew());
+    if (!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    source.data = &image;
+    source.pos = 0;
+
+    if (!sparseSetVerifyCrc32(ctx.get(), verify)
+            || !sparseOpen(ctx.get(), nullptr, nullptr, &cb_read, &cb_seek,
+                           nullptr, &source)) {
+        fprintf(stderr, "Failed to open sparse image\n");
+        return false;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+////////////////////////////////////////////////////////////////////////////////
+
+struct BenchResult
+{
+    double seconds;
+    uint64_t bytes;
+    uint64_t ops;
+};
+
+// The function is given callbacks to mark the start and end of the timed region
+// so that setup (eg. opening the image) is not counted. It reports the number
+// of bytes processed and operations performed.
+template<typename F>
+static bool run_bench(unsigned int iterations, BenchResult &result, F func)
+{
+    result = {};
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point end;
+        uint64_t bytes = 0;
+        uint64_t ops = 0;
+
+        auto start_timer = [&]{
+            start = std::chrono::steady_clock::now();
+        };
+        auto stop_timer = [&]{
+            end = std::chrono::steady_clock::now();
+        };
+
+        if (!func(start_timer, stop_timer, &bytes, &ops)) {
+            return false;
+        }
+
+        result.seconds += std::chrono::duration<double>(end - start).count();
+        result.bytes += bytes;
+        result.ops += ops;
+    }
+
+    return true;
+}
+
+static void print_result(const char *profile, const char *stage,
+                         const BenchResult &result)
+{
+    double mib = static_cast<double>(result.bytes) / (1024 * 1024);
+    double per_op_ns = result.ops > 0 ? result.seconds * 1e9 / result.ops : 0;
+
+    printf("%-8s %-11s %12" PRIu64 " %14.1f %12.1f\n", profile, stage,
+           result.ops, per_op_ns,
+           result.seconds > 0 ? mib / result.seconds : 0.0);
+}
+
+static bool bench_profile(const BenchProfile &profile, uint64_t image_size,
+                          uint32_t seed, unsigned int iterations,
+                          unsigned int random_ops)
+{
+    ImageBuilder builder(seed);
+    ChunkCounts counts;
+
+    profile.make(builder, image_size);
+    uint64_t out_size = builder.size();
+    std::vector<unsigned char> image = builder.finish(&counts);
+
+    printf("%-8s sparse: %.1f MiB, output: %.1f MiB, chunks: %" PRIu32
+           " raw, %" PRIu32 " fill, %" PRIu32 " don't care, %" PRIu32
+           " crc32\n", profile.name,
+           static_cast<double>(image.size()) / (1024 * 1024),
+           static_cast<double>(out_size) / (1024 * 1024),
+           counts.raw, counts.fill, counts.dont_care, counts.crc32);
+
+    // Same offsets for every random access benchmark
+    std::vector<uint64_t> offsets(random_ops);
+    Random random(seed);
+    uint32_t out_blocks = out_size / RANDOM_READ_SIZE;
+    for (auto &offset : offsets) {
+        offset = static_cast<uint64_t>(random.range(0, out_blocks - 1))
+                * RANDOM_READ_SIZE;
+    }
+
+    ScopedSparseCtx ctx(nullptr, sparseCtxFree);
+    MemSource source;
+    BenchResult result;
+
+    if (!run_bench(iterations, result, [&](std::function<void()> start,
+                                           std::function<void()> stop,
+                                           uint64_t *bytes, uint64_t *ops) {
+        start();
+        bool ret = open_image(ctx, source, image, false);
+        stop();
+        *bytes = 0;
+        *ops = 1;
+        return ret;
+    })) {
+        return false;
+    }
+    print_result(profile.name, "open", result);
+
+    if (!run_bench(iterations, result, [&](std::function<void()> start,
+                                           std::function<void()> stop,
+                                           uint64_t *bytes, uint64_t *ops) {
+        if (!open_image(ctx, source, image, false)) {
+            return false;
+        }
+        start();
+        for (uint64_t offset : offsets) {
+            if (!sparseSeek(ctx.get(), offset, SEEK_SET)) {
+                fprintf(stderr, "Failed to seek to %" PRIu64 "\n", offset);
+                return false;
+            }
+        }
+        stop();
+        *bytes = 0;
+        *ops = offsets.size();
+        return true;
+    })) {
+        return false;
+    }
+    print_result(profile.name, "lookup", result);
+
+    if (!run_bench(iterations, result, [&](std::function<void()> start,
+                                           std::function<void()> stop,
+                                           uint64_t *bytes, uint64_t *ops) {
+        char buf[RANDOM_READ_SIZE];
+        uint64_t n;
+
+        if (!open_image(ctx, source, image, false)) {
+            return false;
+        }
+        start();
+        for (uint64_t offset : offsets) {
+            if (!sparseSeek(ctx.get(), offset, SEEK_SET)
+                    || !sparseRead(ctx.get(), buf, sizeof(buf), &n)) {
+                fprintf(stderr, "Failed to read at %" PRIu64 "\n", offset);
+                return false;
+            }
+            *bytes += n;
+        }
+        stop();
+        *ops = offsets.size();
+        return true;
+    })) {
+        return false;
+    }
+    print_result(profile.name, "rand4k", result);
+
+    if (!run_bench(iterations, result, [&](std::function<void()> start,
+                                           std::function<void()> stop,
+                                           uint64_t *bytes, uint64_t *ops) {
+        char buf[RANDOM_READ_SIZE];
+        uint64_t n;
+
+        if (!open_image(ctx, source, image, false)) {
+            return false;
+        }
+        start();
+        for (uint64_t offset : offsets) {
+            if (!sparseReadAt(ctx.get(), buf, sizeof(buf), offset, &n,
+                              &cb_pread, &source)) {
+                fprintf(stderr, "Failed to read at %" PRIu64 "\n", offset);
+                return false;
+            }
+            *bytes += n;
+        }
+        stop();
+        *ops = offsets.size();
+        return true;
+    })) {
+        return false;
+    }
+    print_result(profile.name, "readat4k", result);
+
+    if (!run_bench(iterations, result, [&](std::function<void()> start,
+                                           std::function<void()> stop,
+                                           uint64_t *bytes, uint64_t *ops) {
+        std::vector<char> buf(SEQ_READ_SIZE);
+        uint64_t n;
+
+        if (!open_image(ctx, source, image, false)) {
+            return false;
+        }
+        start();
+        do {
+            if (!sparseRead(ctx.get(), buf.data(), buf.size(), &n)) {
+                fprintf(stderr, "Failed to read sequentially\n");
+                return false;
+            }
+            *bytes += n;
+            *ops += n > 0;
+        } while (n > 0);
+        stop();
+        return true;
+    })) {
+        return false;
+    }
+    print_result(profile.name, "seq", result);
+
+    for (bool verify : { false, true }) {
+        if (!run_bench(iterations, result, [&](std::function<void()> start,
+                                               std::function<void()> stop,
+                                               uint64_t *bytes, uint64_t *ops) {
+            if (!open_image(ctx, source, image, verify)) {
+                return false;
+            }
+            start();
+            bool ret = sparseFlashCb(ctx.get(), &cb_discard, nullptr, nullptr,
+                                     bytes);
+            stop();
+            if (!ret) {
+                fprintf(stderr, "Failed to expand sparse image\n");
+                return false;
+            }
+            *ops = 1;
+            return true;
+        })) {
+            return false;
+        }
+        print_result(profile.name, verify ? "expand+crc" : "expand", result);
+    }
+
+    printf("\n");
+
+    return true;
+}
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream,
+            "Usage: %s [option...]\n\n"
+            "Options:\n"
+            "  -p, --profile <name>  Only benchmark the specified profile\n"
+            "                        (can be specified multiple times)\n"
+            "  -s, --size <size>     Output image size in MiB (default: %d)\n"
+            "  -n, --iterations <n>  Iterations per benchmark (default: %d)\n"
+            "  -r, --random <n>      Random reads per iteration (default: %d)\n"
+            "  -S, --seed <n>        Seed for image generation (default: %d)\n"
+            "  -h, --help            Display this help message\n",
+            prog_name, DEFAULT_IMAGE_SIZE / 1024 / 1024, DEFAULT_ITERATIONS,
+            DEFAULT_RANDOM_OPS, DEFAULT_SEED);
+}
+
+static bool parse_uint(const char *str, unsigned long *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (errno || *str == '\0' || *end != '\0') {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> profiles;
+    unsigned long size_mib = DEFAULT_IMAGE_SIZE / 1024 / 1024;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    unsigned long random_ops = DEFAULT_RANDOM_OPS;
+    unsigned long seed = DEFAULT_SEED;
+    int opt;
+
+    static const char short_options[] = "p:s:n:r:S:h";
+
+    static struct option long_options[] = {
+        {"profile",    required_argument, 0, 'p'},
+        {"size",       required_argument, 0, 's'},
+        {"iterations", required_argument, 0, 'n'},
+        {"random",     required_argument, 0, 'r'},
+        {"seed",       required_argument, 0, 'S'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'p':
+            profiles.push_back(optarg);
+            break;
+        case 's':
+            // Block count must fit in the 32-bit header field
+            if (!parse_uint(optarg, &size_mib) || size_mib == 0
+                    || size_mib > 1024 * 1024) {
+                fprintf(stderr, "Invalid image size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if (!parse_uint(optarg, &iterations) || iterations == 0) {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if (!parse_uint(optarg, &random_ops) || random_ops == 0) {
+                fprintf(stderr, "Invalid random read count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            if (!parse_uint(optarg, &seed)) {
+                fprintf(stderr, "Invalid seed: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 0) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    mb::log::log_set_logger(std::make_shared<ErrorLogger>());
+
+    printf("Image size: %lu MiB, iterations: %lu, random reads: %lu,"
+           " seed: %lu\n\n", size_mib, iterations, random_ops, seed);
+    printf("%-8s %-11s %12s %14s %12s\n",
+           "Profile", "Stage", "Ops", "ns/op", "MiB/s");
+
+    bool ret = true;
+
+    for (auto const &profile : bench_profiles) {
+        if (!profiles.empty() && std::find(profiles.begin(), profiles.end(),
+                                           profile.name) == profiles.end()) {
+            continue;
+        }
+
+        if (!bench_profile(profile, size_mib * 1024 * 1024, seed, iterations,
+                           random_ops)) {
+            ret = false;
+        }
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
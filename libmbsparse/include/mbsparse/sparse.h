@@ -40,11 +40,14 @@ typedef bool (*SparseReadCb)(void *buf, uint64_t size, uint64_t *bytesRead,
                              void *userData);
 typedef bool (*SparseSeekCb)(int64_t offset, int whence, void *userData);
 typedef bool (*SparseSkipCb)(uint64_t offset, void *userData);
+typedef bool (*SparsePreadCb)(void *buf, uint64_t size, uint64_t offset,
+                              uint64_t *bytesRead, void *userData);
 
 struct SparseCtx;
 
 MB_EXPORT struct SparseCtx * sparseCtxNew();
 MB_EXPORT bool sparseCtxFree(struct SparseCtx *ctx);
+MB_EXPORT bool sparseSetVerifyCrc32(struct SparseCtx *ctx, bool enabled);
 
 MB_EXPORT bool sparseOpen(struct SparseCtx *ctx, SparseOpenCb openCb,
                           SparseCloseCb closeCb, SparseReadCb readCb,
@@ -53,9 +56,15 @@ MB_EXPORT bool sparseOpen(struct SparseCtx *ctx, SparseOpenCb openCb,
 MB_EXPORT bool sparseClose(struct SparseCtx *ctx);
 MB_EXPORT bool sparseRead(struct SparseCtx *ctx, void *buf, uint64_t size,
                           uint64_t *bytesRead);
+MB_EXPORT bool sparseReadAt(struct SparseCtx *ctx, void *buf, uint64_t size,
+                            uint64_t offset, uint64_t *bytesRead,
+                            SparsePreadCb preadCb, void *userData);
 MB_EXPORT bool sparseSeek(struct SparseCtx *ctx, int64_t offset, int whence);
 MB_EXPORT bool sparseTell(struct SparseCtx *ctx, uint64_t *offset);
 MB_EXPORT bool sparseSize(struct SparseCtx *ctx, uint64_t *size);
+MB_EXPORT bool sparseGetIndex(struct SparseCtx *ctx, void **data, size_t *size);
+MB_EXPORT bool sparseSetIndex(struct SparseCtx *ctx, const void *data,
+                              size_t size);
 
 #ifdef __cplusplus
 }
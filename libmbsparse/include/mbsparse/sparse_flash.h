@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+#include "mbsparse/sparse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _WIN32
+
+// Discard (BLKDISCARD) the ranges covered by don't care chunks instead of
+// leaving them untouched
+#define SPARSE_FLASH_DISCARD    (1 << 0)
+
+typedef void (*SparseFlashProgressCb)(uint64_t bytes, uint64_t total,
+                                      void *userData);
+typedef bool (*SparseFlashWriteCb)(const void *buf, uint64_t size,
+                                   uint64_t offset, void *userData);
+typedef bool (*SparseFlashZeroCb)(uint64_t size, uint64_t offset,
+                                  void *userData);
+
+MB_EXPORT bool sparseFlashFd(struct SparseCtx *ctx, int fd, int flags,
+                             SparseFlashProgressCb progressCb, void *userData);
+MB_EXPORT bool sparseFlashCb(struct SparseCtx *ctx, SparseFlashWriteCb writeCb,
+                             SparseFlashZeroCb zeroCb,
+                             SparseFlashProgressCb progressCb, void *userData);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_flash.h"
+#include "mbsparse/sparse_writer.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+/*
+ * Seekable compressed sparse container
+ *
+ * The container holds the same data as a sparse image, but the raw data is
+ * split into frames that are compressed independently. A trailing index lists
+ * every frame, so any offset of the output image can be read by decompressing
+ * a single frame.
+ *
+ *   SparseSeekableHeader
+ *   SparseSeekableFrameHeader + compressed data    (repeated)
+ *   SparseSeekableIndexEntry                       (repeated)
+ *   SparseSeekableFooter
+ *
+ * The frames are sorted by output offset and cover the entire output image
+ * with no gaps, so the container can also be expanded sequentially from a
+ * non-seekable stream without reading the index. Fill and don't care frames
+ * have no data. All values are little-endian.
+ */
+
+#define SPARSE_SEEKABLE_MAGIC           0x5a53424d // "MBSZ"
+#define SPARSE_SEEKABLE_FOOTER_MAGIC    0x5844495a // "ZIDX"
+#define SPARSE_SEEKABLE_MAJOR_VER       1
+
+#define SPARSE_SEEKABLE_COMPRESSION_LZ4 1
+
+// Frame data is stored uncompressed because it did not compress
+#define SPARSE_SEEKABLE_FRAME_STORED    (1 << 0)
+
+#define SPARSE_SEEKABLE_DEFAULT_FRAME_SIZE  (1024 * 1024)
+#define SPARSE_SEEKABLE_MAX_FRAME_SIZE      (64 * 1024 * 1024)
+
+struct SparseSeekableHeader
+{
+    uint32_t magic;          // SPARSE_SEEKABLE_MAGIC
+    uint16_t major_version;  // Reject containers with higher major versions
+    uint16_t minor_version;
+    uint16_t header_sz;      // sizeof(SparseSeekableHeader)
+    uint16_t frame_hdr_sz;   // sizeof(SparseSeekableFrameHeader)
+    uint32_t compression;    // SPARSE_SEEKABLE_COMPRESSION_*
+    uint32_t blk_sz;         // Block size of the original sparse image
+    uint32_t max_frame_sz;   // Maximum uncompressed size of a raw frame
+    uint64_t total_sz;       // Size of the output image
+};
+
+struct SparseSeekableFrameHeader
+{
+    uint16_t frame_type;     // CHUNK_TYPE_RAW, CHUNK_TYPE_FILL, or
+                             // CHUNK_TYPE_DONT_CARE
+    uint16_t flags;          // SPARSE_SEEKABLE_FRAME_*
+    uint32_t data_sz;        // Size of the (compressed) data after the header
+    uint64_t out_offset;     // Offset in the output image
+    uint64_t out_sz;         // Size in the output image
+    uint32_t value;          // Raw: CRC32 of uncompressed data; fill: filler
+    uint32_t reserved;
+};
+
+struct SparseSeekableIndexEntry
+{
+    struct SparseSeekableFrameHeader hdr;
+    uint64_t data_offset;    // Offset of the frame data in the container
+};
+
+struct SparseSeekableFooter
+{
+    uint64_t index_offset;   // Offset of the first index entry
+    uint32_t index_count;    // Number of index entries
+    uint32_t index_crc32;    // CRC32 of all index entries
+    uint32_t reserved;
+    uint32_t magic;          // SPARSE_SEEKABLE_FOOTER_MAGIC
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _WIN32
+
+struct SparseSeekableCtx;
+
+MB_EXPORT bool sparseSeekableCompress(struct SparseCtx *input,
+                                      SparseWriteCb writeCb,
+                                      uint32_t frameSize,
+                                      unsigned int threads, void *userData);
+
+MB_EXPORT struct SparseSeekableCtx * sparseSeekableCtxNew();
+MB_EXPORT bool sparseSeekableCtxFree(struct SparseSeekableCtx *ctx);
+
+MB_EXPORT bool sparseSeekableOpen(struct SparseSeekableCtx *ctx,
+                                  SparsePreadCb preadCb, uint64_t fileSize,
+                                  void *userData);
+MB_EXPORT bool sparseSeekableClose(struct SparseSeekableCtx *ctx);
+MB_EXPORT bool sparseSeekableSize(struct SparseSeekableCtx *ctx,
+                                  uint64_t *size);
+MB_EXPORT bool sparseSeekableReadAt(struct SparseSeekableCtx *ctx, void *buf,
+                                    uint64_t size, uint64_t offset,
+                                    uint64_t *bytesRead);
+
+MB_EXPORT bool sparseSeekableFlashStream(SparseReadCb readCb,
+                                         SparseFlashWriteCb writeCb,
+                                         SparseFlashZeroCb zeroCb,
+                                         SparseFlashProgressCb progressCb,
+                                         unsigned int threads,
+                                         void *userData);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
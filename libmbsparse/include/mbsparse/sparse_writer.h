@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+#include "mbsparse/sparse.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef bool (*SparseWriteCb)(const void *buf, uint64_t size,
+                              uint64_t *bytesWritten, void *userData);
+
+struct SparseWriterCtx;
+
+MB_EXPORT struct SparseWriterCtx * sparseWriterCtxNew();
+MB_EXPORT bool sparseWriterCtxFree(struct SparseWriterCtx *ctx);
+
+MB_EXPORT bool sparseWriterSetBlockSize(struct SparseWriterCtx *ctx,
+                                        uint32_t blockSize);
+MB_EXPORT bool sparseWriterSetBlockBitmap(struct SparseWriterCtx *ctx,
+                                          const void *bitmap,
+                                          uint64_t blockCount);
+MB_EXPORT bool sparseWriterSetCrc32(struct SparseWriterCtx *ctx, bool enabled);
+
+MB_EXPORT bool sparseWriterOpen(struct SparseWriterCtx *ctx,
+                                SparseOpenCb openCb, SparseCloseCb closeCb,
+                                SparseWriteCb writeCb, SparseSeekCb seekCb,
+                                void *userData);
+MB_EXPORT bool sparseWriterClose(struct SparseWriterCtx *ctx);
+MB_EXPORT bool sparseWriterWrite(struct SparseWriterCtx *ctx, const void *buf,
+                                 uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
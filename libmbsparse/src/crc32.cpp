@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crc32_p.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32_HAVE_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32_HAVE_ARMV8 1
+#include <arm_acle.h>
+#endif
+
+#define CRC32_POLYNOMIAL        0xedb88320
+
+// Slicing-by-8 tables. g_tables.table[0] is the classic byte-at-a-time table.
+struct Crc32Tables
+{
+    uint32_t table[8][256];
+
+    Crc32Tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; ++j) {
+                c = (c & 1) ? (c >> 1) ^ CRC32_POLYNOMIAL : c >> 1;
+            }
+            table[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                table[k][i] = (table[k - 1][i] >> 8)
+                        ^ table[0][table[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static const Crc32Tables g_tables;
+
+typedef uint32_t (*Crc32Fn)(uint32_t crc, const unsigned char *buf,
+                            size_t size);
+
+// All of the kernels below operate on the inverted CRC value
+
+static uint32_t crc32Bytes(uint32_t crc, const unsigned char *buf, size_t size)
+{
+    while (size-- > 0) {
+        crc = g_tables.table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/*!
+ * \brief Slicing-by-8 CRC32 (assumes a little-endian host like the rest of the
+ *        library)
+ */
+static uint32_t crc32Slice8(uint32_t crc, const unsigned char *buf,
+                            size_t size)
+{
+    const uint32_t (*t)[256] = g_tables.table;
+
+    while (size >= 8) {
+        uint32_t one;
+        uint32_t two;
+        memcpy(&one, buf, sizeof(one));
+        memcpy(&two, buf + 4, sizeof(two));
+        one ^= crc;
+
+        crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff]
+                ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24]
+                ^ t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff]
+                ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+
+        buf += 8;
+        size -= 8;
+    }
+
+    return crc32Bytes(crc, buf, size);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+/*!
+ * \brief CRC32 using carry-less multiplication
+ *
+ * This folds four 128-bit lanes at a time and then reduces the result with a
+ * Barrett reduction as described in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" paper. The constants are the same as
+ * the ones used by the Linux kernel and zlib for the 802.3 polynomial.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Pclmul(uint32_t crc, const unsigned char *buf,
+                            size_t size)
+{
+    if (size < 64) {
+        return crc32Slice8(crc, buf, size);
+    }
+
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+
+    buf += 64;
+    size -= 64;
+
+    // Fold 64 bytes at a time
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x00));
+        y6 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x10));
+        y7 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x20));
+        y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        size -= 64;
+    }
+
+    // Fold the four lanes into one
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold remaining 16-byte blocks
+    while (size >= 16) {
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf));
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        size -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+
+    return crc32Slice8(crc, buf, size);
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+/*!
+ * \brief CRC32 using the ARMv8 CRC32 instructions (same polynomial)
+ */
+static uint32_t crc32Armv8(uint32_t crc, const unsigned char *buf,
+                           size_t size)
+{
+    while (size >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        crc = __crc32d(crc, v);
+        buf += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = __crc32b(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+static Crc32Fn selectCrc32Fn()
+{
+#if defined(CRC32_HAVE_ARMV8)
+    return &crc32Armv8;
+#else
+#  if defined(CRC32_HAVE_PCLMUL)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        return &crc32Pclmul;
+    }
+#  endif
+    return &crc32Slice8;
+#endif
+}
+
+uint32_t sparseCrc32(uint32_t crc, const void *buf, size_t size)
+{
+    static const Crc32Fn fn = selectCrc32Fn();
+
+    return ~fn(~crc, static_cast<const unsigned char *>(buf), size);
+}
+
+uint32_t sparseCrc32Portable(uint32_t crc, const void *buf, size_t size)
+{
+    return ~crc32Slice8(~crc, static_cast<const unsigned char *>(buf), size);
+}
+
+#define GF2_DIM 32
+
+static uint32_t gf2MatrixTimes(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        ++mat;
+    }
+    return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < GF2_DIM; ++n) {
+        square[n] = gf2MatrixTimes(mat, mat[n]);
+    }
+}
+
+uint32_t sparseCrc32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+    uint32_t even[GF2_DIM];
+    uint32_t odd[GF2_DIM];
+
+    if (size2 == 0) {
+        return crc1;
+    }
+
+    // Operator for one zero bit
+    odd[0] = CRC32_POLYNOMIAL;
+    uint32_t row = 1;
+    for (int n = 1; n < GF2_DIM; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    // Operators for two and four zero bits
+    gf2MatrixSquare(even, odd);
+    gf2MatrixSquare(odd, even);
+
+    // Apply size2 zero bytes to crc1
+    do {
+        gf2MatrixSquare(even, odd);
+        if (size2 & 1) {
+            crc1 = gf2MatrixTimes(even, crc1);
+        }
+        size2 >>= 1;
+
+        if (size2 == 0) {
+            break;
+        }
+
+        gf2MatrixSquare(odd, even);
+        if (size2 & 1) {
+            crc1 = gf2MatrixTimes(odd, crc1);
+        }
+        size2 >>= 1;
+    } while (size2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+uint32_t sparseCrc32Repeat(uint32_t crc, uint32_t word, uint64_t size)
+{
+    // Double the length of the repeated unit until all of the bits of the
+    // number of repetitions have been consumed
+    uint32_t unit = sparseCrc32(0, &word, sizeof(word));
+    uint64_t unitSize = sizeof(word);
+    uint64_t count = size / sizeof(word);
+
+    while (count > 0) {
+        if (count & 1) {
+            crc = sparseCrc32Combine(crc, unit, unitSize);
+        }
+        count >>= 1;
+        if (count > 0) {
+            unit = sparseCrc32Combine(unit, unit, unitSize);
+            unitSize *= 2;
+        }
+    }
+
+    return sparseCrc32(crc, &word, size % sizeof(word));
+}
+
+uint32_t sparseCrc32Zeros(uint32_t crc, uint64_t size)
+{
+    return sparseCrc32Repeat(crc, 0, size);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * \brief Update a CRC32 checksum (802.3 polynomial, same as zlib's crc32())
+ *
+ * The fastest kernel supported by the CPU is selected on first use: ARMv8 CRC32
+ * instructions (if enabled at compile time), PCLMULQDQ folding on x86, or
+ * slicing-by-8 tables otherwise.
+ *
+ * \param crc Current checksum. Use 0 for the initial value.
+ * \param buf Data to add to the checksum
+ * \param size Size of data
+ * \return New checksum
+ */
+uint32_t sparseCrc32(uint32_t crc, const void *buf, size_t size);
+
+/*!
+ * \brief Same as sparseCrc32(), but always uses the slicing-by-8 kernel
+ */
+uint32_t sparseCrc32Portable(uint32_t crc, const void *buf, size_t size);
+
+/*!
+ * \brief Compute the checksum of two concatenated pieces of data
+ *
+ * \param crc1 Checksum of the first piece of data
+ * \param crc2 Checksum of the second piece of data
+ * \param size2 Size of the second piece of data
+ * \return Checksum of the concatenated data
+ */
+uint32_t sparseCrc32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+/*!
+ * \brief Update a CRC32 checksum with \a word repeated to fill \a size bytes
+ *
+ * This takes O(log(size)) time, so fill and don't care chunks of any size can
+ * be checksummed without expanding them.
+ */
+uint32_t sparseCrc32Repeat(uint32_t crc, uint32_t word, uint64_t size);
+
+/*!
+ * \brief Update a CRC32 checksum with \a size zero bytes
+ */
+uint32_t sparseCrc32Zeros(uint32_t crc, uint64_t size);
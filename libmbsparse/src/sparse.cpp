@@ -33,98 +33,13 @@
 #include <cassert>
 #include <cinttypes>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 
 #include "mbcommon/string.h"
-#include "mblog/logging.h"
 
-// Enable debug logging of headers, offsets, etc.?
-#define SPARSE_DEBUG 1
-// Enable debug logging of operations (warning! very verbose!)
-#define SPARSE_DEBUG_OPER 0
-// Enable logging of errors
-#define SPARSE_ERROR 1
-
-#if SPARSE_DEBUG
-#define DEBUG(...) LOGD(__VA_ARGS__)
-#else
-#define DEBUG(...)
-#endif
-
-#if SPARSE_DEBUG_OPER
-#define OPER(...) LOGD(__VA_ARGS__)
-#else
-#define OPER(...)
-#endif
-
-#if SPARSE_ERROR
-#define ERROR(...) LOGE(__VA_ARGS__)
-#else
-#define ERROR(...)
-#endif
-
-/*! \brief Minimum information we need from the chunk headers while reading */
-struct ChunkInfo
-{
-    /*! \brief Same as ChunkHeader::chunk_type */
-    uint16_t type;
-
-    /*! \brief Start of byte range in output file that this chunk represents */
-    uint64_t begin;
-    /*! \brief End of byte range in output file that this chunk represents */
-    uint64_t end;
-
-    /*! \brief Start of byte range for the entire chunk in the source file */
-    uint64_t srcBegin;
-    /*! \brief End of byte range for the entire chunk in the source file */
-    uint64_t srcEnd;
-
-    /*! \brief [CHUNK_TYPE_RAW only] Start of raw bytes in input file */
-    uint64_t rawBegin;
-    /*! \brief [CHUNK_TYPE_RAW only] End of raw bytes in input file */
-    uint64_t rawEnd;
-
-    /*! \brief [CHUNK_TYPE_FILL only] Filler value for the chunk */
-    uint32_t fillVal;
-};
-
-struct SparseCtx
-{
-    // Callbacks
-    SparseOpenCb cbOpen;
-    SparseCloseCb cbClose;
-    SparseReadCb cbRead;
-    SparseSeekCb cbSeek;
-    SparseSkipCb cbSkip;
-    void *cbUserData;
-
-    void setCallbacks(SparseOpenCb openCb, SparseCloseCb closeCb,
-                      SparseReadCb readCb, SparseSeekCb seekCb,
-                      SparseSkipCb skipCb, void *userData);
-    void clearCallbacks();
-
-    // Callback wrappers to avoid passing ctx->cbUserdata everywhere
-    bool open();
-    bool close();
-    bool read(void *buf, uint64_t size, uint64_t *bytesRead);
-    bool seek(int64_t offset, int whence);
-    bool skip(uint64_t offset);
-
-    bool skipBytes(uint64_t bytes);
-
-    bool isOpen;
-
-    uint32_t expectedCrc32 = 0;
-
-    uint64_t srcOffset = 0;
-    uint64_t outOffset = 0;
-    uint64_t fileSize;
-
-    SparseHeader shdr;
-
-    std::vector<ChunkInfo> chunks;
-    size_t chunk = 0;
-};
+#include "crc32_p.h"
+#include "sparse_p.h"
 
 void SparseCtx::setCallbacks(SparseOpenCb openCb, SparseCloseCb closeCb,
                              SparseReadCb readCb, SparseSeekCb seekCb,
@@ -235,7 +150,7 @@ static void dumpSparseHeader(SparseHeader *header)
     DEBUG("- blk_sz:         %" PRIu32 " (bytes)", header->blk_sz);
     DEBUG("- total_blks:     %" PRIu32, header->total_blks);
     DEBUG("- total_chunks:   %" PRIu32, header->total_chunks);
-    DEBUG("- image_checksum: 0x%08" PRIu32, header->image_checksum);
+    DEBUG("- image_checksum: 0x%08" PRIx32, header->image_checksum);
 }
 
 static const char * chunkTypeToString(uint16_t chunkType)
@@ -438,15 +353,15 @@ static bool processCrc32Chunk(SparseCtx *ctx, ChunkHeader *chunkHeader,
         return false;
     }
 
-    ctx->expectedCrc32 = expectedCrc32;
-
+    // The CRC32 value has already been read at this point
     ctx->chunks.emplace_back();
     ChunkInfo &chunk = ctx->chunks.back();
     chunk.type = chunkHeader->chunk_type;
     chunk.begin = outOffset;
     chunk.end = outOffset;
-    chunk.srcBegin = ctx->srcOffset - ctx->shdr.chunk_hdr_sz;
-    chunk.srcEnd = ctx->srcOffset + dataSize;
+    chunk.srcBegin = ctx->srcOffset - dataSize - ctx->shdr.chunk_hdr_sz;
+    chunk.srcEnd = ctx->srcOffset;
+    chunk.crc32 = expectedCrc32;
 
     return true;
 }
@@ -582,9 +497,135 @@ bool processSparseHeader(SparseCtx *ctx)
     return true;
 }
 
+/*!
+ * \brief Read and verify the next chunk header and add it to the chunk list
+ *
+ * The chunk that is read is chunk number \a ctx->chunks.size().
+ *
+ * \pre \a ctx->chunks.size() is less than \a ctx->shdr.total_chunks
+ * \post If the chunk is a raw chunk, the source file position will be at the
+ *       first byte of the raw data. Otherwise, the source file position will be
+ *       at the byte after the entire chunk.
+ *
+ * \param ctx Sparse context
+ * \return Whether the chunk header was successfully read and is valid
+ */
+static bool readNextChunk(SparseCtx *ctx)
+{
+    size_t index = ctx->chunks.size();
+
+    DEBUG("Reading next chunk (#%" MB_PRIzu ")", index);
+
+    // Get starting offset for chunk in source file and starting offset for
+    // data in the output file
+    uint64_t srcBegin = ctx->shdr.file_hdr_sz;
+    uint64_t outBegin = 0;
+    if (index > 0) {
+        srcBegin = ctx->chunks[index - 1].srcEnd;
+        outBegin = ctx->chunks[index - 1].end;
+    }
+
+    // Skip to srcBegin
+    if (srcBegin < ctx->srcOffset) {
+        ERROR("- Internal error: srcBegin (%" PRIu64 ")"
+              " < srcOffset (%" PRIu64 ")", srcBegin, ctx->srcOffset);
+        return false;
+    }
+
+    uint64_t diff = srcBegin - ctx->srcOffset;
+    if (diff > 0 && !ctx->skipBytes(diff)) {
+        ERROR("- Failed to skip to chunk #%" MB_PRIzu, index);
+        return false;
+    }
+
+    ChunkHeader chunkHeader;
+
+    if (!readFully(ctx, &chunkHeader, sizeof(ChunkHeader))) {
+        ERROR("- Failed to read chunk header for chunk %" MB_PRIzu, index);
+        return false;
+    }
+
+#if SPARSE_DEBUG
+    dumpChunkHeader(&chunkHeader);
+#endif
+
+    // Skip any extra bytes in the chunk header. processSparseHeader() checks
+    // the size to make sure that the value won't underflow
+    diff = ctx->shdr.chunk_hdr_sz - sizeof(ChunkHeader);
+    if (!ctx->skipBytes(diff)) {
+        ERROR("- Failed to skip extra bytes in chunk #%" MB_PRIzu "'s header",
+              index);
+        return false;
+    }
+
+    if (!processChunk(ctx, &chunkHeader, outBegin)) {
+        return false;
+    }
+
+    const ChunkInfo &chunk = ctx->chunks[index];
+
+    OPER("- Chunk #%" MB_PRIzu " covers source range (%" PRIu64 " - %" PRIu64 ")",
+         index, chunk.srcBegin, chunk.srcEnd);
+    OPER("- Chunk #%" MB_PRIzu " covers output range (%" PRIu64 " - %" PRIu64 ")",
+         index, chunk.begin, chunk.end);
+
+    // Make sure the chunk does not end after the header-specified file size
+    if (chunk.end > ctx->fileSize) {
+        ERROR("Chunk #%" MB_PRIzu " ends (%" PRIu64 ") after the file size "
+              "specified in the sparse header (%" PRIu64 ")",
+              index, chunk.end, ctx->fileSize);
+        return false;
+    }
+
+    // If we just read the last chunk, make sure it ends at the same position
+    // as specified in the sparse header
+    if (index == ctx->shdr.total_chunks - 1 && chunk.end != ctx->fileSize) {
+        ERROR("Last chunk does not end (%" PRIu64 ")"
+              " at position specified by sparse header (%" PRIu64 ")",
+              chunk.end, ctx->fileSize);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read all chunk headers up front
+ *
+ * This is only done for seekable sources. The raw data is seeked over, so the
+ * cost is proportional to the number of chunks and not the size of the file.
+ * Once all chunks are known, tryMoveToChunkForOffset() can do a binary search
+ * instead of walking the chunk list.
+ *
+ * \param ctx Sparse context
+ * \return Whether all chunk headers were successfully read and are valid
+ */
+static bool buildChunkIndex(SparseCtx *ctx)
+{
+    assert(ctx->cbSeek != nullptr);
+
+    // Don't trust total_chunks for the allocation size since the header has
+    // not been validated against the actual number of chunks yet
+    ctx->chunks.reserve(std::min<uint32_t>(ctx->shdr.total_chunks, 4096));
+
+    while (ctx->chunks.size() < ctx->shdr.total_chunks) {
+        if (!readNextChunk(ctx)) {
+            return false;
+        }
+    }
+
+    DEBUG("Indexed %" MB_PRIzu " chunks", ctx->chunks.size());
+
+    return true;
+}
+
 /*!
  * \brief Find and move to chunk that is responsible for the specified offset
  *
+ * If all of the chunk headers have been read (always the case for seekable
+ * sources), the chunk is found with a binary search. Otherwise, the chunk
+ * headers are read on demand until the matching chunk is found.
+ *
  * \warning Always check if the offset exceeds the range of all chunks (EOF) by
  *          testing: "ctx->chunk == ctx->shdr.total_chunks"
  *
@@ -592,6 +633,18 @@ bool processSparseHeader(SparseCtx *ctx)
  */
 bool tryMoveToChunkForOffset(SparseCtx *ctx, uint64_t offset)
 {
+    if (ctx->chunks.size() == ctx->shdr.total_chunks) {
+        // The chunks are contiguous and sorted, so the matching chunk is the
+        // first one that ends after the offset. Zero-length (CRC32) chunks are
+        // never matched. If no chunk matches, then the offset is at or past
+        // EOF.
+        auto it = std::upper_bound(
+                ctx->chunks.begin(), ctx->chunks.end(), offset,
+                [](uint64_t o, const ChunkInfo &c) { return o < c.end; });
+        ctx->chunk = it - ctx->chunks.begin();
+        return true;
+    }
+
     // If were at EOF, move back one so we can search again
     if (ctx->shdr.total_chunks != 0 && ctx->chunk == ctx->shdr.total_chunks) {
         --ctx->chunk;
@@ -610,91 +663,193 @@ bool tryMoveToChunkForOffset(SparseCtx *ctx, uint64_t offset)
 
     for (; ctx->chunk < ctx->shdr.total_chunks; ++ctx->chunk) {
         // If we don't have the chunk yet, then read it
-        if (ctx->chunk >= ctx->chunks.size()) {
-            DEBUG("Reading next chunk (#%" MB_PRIzu ")", ctx->chunk);
-
-            // Get starting offset for chunk in source file and starting
-            // offset for data in the output file
-            uint64_t srcBegin = ctx->shdr.file_hdr_sz;
-            uint64_t outBegin = 0;
-            if (ctx->chunk > 0) {
-                srcBegin = ctx->chunks[ctx->chunk - 1].srcEnd;
-                outBegin = ctx->chunks[ctx->chunk - 1].end;
-            }
+        if (ctx->chunk >= ctx->chunks.size() && !readNextChunk(ctx)) {
+            return false;
+        }
 
-            // Skip to srcBegin
-            if (srcBegin < ctx->srcOffset) {
-                ERROR("- Internal error: srcBegin (%" PRIu64 ")"
-                      " < srcOffset (%" PRIu64 ")", srcBegin, ctx->srcOffset);
-                return false;
-            }
+        if (offset >= ctx->chunks[ctx->chunk].begin
+                && offset < ctx->chunks[ctx->chunk].end) {
+            // Found matching chunk. Stop looking
+            break;
+        }
+    }
 
-            uint64_t diff = srcBegin - ctx->srcOffset;
-            if (diff > 0 && !ctx->skipBytes(diff)) {
-                ERROR("- Failed to skip to chunk #%" MB_PRIzu, ctx->chunk);
-                return false;
-            }
+    return true;
+}
 
-            ChunkHeader chunkHeader;
+/*!
+ * \brief Restart CRC32 verification from the beginning of the output file
+ */
+void resetCrc32(SparseCtx *ctx)
+{
+    ctx->crc32Active = ctx->verifyCrc32;
+    ctx->crc32 = 0;
+    ctx->crc32Offset = 0;
+    ctx->crc32Chunk = 0;
+}
 
-            if (!readFully(ctx, &chunkHeader, sizeof(ChunkHeader))) {
-                ERROR("- Failed to read chunk header for chunk %" MB_PRIzu,
-                      ctx->chunk);
-                return false;
-            }
+/*!
+ * \brief Verify checksums covered by the data that has been checksummed so far
+ *
+ * Every CRC32 chunk that begins at \a SparseCtx::crc32Offset is compared
+ * against the running checksum. Once the entire output file has been
+ * checksummed and all chunks have been read, the checksum is also compared
+ * against the \a image_checksum field of the sparse header (if nonzero).
+ *
+ * \pre Callers must invoke this after every chunk header is read and after
+ *      every chunk boundary is reached so that no CRC32 chunk is skipped
+ *
+ * \return False if a checksum does not match. Otherwise, true.
+ */
+bool checkCrc32(SparseCtx *ctx)
+{
+    if (!ctx->crc32Active) {
+        return true;
+    }
 
-#if SPARSE_DEBUG
-            dumpChunkHeader(&chunkHeader);
-#endif
+    for (; ctx->crc32Chunk < ctx->chunks.size(); ++ctx->crc32Chunk) {
+        const ChunkInfo &chunk = ctx->chunks[ctx->crc32Chunk];
+
+        if (chunk.end > ctx->crc32Offset) {
+            return true;
+        }
+
+        if (chunk.type == CHUNK_TYPE_CRC32 && chunk.crc32 != ctx->crc32) {
+            ERROR("CRC32 mismatch at offset %" PRIu64 ": expected 0x%08" PRIx32
+                  ", but have 0x%08" PRIx32,
+                  ctx->crc32Offset, chunk.crc32, ctx->crc32);
+            return false;
+        }
+    }
 
-            // Skip any extra bytes in the chunk header. processSparseHeader()
-            // checks the size to make sure that the value won't underflow
-            diff = ctx->shdr.chunk_hdr_sz - sizeof(ChunkHeader);
-            if (!ctx->skipBytes(diff)) {
-                ERROR("- Failed to skip extra bytes in chunk #%" MB_PRIzu "'s header",
-                      ctx->chunk);
+    if (ctx->crc32Offset == ctx->fileSize
+            && ctx->chunks.size() == ctx->shdr.total_chunks) {
+        if (ctx->shdr.image_checksum != 0
+                && ctx->shdr.image_checksum != ctx->crc32) {
+            ERROR("Image CRC32 mismatch: expected 0x%08" PRIx32
+                  ", but have 0x%08" PRIx32,
+                  ctx->shdr.image_checksum, ctx->crc32);
+            return false;
+        }
+
+        DEBUG("Verified CRC32 checksum: 0x%08" PRIx32, ctx->crc32);
+        ctx->crc32Active = false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Fill buffer with the filler value of a fill chunk
+ *
+ * \param buf Output buffer
+ * \param size Number of bytes to fill
+ * \param fillVal Filler value
+ * \param chunkOffset Offset of \a buf relative to the beginning of the chunk.
+ *                    This determines which byte of \a fillVal comes first.
+ */
+static void fillBuffer(void *buf, uint64_t size, uint32_t fillVal,
+                       uint64_t chunkOffset)
+{
+    auto shift = chunkOffset % sizeof(uint32_t);
+    uint32_t shifted = 0;
+    for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+        ((char *) &shifted)[i] =
+                ((char *) &fillVal)[(i + shift) % sizeof(uint32_t)];
+    }
+    char *tempBuf = (char *) buf;
+    while (size >= sizeof(shifted)) {
+        memcpy(tempBuf, &shifted, sizeof(shifted));
+        size -= sizeof(shifted);
+        tempBuf += sizeof(shifted);
+    }
+    memcpy(tempBuf, &shifted, size);
+}
+
+#define SPARSE_INDEX_MAGIC      0x58444953 // "SIDX"
+#define SPARSE_INDEX_VERSION    2
+
+/*!
+ * \brief Serialized chunk index header
+ *
+ * The serialized index consists of this header followed by
+ * \a SparseIndexHeader::chunk_count instances of \a SparseIndexChunk. Like the
+ * sparse file headers, the values are stored in the host's (little-endian)
+ * byte order.
+ */
+struct SparseIndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    SparseHeader shdr;
+    uint32_t chunk_count;
+};
+
+/*! \brief Serialized chunk index entry */
+struct SparseIndexChunk
+{
+    uint16_t type;
+    uint16_t reserved;
+    // Filler value for fill chunks or checksum for CRC32 chunks
+    uint32_t value;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t srcBegin;
+    uint64_t srcEnd;
+};
+
+/*!
+ * \brief Check that a deserialized chunk index describes a valid sparse file
+ *
+ * This performs the same checks as \a readNextChunk() so that a corrupted or
+ * mismatched index cannot cause out of range reads.
+ */
+static bool validateChunkIndex(const SparseHeader &shdr,
+                               const std::vector<ChunkInfo> &chunks)
+{
+    uint64_t outOffset = 0;
+    uint64_t srcOffset = shdr.file_hdr_sz;
+
+    for (const ChunkInfo &chunk : chunks) {
+        if (chunk.begin != outOffset || chunk.srcBegin != srcOffset
+                || chunk.end < chunk.begin || chunk.srcEnd < chunk.srcBegin
+                || chunk.srcEnd - chunk.srcBegin < shdr.chunk_hdr_sz) {
+            return false;
+        }
+
+        uint64_t dataSize = chunk.srcEnd - chunk.srcBegin - shdr.chunk_hdr_sz;
+
+        switch (chunk.type) {
+        case CHUNK_TYPE_RAW:
+            if (dataSize != chunk.end - chunk.begin
+                    || chunk.rawBegin != chunk.srcBegin + shdr.chunk_hdr_sz) {
                 return false;
             }
-
-            if (!processChunk(ctx, &chunkHeader, outBegin)) {
+            break;
+        case CHUNK_TYPE_FILL:
+            if (dataSize != sizeof(uint32_t)) {
                 return false;
             }
-
-            OPER("- Chunk #%" MB_PRIzu " covers source range (%" PRIu64 " - %" PRIu64 ")",
-                 ctx->chunk, ctx->chunks[ctx->chunk].srcBegin,
-                 ctx->chunks[ctx->chunk].srcEnd);
-            OPER("- Chunk #%" MB_PRIzu " covers output range (%" PRIu64 " - %" PRIu64 ")",
-                 ctx->chunk, ctx->chunks[ctx->chunk].begin,
-                 ctx->chunks[ctx->chunk].end);
-
-            // Make sure the chunk does not end after the header-specified file
-            // size
-            if (ctx->chunks[ctx->chunk].end > ctx->fileSize) {
-                ERROR("Chunk #%" MB_PRIzu " ends (%" PRIu64 ") after the file size "
-                      "specified in the sparse header (%" PRIu64 ")",
-                      ctx->chunk, ctx->chunks[ctx->chunk].end, ctx->fileSize);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            if (dataSize != 0) {
                 return false;
             }
-
-            // If we just read the last chunk, make sure it ends at the same
-            // position as specified in the sparse header
-            if (ctx->chunk == ctx->shdr.total_chunks - 1
-                    && ctx->chunks[ctx->chunk].end != ctx->fileSize) {
-                ERROR("Last chunk does not end (%" PRIu64 ")"
-                      " at position specified by sparse header (%" PRIu64 ")",
-                      ctx->chunks[ctx->chunk].end, ctx->fileSize);
+            break;
+        case CHUNK_TYPE_CRC32:
+            if (dataSize != sizeof(uint32_t) || chunk.end != chunk.begin) {
                 return false;
             }
-        }
-
-        if (offset >= ctx->chunks[ctx->chunk].begin
-                && offset < ctx->chunks[ctx->chunk].end) {
-            // Found matching chunk. Stop looking
             break;
+        default:
+            return false;
         }
+
+        outOffset = chunk.end;
+        srcOffset = chunk.srcEnd;
     }
 
-    return true;
+    return outOffset == (uint64_t) shdr.total_blks * shdr.blk_sz;
 }
 
 extern "C" {
@@ -719,6 +874,37 @@ bool sparseCtxFree(SparseCtx *ctx)
     return ret;
 }
 
+/*!
+ * \brief Set whether to verify CRC32 checksums while reading
+ *
+ * If enabled, a running checksum of the output data is computed while the
+ * sparse file is read sequentially from the beginning with \a sparseRead() or
+ * written with \a sparseFlashFd(). It is compared against every CRC32 chunk as
+ * soon as it is reached and against the sparse header's \a image_checksum field
+ * (if nonzero) once the end of the file is reached. A mismatch causes the read
+ * or flash operation to fail.
+ *
+ * Verification is abandoned (without failing) for the rest of the file if it
+ * is not read sequentially, eg. after seeking. \a sparseReadAt() never
+ * verifies checksums. This is disabled by default.
+ *
+ * \note Data before the point of the mismatch has already been returned to the
+ *       caller or written to the output by the time the mismatch is detected.
+ *
+ * \param ctx Sparse context
+ * \param enabled Whether to verify checksums
+ * \return True, unless the file is open
+ */
+bool sparseSetVerifyCrc32(SparseCtx *ctx, bool enabled)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    ctx->verifyCrc32 = enabled;
+    return true;
+}
+
 /*!
  * \brief Open sparse file for reading
  *
@@ -747,6 +933,11 @@ bool sparseCtxFree(SparseCtx *ctx)
  *       the source. Otherwise, it's up to the caller to ensure that the
  *       position of the source is at the beginning of the sparse file.
  *
+ * \note If a seek callback is provided, all of the chunk headers are read when
+ *       the file is opened (the raw data is seeked over). An index previously
+ *       obtained with \a sparseGetIndex() can be passed to \a sparseSetIndex()
+ *       before calling this function to avoid reading the chunk headers again.
+ *
  * \note After the sparse file is closed, another sparse file can be opened
  *       using the same \a ctx object.
  *
@@ -788,10 +979,28 @@ bool sparseOpen(SparseCtx *ctx, SparseOpenCb openCb, SparseCloseCb closeCb,
         return false;
     }
 
-    // The chunk headers are processed on demand
+    // If the source is seekable, read all of the chunk headers now so that
+    // seeking does not need to walk the chunk list. Otherwise, the chunk
+    // headers are processed on demand.
+    if (ctx->cbSeek) {
+        if (!ctx->savedChunks.empty() && memcmp(&ctx->savedShdr, &ctx->shdr,
+                                                sizeof(SparseHeader)) == 0) {
+            DEBUG("Using previously saved chunk index");
+            ctx->chunks.swap(ctx->savedChunks);
+        } else if (!buildChunkIndex(ctx)) {
+            ctx->chunks.clear();
+            ctx->srcOffset = 0;
+            ctx->close();
+            ctx->clearCallbacks();
+            return false;
+        }
+    }
 
+    ctx->savedChunks.clear();
     ctx->isOpen = true;
 
+    resetCrc32(ctx);
+
     return true;
 }
 
@@ -813,9 +1022,9 @@ bool sparseClose(SparseCtx *ctx)
     ctx->isOpen = false;
     ctx->srcOffset = 0;
     ctx->outOffset = 0;
-    ctx->expectedCrc32 = 0;
     ctx->chunks.clear();
     ctx->chunk = 0;
+    ctx->crc32Active = false;
 
     bool ret = true;
     if (ctx->cbClose) {
@@ -841,6 +1050,7 @@ bool sparseClose(SparseCtx *ctx)
  * - Ran out of sparse chunks despite the main sparse header promising more
  *   chunks
  * - Chunk header is invalid
+ * - CRC32 checksum does not match (if enabled with \a sparseSetVerifyCrc32())
  *
  * \param ctx Sparse context
  * \param buf Buffer to read data into
@@ -865,7 +1075,8 @@ bool sparseRead(SparseCtx *ctx, void *buf, uint64_t size, uint64_t *bytesRead)
         if (ctx->chunks.empty()
                 || ctx->chunk == ctx->shdr.total_chunks
                 || ctx->outOffset >= ctx->chunks[ctx->chunk].end) {
-            if (!tryMoveToChunkForOffset(ctx, ctx->outOffset)) {
+            if (!tryMoveToChunkForOffset(ctx, ctx->outOffset)
+                    || !checkCrc32(ctx)) {
                 return false;
             }
 
@@ -904,28 +1115,11 @@ bool sparseRead(SparseCtx *ctx, void *buf, uint64_t size, uint64_t *bytesRead)
             }
             break;
         }
-        case CHUNK_TYPE_FILL: {
-            assert(sizeof(ctx->chunks[ctx->chunk].fillVal) == sizeof(uint32_t));
-            auto shift = (ctx->outOffset - ctx->chunks[ctx->chunk].begin)
-                    % sizeof(uint32_t);
-            uint32_t fillVal = ctx->chunks[ctx->chunk].fillVal;
-            uint32_t shifted = 0;
-            for (size_t i = 0; i < sizeof(uint32_t); ++i) {
-                ((char *) &shifted)[i] =
-                        ((char *) &fillVal)[(i + shift) % sizeof(uint32_t)];
-                //uint32_t amount = 8 * ((i + shift) % sizeof(uint32_t));
-                //shifted |= (fillVal & (0xff << amount)) >> amount << i * 8;
-            }
-            char *tempBuf = (char *) buf;
-            while (toRead > 0) {
-                size_t toWrite = std::min<size_t>(sizeof(shifted), toRead);
-                memcpy(tempBuf, &shifted, toWrite);
-                nRead += toWrite;
-                toRead -= toWrite;
-                tempBuf += toWrite;
-            }
+        case CHUNK_TYPE_FILL:
+            fillBuffer(buf, toRead, ctx->chunks[ctx->chunk].fillVal,
+                       ctx->outOffset - ctx->chunks[ctx->chunk].begin);
+            nRead = toRead;
             break;
-        }
         case CHUNK_TYPE_DONT_CARE:
             memset(buf, 0, toRead);
             nRead = toRead;
@@ -937,6 +1131,18 @@ bool sparseRead(SparseCtx *ctx, void *buf, uint64_t size, uint64_t *bytesRead)
         }
 
         OPER("- Read %" PRIu64 " bytes", nRead);
+
+        if (ctx->crc32Active) {
+            if (ctx->crc32Offset == ctx->outOffset) {
+                ctx->crc32 = sparseCrc32(ctx->crc32, buf, nRead);
+                ctx->crc32Offset += nRead;
+            } else {
+                DEBUG("Disabling CRC32 verification due to non-sequential"
+                      " read at offset %" PRIu64, ctx->outOffset);
+                ctx->crc32Active = false;
+            }
+        }
+
         totalRead += nRead;
         ctx->outOffset += nRead;
         size -= nRead;
@@ -948,6 +1154,94 @@ done:
     return true;
 }
 
+/*!
+ * \brief Read sparse file at the specified offset
+ *
+ * Unlike \a sparseRead(), this function does not use or change the file
+ * position of the sparse file and reads the source with \a preadCb instead of
+ * the callbacks passed to \a sparseOpen(). The chunk index is only read, so
+ * this function may be called concurrently from multiple threads (with a
+ * thread-safe \a preadCb) as long as no other function is called on \a ctx at
+ * the same time.
+ *
+ * This requires that all of the chunk headers have already been read, which is
+ * always the case if a seek callback was passed to \a sparseOpen().
+ *
+ * If this function returns true and \a bytesRead is less than \a size, then
+ * the end of the sparse file (EOF) has been reached or the source file is
+ * truncated.
+ *
+ * \param ctx Sparse context
+ * \param buf Buffer to read data into
+ * \param size Number of bytes to read
+ * \param offset Offset in the sparse file to read from
+ * \param bytesRead Number of bytes that were read
+ * \param preadCb Positional read callback for the source file
+ * \param userData Caller-supplied pointer to pass to \a preadCb
+ * \return Whether the data was successfully read
+ */
+bool sparseReadAt(SparseCtx *ctx, void *buf, uint64_t size, uint64_t offset,
+                  uint64_t *bytesRead, SparsePreadCb preadCb, void *userData)
+{
+    if (!ctx->isOpen || ctx->chunks.size() != ctx->shdr.total_chunks) {
+        return false;
+    }
+
+    const std::vector<ChunkInfo> &chunks = ctx->chunks;
+    uint64_t totalRead = 0;
+
+    auto it = std::upper_bound(
+            chunks.begin(), chunks.end(), offset,
+            [](uint64_t o, const ChunkInfo &c) { return o < c.end; });
+
+    for (; size > 0 && it != chunks.end(); ++it) {
+        const ChunkInfo &chunk = *it;
+
+        // Skip zero-length (CRC32) chunks
+        if (chunk.begin == chunk.end) {
+            continue;
+        }
+
+        uint64_t diff = offset - chunk.begin;
+        uint64_t toRead = std::min(size, chunk.end - offset);
+
+        switch (chunk.type) {
+        case CHUNK_TYPE_RAW: {
+            uint64_t nRead = 0;
+            while (nRead < toRead) {
+                uint64_t n;
+                if (!preadCb((char *) buf + nRead, toRead - nRead,
+                             chunk.rawBegin + diff + nRead, &n, userData)) {
+                    return false;
+                } else if (n == 0) {
+                    // EOF
+                    *bytesRead = totalRead + nRead;
+                    return true;
+                }
+                nRead += n;
+            }
+            break;
+        }
+        case CHUNK_TYPE_FILL:
+            fillBuffer(buf, toRead, chunk.fillVal, diff);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            memset(buf, 0, toRead);
+            break;
+        default:
+            return false;
+        }
+
+        totalRead += toRead;
+        offset += toRead;
+        size -= toRead;
+        buf = (char *) buf + toRead;
+    }
+
+    *bytesRead = totalRead;
+    return true;
+}
+
 /*!
  * \brief Seek sparse file
  *
@@ -1049,4 +1343,143 @@ bool sparseSize(SparseCtx *ctx, uint64_t *size)
     return true;
 }
 
+/*!
+ * \brief Serialize the chunk index of an opened sparse file
+ *
+ * The serialized index can be passed to \a sparseSetIndex() to avoid reading
+ * the chunk headers when the same sparse file is opened again. The index is
+ * only available once all of the chunk headers have been read, which is always
+ * the case if a seek callback was provided.
+ *
+ * \param ctx Sparse context
+ * \param[out] data Output pointer for the serialized index. The buffer is
+ *                  allocated with \a malloc() and must be freed by the caller.
+ * \param[out] size Output pointer for the size of the serialized index
+ * \return True, unless the file is not open, the chunk headers have not all
+ *         been read, or memory could not be allocated
+ */
+bool sparseGetIndex(SparseCtx *ctx, void **data, size_t *size)
+{
+    if (!ctx->isOpen || ctx->chunks.size() != ctx->shdr.total_chunks) {
+        return false;
+    }
+
+    size_t bufSize = sizeof(SparseIndexHeader)
+            + ctx->chunks.size() * sizeof(SparseIndexChunk);
+    char *buf = static_cast<char *>(malloc(bufSize));
+    if (!buf) {
+        return false;
+    }
+
+    SparseIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SPARSE_INDEX_MAGIC;
+    header.version = SPARSE_INDEX_VERSION;
+    header.shdr = ctx->shdr;
+    header.chunk_count = ctx->shdr.total_chunks;
+    memcpy(buf, &header, sizeof(header));
+
+    char *ptr = buf + sizeof(header);
+    for (const ChunkInfo &chunk : ctx->chunks) {
+        SparseIndexChunk entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = chunk.type;
+        if (chunk.type == CHUNK_TYPE_FILL) {
+            entry.value = chunk.fillVal;
+        } else if (chunk.type == CHUNK_TYPE_CRC32) {
+            entry.value = chunk.crc32;
+        }
+        entry.begin = chunk.begin;
+        entry.end = chunk.end;
+        entry.srcBegin = chunk.srcBegin;
+        entry.srcEnd = chunk.srcEnd;
+        memcpy(ptr, &entry, sizeof(entry));
+        ptr += sizeof(entry);
+    }
+
+    *data = buf;
+    *size = bufSize;
+    return true;
+}
+
+/*!
+ * \brief Supply a previously serialized chunk index for the next open
+ *
+ * The index is used by the next call to \a sparseOpen() if a seek callback is
+ * provided and the sparse header of the opened file matches the header stored
+ * in the index. Otherwise, the index is discarded and the chunk headers are
+ * read from the file as usual.
+ *
+ * \note The sparse header is the only part of the file that is checked against
+ *       the index. It is up to the caller to make sure that the index belongs
+ *       to the file being opened (eg. by keying it on the file's inode and
+ *       modification time).
+ *
+ * \param ctx Sparse context
+ * \param data Serialized index from \a sparseGetIndex()
+ * \param size Size of serialized index
+ * \return True if the index is valid. False if the file is already open or the
+ *         index is malformed.
+ */
+bool sparseSetIndex(SparseCtx *ctx, const void *data, size_t size)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    ctx->savedChunks.clear();
+
+    SparseIndexHeader header;
+    if (size < sizeof(header)) {
+        ERROR("Sparse index is too small");
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (header.magic != SPARSE_INDEX_MAGIC
+            || header.version != SPARSE_INDEX_VERSION
+            || header.chunk_count != header.shdr.total_chunks
+            || header.shdr.file_hdr_sz < sizeof(SparseHeader)
+            || header.shdr.chunk_hdr_sz < sizeof(ChunkHeader)
+            || (size - sizeof(header)) / sizeof(SparseIndexChunk)
+                    != header.chunk_count
+            || (size - sizeof(header)) % sizeof(SparseIndexChunk) != 0) {
+        ERROR("Sparse index is invalid");
+        return false;
+    }
+
+    std::vector<ChunkInfo> chunks(header.chunk_count);
+    const char *ptr = static_cast<const char *>(data) + sizeof(header);
+
+    for (ChunkInfo &chunk : chunks) {
+        SparseIndexChunk entry;
+        memcpy(&entry, ptr, sizeof(entry));
+        ptr += sizeof(entry);
+
+        chunk.type = entry.type;
+        chunk.fillVal = entry.type == CHUNK_TYPE_FILL ? entry.value : 0;
+        chunk.crc32 = entry.type == CHUNK_TYPE_CRC32 ? entry.value : 0;
+        chunk.begin = entry.begin;
+        chunk.end = entry.end;
+        chunk.srcBegin = entry.srcBegin;
+        chunk.srcEnd = entry.srcEnd;
+        if (entry.type == CHUNK_TYPE_RAW) {
+            chunk.rawBegin = entry.srcBegin + header.shdr.chunk_hdr_sz;
+            chunk.rawEnd = entry.srcEnd;
+        } else {
+            chunk.rawBegin = 0;
+            chunk.rawEnd = 0;
+        }
+    }
+
+    if (!validateChunkIndex(header.shdr, chunks)) {
+        ERROR("Sparse index does not describe a valid sparse file");
+        return false;
+    }
+
+    ctx->savedShdr = header.shdr;
+    ctx->savedChunks.swap(chunks);
+    return true;
+}
+
 }
@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/sparse_flash.h"
+
+#ifndef _WIN32
+
+// For std::min()
+#include <algorithm>
+#include <memory>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "crc32_p.h"
+#include "sparse_p.h"
+
+// Size of the buffer used for raw data and expanded fill patterns. Large
+// writes are significantly faster than small ones on eMMC.
+#define SPARSE_FLASH_BUF_SIZE   (1024 * 1024)
+
+struct FlashState
+{
+    SparseCtx *ctx;
+    int fd;
+    int flags;
+    bool isBlockDev;
+
+    std::unique_ptr<char, decltype(free) *> buf{nullptr, &free};
+    // Filler value that \a buf is currently expanded with (if \a bufIsFill)
+    uint32_t bufFillVal;
+    bool bufIsFill = false;
+
+    // If set, data is passed to this callback instead of being written to fd
+    SparseFlashWriteCb writeCb = nullptr;
+    // If set, zero-filled ranges are passed to this callback instead of being
+    // expanded
+    SparseFlashZeroCb zeroCb = nullptr;
+    SparseFlashProgressCb progressCb;
+    void *userData;
+};
+
+static bool writeFullyAt(FlashState *state, const void *buf, size_t size,
+                         uint64_t offset)
+{
+    if (state->writeCb) {
+        if (!state->writeCb(buf, size, offset, state->userData)) {
+            ERROR("Write callback returned failure at offset %" PRIu64,
+                  offset);
+            return false;
+        }
+        return true;
+    }
+
+    while (size > 0) {
+        ssize_t n = pwrite64(state->fd, buf, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERROR("Failed to write at offset %" PRIu64 ": %s",
+                  offset, strerror(errno));
+            return false;
+        }
+        size -= n;
+        offset += n;
+        buf = static_cast<const char *>(buf) + n;
+    }
+    return true;
+}
+
+/*!
+ * \brief Perform a block device range ioctl (BLKDISCARD or BLKZEROOUT)
+ *
+ * \return Whether the ioctl succeeded. On failure, the caller should fall back
+ *         to writing the data.
+ */
+static bool blockRangeIoctl(FlashState *state, unsigned long request,
+                            uint64_t offset, uint64_t size)
+{
+#ifdef __linux__
+    // The kernel requires the range to be aligned to the logical sector size
+    if (!state->isBlockDev || offset % 512 != 0 || size % 512 != 0) {
+        return false;
+    }
+
+    uint64_t range[2] = { offset, size };
+    if (ioctl(state->fd, request, &range) < 0) {
+        DEBUG("Block range ioctl 0x%lx failed: %s", request, strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void) state;
+    (void) request;
+    (void) offset;
+    (void) size;
+    return false;
+#endif
+}
+
+static bool flashRawChunk(FlashState *state, const ChunkInfo &chunk)
+{
+    SparseCtx *ctx = state->ctx;
+
+    if (ctx->cbSeek && !ctx->seek(
+            chunk.rawBegin + (ctx->outOffset - chunk.begin), SEEK_SET)) {
+        return false;
+    }
+
+    state->bufIsFill = false;
+
+    while (ctx->outOffset < chunk.end) {
+        uint64_t toRead = std::min<uint64_t>(chunk.end - ctx->outOffset,
+                                             SPARSE_FLASH_BUF_SIZE);
+        uint64_t total = 0;
+
+        while (total < toRead) {
+            uint64_t n;
+            if (!ctx->read(state->buf.get() + total, toRead - total, &n)) {
+                ERROR("Sparse read callback returned failure");
+                return false;
+            } else if (n == 0) {
+                ERROR("Source file is truncated");
+                return false;
+            }
+            total += n;
+        }
+
+        if (!writeFullyAt(state, state->buf.get(), toRead, ctx->outOffset)) {
+            return false;
+        }
+
+        if (ctx->crc32Active) {
+            ctx->crc32 = sparseCrc32(ctx->crc32, state->buf.get(), toRead);
+        }
+
+        ctx->outOffset += toRead;
+    }
+
+    return true;
+}
+
+static bool flashFillChunk(FlashState *state, const ChunkInfo &chunk)
+{
+    SparseCtx *ctx = state->ctx;
+    uint64_t size = chunk.end - ctx->outOffset;
+
+    // The pattern does not need to be expanded to be checksummed
+    if (ctx->crc32Active) {
+        ctx->crc32 = sparseCrc32Repeat(ctx->crc32, chunk.fillVal, size);
+    }
+
+    if (chunk.fillVal == 0 && state->zeroCb) {
+        if (!state->zeroCb(size, ctx->outOffset, state->userData)) {
+            ERROR("Zero callback returned failure at offset %" PRIu64,
+                  ctx->outOffset);
+            return false;
+        }
+        ctx->outOffset = chunk.end;
+        return true;
+    } else if (chunk.fillVal == 0) {
+#ifdef BLKZEROOUT
+        if (blockRangeIoctl(state, BLKZEROOUT, ctx->outOffset, size)) {
+            ctx->outOffset = chunk.end;
+            return true;
+        }
+#endif
+    }
+
+    // The block size is a multiple of 4, so the pattern is always aligned
+    // to the beginning of the chunk
+    if (!state->bufIsFill || state->bufFillVal != chunk.fillVal) {
+        uint32_t *ptr = reinterpret_cast<uint32_t *>(state->buf.get());
+        std::fill(ptr, ptr + SPARSE_FLASH_BUF_SIZE / sizeof(uint32_t),
+                  chunk.fillVal);
+        state->bufFillVal = chunk.fillVal;
+        state->bufIsFill = true;
+    }
+
+    while (ctx->outOffset < chunk.end) {
+        size_t n = std::min<uint64_t>(chunk.end - ctx->outOffset,
+                                      SPARSE_FLASH_BUF_SIZE);
+        if (!writeFullyAt(state, state->buf.get(), n, ctx->outOffset)) {
+            return false;
+        }
+        ctx->outOffset += n;
+    }
+
+    return true;
+}
+
+static bool flashDontCareChunk(FlashState *state, const ChunkInfo &chunk)
+{
+    SparseCtx *ctx = state->ctx;
+
+    if (ctx->crc32Active) {
+        ctx->crc32 = sparseCrc32Zeros(ctx->crc32, chunk.end - ctx->outOffset);
+    }
+
+    if (state->flags & SPARSE_FLASH_DISCARD) {
+#ifdef BLKDISCARD
+        // Failure is not fatal since the contents are undefined anyway
+        blockRangeIoctl(state, BLKDISCARD, ctx->outOffset,
+                        chunk.end - ctx->outOffset);
+#endif
+    }
+
+    ctx->outOffset = chunk.end;
+    return true;
+}
+
+static bool flashChunks(FlashState *state)
+{
+    SparseCtx *ctx = state->ctx;
+
+    ctx->outOffset = 0;
+    resetCrc32(ctx);
+
+    while (true) {
+        if (!tryMoveToChunkForOffset(ctx, ctx->outOffset)) {
+            return false;
+        }
+
+        ctx->crc32Offset = ctx->outOffset;
+        if (!checkCrc32(ctx)) {
+            return false;
+        }
+
+        if (ctx->chunk == ctx->shdr.total_chunks) {
+            break;
+        }
+
+        // Copy since reading chunk headers may reallocate the chunk list
+        ChunkInfo chunk = ctx->chunks[ctx->chunk];
+        bool ret;
+
+        switch (chunk.type) {
+        case CHUNK_TYPE_RAW:
+            ret = flashRawChunk(state, chunk);
+            break;
+        case CHUNK_TYPE_FILL:
+            ret = flashFillChunk(state, chunk);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            ret = flashDontCareChunk(state, chunk);
+            break;
+        default:
+            ret = false;
+            break;
+        }
+
+        if (!ret) {
+            return false;
+        }
+
+        if (state->progressCb) {
+            state->progressCb(ctx->outOffset, ctx->fileSize,
+                              state->userData);
+        }
+    }
+
+    return true;
+}
+
+extern "C" {
+
+/*!
+ * \brief Write the contents of a sparse file to a file descriptor
+ *
+ * Unlike copying the output of \a sparseRead(), this works on whole chunks.
+ * Raw chunks are copied with large positional writes, fill chunks are written
+ * from a pre-expanded pattern buffer (or with BLKZEROOUT for zero-filled
+ * chunks on block devices), and don't care chunks are skipped entirely. If
+ * \a SPARSE_FLASH_DISCARD is passed, don't care ranges on block devices are
+ * discarded with BLKDISCARD.
+ *
+ * Offset 0 of the sparse file is written to offset 0 of \a fd. The file
+ * position of \a fd is not used or changed. If \a fd refers to a regular file,
+ * it will be resized to the size of the sparse file so that trailing don't care
+ * chunks become holes.
+ *
+ * This works with sources that are not seekable. In that case, the sparse file
+ * must not have been read or seeked yet.
+ *
+ * If CRC32 verification was enabled with \a sparseSetVerifyCrc32(), the
+ * checksums are verified while the data is written. Fill and don't care chunks
+ * are checksummed without expanding them.
+ *
+ * \param ctx Sparse context
+ * \param fd Output file descriptor (opened for writing)
+ * \param flags Bitwise-or of \a SPARSE_FLASH_* flags
+ * \param progressCb Optional callback for reporting the number of bytes of the
+ *                   sparse file that have been processed
+ * \param userData Caller-supplied pointer to pass to \a progressCb
+ * \return Whether the sparse file was successfully written
+ */
+bool sparseFlashFd(SparseCtx *ctx, int fd, int flags,
+                   SparseFlashProgressCb progressCb, void *userData)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        ERROR("Failed to stat output file: %s", strerror(errno));
+        return false;
+    }
+
+    FlashState state;
+    state.ctx = ctx;
+    state.fd = fd;
+    state.flags = flags;
+    state.isBlockDev = S_ISBLK(sb.st_mode);
+    state.progressCb = progressCb;
+    state.userData = userData;
+    state.buf.reset(static_cast<char *>(malloc(SPARSE_FLASH_BUF_SIZE)));
+
+    if (!state.buf) {
+        ERROR("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
+    if (S_ISREG(sb.st_mode) && ftruncate64(fd, ctx->fileSize) < 0) {
+        ERROR("Failed to resize output file: %s", strerror(errno));
+        return false;
+    }
+
+    return flashChunks(&state);
+}
+
+/*!
+ * \brief Write the contents of a sparse file with a callback
+ *
+ * This is the same as \a sparseFlashFd(), except that the data is passed to
+ * \a writeCb instead of being written to a file descriptor. This allows the
+ * caller to perform the writes asynchronously (eg. on another thread).
+ *
+ * \a writeCb is called with the data for raw and fill chunks in increasing
+ * offset order. Don't care ranges are never passed to the callback. The buffer
+ * is only valid for the duration of the call.
+ *
+ * If \a zeroCb is not nullptr, zero-filled fill chunks are passed to it as
+ * ranges instead of being expanded and passed to \a writeCb. This lets the
+ * caller zero the range efficiently (eg. with BLKZEROOUT on a block device).
+ * The calls to both callbacks are in increasing offset order.
+ *
+ * \param ctx Sparse context
+ * \param writeCb Callback for writing data at the specified output offset
+ * \param zeroCb Optional callback for zeroing a range of the output
+ * \param progressCb Optional callback for reporting the number of bytes of the
+ *                   sparse file that have been processed
+ * \param userData Caller-supplied pointer to pass to the callbacks
+ * \return Whether the sparse file was successfully processed. If \a writeCb
+ *         returns false, processing stops and this function returns false.
+ */
+bool sparseFlashCb(SparseCtx *ctx, SparseFlashWriteCb writeCb,
+                   SparseFlashZeroCb zeroCb, SparseFlashProgressCb progressCb,
+                   void *userData)
+{
+    if (!ctx->isOpen || !writeCb) {
+        return false;
+    }
+
+    FlashState state;
+    state.ctx = ctx;
+    state.fd = -1;
+    state.flags = 0;
+    state.isBlockDev = false;
+    state.writeCb = writeCb;
+    state.zeroCb = zeroCb;
+    state.progressCb = progressCb;
+    state.userData = userData;
+    state.buf.reset(static_cast<char *>(malloc(SPARSE_FLASH_BUF_SIZE)));
+
+    if (!state.buf) {
+        ERROR("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
+    return flashChunks(&state);
+}
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2015-2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbsparse/sparse.h"
+
+#include <vector>
+
+#include <cstdint>
+
+#include "mblog/logging.h"
+
+// Enable debug logging of headers, offsets, etc.?
+#define SPARSE_DEBUG 1
+// Enable debug logging of operations (warning! very verbose!)
+#define SPARSE_DEBUG_OPER 0
+// Enable logging of errors
+#define SPARSE_ERROR 1
+
+#if SPARSE_DEBUG
+#define DEBUG(...) LOGD(__VA_ARGS__)
+#else
+#define DEBUG(...)
+#endif
+
+#if SPARSE_DEBUG_OPER
+#define OPER(...) LOGD(__VA_ARGS__)
+#else
+#define OPER(...)
+#endif
+
+#if SPARSE_ERROR
+#define ERROR(...) LOGE(__VA_ARGS__)
+#else
+#define ERROR(...)
+#endif
+
+/*! \brief Minimum information we need from the chunk headers while reading */
+struct ChunkInfo
+{
+    /*! \brief Same as ChunkHeader::chunk_type */
+    uint16_t type;
+
+    /*! \brief Start of byte range in output file that this chunk represents */
+    uint64_t begin;
+    /*! \brief End of byte range in output file that this chunk represents */
+    uint64_t end;
+
+    /*! \brief Start of byte range for the entire chunk in the source file */
+    uint64_t srcBegin;
+    /*! \brief End of byte range for the entire chunk in the source file */
+    uint64_t srcEnd;
+
+    /*! \brief [CHUNK_TYPE_RAW only] Start of raw bytes in input file */
+    uint64_t rawBegin;
+    /*! \brief [CHUNK_TYPE_RAW only] End of raw bytes in input file */
+    uint64_t rawEnd;
+
+    /*! \brief [CHUNK_TYPE_FILL only] Filler value for the chunk */
+    uint32_t fillVal;
+
+    /*! \brief [CHUNK_TYPE_CRC32 only] Checksum of all preceding data */
+    uint32_t crc32;
+};
+
+struct SparseCtx
+{
+    // Callbacks
+    SparseOpenCb cbOpen;
+    SparseCloseCb cbClose;
+    SparseReadCb cbRead;
+    SparseSeekCb cbSeek;
+    SparseSkipCb cbSkip;
+    void *cbUserData;
+
+    void setCallbacks(SparseOpenCb openCb, SparseCloseCb closeCb,
+                      SparseReadCb readCb, SparseSeekCb seekCb,
+                      SparseSkipCb skipCb, void *userData);
+    void clearCallbacks();
+
+    // Callback wrappers to avoid passing ctx->cbUserdata everywhere
+    bool open();
+    bool close();
+    bool read(void *buf, uint64_t size, uint64_t *bytesRead);
+    bool seek(int64_t offset, int whence);
+    bool skip(uint64_t offset);
+
+    bool skipBytes(uint64_t bytes);
+
+    bool isOpen;
+
+    // CRC32 verification (see sparseSetVerifyCrc32()). \a crc32 is the
+    // checksum of the first \a crc32Offset bytes of the output file and
+    // \a crc32Chunk is the first chunk that has not been verified yet.
+    bool verifyCrc32 = false;
+    bool crc32Active = false;
+    uint32_t crc32 = 0;
+    uint64_t crc32Offset = 0;
+    size_t crc32Chunk = 0;
+
+    uint64_t srcOffset = 0;
+    uint64_t outOffset = 0;
+    uint64_t fileSize;
+
+    SparseHeader shdr;
+
+    std::vector<ChunkInfo> chunks;
+    size_t chunk = 0;
+
+    // Index supplied by sparseSetIndex() for the next sparseOpen()
+    std::vector<ChunkInfo> savedChunks;
+    SparseHeader savedShdr;
+};
+
+bool tryMoveToChunkForOffset(SparseCtx *ctx, uint64_t offset);
+
+void resetCrc32(SparseCtx *ctx);
+bool checkCrc32(SparseCtx *ctx);
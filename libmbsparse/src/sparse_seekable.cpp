@@ -0,0 +1,1063 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/sparse_seekable.h"
+
+#ifndef _WIN32
+
+// For std::min()
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <cinttypes>
+#include <cstring>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <lz4.h>
+
+#include "crc32_p.h"
+#include "sparse_p.h"
+
+// Size of the buffer used for expanded fill patterns
+#define SEEKABLE_FILL_BUF_SIZE  (1024 * 1024)
+
+// Number of decompressed frames cached by sparseSeekableReadAt()
+#define SEEKABLE_CACHE_SLOTS    8
+
+static_assert(sizeof(SparseSeekableHeader) == 32,
+              "SparseSeekableHeader has unexpected padding");
+static_assert(sizeof(SparseSeekableFrameHeader) == 32,
+              "SparseSeekableFrameHeader has unexpected padding");
+static_assert(sizeof(SparseSeekableIndexEntry) == 40,
+              "SparseSeekableIndexEntry has unexpected padding");
+static_assert(sizeof(SparseSeekableFooter) == 24,
+              "SparseSeekableFooter has unexpected padding");
+
+/*!
+ * \brief Run \a fn on every job, using one thread per job
+ *
+ * The first job runs on the calling thread. If a thread cannot be created,
+ * its job also runs on the calling thread.
+ */
+template<typename T>
+static void runJobs(T *jobs, size_t count, void * (*fn)(void *))
+{
+    std::vector<pthread_t> tids(count);
+    std::vector<bool> started(count, false);
+
+    for (size_t i = 1; i < count; ++i) {
+        started[i] = pthread_create(&tids[i], nullptr, fn, &jobs[i]) == 0;
+    }
+
+    if (count > 0) {
+        fn(&jobs[0]);
+    }
+
+    for (size_t i = 1; i < count; ++i) {
+        if (started[i]) {
+            pthread_join(tids[i], nullptr);
+        } else {
+            fn(&jobs[i]);
+        }
+    }
+}
+
+static unsigned int defaultThreads(unsigned int threads)
+{
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? static_cast<unsigned int>(n) : 1;
+    }
+    return threads;
+}
+
+/*!
+ * \brief Decode the data of a raw frame and verify its checksum
+ *
+ * \param hdr Frame header (already validated against the maximum frame size)
+ * \param src Frame data (\a hdr.data_sz bytes)
+ * \param dst Output buffer (at least \a hdr.out_sz bytes)
+ */
+static bool decodeFrame(const SparseSeekableFrameHeader &hdr, const char *src,
+                        char *dst)
+{
+    if (hdr.flags & SPARSE_SEEKABLE_FRAME_STORED) {
+        if (hdr.data_sz != hdr.out_sz) {
+            ERROR("Stored frame at offset %" PRIu64 " has invalid size",
+                  hdr.out_offset);
+            return false;
+        }
+        memcpy(dst, src, hdr.out_sz);
+    } else {
+        int n = LZ4_decompress_safe(src, dst, static_cast<int>(hdr.data_sz),
+                                    static_cast<int>(hdr.out_sz));
+        if (n < 0 || static_cast<uint64_t>(n) != hdr.out_sz) {
+            ERROR("Failed to decompress frame at offset %" PRIu64,
+                  hdr.out_offset);
+            return false;
+        }
+    }
+
+    uint32_t crc = sparseCrc32(0, dst, hdr.out_sz);
+    if (crc != hdr.value) {
+        ERROR("CRC32 mismatch in frame at offset %" PRIu64 ": expected 0x%08"
+              PRIx32 ", but have 0x%08" PRIx32, hdr.out_offset, hdr.value, crc);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check that a frame header is consistent with the container header
+ */
+static bool validateFrame(const SparseSeekableHeader &shdr,
+                          const SparseSeekableFrameHeader &hdr,
+                          uint64_t expectedOffset)
+{
+    if (hdr.out_offset != expectedOffset || hdr.out_sz == 0
+            || hdr.out_sz > shdr.total_sz - hdr.out_offset) {
+        ERROR("Frame at offset %" PRIu64 " is not contiguous",
+              hdr.out_offset);
+        return false;
+    }
+
+    switch (hdr.frame_type) {
+    case CHUNK_TYPE_RAW:
+        if (hdr.out_sz > shdr.max_frame_sz || hdr.data_sz == 0
+                || hdr.data_sz > static_cast<uint32_t>(
+                        LZ4_compressBound(shdr.max_frame_sz))) {
+            ERROR("Raw frame at offset %" PRIu64 " has invalid size",
+                  hdr.out_offset);
+            return false;
+        }
+        return true;
+    case CHUNK_TYPE_FILL:
+    case CHUNK_TYPE_DONT_CARE:
+        if (hdr.data_sz != 0) {
+            ERROR("Frame at offset %" PRIu64 " has unexpected data",
+                  hdr.out_offset);
+            return false;
+        }
+        return true;
+    default:
+        ERROR("Frame at offset %" PRIu64 " has invalid type: 0x%04" PRIx16,
+              hdr.out_offset, hdr.frame_type);
+        return false;
+    }
+}
+
+static bool validateHeader(const SparseSeekableHeader &shdr)
+{
+    if (shdr.magic != SPARSE_SEEKABLE_MAGIC) {
+        ERROR("Invalid seekable container magic: 0x%08" PRIx32, shdr.magic);
+        return false;
+    } else if (shdr.major_version != SPARSE_SEEKABLE_MAJOR_VER) {
+        ERROR("Unsupported seekable container version: %" PRIu16,
+              shdr.major_version);
+        return false;
+    } else if (shdr.header_sz != sizeof(SparseSeekableHeader)
+            || shdr.frame_hdr_sz != sizeof(SparseSeekableFrameHeader)) {
+        ERROR("Unsupported seekable container header sizes");
+        return false;
+    } else if (shdr.compression != SPARSE_SEEKABLE_COMPRESSION_LZ4) {
+        ERROR("Unsupported compression: %" PRIu32, shdr.compression);
+        return false;
+    } else if (shdr.max_frame_sz == 0
+            || shdr.max_frame_sz > SPARSE_SEEKABLE_MAX_FRAME_SIZE) {
+        ERROR("Invalid maximum frame size: %" PRIu32, shdr.max_frame_sz);
+        return false;
+    }
+    return true;
+}
+
+// Compression
+
+struct CompressJob
+{
+    SparseSeekableFrameHeader hdr;
+    // [CHUNK_TYPE_RAW only] Uncompressed and compressed data
+    std::vector<char> raw;
+    std::vector<char> compressed;
+};
+
+struct CompressState
+{
+    SparseCtx *ctx;
+    SparseWriteCb writeCb;
+    void *userData;
+    uint32_t frameSize;
+    unsigned int threads;
+
+    uint64_t srcOffset = 0;
+    std::vector<SparseSeekableIndexEntry> index;
+
+    // Frames that have not been written yet. Only the first \a batchSize are
+    // valid. The jobs are reused so that their buffers are only allocated once.
+    std::vector<CompressJob> batch;
+    size_t batchSize = 0;
+    // Number of raw frames in the batch
+    size_t batchRaw = 0;
+};
+
+static bool writeFully(CompressState *state, const void *buf, uint64_t size)
+{
+    while (size > 0) {
+        uint64_t n;
+        if (!state->writeCb(buf, size, &n, state->userData)) {
+            ERROR("Write callback returned failure");
+            return false;
+        } else if (n == 0) {
+            ERROR("Write callback wrote no data");
+            return false;
+        }
+        buf = static_cast<const char *>(buf) + n;
+        size -= n;
+        state->srcOffset += n;
+    }
+    return true;
+}
+
+static void * compressThread(void *data)
+{
+    CompressJob *job = static_cast<CompressJob *>(data);
+    SparseSeekableFrameHeader &hdr = job->hdr;
+
+    if (hdr.frame_type != CHUNK_TYPE_RAW) {
+        return nullptr;
+    }
+
+    hdr.value = sparseCrc32(0, job->raw.data(), hdr.out_sz);
+
+    int n = LZ4_compress_default(job->raw.data(), job->compressed.data(),
+                                 static_cast<int>(hdr.out_sz),
+                                 static_cast<int>(job->compressed.size()));
+    if (n <= 0 || static_cast<uint64_t>(n) >= hdr.out_sz) {
+        // Incompressible data is stored as is
+        hdr.flags = SPARSE_SEEKABLE_FRAME_STORED;
+        hdr.data_sz = hdr.out_sz;
+    } else {
+        hdr.flags = 0;
+        hdr.data_sz = n;
+    }
+
+    return nullptr;
+}
+
+/*!
+ * \brief Compress the raw frames of the batch in parallel and write all frames
+ *        in order
+ */
+static bool flushBatch(CompressState *state)
+{
+    // Threads are only worth it if there are several raw frames. Running the
+    // job for a non-raw frame is a no-op.
+    if (state->batchRaw > 1) {
+        runJobs(state->batch.data(), state->batchSize, &compressThread);
+    } else {
+        for (size_t i = 0; i < state->batchSize; ++i) {
+            compressThread(&state->batch[i]);
+        }
+    }
+
+    for (size_t i = 0; i < state->batchSize; ++i) {
+        CompressJob &job = state->batch[i];
+
+        if (!writeFully(state, &job.hdr, sizeof(job.hdr))) {
+            return false;
+        }
+
+        SparseSeekableIndexEntry entry;
+        entry.hdr = job.hdr;
+        entry.data_offset = state->srcOffset;
+        state->index.push_back(entry);
+
+        if (job.hdr.data_sz > 0) {
+            const char *data = (job.hdr.flags & SPARSE_SEEKABLE_FRAME_STORED)
+                    ? job.raw.data() : job.compressed.data();
+            if (!writeFully(state, data, job.hdr.data_sz)) {
+                return false;
+            }
+        }
+    }
+
+    state->batchSize = 0;
+    state->batchRaw = 0;
+    return true;
+}
+
+/*!
+ * \brief Get the frame at the end of the batch if it can be extended
+ */
+static CompressJob * lastFrame(CompressState *state, uint16_t type)
+{
+    if (state->batchSize == 0) {
+        return nullptr;
+    }
+
+    CompressJob *job = &state->batch[state->batchSize - 1];
+    if (job->hdr.frame_type != type) {
+        return nullptr;
+    }
+    return job;
+}
+
+static CompressJob * newFrame(CompressState *state, uint16_t type,
+                              uint64_t offset)
+{
+    if (type == CHUNK_TYPE_RAW && state->batchRaw == state->threads
+            && !flushBatch(state)) {
+        return nullptr;
+    }
+
+    if (state->batchSize == state->batch.size()) {
+        state->batch.emplace_back();
+    }
+
+    CompressJob *job = &state->batch[state->batchSize++];
+    memset(&job->hdr, 0, sizeof(job->hdr));
+    job->hdr.frame_type = type;
+    job->hdr.out_offset = offset;
+
+    if (type == CHUNK_TYPE_RAW) {
+        job->raw.resize(state->frameSize);
+        job->compressed.resize(LZ4_compressBound(state->frameSize));
+        ++state->batchRaw;
+    }
+
+    return job;
+}
+
+static bool compressRawChunk(CompressState *state, const ChunkInfo &chunk)
+{
+    SparseCtx *ctx = state->ctx;
+
+    if (ctx->cbSeek && !ctx->seek(
+            chunk.rawBegin + (ctx->outOffset - chunk.begin), SEEK_SET)) {
+        return false;
+    }
+
+    while (ctx->outOffset < chunk.end) {
+        // Adjacent raw chunks share frames
+        CompressJob *job = lastFrame(state, CHUNK_TYPE_RAW);
+        if (!job || job->hdr.out_sz == state->frameSize) {
+            job = newFrame(state, CHUNK_TYPE_RAW, ctx->outOffset);
+            if (!job) {
+                return false;
+            }
+        }
+
+        uint64_t toRead = std::min<uint64_t>(chunk.end - ctx->outOffset,
+                                             state->frameSize - job->hdr.out_sz);
+        char *buf = job->raw.data() + job->hdr.out_sz;
+        uint64_t total = 0;
+
+        while (total < toRead) {
+            uint64_t n;
+            if (!ctx->read(buf + total, toRead - total, &n)) {
+                ERROR("Sparse read callback returned failure");
+                return false;
+            } else if (n == 0) {
+                ERROR("Source file is truncated");
+                return false;
+            }
+            total += n;
+        }
+
+        if (ctx->crc32Active) {
+            ctx->crc32 = sparseCrc32(ctx->crc32, buf, toRead);
+        }
+
+        job->hdr.out_sz += toRead;
+        ctx->outOffset += toRead;
+    }
+
+    return true;
+}
+
+static bool compressFillChunk(CompressState *state, const ChunkInfo &chunk,
+                              uint16_t type, uint32_t value)
+{
+    SparseCtx *ctx = state->ctx;
+    uint64_t size = chunk.end - ctx->outOffset;
+
+    if (ctx->crc32Active) {
+        ctx->crc32 = sparseCrc32Repeat(ctx->crc32, value, size);
+    }
+
+    // Adjacent chunks with the same filler value are merged
+    CompressJob *job = lastFrame(state, type);
+    if (!job || job->hdr.value != value) {
+        job = newFrame(state, type, ctx->outOffset);
+        if (!job) {
+            return false;
+        }
+        job->hdr.value = value;
+    }
+
+    job->hdr.out_sz += size;
+    ctx->outOffset = chunk.end;
+    return true;
+}
+
+static bool compressChunks(CompressState *state)
+{
+    SparseCtx *ctx = state->ctx;
+
+    ctx->outOffset = 0;
+    resetCrc32(ctx);
+
+    while (true) {
+        if (!tryMoveToChunkForOffset(ctx, ctx->outOffset)) {
+            return false;
+        }
+
+        ctx->crc32Offset = ctx->outOffset;
+        if (!checkCrc32(ctx)) {
+            return false;
+        }
+
+        if (ctx->chunk == ctx->shdr.total_chunks) {
+            break;
+        }
+
+        // Copy since reading chunk headers may reallocate the chunk list
+        ChunkInfo chunk = ctx->chunks[ctx->chunk];
+        bool ret;
+
+        switch (chunk.type) {
+        case CHUNK_TYPE_RAW:
+            ret = compressRawChunk(state, chunk);
+            break;
+        case CHUNK_TYPE_FILL:
+            ret = compressFillChunk(state, chunk, CHUNK_TYPE_FILL,
+                                    chunk.fillVal);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            // Don't care ranges read as zeros
+            ret = compressFillChunk(state, chunk, CHUNK_TYPE_DONT_CARE, 0);
+            break;
+        default:
+            ret = false;
+            break;
+        }
+
+        if (!ret) {
+            return false;
+        }
+    }
+
+    return flushBatch(state);
+}
+
+// Random access
+
+struct SparseSeekableCtx
+{
+    SparsePreadCb cbPread;
+    void *cbUserData;
+
+    bool isOpen;
+
+    SparseSeekableHeader shdr;
+    std::vector<SparseSeekableIndexEntry> index;
+
+    struct CacheSlot
+    {
+        size_t frame;
+        std::shared_ptr<std::vector<char>> data;
+        uint64_t lastUse;
+    };
+
+    // Recently decompressed frames. Readers hold a reference to the data, so
+    // slots can be replaced while other threads are still copying from them.
+    std::mutex cacheLock;
+    std::vector<CacheSlot> cache;
+    uint64_t cacheClock = 0;
+};
+
+static bool preadFully(SparseSeekableCtx *ctx, void *buf, uint64_t size,
+                       uint64_t offset)
+{
+    while (size > 0) {
+        uint64_t n;
+        if (!ctx->cbPread(buf, size, offset, &n, ctx->cbUserData)) {
+            ERROR("Positional read callback returned failure");
+            return false;
+        } else if (n == 0) {
+            ERROR("Container is truncated at offset %" PRIu64, offset);
+            return false;
+        }
+        buf = static_cast<char *>(buf) + n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*!
+ * \brief Get the decompressed data of a raw frame, using the cache if possible
+ */
+static std::shared_ptr<std::vector<char>> getFrame(SparseSeekableCtx *ctx,
+                                                   size_t frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(ctx->cacheLock);
+        for (auto &slot : ctx->cache) {
+            if (slot.data && slot.frame == frame) {
+                slot.lastUse = ++ctx->cacheClock;
+                return slot.data;
+            }
+        }
+    }
+
+    // Decompress without holding the lock so that other frames can be read
+    // concurrently
+    const SparseSeekableIndexEntry &entry = ctx->index[frame];
+    std::vector<char> src(entry.hdr.data_sz);
+    std::shared_ptr<std::vector<char>> data(
+            new(std::nothrow) std::vector<char>(entry.hdr.out_sz));
+
+    if (!data || !preadFully(ctx, src.data(), src.size(), entry.data_offset)
+            || !decodeFrame(entry.hdr, src.data(), data->data())) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->cacheLock);
+    auto victim = std::min_element(
+            ctx->cache.begin(), ctx->cache.end(),
+            [](const SparseSeekableCtx::CacheSlot &a,
+               const SparseSeekableCtx::CacheSlot &b) {
+                return a.lastUse < b.lastUse;
+            });
+    victim->frame = frame;
+    victim->data = data;
+    victim->lastUse = ++ctx->cacheClock;
+
+    return data;
+}
+
+// Expansion of non-seekable streams
+
+struct DecompressJob
+{
+    SparseSeekableFrameHeader hdr;
+    std::vector<char> src;
+    std::vector<char> dst;
+    bool ret;
+};
+
+static void * decompressThread(void *data)
+{
+    DecompressJob *job = static_cast<DecompressJob *>(data);
+    job->ret = decodeFrame(job->hdr, job->src.data(), job->dst.data());
+    return nullptr;
+}
+
+struct StreamState
+{
+    SparseReadCb readCb;
+    SparseFlashWriteCb writeCb;
+    SparseFlashZeroCb zeroCb;
+    SparseFlashProgressCb progressCb;
+    void *userData;
+
+    SparseSeekableHeader shdr;
+
+    // Raw frames of the current batch
+    std::vector<DecompressJob> jobs;
+    size_t jobCount = 0;
+    // All frames of the current batch. Raw frames have a data_sz of 0 here
+    // and refer to the next job instead.
+    std::vector<SparseSeekableFrameHeader> frames;
+
+    std::vector<char> fillBuf;
+    uint32_t fillVal = 0;
+    bool fillValid = false;
+};
+
+static bool readFully(StreamState *state, void *buf, uint64_t size)
+{
+    while (size > 0) {
+        uint64_t n;
+        if (!state->readCb(buf, size, &n, state->userData)) {
+            ERROR("Read callback returned failure");
+            return false;
+        } else if (n == 0) {
+            ERROR("Container is truncated");
+            return false;
+        }
+        buf = static_cast<char *>(buf) + n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool writeFill(StreamState *state, const SparseSeekableFrameHeader &hdr)
+{
+    if (hdr.value == 0 && state->zeroCb) {
+        if (!state->zeroCb(hdr.out_sz, hdr.out_offset, state->userData)) {
+            ERROR("Zero callback returned failure at offset %" PRIu64,
+                  hdr.out_offset);
+            return false;
+        }
+        return true;
+    }
+
+    if (!state->fillValid || state->fillVal != hdr.value) {
+        uint32_t *ptr = reinterpret_cast<uint32_t *>(state->fillBuf.data());
+        std::fill(ptr, ptr + SEEKABLE_FILL_BUF_SIZE / sizeof(uint32_t),
+                  hdr.value);
+        state->fillVal = hdr.value;
+        state->fillValid = true;
+    }
+
+    for (uint64_t done = 0; done < hdr.out_sz;) {
+        uint64_t n = std::min<uint64_t>(hdr.out_sz - done,
+                                        SEEKABLE_FILL_BUF_SIZE);
+        if (!state->writeCb(state->fillBuf.data(), n, hdr.out_offset + done,
+                            state->userData)) {
+            ERROR("Write callback returned failure at offset %" PRIu64,
+                  hdr.out_offset + done);
+            return false;
+        }
+        done += n;
+    }
+
+    return true;
+}
+
+static bool flushStreamBatch(StreamState *state)
+{
+    runJobs(state->jobs.data(), state->jobCount, &decompressThread);
+
+    size_t job = 0;
+
+    for (const SparseSeekableFrameHeader &hdr : state->frames) {
+        switch (hdr.frame_type) {
+        case CHUNK_TYPE_RAW:
+            if (!state->jobs[job].ret) {
+                return false;
+            }
+            if (!state->writeCb(state->jobs[job].dst.data(), hdr.out_sz,
+                                hdr.out_offset, state->userData)) {
+                ERROR("Write callback returned failure at offset %" PRIu64,
+                      hdr.out_offset);
+                return false;
+            }
+            ++job;
+            break;
+        case CHUNK_TYPE_FILL:
+            if (!writeFill(state, hdr)) {
+                return false;
+            }
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            break;
+        }
+
+        if (state->progressCb) {
+            state->progressCb(hdr.out_offset + hdr.out_sz,
+                              state->shdr.total_sz, state->userData);
+        }
+    }
+
+    state->jobCount = 0;
+    state->frames.clear();
+    return true;
+}
+
+extern "C" {
+
+/*!
+ * \brief Convert a sparse file into a seekable compressed container
+ *
+ * The raw data of \a input is split into frames of up to \a frameSize bytes.
+ * Adjacent raw chunks share frames. Each frame is compressed independently
+ * with LZ4 and frames that do not compress are stored as is. Fill and don't
+ * care chunks become frames without any data. Up to \a threads frames are
+ * compressed in parallel while the container is written in order.
+ *
+ * \a input must have been opened, but not read or seeked yet. It does not need
+ * to be seekable. If CRC32 verification was enabled for \a input with
+ * \a sparseSetVerifyCrc32(), its checksums are verified during conversion.
+ * Each raw frame of the container has its own CRC32 checksum.
+ *
+ * \param input Sparse context of the source file
+ * \param writeCb Callback for writing the container sequentially
+ * \param frameSize Maximum uncompressed size of a frame. Must be a non-zero
+ *                  multiple of 4 no larger than
+ *                  \a SPARSE_SEEKABLE_MAX_FRAME_SIZE. Pass 0 to use
+ *                  \a SPARSE_SEEKABLE_DEFAULT_FRAME_SIZE.
+ * \param threads Number of compression threads. Pass 0 to use one thread per
+ *                CPU.
+ * \param userData Caller-supplied pointer to pass to \a writeCb
+ * \return Whether the container was successfully written
+ */
+bool sparseSeekableCompress(SparseCtx *input, SparseWriteCb writeCb,
+                            uint32_t frameSize, unsigned int threads,
+                            void *userData)
+{
+    if (frameSize == 0) {
+        frameSize = SPARSE_SEEKABLE_DEFAULT_FRAME_SIZE;
+    }
+
+    if (!input->isOpen || !writeCb || frameSize % sizeof(uint32_t) != 0
+            || frameSize > SPARSE_SEEKABLE_MAX_FRAME_SIZE) {
+        return false;
+    }
+
+    CompressState state;
+    state.ctx = input;
+    state.writeCb = writeCb;
+    state.userData = userData;
+    state.frameSize = frameSize;
+    state.threads = defaultThreads(threads);
+
+    SparseSeekableHeader shdr;
+    memset(&shdr, 0, sizeof(shdr));
+    shdr.magic = SPARSE_SEEKABLE_MAGIC;
+    shdr.major_version = SPARSE_SEEKABLE_MAJOR_VER;
+    shdr.minor_version = 0;
+    shdr.header_sz = sizeof(SparseSeekableHeader);
+    shdr.frame_hdr_sz = sizeof(SparseSeekableFrameHeader);
+    shdr.compression = SPARSE_SEEKABLE_COMPRESSION_LZ4;
+    shdr.blk_sz = input->shdr.blk_sz;
+    shdr.max_frame_sz = frameSize;
+    shdr.total_sz = input->fileSize;
+
+    if (!writeFully(&state, &shdr, sizeof(shdr))
+            || !compressChunks(&state)) {
+        return false;
+    }
+
+    SparseSeekableFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    footer.index_offset = state.srcOffset;
+    footer.index_count = static_cast<uint32_t>(state.index.size());
+    footer.index_crc32 = sparseCrc32(
+            0, state.index.data(),
+            state.index.size() * sizeof(SparseSeekableIndexEntry));
+    footer.magic = SPARSE_SEEKABLE_FOOTER_MAGIC;
+
+    DEBUG("Wrote %zu frames (%" PRIu64 " bytes for %" PRIu64 " byte image)",
+          state.index.size(), state.srcOffset, shdr.total_sz);
+
+    return writeFully(&state, state.index.data(),
+                      state.index.size() * sizeof(SparseSeekableIndexEntry))
+            && writeFully(&state, &footer, sizeof(footer));
+}
+
+SparseSeekableCtx * sparseSeekableCtxNew()
+{
+    SparseSeekableCtx *ctx = new(std::nothrow) SparseSeekableCtx();
+    if (!ctx) {
+        return nullptr;
+    }
+    ctx->cbPread = nullptr;
+    ctx->cbUserData = nullptr;
+    ctx->isOpen = false;
+    return ctx;
+}
+
+bool sparseSeekableCtxFree(SparseSeekableCtx *ctx)
+{
+    bool ret = true;
+    if (ctx->isOpen) {
+        ret = sparseSeekableClose(ctx);
+    }
+    delete ctx;
+    return ret;
+}
+
+/*!
+ * \brief Open a seekable container for random access
+ *
+ * The header, footer, and index are read and validated. Afterwards,
+ * \a sparseSeekableReadAt() can be called from multiple threads.
+ *
+ * \param ctx Seekable context
+ * \param preadCb Positional read callback for the container. It must be safe
+ *                to call concurrently.
+ * \param fileSize Size of the container
+ * \param userData Caller-supplied pointer to pass to \a preadCb
+ * \return Whether the container was opened
+ */
+bool sparseSeekableOpen(SparseSeekableCtx *ctx, SparsePreadCb preadCb,
+                        uint64_t fileSize, void *userData)
+{
+    if (ctx->isOpen || !preadCb) {
+        return false;
+    }
+
+    ctx->cbPread = preadCb;
+    ctx->cbUserData = userData;
+
+    SparseSeekableFooter footer;
+    uint64_t minSize = sizeof(SparseSeekableHeader) + sizeof(footer);
+
+    if (fileSize < minSize) {
+        ERROR("Container is too small");
+        return false;
+    }
+
+    if (!preadFully(ctx, &ctx->shdr, sizeof(ctx->shdr), 0)
+            || !validateHeader(ctx->shdr)
+            || !preadFully(ctx, &footer, sizeof(footer),
+                           fileSize - sizeof(footer))) {
+        return false;
+    }
+
+    uint64_t indexSize = static_cast<uint64_t>(footer.index_count)
+            * sizeof(SparseSeekableIndexEntry);
+
+    if (footer.magic != SPARSE_SEEKABLE_FOOTER_MAGIC
+            || footer.index_offset < sizeof(SparseSeekableHeader)
+            || footer.index_offset > fileSize - sizeof(footer)
+            || indexSize != fileSize - sizeof(footer) - footer.index_offset) {
+        ERROR("Invalid seekable container footer");
+        return false;
+    }
+
+    std::vector<SparseSeekableIndexEntry> index(footer.index_count);
+
+    if (!preadFully(ctx, index.data(), indexSize, footer.index_offset)) {
+        return false;
+    }
+
+    if (sparseCrc32(0, index.data(), indexSize) != footer.index_crc32) {
+        ERROR("Seekable container index is corrupted");
+        return false;
+    }
+
+    uint64_t expectedOffset = 0;
+
+    for (const SparseSeekableIndexEntry &entry : index) {
+        if (!validateFrame(ctx->shdr, entry.hdr, expectedOffset)
+                || entry.data_offset > footer.index_offset
+                || entry.hdr.data_sz > footer.index_offset
+                        - entry.data_offset) {
+            return false;
+        }
+        expectedOffset += entry.hdr.out_sz;
+    }
+
+    if (expectedOffset != ctx->shdr.total_sz) {
+        ERROR("Frames do not cover the entire image");
+        return false;
+    }
+
+    ctx->index = std::move(index);
+    ctx->cache.assign(SEEKABLE_CACHE_SLOTS, SparseSeekableCtx::CacheSlot());
+    ctx->cacheClock = 0;
+    ctx->isOpen = true;
+
+    DEBUG("Opened seekable container with %zu frames", ctx->index.size());
+
+    return true;
+}
+
+bool sparseSeekableClose(SparseSeekableCtx *ctx)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    ctx->isOpen = false;
+    ctx->index.clear();
+    ctx->cache.clear();
+    ctx->cbPread = nullptr;
+    ctx->cbUserData = nullptr;
+    return true;
+}
+
+bool sparseSeekableSize(SparseSeekableCtx *ctx, uint64_t *size)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    *size = ctx->shdr.total_sz;
+    return true;
+}
+
+/*!
+ * \brief Read from any offset of the output image
+ *
+ * Only the frames that overlap the requested range are read and decompressed.
+ * Recently used frames are cached, so sequential small reads only decompress
+ * each frame once. This function is thread-safe.
+ *
+ * \param ctx Seekable context
+ * \param buf Output buffer
+ * \param size Number of bytes to read
+ * \param offset Offset in the output image
+ * \param bytesRead Number of bytes read. This is less than \a size only at the
+ *                  end of the image.
+ * \return Whether the data was successfully read
+ */
+bool sparseSeekableReadAt(SparseSeekableCtx *ctx, void *buf, uint64_t size,
+                          uint64_t offset, uint64_t *bytesRead)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    char *ptr = static_cast<char *>(buf);
+    uint64_t total = 0;
+
+    if (offset < ctx->shdr.total_sz) {
+        size = std::min(size, ctx->shdr.total_sz - offset);
+    } else {
+        size = 0;
+    }
+
+    // The frames are contiguous and sorted, so the first frame to read from
+    // is the first one that ends after the offset
+    auto it = std::upper_bound(
+            ctx->index.begin(), ctx->index.end(), offset,
+            [](uint64_t o, const SparseSeekableIndexEntry &e) {
+                return o < e.hdr.out_offset + e.hdr.out_sz;
+            });
+
+    for (; total < size; ++it) {
+        const SparseSeekableFrameHeader &hdr = it->hdr;
+        uint64_t pos = offset + total - hdr.out_offset;
+        uint64_t n = std::min(size - total, hdr.out_sz - pos);
+
+        switch (hdr.frame_type) {
+        case CHUNK_TYPE_RAW: {
+            auto data = getFrame(ctx, it - ctx->index.begin());
+            if (!data) {
+                return false;
+            }
+            memcpy(ptr + total, data->data() + pos, n);
+            break;
+        }
+        case CHUNK_TYPE_FILL: {
+            // Frames start at a multiple of the block size, so the pattern is
+            // aligned to multiples of 4 in the output image
+            const unsigned char *pattern =
+                    reinterpret_cast<const unsigned char *>(&hdr.value);
+            uint64_t start = offset + total;
+            for (uint64_t i = 0; i < n; ++i) {
+                ptr[total + i] = pattern[(start + i) % sizeof(hdr.value)];
+            }
+            break;
+        }
+        default:
+            memset(ptr + total, 0, n);
+            break;
+        }
+
+        total += n;
+    }
+
+    *bytesRead = total;
+    return true;
+}
+
+/*!
+ * \brief Expand a seekable container from a non-seekable stream
+ *
+ * The frames are read sequentially without using the index. Batches of up to
+ * \a threads raw frames are decompressed in parallel and then passed to
+ * \a writeCb in increasing offset order. Don't care frames are never passed to
+ * \a writeCb. Like \a sparseFlashCb(), the buffer is only valid for the duration
+ * of the call. If \a zeroCb is not nullptr, zero-filled fill frames are passed
+ * to it as ranges instead of being expanded.
+ *
+ * Every raw frame is verified against its CRC32 checksum.
+ *
+ * \param readCb Callback for reading the container sequentially
+ * \param writeCb Callback for writing data at the specified output offset
+ * \param zeroCb Optional callback for zeroing a range of the output
+ * \param progressCb Optional callback for reporting the number of bytes of the
+ *                   output image that have been processed
+ * \param threads Number of decompression threads. Pass 0 to use one thread per
+ *                CPU.
+ * \param userData Caller-supplied pointer to pass to the callbacks
+ * \return Whether the container was successfully processed. If \a writeCb
+ *         returns false, processing stops and this function returns false.
+ */
+bool sparseSeekableFlashStream(SparseReadCb readCb, SparseFlashWriteCb writeCb,
+                               SparseFlashZeroCb zeroCb,
+                               SparseFlashProgressCb progressCb,
+                               unsigned int threads, void *userData)
+{
+    if (!readCb || !writeCb) {
+        return false;
+    }
+
+    StreamState state;
+    state.readCb = readCb;
+    state.writeCb = writeCb;
+    state.zeroCb = zeroCb;
+    state.progressCb = progressCb;
+    state.userData = userData;
+    state.jobs.resize(defaultThreads(threads));
+    state.fillBuf.resize(SEEKABLE_FILL_BUF_SIZE);
+
+    if (!readFully(&state, &state.shdr, sizeof(state.shdr))
+            || !validateHeader(state.shdr)) {
+        return false;
+    }
+
+    uint64_t offset = 0;
+
+    while (offset < state.shdr.total_sz) {
+        SparseSeekableFrameHeader hdr;
+
+        if (!readFully(&state, &hdr, sizeof(hdr))
+                || !validateFrame(state.shdr, hdr, offset)) {
+            return false;
+        }
+
+        if (hdr.frame_type == CHUNK_TYPE_RAW) {
+            if (state.jobCount == state.jobs.size()
+                    && !flushStreamBatch(&state)) {
+                return false;
+            }
+
+            DecompressJob &job = state.jobs[state.jobCount++];
+            job.hdr = hdr;
+            job.src.resize(hdr.data_sz);
+            job.dst.resize(hdr.out_sz);
+
+            if (!readFully(&state, job.src.data(), hdr.data_sz)) {
+                return false;
+            }
+        }
+
+        state.frames.push_back(hdr);
+        offset += hdr.out_sz;
+    }
+
+    // The index and footer are not needed
+    return flushStreamBatch(&state);
+}
+
+}
+
+#endif
@@ -0,0 +1,732 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __ANDROID__
+// Android does not support C++11 properly...
+#define __STDC_LIMIT_MACROS
+#endif
+
+#include "mbsparse/sparse_writer.h"
+
+// For std::min()
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "crc32_p.h"
+#include "sparse_p.h"
+
+#define SPARSE_WRITER_DEFAULT_BLOCK_SIZE    4096
+
+// Same limit as AOSP's libsparse. This keeps the chunk's total_sz field from
+// overflowing and limits how much data needs to be rewritten if a raw chunk is
+// corrupted.
+#define SPARSE_WRITER_MAX_RAW_CHUNK_SIZE    (64 * 1024 * 1024)
+
+struct SparseWriterCtx
+{
+    // Callbacks
+    SparseOpenCb cbOpen;
+    SparseCloseCb cbClose;
+    SparseWriteCb cbWrite;
+    SparseSeekCb cbSeek;
+    void *cbUserData;
+
+    bool isOpen;
+
+    // Options
+    uint32_t blockSize = SPARSE_WRITER_DEFAULT_BLOCK_SIZE;
+    bool crc32Enabled = false;
+    std::vector<unsigned char> bitmap;
+    uint64_t bitmapBlocks = 0;
+
+    // Incomplete block from the previous sparseWriterWrite() call
+    std::vector<unsigned char> partial;
+    size_t partialSize = 0;
+
+    uint64_t outOffset = 0;
+    uint64_t blocks = 0;
+    uint32_t chunks = 0;
+    uint32_t crc32 = 0;
+
+    // Chunk that is currently being built (0 if there is none)
+    uint16_t chunkType = 0;
+    uint32_t chunkBlocks = 0;
+    uint32_t chunkFillVal = 0;
+    // [CHUNK_TYPE_RAW only] Offset of the chunk header in the output file
+    uint64_t chunkHeaderOffset = 0;
+
+    void setCallbacks(SparseOpenCb openCb, SparseCloseCb closeCb,
+                      SparseWriteCb writeCb, SparseSeekCb seekCb,
+                      void *userData);
+    void clearCallbacks();
+    void resetState();
+};
+
+void SparseWriterCtx::setCallbacks(SparseOpenCb openCb, SparseCloseCb closeCb,
+                                   SparseWriteCb writeCb, SparseSeekCb seekCb,
+                                   void *userData)
+{
+    cbOpen = openCb;
+    cbClose = closeCb;
+    cbWrite = writeCb;
+    cbSeek = seekCb;
+    cbUserData = userData;
+}
+
+void SparseWriterCtx::clearCallbacks()
+{
+    cbOpen = nullptr;
+    cbClose = nullptr;
+    cbWrite = nullptr;
+    cbSeek = nullptr;
+    cbUserData = nullptr;
+}
+
+void SparseWriterCtx::resetState()
+{
+    partialSize = 0;
+    outOffset = 0;
+    blocks = 0;
+    chunks = 0;
+    crc32 = 0;
+    chunkType = 0;
+    chunkBlocks = 0;
+    chunkFillVal = 0;
+    chunkHeaderOffset = 0;
+}
+
+/*!
+ * \brief Check if a block consists of a single repeated 32-bit word
+ *
+ * An all-zero block is the common case and is just a uniform block with a
+ * filler value of 0. The comparison is vectorized when SSE2 or NEON is
+ * available and bails out at the first 64-byte group that differs, so blocks
+ * with real data are usually rejected after looking at a few bytes.
+ *
+ * \param buf Block data
+ * \param size Block size (multiple of 4)
+ * \param[out] fillVal Filler value if the block is uniform
+ * \return Whether the block is uniform
+ */
+static bool isUniformBlock(const unsigned char *buf, size_t size,
+                           uint32_t *fillVal)
+{
+    uint32_t word;
+    memcpy(&word, buf, sizeof(word));
+
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i pattern = _mm_set1_epi32(static_cast<int>(word));
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 64 <= size; i += 64) {
+        const __m128i *p = reinterpret_cast<const __m128i *>(buf + i);
+        __m128i diff = _mm_or_si128(
+                _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p), pattern),
+                             _mm_xor_si128(_mm_loadu_si128(p + 1), pattern)),
+                _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 2), pattern),
+                             _mm_xor_si128(_mm_loadu_si128(p + 3), pattern)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xffff) {
+            return false;
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint32x4_t pattern = vdupq_n_u32(word);
+
+    for (; i + 64 <= size; i += 64) {
+        const uint32_t *p = reinterpret_cast<const uint32_t *>(buf + i);
+        uint32x4_t diff = vorrq_u32(
+                vorrq_u32(veorq_u32(vld1q_u32(p), pattern),
+                          veorq_u32(vld1q_u32(p + 4), pattern)),
+                vorrq_u32(veorq_u32(vld1q_u32(p + 8), pattern),
+                          veorq_u32(vld1q_u32(p + 12), pattern)));
+        uint64x2_t diff64 = vreinterpretq_u64_u32(diff);
+        if ((vgetq_lane_u64(diff64, 0) | vgetq_lane_u64(diff64, 1)) != 0) {
+            return false;
+        }
+    }
+#else
+    const uint64_t pattern = (static_cast<uint64_t>(word) << 32) | word;
+
+    for (; i + 32 <= size; i += 32) {
+        uint64_t v[4];
+        memcpy(v, buf + i, sizeof(v));
+        if (((v[0] ^ pattern) | (v[1] ^ pattern)
+                | (v[2] ^ pattern) | (v[3] ^ pattern)) != 0) {
+            return false;
+        }
+    }
+#endif
+
+    // Remainder when the block size is not a multiple of the group size
+    for (; i < size; i += sizeof(word)) {
+        uint32_t v;
+        memcpy(&v, buf + i, sizeof(v));
+        if (v != word) {
+            return false;
+        }
+    }
+
+    *fillVal = word;
+    return true;
+}
+
+static bool isBlockUsed(SparseWriterCtx *ctx, uint64_t block)
+{
+    if (block >= ctx->bitmapBlocks) {
+        return true;
+    }
+    return ctx->bitmap[block / 8] & (1u << (block % 8));
+}
+
+static bool writeFully(SparseWriterCtx *ctx, const void *buf, uint64_t size)
+{
+    while (size > 0) {
+        uint64_t bytesWritten;
+        if (!ctx->cbWrite(buf, size, &bytesWritten, ctx->cbUserData)) {
+            ERROR("Sparse write callback returned failure");
+            return false;
+        }
+        if (bytesWritten == 0) {
+            ERROR("Sparse write callback wrote no data");
+            return false;
+        }
+        size -= bytesWritten;
+        ctx->outOffset += bytesWritten;
+        buf = static_cast<const char *>(buf) + bytesWritten;
+    }
+    return true;
+}
+
+static bool seekTo(SparseWriterCtx *ctx, uint64_t offset)
+{
+    if (!ctx->cbSeek(static_cast<int64_t>(offset), SEEK_SET,
+                     ctx->cbUserData)) {
+        ERROR("Sparse seek callback returned failure");
+        return false;
+    }
+    ctx->outOffset = offset;
+    return true;
+}
+
+static bool writeChunkHeader(SparseWriterCtx *ctx, uint16_t type,
+                             uint32_t chunkBlocks, uint32_t dataSize)
+{
+    ChunkHeader chdr;
+    memset(&chdr, 0, sizeof(chdr));
+    chdr.chunk_type = type;
+    chdr.chunk_sz = chunkBlocks;
+    chdr.total_sz = sizeof(ChunkHeader) + dataSize;
+    return writeFully(ctx, &chdr, sizeof(chdr));
+}
+
+/*!
+ * \brief Write out the chunk that is currently being built
+ *
+ * The data for raw chunks has already been written, so only the placeholder
+ * chunk header needs to be replaced.
+ */
+static bool finishChunk(SparseWriterCtx *ctx)
+{
+    bool ret;
+
+    switch (ctx->chunkType) {
+    case 0:
+        return true;
+    case CHUNK_TYPE_RAW: {
+        uint64_t endOffset = ctx->outOffset;
+        ret = seekTo(ctx, ctx->chunkHeaderOffset)
+                && writeChunkHeader(ctx, CHUNK_TYPE_RAW, ctx->chunkBlocks,
+                                    ctx->chunkBlocks * ctx->blockSize)
+                && seekTo(ctx, endOffset);
+        break;
+    }
+    case CHUNK_TYPE_FILL:
+        ret = writeChunkHeader(ctx, CHUNK_TYPE_FILL, ctx->chunkBlocks,
+                               sizeof(ctx->chunkFillVal))
+                && writeFully(ctx, &ctx->chunkFillVal,
+                              sizeof(ctx->chunkFillVal));
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        ret = writeChunkHeader(ctx, CHUNK_TYPE_DONT_CARE, ctx->chunkBlocks, 0);
+        break;
+    default:
+        assert(false);
+        return false;
+    }
+
+    if (!ret) {
+        return false;
+    }
+
+    if (ctx->chunks == UINT32_MAX) {
+        ERROR("Too many chunks");
+        return false;
+    }
+
+    ++ctx->chunks;
+    ctx->chunkType = 0;
+    ctx->chunkBlocks = 0;
+    return true;
+}
+
+/*!
+ * \brief Start a new chunk if the current one cannot be extended
+ */
+static bool beginChunk(SparseWriterCtx *ctx, uint16_t type, uint32_t fillVal,
+                       uint32_t maxBlocks)
+{
+    if (ctx->chunkType == type && ctx->chunkBlocks < maxBlocks
+            && (type != CHUNK_TYPE_FILL || ctx->chunkFillVal == fillVal)) {
+        return true;
+    }
+
+    if (!finishChunk(ctx)) {
+        return false;
+    }
+
+    ctx->chunkType = type;
+    ctx->chunkBlocks = 0;
+    ctx->chunkFillVal = fillVal;
+
+    if (type == CHUNK_TYPE_RAW) {
+        // Reserve space for the header. It is rewritten once the number of
+        // blocks is known.
+        ctx->chunkHeaderOffset = ctx->outOffset;
+        return writeChunkHeader(ctx, CHUNK_TYPE_RAW, 0, 0);
+    }
+
+    return true;
+}
+
+static bool addRawBlocks(SparseWriterCtx *ctx, const unsigned char *data,
+                         uint64_t count)
+{
+    uint32_t maxBlocks = SPARSE_WRITER_MAX_RAW_CHUNK_SIZE / ctx->blockSize;
+
+    while (count > 0) {
+        if (!beginChunk(ctx, CHUNK_TYPE_RAW, 0, maxBlocks)) {
+            return false;
+        }
+
+        uint32_t n = std::min<uint64_t>(count, maxBlocks - ctx->chunkBlocks);
+        uint64_t size = static_cast<uint64_t>(n) * ctx->blockSize;
+
+        // Consecutive raw blocks are passed to the write callback at once
+        if (!writeFully(ctx, data, size)) {
+            return false;
+        }
+
+        if (ctx->crc32Enabled) {
+            ctx->crc32 = sparseCrc32(ctx->crc32, data, size);
+        }
+
+        ctx->chunkBlocks += n;
+        data += size;
+        count -= n;
+    }
+
+    return true;
+}
+
+static bool addFillBlock(SparseWriterCtx *ctx, const unsigned char *data,
+                         uint32_t fillVal)
+{
+    if (!beginChunk(ctx, CHUNK_TYPE_FILL, fillVal, UINT32_MAX)) {
+        return false;
+    }
+
+    if (ctx->crc32Enabled) {
+        ctx->crc32 = sparseCrc32(ctx->crc32, data, ctx->blockSize);
+    }
+
+    ++ctx->chunkBlocks;
+    return true;
+}
+
+static bool addDontCareBlock(SparseWriterCtx *ctx)
+{
+    if (!beginChunk(ctx, CHUNK_TYPE_DONT_CARE, 0, UINT32_MAX)) {
+        return false;
+    }
+
+    // Don't care blocks count as zeros in the image checksum
+    if (ctx->crc32Enabled) {
+        ctx->crc32 = sparseCrc32Zeros(ctx->crc32, ctx->blockSize);
+    }
+
+    ++ctx->chunkBlocks;
+    return true;
+}
+
+/*!
+ * \brief Classify and write complete blocks
+ *
+ * \param ctx Sparse writer context
+ * \param data Block data
+ * \param count Number of blocks in \a data
+ * \return Whether the blocks were successfully written
+ */
+static bool processBlocks(SparseWriterCtx *ctx, const unsigned char *data,
+                          uint64_t count)
+{
+    if (count > UINT32_MAX - ctx->blocks) {
+        ERROR("Output file has too many blocks");
+        return false;
+    }
+
+    uint64_t rawBegin = 0;
+    uint64_t rawCount = 0;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        const unsigned char *block = data + i * ctx->blockSize;
+        uint32_t fillVal;
+        bool ret;
+
+        if (!isBlockUsed(ctx, ctx->blocks + i)) {
+            ret = addRawBlocks(ctx, data + rawBegin * ctx->blockSize, rawCount)
+                    && addDontCareBlock(ctx);
+        } else if (isUniformBlock(block, ctx->blockSize, &fillVal)) {
+            ret = addRawBlocks(ctx, data + rawBegin * ctx->blockSize, rawCount)
+                    && addFillBlock(ctx, block, fillVal);
+        } else {
+            // Accumulate runs of raw blocks so they can be written at once
+            if (rawCount == 0) {
+                rawBegin = i;
+            }
+            ++rawCount;
+            continue;
+        }
+
+        if (!ret) {
+            return false;
+        }
+        rawCount = 0;
+    }
+
+    if (!addRawBlocks(ctx, data + rawBegin * ctx->blockSize, rawCount)) {
+        return false;
+    }
+
+    ctx->blocks += count;
+    return true;
+}
+
+/*!
+ * \brief Write the trailing CRC32 chunk and the final sparse header
+ */
+static bool finishFile(SparseWriterCtx *ctx)
+{
+    if (ctx->partialSize > 0) {
+        // Pad the last block with zeros
+        memset(ctx->partial.data() + ctx->partialSize, 0,
+               ctx->blockSize - ctx->partialSize);
+        ctx->partialSize = 0;
+
+        if (!processBlocks(ctx, ctx->partial.data(), 1)) {
+            return false;
+        }
+    }
+
+    if (!finishChunk(ctx)) {
+        return false;
+    }
+
+    if (ctx->crc32Enabled) {
+        if (!writeChunkHeader(ctx, CHUNK_TYPE_CRC32, 0, sizeof(ctx->crc32))
+                || !writeFully(ctx, &ctx->crc32, sizeof(ctx->crc32))) {
+            return false;
+        }
+        ++ctx->chunks;
+    }
+
+    uint64_t endOffset = ctx->outOffset;
+
+    SparseHeader shdr;
+    memset(&shdr, 0, sizeof(shdr));
+    shdr.magic = SPARSE_HEADER_MAGIC;
+    shdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    shdr.minor_version = 0;
+    shdr.file_hdr_sz = sizeof(SparseHeader);
+    shdr.chunk_hdr_sz = sizeof(ChunkHeader);
+    shdr.blk_sz = ctx->blockSize;
+    shdr.total_blks = static_cast<uint32_t>(ctx->blocks);
+    shdr.total_chunks = ctx->chunks;
+    shdr.image_checksum = ctx->crc32Enabled ? ctx->crc32 : 0;
+
+    return seekTo(ctx, 0)
+            && writeFully(ctx, &shdr, sizeof(shdr))
+            && seekTo(ctx, endOffset);
+}
+
+extern "C" {
+
+SparseWriterCtx * sparseWriterCtxNew()
+{
+    SparseWriterCtx *ctx = new(std::nothrow) SparseWriterCtx();
+    if (!ctx) {
+        return nullptr;
+    }
+    ctx->isOpen = false;
+    ctx->clearCallbacks();
+    return ctx;
+}
+
+bool sparseWriterCtxFree(SparseWriterCtx *ctx)
+{
+    bool ret = true;
+    if (ctx->isOpen) {
+        ret = sparseWriterClose(ctx);
+    }
+    delete ctx;
+    return ret;
+}
+
+/*!
+ * \brief Set the block size of sparse files created by the writer
+ *
+ * The block size is the granularity at which the input data is classified into
+ * raw, fill, and don't care chunks. The default is 4096 bytes.
+ *
+ * \param ctx Sparse writer context
+ * \param blockSize Block size. Must be a non-zero multiple of 4 and no larger
+ *                  than 64 MiB.
+ * \return True, unless the writer is open or the block size is invalid
+ */
+bool sparseWriterSetBlockSize(SparseWriterCtx *ctx, uint32_t blockSize)
+{
+    if (ctx->isOpen || blockSize == 0 || blockSize % sizeof(uint32_t) != 0
+            || blockSize > SPARSE_WRITER_MAX_RAW_CHUNK_SIZE) {
+        return false;
+    }
+
+    ctx->blockSize = blockSize;
+    return true;
+}
+
+/*!
+ * \brief Set bitmap of blocks that contain meaningful data
+ *
+ * Blocks whose bit is not set are written as don't care chunks, regardless of
+ * their contents. This is intended for filesystem images where the block
+ * allocation bitmap is known. Bit \a n is bit `n % 8` (least significant bit
+ * first) of byte `n / 8`. Blocks beyond \a blockCount are always considered to
+ * be in use.
+ *
+ * \param ctx Sparse writer context
+ * \param bitmap Block bitmap (copied) or nullptr to clear the bitmap
+ * \param blockCount Number of blocks described by \a bitmap
+ * \return True, unless the writer is open
+ */
+bool sparseWriterSetBlockBitmap(SparseWriterCtx *ctx, const void *bitmap,
+                                uint64_t blockCount)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    if (!bitmap) {
+        blockCount = 0;
+    }
+
+    auto const *ptr = static_cast<const unsigned char *>(bitmap);
+    ctx->bitmap.assign(ptr, ptr + (blockCount + 7) / 8);
+    ctx->bitmapBlocks = blockCount;
+    return true;
+}
+
+/*!
+ * \brief Set whether to store a CRC32 checksum of the image
+ *
+ * If enabled, the checksum is stored in the sparse header's \a image_checksum
+ * field and in a CRC32 chunk at the end of the file. This is disabled by
+ * default since checksumming the entire image is not free.
+ *
+ * \param ctx Sparse writer context
+ * \param enabled Whether to store a checksum
+ * \return True, unless the writer is open
+ */
+bool sparseWriterSetCrc32(SparseWriterCtx *ctx, bool enabled)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    ctx->crc32Enabled = enabled;
+    return true;
+}
+
+/*!
+ * \brief Open sparse file for writing
+ *
+ * The output, which may not necessarily be a file, is written by calling
+ * functions provided by the caller. The write and seek callbacks are required
+ * because the sparse header and the raw chunk headers are only written once
+ * their contents are known. The open and close callbacks are optional and
+ * behave the same way as they do for \a sparseOpen().
+ *
+ * The options set with \a sparseWriterSetBlockSize(),
+ * \a sparseWriterSetBlockBitmap(), and \a sparseWriterSetCrc32() apply to all
+ * files subsequently opened with \a ctx.
+ *
+ * \param ctx Sparse writer context
+ * \param openCb Open callback
+ * \param closeCb Close callback
+ * \param writeCb Write callback
+ * \param seekCb Seek callback
+ * \param userData Caller-supplied pointer to pass to callback functions
+ * \return Whether the sparse file was opened
+ */
+bool sparseWriterOpen(SparseWriterCtx *ctx, SparseOpenCb openCb,
+                      SparseCloseCb closeCb, SparseWriteCb writeCb,
+                      SparseSeekCb seekCb, void *userData)
+{
+    if (ctx->isOpen || !writeCb || !seekCb) {
+        return false;
+    }
+
+    ctx->setCallbacks(openCb, closeCb, writeCb, seekCb, userData);
+
+    if (ctx->cbOpen && !ctx->cbOpen(ctx->cbUserData)) {
+        ctx->clearCallbacks();
+        return false;
+    }
+
+    ctx->resetState();
+    ctx->partial.resize(ctx->blockSize);
+
+    // Reserve space for the sparse header
+    SparseHeader shdr;
+    memset(&shdr, 0, sizeof(shdr));
+
+    if (!seekTo(ctx, 0) || !writeFully(ctx, &shdr, sizeof(shdr))) {
+        if (ctx->cbClose) {
+            ctx->cbClose(ctx->cbUserData);
+        }
+        ctx->clearCallbacks();
+        return false;
+    }
+
+    ctx->isOpen = true;
+
+    return true;
+}
+
+/*!
+ * \brief Finish writing and close sparse file
+ *
+ * The final partial block, if any, is padded with zeros. The remaining chunks
+ * and the sparse header are then written.
+ *
+ * \note If the sparse file is open, then no matter what value is returned, the
+ *       sparse file will be closed.
+ *
+ * \return Whether the sparse file was successfully written and closed
+ */
+bool sparseWriterClose(SparseWriterCtx *ctx)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    ctx->isOpen = false;
+
+    bool ret = finishFile(ctx);
+
+    if (ctx->cbClose && !ctx->cbClose(ctx->cbUserData)) {
+        ret = false;
+    }
+
+    ctx->resetState();
+    ctx->clearCallbacks();
+    return ret;
+}
+
+/*!
+ * \brief Write raw data to the sparse file
+ *
+ * The data is split into blocks. Blocks that are not in use according to the
+ * block bitmap are stored as don't care chunks, blocks that consist of a single
+ * repeated 32-bit value are stored as fill chunks, and all other blocks are
+ * stored as raw chunks. Adjacent blocks of the same kind are merged into a
+ * single chunk.
+ *
+ * If an error occurs, the function will return false and the sparse file should
+ * be closed and discarded.
+ *
+ * \param ctx Sparse writer context
+ * \param buf Data to write
+ * \param size Size of data
+ * \return Whether the data was successfully written
+ */
+bool sparseWriterWrite(SparseWriterCtx *ctx, const void *buf, uint64_t size)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    auto const *ptr = static_cast<const unsigned char *>(buf);
+
+    // Complete the partial block from the last call
+    if (ctx->partialSize > 0) {
+        size_t n = std::min<uint64_t>(size, ctx->blockSize - ctx->partialSize);
+        memcpy(ctx->partial.data() + ctx->partialSize, ptr, n);
+        ctx->partialSize += n;
+        ptr += n;
+        size -= n;
+
+        if (ctx->partialSize < ctx->blockSize) {
+            return true;
+        }
+
+        ctx->partialSize = 0;
+        if (!processBlocks(ctx, ctx->partial.data(), 1)) {
+            return false;
+        }
+    }
+
+    // Process complete blocks directly from the caller's buffer
+    uint64_t count = size / ctx->blockSize;
+    if (count > 0) {
+        if (!processBlocks(ctx, ptr, count)) {
+            return false;
+        }
+        ptr += count * ctx->blockSize;
+        size -= count * ctx->blockSize;
+    }
+
+    memcpy(ctx->partial.data(), ptr, size);
+    ctx->partialSize = size;
+
+    return true;
+}
+
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <cstring>
+
+#include "crc32_p.h"
+
+// Bit-at-a-time CRC32 that shares no code with the library
+static uint32_t referenceCrc32(uint32_t crc, const void *buf, size_t size)
+{
+    auto const *ptr = static_cast<const unsigned char *>(buf);
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= ptr[i];
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static std::vector<unsigned char> testData(size_t size)
+{
+    std::vector<unsigned char> data(size);
+    uint32_t state = 0x12345678;
+    for (auto &c : data) {
+        state = state * 1103515245 + 12345;
+        c = static_cast<unsigned char>(state >> 16);
+    }
+    return data;
+}
+
+TEST(Crc32Test, KnownVectors)
+{
+    const char *check = "123456789";
+
+    ASSERT_EQ(sparseCrc32(0, "", 0), 0u);
+    ASSERT_EQ(sparseCrc32(0, "a", 1), 0xe8b7be43u);
+    ASSERT_EQ(sparseCrc32(0, check, strlen(check)), 0xcbf43926u);
+    ASSERT_EQ(sparseCrc32Portable(0, check, strlen(check)), 0xcbf43926u);
+
+    std::vector<unsigned char> zeros(4096, 0);
+    ASSERT_EQ(sparseCrc32(0, zeros.data(), zeros.size()),
+              referenceCrc32(0, zeros.data(), zeros.size()));
+}
+
+TEST(Crc32Test, MatchesReferenceForAllLengthsAndAlignments)
+{
+    // Covers the byte-at-a-time tails and the 16 and 64 byte folding
+    // boundaries of the accelerated kernels
+    auto data = testData(1024 + 16);
+
+    for (size_t offset = 0; offset < 16; ++offset) {
+        for (size_t size = 0; size <= 300; ++size) {
+            const unsigned char *ptr = data.data() + offset;
+            uint32_t expected = referenceCrc32(0, ptr, size);
+
+            ASSERT_EQ(sparseCrc32(0, ptr, size), expected)
+                    << "offset " << offset << ", size " << size;
+            ASSERT_EQ(sparseCrc32Portable(0, ptr, size), expected)
+                    << "offset " << offset << ", size " << size;
+        }
+    }
+
+    for (size_t size : { 511, 512, 513, 1000, 1023, 1024 }) {
+        ASSERT_EQ(sparseCrc32(0, data.data() + 3, size),
+                  referenceCrc32(0, data.data() + 3, size))
+                << "size " << size;
+    }
+}
+
+TEST(Crc32Test, UpdatesIncrementally)
+{
+    auto data = testData(512);
+    uint32_t expected = referenceCrc32(0, data.data(), data.size());
+
+    for (size_t split = 0; split <= data.size(); split += 7) {
+        uint32_t crc = sparseCrc32(0, data.data(), split);
+        crc = sparseCrc32(crc, data.data() + split, data.size() - split);
+        ASSERT_EQ(crc, expected) << "split " << split;
+    }
+}
+
+TEST(Crc32Test, CombineMatchesConcatenation)
+{
+    auto data = testData(700);
+
+    for (size_t split : { 0, 1, 4, 15, 16, 17, 64, 65, 300, 700 }) {
+        uint32_t crc1 = referenceCrc32(0, data.data(), split);
+        uint32_t crc2 = referenceCrc32(0, data.data() + split,
+                                       data.size() - split);
+
+        ASSERT_EQ(sparseCrc32Combine(crc1, crc2, data.size() - split),
+                  referenceCrc32(0, data.data(), data.size()))
+                << "split " << split;
+    }
+}
+
+TEST(Crc32Test, RepeatMatchesExpandedData)
+{
+    const uint32_t words[] = { 0, 0x5a5a5a5a, 0x12345678 };
+    auto prefix = testData(5);
+    uint32_t prefixCrc = referenceCrc32(0, prefix.data(), prefix.size());
+
+    for (uint32_t word : words) {
+        for (uint64_t size : { 0, 1, 2, 3, 4, 5, 7, 8, 63, 64, 65, 4096,
+                               4099, 1024 * 1024 + 2 }) {
+            std::vector<unsigned char> expanded(prefix);
+            for (uint64_t i = 0; i < size; ++i) {
+                expanded.push_back(reinterpret_cast<const unsigned char *>(
+                        &word)[i % sizeof(word)]);
+            }
+            uint32_t expected = referenceCrc32(0, expanded.data(),
+                                               expanded.size());
+
+            ASSERT_EQ(sparseCrc32Repeat(prefixCrc, word, size), expected)
+                    << "word " << word << ", size " << size;
+
+            if (word == 0) {
+                ASSERT_EQ(sparseCrc32Zeros(prefixCrc, size), expected)
+                        << "size " << size;
+            }
+        }
+    }
+}
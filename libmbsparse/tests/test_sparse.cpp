@@ -19,6 +19,10 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <memory>
+#include <thread>
+
 #include "mbsparse/sparse.h"
 
 struct SparseTest : testing::Test
@@ -83,6 +87,21 @@ struct SparseTest : testing::Test
         return true;
     }
 
+    static bool cbPread(void *buf, uint64_t size, uint64_t offset,
+                        uint64_t *bytesRead, void *userData)
+    {
+        SparseTest *test = static_cast<SparseTest *>(userData);
+        if (offset > test->_data.size()) {
+            *bytesRead = 0;
+        } else {
+            uint64_t canRead = std::min<uint64_t>(
+                    size, test->_data.size() - offset);
+            memcpy(buf, test->_data.data() + offset, canRead);
+            *bytesRead = canRead;
+        }
+        return true;
+    }
+
     bool sparseOpen()
     {
         return ::sparseOpen(_ctx, nullptr, nullptr, &cbRead, &cbSeek, nullptr,
@@ -115,6 +134,16 @@ struct SparseTest : testing::Test
         return ::sparseTell(_ctx, offset);
     }
 
+    bool sparseGetIndex(void **data, size_t *size)
+    {
+        return ::sparseGetIndex(_ctx, data, size);
+    }
+
+    bool sparseSetIndex(const void *data, size_t size)
+    {
+        return ::sparseSetIndex(_ctx, data, size);
+    }
+
     void buildDataHeaderProperSized()
     {
         SparseHeader hdr;
@@ -230,6 +259,51 @@ struct SparseTest : testing::Test
         auto const *crc32Ptr = reinterpret_cast<const unsigned char *>(&crc32);
         _data.insert(_data.end(), crc32Ptr, crc32Ptr + sizeof(uint32_t));
     }
+
+    void buildDataManyChunks(uint32_t count, std::vector<unsigned char> *out)
+    {
+        SparseHeader hdr;
+        auto const *hdrPtr = reinterpret_cast<const unsigned char *>(&hdr);
+
+        memset(&hdr, 0, sizeof(SparseHeader));
+        hdr.magic = SPARSE_HEADER_MAGIC;
+        hdr.major_version = SPARSE_HEADER_MAJOR_VER;
+        hdr.minor_version = 0;
+        hdr.file_hdr_sz = sizeof(SparseHeader);
+        hdr.chunk_hdr_sz = sizeof(ChunkHeader);
+        hdr.blk_sz = 4;
+        hdr.total_blks = count * 2;
+        hdr.total_chunks = count;
+        hdr.image_checksum = 0;
+        _data.insert(_data.end(), hdrPtr, hdrPtr + sizeof(SparseHeader));
+
+        ChunkHeader chdr;
+        auto const *chdrPtr = reinterpret_cast<const unsigned char *>(&chdr);
+
+        // Alternate between 8-byte raw chunks and 8-byte fill chunks
+        for (uint32_t i = 0; i < count; ++i) {
+            memset(&chdr, 0, sizeof(ChunkHeader));
+            chdr.chunk_sz = 2;
+
+            unsigned char data[8];
+            if (i % 2 == 0) {
+                chdr.chunk_type = CHUNK_TYPE_RAW;
+                chdr.total_sz = hdr.chunk_hdr_sz + sizeof(data);
+                for (size_t j = 0; j < sizeof(data); ++j) {
+                    data[j] = static_cast<unsigned char>(i + j);
+                }
+            } else {
+                chdr.chunk_type = CHUNK_TYPE_FILL;
+                chdr.total_sz = hdr.chunk_hdr_sz + sizeof(uint32_t);
+                memset(data, static_cast<unsigned char>(i), sizeof(data));
+            }
+
+            _data.insert(_data.end(), chdrPtr, chdrPtr + sizeof(ChunkHeader));
+            _data.insert(_data.end(), data, data + chdr.total_sz
+                    - hdr.chunk_hdr_sz);
+            out->insert(out->end(), data, data + sizeof(data));
+        }
+    }
 };
 
 TEST_F(SparseTest, ReadPerfectlySizedHeader)
@@ -377,6 +451,121 @@ TEST_F(SparseTest, ReadValidSparseFileNoSeek)
     ASSERT_TRUE(sparseClose());
 }
 
+TEST_F(SparseTest, RandomSeekManyChunks)
+{
+    std::vector<unsigned char> expected;
+    unsigned char buf[64];
+    uint64_t bytesRead;
+    buildDataManyChunks(1001, &expected);
+
+    ASSERT_TRUE(sparseOpen());
+
+    // Seek backwards and forwards across the whole file
+    uint32_t seed = 1;
+    for (int i = 0; i < 1000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        uint64_t offset = (seed >> 8) % expected.size();
+        uint64_t expectedSize = std::min<uint64_t>(
+                sizeof(buf), expected.size() - offset);
+
+        ASSERT_TRUE(sparseSeek(offset, SEEK_SET));
+        ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+        ASSERT_EQ(bytesRead, expectedSize);
+        ASSERT_EQ(memcmp(buf, expected.data() + offset, expectedSize), 0);
+    }
+
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, ConcurrentReadAt)
+{
+    std::vector<unsigned char> expected;
+    buildDataManyChunks(1001, &expected);
+
+    ASSERT_TRUE(sparseOpen());
+
+    std::vector<std::thread> threads;
+    std::atomic<int> failures(0);
+
+    for (uint32_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]{
+            unsigned char buf[64];
+            uint64_t bytesRead;
+            uint32_t seed = t + 1;
+
+            for (int i = 0; i < 1000; ++i) {
+                seed = seed * 1103515245 + 12345;
+                uint64_t offset = (seed >> 8) % expected.size();
+                uint64_t expectedSize = std::min<uint64_t>(
+                        sizeof(buf), expected.size() - offset);
+
+                if (!sparseReadAt(_ctx, buf, sizeof(buf), offset, &bytesRead,
+                                  &cbPread, this)
+                        || bytesRead != expectedSize
+                        || memcmp(buf, expected.data() + offset,
+                                  expectedSize) != 0) {
+                    ++failures;
+                }
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    ASSERT_EQ(failures, 0);
+
+    // The file position is not affected
+    uint64_t pos;
+    ASSERT_TRUE(sparseTell(&pos));
+    ASSERT_EQ(pos, 0u);
+
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, ReuseSerializedIndex)
+{
+    char expected[16] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        'a', 'b', 'c', 'd', 'e', 'f'
+    };
+
+    char buf[1024];
+    uint64_t bytesRead;
+    void *index;
+    size_t indexSize;
+    buildDataCompleteValid();
+
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseGetIndex(&index, &indexSize));
+    ASSERT_TRUE(sparseClose());
+
+    std::unique_ptr<void, decltype(free) *> scopedIndex(index, free);
+
+    // Corrupt the first chunk header so that the file can only be opened if
+    // the saved index is used
+    ChunkHeader *chdr = reinterpret_cast<ChunkHeader *>(
+            _data.data() + sizeof(SparseHeader));
+    chdr->chunk_type = 0xffff;
+    ASSERT_FALSE(sparseOpen());
+
+    ASSERT_TRUE(sparseSetIndex(index, indexSize));
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 48);
+    ASSERT_EQ(memcmp(buf, expected, sizeof(expected)), 0);
+    ASSERT_TRUE(sparseClose());
+
+    // The index is only used for a single open
+    ASSERT_FALSE(sparseOpen());
+
+    // Malformed indexes are rejected
+    ASSERT_FALSE(sparseSetIndex(index, indexSize - 1));
+    static_cast<char *>(index)[0] ^= 0xff;
+    ASSERT_FALSE(sparseSetIndex(index, indexSize));
+}
+
 int main(int argc, char *argv[])
 {
     testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_flash.h"
+#include "mbsparse/sparse_writer.h"
+
+struct SparseFlashTest : testing::Test
+{
+    std::vector<unsigned char> _data;
+    size_t _pos = 0;
+    char _path[64];
+    int _fd = -1;
+
+    virtual void SetUp()
+    {
+        strcpy(_path, "/tmp/mbsparse_flash_XXXXXX");
+        _fd = mkstemp(_path);
+        ASSERT_GE(_fd, 0);
+    }
+
+    virtual void TearDown()
+    {
+        if (_fd >= 0) {
+            close(_fd);
+            unlink(_path);
+        }
+    }
+
+    static bool cbWrite(const void *buf, uint64_t size, uint64_t *bytesWritten,
+                        void *userData)
+    {
+        SparseFlashTest *test = static_cast<SparseFlashTest *>(userData);
+        if (test->_pos + size > test->_data.size()) {
+            test->_data.resize(test->_pos + size);
+        }
+        memcpy(test->_data.data() + test->_pos, buf, size);
+        test->_pos += size;
+        *bytesWritten = size;
+        return true;
+    }
+
+    static bool cbRead(void *buf, uint64_t size, uint64_t *bytesRead,
+                       void *userData)
+    {
+        SparseFlashTest *test = static_cast<SparseFlashTest *>(userData);
+        uint64_t canRead = std::min<uint64_t>(
+                size, test->_data.size() - std::min(test->_pos,
+                                                    test->_data.size()));
+        memcpy(buf, test->_data.data() + test->_pos, canRead);
+        test->_pos += canRead;
+        *bytesRead = canRead;
+        return true;
+    }
+
+    static bool cbSeek(int64_t offset, int whence, void *userData)
+    {
+        SparseFlashTest *test = static_cast<SparseFlashTest *>(userData);
+        switch (whence) {
+        case SEEK_SET:
+            test->_pos = offset;
+            return true;
+        case SEEK_CUR:
+            test->_pos += offset;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void buildSparseFile(const std::vector<unsigned char> &input,
+                         const unsigned char *bitmap, uint64_t blocks)
+    {
+        SparseWriterCtx *ctx = sparseWriterCtxNew();
+        ASSERT_TRUE(!!ctx);
+        ASSERT_TRUE(sparseWriterSetBlockBitmap(ctx, bitmap, blocks));
+        ASSERT_TRUE(sparseWriterSetCrc32(ctx, true));
+        ASSERT_TRUE(sparseWriterOpen(ctx, nullptr, nullptr, &cbWrite, &cbSeek,
+                                     this));
+        ASSERT_TRUE(sparseWriterWrite(ctx, input.data(), input.size()));
+        ASSERT_TRUE(sparseWriterClose(ctx));
+        sparseWriterCtxFree(ctx);
+        _pos = 0;
+    }
+
+    void flash(bool seekable, bool expectSuccess = true)
+    {
+        SparseCtx *ctx = sparseCtxNew();
+        ASSERT_TRUE(!!ctx);
+        ASSERT_TRUE(sparseSetVerifyCrc32(ctx, true));
+        ASSERT_TRUE(sparseOpen(ctx, nullptr, nullptr, &cbRead,
+                               seekable ? &cbSeek : nullptr, nullptr, this));
+        ASSERT_EQ(sparseFlashFd(ctx, _fd, 0, nullptr, nullptr), expectSuccess);
+        ASSERT_TRUE(sparseClose(ctx));
+        sparseCtxFree(ctx);
+    }
+
+    std::vector<unsigned char> readOutput()
+    {
+        struct stat sb;
+        EXPECT_EQ(fstat(_fd, &sb), 0);
+        std::vector<unsigned char> result(sb.st_size);
+        EXPECT_EQ(pread(_fd, result.data(), result.size(), 0),
+                  static_cast<ssize_t>(result.size()));
+        return result;
+    }
+
+    void runTest(bool seekable)
+    {
+        std::vector<unsigned char> input;
+
+        // Raw, zero, fill, unused, raw
+        for (int i = 0; i < 4096; ++i) {
+            input.push_back(static_cast<unsigned char>(i * 7));
+        }
+        input.insert(input.end(), 2 * 4096, 0);
+        input.insert(input.end(), 4096, 0x5a);
+        input.insert(input.end(), 4096, 0x33);
+        for (int i = 0; i < 4096; ++i) {
+            input.push_back(static_cast<unsigned char>(i * 13));
+        }
+
+        unsigned char bitmap = 0x2f;
+        buildSparseFile(input, &bitmap, 6);
+
+        // Existing data in the don't care range must be left alone
+        std::vector<unsigned char> existing(input.size(), 0xee);
+        ASSERT_EQ(write(_fd, existing.data(), existing.size()),
+                  static_cast<ssize_t>(existing.size()));
+
+        flash(seekable);
+
+        std::vector<unsigned char> expected(input);
+        memset(expected.data() + 4 * 4096, 0xee, 4096);
+        ASSERT_EQ(readOutput(), expected);
+    }
+};
+
+TEST_F(SparseFlashTest, FlashSeekableSource)
+{
+    runTest(true);
+}
+
+TEST_F(SparseFlashTest, FlashUnseekableSource)
+{
+    runTest(false);
+}
+
+TEST_F(SparseFlashTest, TruncatesRegularFile)
+{
+    std::vector<unsigned char> input(3 * 4096, 0x42);
+    unsigned char bitmap = 0x01;
+    buildSparseFile(input, &bitmap, 3);
+
+    flash(true);
+
+    std::vector<unsigned char> expected(3 * 4096, 0);
+    memset(expected.data(), 0x42, 4096);
+    ASSERT_EQ(readOutput(), expected);
+}
+
+TEST_F(SparseFlashTest, DetectsCorruptedData)
+{
+    std::vector<unsigned char> input;
+    for (int i = 0; i < 2 * 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i * 7));
+    }
+    input.insert(input.end(), 4096, 0x5a);
+    unsigned char bitmap = 0x07;
+    buildSparseFile(input, &bitmap, 3);
+
+    // Corrupt the last byte of the raw data
+    _data[sizeof(SparseHeader) + sizeof(ChunkHeader) + 2 * 4096 - 1] ^= 0x80;
+
+    flash(true, false);
+}
+
+static bool cbFlashWrite(const void *buf, uint64_t size, uint64_t offset,
+                         void *userData)
+{
+    auto *output = static_cast<std::vector<unsigned char> *>(userData);
+    if (offset + size > output->size()) {
+        output->resize(offset + size, 0xee);
+    }
+    memcpy(output->data() + offset, buf, size);
+    return true;
+}
+
+TEST_F(SparseFlashTest, FlashWithCallback)
+{
+    std::vector<unsigned char> input;
+    for (int i = 0; i < 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i * 7));
+    }
+    input.insert(input.end(), 4096, 0x5a);
+    input.insert(input.end(), 4096, 0x33);
+    for (int i = 0; i < 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i * 13));
+    }
+
+    // Block 2 is unused
+    unsigned char bitmap = 0x0b;
+    buildSparseFile(input, &bitmap, 4);
+
+    SparseCtx *ctx = sparseCtxNew();
+    ASSERT_TRUE(!!ctx);
+    ASSERT_TRUE(sparseOpen(ctx, nullptr, nullptr, &cbRead, nullptr, nullptr,
+                           this));
+
+    std::vector<unsigned char> output;
+    ASSERT_TRUE(sparseFlashCb(ctx, &cbFlashWrite, nullptr, nullptr, &output));
+    ASSERT_TRUE(sparseClose(ctx));
+    sparseCtxFree(ctx);
+
+    // Don't care ranges are never passed to the callback
+    std::vector<unsigned char> expected(input);
+    memset(expected.data() + 2 * 4096, 0xee, 4096);
+    ASSERT_EQ(output, expected);
+}
+
+struct ZeroRange
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+static bool cbFlashZero(uint64_t size, uint64_t offset, void *userData)
+{
+    auto *ranges = static_cast<std::vector<ZeroRange> *>(
+            static_cast<void **>(userData)[1]);
+    ranges->push_back({ offset, size });
+    return true;
+}
+
+static bool cbFlashWriteData(const void *buf, uint64_t size, uint64_t offset,
+                             void *userData)
+{
+    return cbFlashWrite(buf, size, offset, static_cast<void **>(userData)[0]);
+}
+
+TEST_F(SparseFlashTest, FlashWithZeroCallback)
+{
+    std::vector<unsigned char> input;
+    for (int i = 0; i < 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i * 7));
+    }
+    input.insert(input.end(), 2 * 4096, 0);
+    input.insert(input.end(), 4096, 0x5a);
+
+    unsigned char bitmap = 0x0f;
+    buildSparseFile(input, &bitmap, 4);
+
+    SparseCtx *ctx = sparseCtxNew();
+    ASSERT_TRUE(!!ctx);
+    ASSERT_TRUE(sparseSetVerifyCrc32(ctx, true));
+    ASSERT_TRUE(sparseOpen(ctx, nullptr, nullptr, &cbRead, nullptr, nullptr,
+                           this));
+
+    std::vector<unsigned char> output;
+    std::vector<ZeroRange> ranges;
+    void *userData[] = { &output, &ranges };
+    ASSERT_TRUE(sparseFlashCb(ctx, &cbFlashWriteData, &cbFlashZero, nullptr,
+                              userData));
+    ASSERT_TRUE(sparseClose(ctx));
+    sparseCtxFree(ctx);
+
+    // The zero-filled chunk is passed as a range and is not expanded
+    ASSERT_EQ(ranges.size(), 1u);
+    ASSERT_EQ(ranges[0].offset, 4096u);
+    ASSERT_EQ(ranges[0].size, 2u * 4096);
+
+    std::vector<unsigned char> expected(input);
+    memset(expected.data() + 4096, 0xee, 2 * 4096);
+    ASSERT_EQ(output, expected);
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <cstring>
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_seekable.h"
+#include "mbsparse/sparse_writer.h"
+
+#ifndef _WIN32
+
+// Small frames so that the test data spans many of them
+#define TEST_FRAME_SIZE         8192
+
+struct Buffer
+{
+    std::vector<unsigned char> data;
+    size_t pos = 0;
+};
+
+static bool cbWrite(const void *buf, uint64_t size, uint64_t *bytesWritten,
+                    void *userData)
+{
+    Buffer *b = static_cast<Buffer *>(userData);
+    auto const *ptr = static_cast<const unsigned char *>(buf);
+    if (b->pos + size > b->data.size()) {
+        b->data.resize(b->pos + size);
+    }
+    memcpy(b->data.data() + b->pos, ptr, size);
+    b->pos += size;
+    *bytesWritten = size;
+    return true;
+}
+
+static bool cbRead(void *buf, uint64_t size, uint64_t *bytesRead,
+                   void *userData)
+{
+    Buffer *b = static_cast<Buffer *>(userData);
+    uint64_t canRead = std::min<uint64_t>(
+            size, b->data.size() - std::min(b->pos, b->data.size()));
+    memcpy(buf, b->data.data() + b->pos, canRead);
+    b->pos += canRead;
+    *bytesRead = canRead;
+    return true;
+}
+
+static bool cbSeek(int64_t offset, int whence, void *userData)
+{
+    Buffer *b = static_cast<Buffer *>(userData);
+    if (whence != SEEK_SET || offset < 0) {
+        return false;
+    }
+    b->pos = offset;
+    return true;
+}
+
+static bool cbPread(void *buf, uint64_t size, uint64_t offset,
+                    uint64_t *bytesRead, void *userData)
+{
+    Buffer *b = static_cast<Buffer *>(userData);
+    uint64_t canRead = offset < b->data.size()
+            ? std::min<uint64_t>(size, b->data.size() - offset) : 0;
+    memcpy(buf, b->data.data() + offset, canRead);
+    *bytesRead = canRead;
+    return true;
+}
+
+struct StreamCtx
+{
+    Buffer *container;
+    std::vector<unsigned char> out;
+};
+
+static bool cbStreamRead(void *buf, uint64_t size, uint64_t *bytesRead,
+                         void *userData)
+{
+    return cbRead(buf, size, bytesRead,
+                  static_cast<StreamCtx *>(userData)->container);
+}
+
+static bool cbStreamWrite(const void *buf, uint64_t size, uint64_t offset,
+                          void *userData)
+{
+    std::vector<unsigned char> &out = static_cast<StreamCtx *>(userData)->out;
+    if (offset + size > out.size()) {
+        return false;
+    }
+    memcpy(out.data() + offset, buf, size);
+    return true;
+}
+
+struct SparseSeekableTest : testing::Test
+{
+    // Expected contents of the output image
+    std::vector<unsigned char> _image;
+    Buffer _sparse;
+    Buffer _container;
+
+    void SetUp() override
+    {
+        // 10 raw blocks (spanning several frames), 3 fill blocks, 4 don't care
+        // blocks, and 5 more raw blocks
+        for (int i = 0; i < 10 * 4096; ++i) {
+            _image.push_back(static_cast<unsigned char>((i * 7) ^ (i >> 9)));
+        }
+        for (int i = 0; i < 3 * 4096 / 4; ++i) {
+            const unsigned char word[] = { 0x78, 0x56, 0x34, 0x12 };
+            _image.insert(_image.end(), word, word + 4);
+        }
+        _image.insert(_image.end(), 4 * 4096, 0);
+        for (int i = 0; i < 5 * 4096; ++i) {
+            // Compressible
+            _image.push_back(static_cast<unsigned char>(i / 64));
+        }
+
+        // Don't care blocks
+        unsigned char bitmap[3] = { 0xff, 0x1f, 0x7e };
+
+        SparseWriterCtx *writer = sparseWriterCtxNew();
+        ASSERT_TRUE(sparseWriterSetBlockBitmap(writer, bitmap, 22));
+        ASSERT_TRUE(sparseWriterSetCrc32(writer, true));
+        ASSERT_TRUE(sparseWriterOpen(writer, nullptr, nullptr, &cbWrite,
+                                     &cbSeek, &_sparse));
+        ASSERT_TRUE(sparseWriterWrite(writer, _image.data(), _image.size()));
+        ASSERT_TRUE(sparseWriterClose(writer));
+        sparseWriterCtxFree(writer);
+
+        // Compress
+        _sparse.pos = 0;
+        SparseCtx *ctx = sparseCtxNew();
+        ASSERT_TRUE(sparseSetVerifyCrc32(ctx, true));
+        ASSERT_TRUE(sparseOpen(ctx, nullptr, nullptr, &cbRead, nullptr,
+                               nullptr, &_sparse));
+        ASSERT_TRUE(sparseSeekableCompress(ctx, &cbWrite, TEST_FRAME_SIZE, 3,
+                                           &_container));
+        ASSERT_TRUE(sparseClose(ctx));
+        sparseCtxFree(ctx);
+    }
+};
+
+TEST_F(SparseSeekableTest, ExpandsStream)
+{
+    StreamCtx ctx;
+    ctx.container = &_container;
+    _container.pos = 0;
+    ctx.out.assign(_image.size(), 0);
+
+    ASSERT_TRUE(sparseSeekableFlashStream(&cbStreamRead, &cbStreamWrite,
+                                          nullptr, nullptr, 4, &ctx));
+    ASSERT_EQ(ctx.out, _image);
+}
+
+TEST_F(SparseSeekableTest, ReadsAtAnyOffset)
+{
+    SparseSeekableCtx *ctx = sparseSeekableCtxNew();
+    ASSERT_TRUE(sparseSeekableOpen(ctx, &cbPread, _container.data.size(),
+                                   &_container));
+
+    uint64_t size;
+    ASSERT_TRUE(sparseSeekableSize(ctx, &size));
+    ASSERT_EQ(size, _image.size());
+
+    // Reads that start and end inside frames and span frame types
+    const uint64_t ranges[][2] = {
+        { 0, 1 },
+        { 100, 20000 },
+        { 8191, 2 },
+        { 40000, 15000 },
+        { 41002, 3 },
+        { 53000, 20000 },
+        { 0, 22 * 4096 },
+    };
+
+    for (auto const &range : ranges) {
+        std::vector<unsigned char> buf(range[1]);
+        uint64_t bytesRead;
+        ASSERT_TRUE(sparseSeekableReadAt(ctx, buf.data(), buf.size(),
+                                         range[0], &bytesRead));
+        ASSERT_EQ(bytesRead, range[1]);
+        ASSERT_TRUE(std::equal(buf.begin(), buf.end(),
+                               _image.begin() + range[0]))
+                << "Mismatch at offset " << range[0];
+    }
+
+    // Short read at EOF
+    unsigned char buf[100];
+    uint64_t bytesRead;
+    ASSERT_TRUE(sparseSeekableReadAt(ctx, buf, sizeof(buf),
+                                     _image.size() - 10, &bytesRead));
+    ASSERT_EQ(bytesRead, 10u);
+    ASSERT_TRUE(sparseSeekableReadAt(ctx, buf, sizeof(buf), _image.size(),
+                                     &bytesRead));
+    ASSERT_EQ(bytesRead, 0u);
+
+    ASSERT_TRUE(sparseSeekableCtxFree(ctx));
+}
+
+TEST_F(SparseSeekableTest, DetectsCorruptedFrame)
+{
+    // Corrupt the data of the first frame
+    _container.data[sizeof(SparseSeekableHeader)
+            + sizeof(SparseSeekableFrameHeader) + 5] ^= 0x01;
+
+    SparseSeekableCtx *ctx = sparseSeekableCtxNew();
+    ASSERT_TRUE(sparseSeekableOpen(ctx, &cbPread, _container.data.size(),
+                                   &_container));
+
+    unsigned char buf[16];
+    uint64_t bytesRead;
+    ASSERT_FALSE(sparseSeekableReadAt(ctx, buf, sizeof(buf), 0, &bytesRead));
+    // Other frames are still readable
+    ASSERT_TRUE(sparseSeekableReadAt(ctx, buf, sizeof(buf), 20000,
+                                     &bytesRead));
+
+    ASSERT_TRUE(sparseSeekableCtxFree(ctx));
+}
+
+TEST_F(SparseSeekableTest, RejectsCorruptedIndex)
+{
+    _container.data[_container.data.size() - sizeof(SparseSeekableFooter)
+            - sizeof(SparseSeekableIndexEntry)] ^= 0x01;
+
+    SparseSeekableCtx *ctx = sparseSeekableCtxNew();
+    ASSERT_FALSE(sparseSeekableOpen(ctx, &cbPread, _container.data.size(),
+                                    &_container));
+    sparseSeekableCtxFree(ctx);
+}
+
+#endif
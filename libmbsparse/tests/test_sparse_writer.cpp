@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <cstring>
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_writer.h"
+
+struct SparseWriterTest : testing::Test
+{
+    SparseWriterCtx *_ctx;
+    std::vector<unsigned char> _data;
+    size_t _pos = 0;
+
+    SparseWriterTest()
+    {
+        _ctx = sparseWriterCtxNew();
+    }
+
+    virtual ~SparseWriterTest()
+    {
+        sparseWriterCtxFree(_ctx);
+    }
+
+    static bool cbWrite(const void *buf, uint64_t size, uint64_t *bytesWritten,
+                        void *userData)
+    {
+        SparseWriterTest *test = static_cast<SparseWriterTest *>(userData);
+        auto const *ptr = static_cast<const unsigned char *>(buf);
+        if (test->_pos + size > test->_data.size()) {
+            test->_data.resize(test->_pos + size);
+        }
+        memcpy(test->_data.data() + test->_pos, ptr, size);
+        test->_pos += size;
+        *bytesWritten = size;
+        return true;
+    }
+
+    static bool cbRead(void *buf, uint64_t size, uint64_t *bytesRead,
+                       void *userData)
+    {
+        SparseWriterTest *test = static_cast<SparseWriterTest *>(userData);
+        uint64_t canRead = std::min<uint64_t>(
+                size, test->_data.size() - std::min(test->_pos,
+                                                    test->_data.size()));
+        memcpy(buf, test->_data.data() + test->_pos, canRead);
+        test->_pos += canRead;
+        *bytesRead = canRead;
+        return true;
+    }
+
+    static bool cbSeek(int64_t offset, int whence, void *userData)
+    {
+        SparseWriterTest *test = static_cast<SparseWriterTest *>(userData);
+        switch (whence) {
+        case SEEK_SET:
+            if (offset < 0) {
+                return false;
+            }
+            test->_pos = offset;
+            return true;
+        case SEEK_CUR:
+            if (offset < 0 && (uint64_t) -offset > test->_pos) {
+                return false;
+            }
+            test->_pos += offset;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool sparseWriterOpen()
+    {
+        return ::sparseWriterOpen(_ctx, nullptr, nullptr, &cbWrite, &cbSeek,
+                                  this);
+    }
+
+    const SparseHeader * header()
+    {
+        return reinterpret_cast<const SparseHeader *>(_data.data());
+    }
+
+    std::vector<uint16_t> chunkTypes()
+    {
+        std::vector<uint16_t> types;
+        size_t offset = sizeof(SparseHeader);
+        for (uint32_t i = 0; i < header()->total_chunks; ++i) {
+            auto const *chdr = reinterpret_cast<const ChunkHeader *>(
+                    _data.data() + offset);
+            types.push_back(chdr->chunk_type);
+            offset += chdr->total_sz;
+        }
+        EXPECT_EQ(offset, _data.size());
+        return types;
+    }
+
+    std::vector<unsigned char> desparse(bool verify = false, bool *ok = nullptr)
+    {
+        std::vector<unsigned char> result;
+        SparseCtx *ctx = sparseCtxNew();
+        EXPECT_TRUE(sparseSetVerifyCrc32(ctx, verify));
+        EXPECT_TRUE(::sparseOpen(ctx, nullptr, nullptr, &cbRead, &cbSeek,
+                                 nullptr, this));
+
+        unsigned char buf[10000];
+        uint64_t bytesRead;
+        bool ret;
+        while ((ret = sparseRead(ctx, buf, sizeof(buf), &bytesRead))
+                && bytesRead > 0) {
+            result.insert(result.end(), buf, buf + bytesRead);
+        }
+        if (ok) {
+            *ok = ret;
+        }
+
+        EXPECT_TRUE(sparseClose(ctx));
+        sparseCtxFree(ctx);
+        return result;
+    }
+
+    static uint32_t crc32(const std::vector<unsigned char> &data)
+    {
+        uint32_t crc = 0xffffffff;
+        for (unsigned char c : data) {
+            crc ^= c;
+            for (int i = 0; i < 8; ++i) {
+                crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+            }
+        }
+        return ~crc;
+    }
+};
+
+TEST_F(SparseWriterTest, RoundTripClassifiesBlocks)
+{
+    std::vector<unsigned char> input;
+
+    // Raw, raw, zero, zero, fill, fill (different value), raw
+    for (int i = 0; i < 2 * 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i * 7));
+    }
+    input.insert(input.end(), 2 * 4096, 0);
+    for (int i = 0; i < 4096 / 4; ++i) {
+        const unsigned char word[] = { 0x78, 0x56, 0x34, 0x12 };
+        input.insert(input.end(), word, word + 4);
+    }
+    input.insert(input.end(), 4096, 0xab);
+    for (int i = 0; i < 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i * 13));
+    }
+
+    ASSERT_TRUE(sparseWriterOpen());
+    // Write in odd-sized pieces to exercise partial blocks
+    for (size_t offset = 0; offset < input.size(); offset += 1000) {
+        size_t n = std::min<size_t>(1000, input.size() - offset);
+        ASSERT_TRUE(sparseWriterWrite(_ctx, input.data() + offset, n));
+    }
+    ASSERT_TRUE(sparseWriterClose(_ctx));
+
+    ASSERT_EQ(header()->total_blks, 7u);
+    std::vector<uint16_t> expectedTypes{
+        CHUNK_TYPE_RAW, CHUNK_TYPE_FILL, CHUNK_TYPE_FILL, CHUNK_TYPE_FILL,
+        CHUNK_TYPE_RAW
+    };
+    ASSERT_EQ(chunkTypes(), expectedTypes);
+    ASSERT_EQ(desparse(), input);
+}
+
+TEST_F(SparseWriterTest, PadsPartialBlock)
+{
+    std::vector<unsigned char> input(5000, 0x11);
+    input[4999] = 0x22;
+
+    ASSERT_TRUE(sparseWriterOpen());
+    ASSERT_TRUE(sparseWriterWrite(_ctx, input.data(), input.size()));
+    ASSERT_TRUE(sparseWriterClose(_ctx));
+
+    ASSERT_EQ(header()->total_blks, 2u);
+    input.resize(8192, 0);
+    ASSERT_EQ(desparse(), input);
+}
+
+TEST_F(SparseWriterTest, BitmapSkipsUnusedBlocks)
+{
+    std::vector<unsigned char> input;
+    for (int i = 0; i < 4 * 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i * 7));
+    }
+
+    // Only blocks 0 and 3 are in use
+    unsigned char bitmap = 0x09;
+    ASSERT_TRUE(sparseWriterSetBlockBitmap(_ctx, &bitmap, 4));
+
+    ASSERT_TRUE(sparseWriterOpen());
+    ASSERT_TRUE(sparseWriterWrite(_ctx, input.data(), input.size()));
+    ASSERT_TRUE(sparseWriterClose(_ctx));
+
+    std::vector<uint16_t> expectedTypes{
+        CHUNK_TYPE_RAW, CHUNK_TYPE_DONT_CARE, CHUNK_TYPE_RAW
+    };
+    ASSERT_EQ(chunkTypes(), expectedTypes);
+
+    memset(input.data() + 4096, 0, 2 * 4096);
+    ASSERT_EQ(desparse(), input);
+}
+
+TEST_F(SparseWriterTest, WritesChecksum)
+{
+    std::vector<unsigned char> input;
+    for (int i = 0; i < 3 * 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i % 3 == 0 ? i : 0));
+    }
+    input.insert(input.end(), 4096, 0);
+
+    unsigned char bitmap = 0x07;
+    ASSERT_TRUE(sparseWriterSetBlockBitmap(_ctx, &bitmap, 4));
+    ASSERT_TRUE(sparseWriterSetCrc32(_ctx, true));
+
+    ASSERT_TRUE(sparseWriterOpen());
+    ASSERT_TRUE(sparseWriterWrite(_ctx, input.data(), input.size()));
+    ASSERT_TRUE(sparseWriterClose(_ctx));
+
+    std::vector<uint16_t> types = chunkTypes();
+    ASSERT_EQ(types.back(), CHUNK_TYPE_CRC32);
+
+    uint32_t crc = crc32(input);
+    uint32_t chunkCrc;
+    memcpy(&chunkCrc, _data.data() + _data.size() - sizeof(chunkCrc),
+           sizeof(chunkCrc));
+    ASSERT_EQ(header()->image_checksum, crc);
+    ASSERT_EQ(chunkCrc, crc);
+    ASSERT_EQ(desparse(), input);
+}
+
+TEST_F(SparseWriterTest, VerifiesChecksumWhileReading)
+{
+    std::vector<unsigned char> input;
+    for (int i = 0; i < 3 * 4096; ++i) {
+        input.push_back(static_cast<unsigned char>(i % 3 == 0 ? i : 0));
+    }
+    input.insert(input.end(), 4096, 0);
+
+    unsigned char bitmap = 0x07;
+    ASSERT_TRUE(sparseWriterSetBlockBitmap(_ctx, &bitmap, 4));
+    ASSERT_TRUE(sparseWriterSetCrc32(_ctx, true));
+
+    ASSERT_TRUE(sparseWriterOpen());
+    ASSERT_TRUE(sparseWriterWrite(_ctx, input.data(), input.size()));
+    ASSERT_TRUE(sparseWriterClose(_ctx));
+
+    bool ok;
+    ASSERT_EQ(desparse(true, &ok), input);
+    ASSERT_TRUE(ok);
+
+    // Corrupt a byte of raw data. This is only detected if verification is
+    // enabled.
+    _data[sizeof(SparseHeader) + sizeof(ChunkHeader) + 3] ^= 0x01;
+
+    desparse(false, &ok);
+    ASSERT_TRUE(ok);
+    desparse(true, &ok);
+    ASSERT_FALSE(ok);
+}
+
+TEST_F(SparseWriterTest, RejectsInvalidBlockSize)
+{
+    ASSERT_FALSE(sparseWriterSetBlockSize(_ctx, 0));
+    ASSERT_FALSE(sparseWriterSetBlockSize(_ctx, 4097));
+    ASSERT_TRUE(sparseWriterSetBlockSize(_ctx, 1024));
+    ASSERT_TRUE(sparseWriterOpen());
+    ASSERT_FALSE(sparseWriterSetBlockSize(_ctx, 4096));
+    ASSERT_TRUE(sparseWriterClose(_ctx));
+}
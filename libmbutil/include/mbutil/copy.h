@@ -19,8 +19,11 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 
+#include <cstdint>
+
 namespace mb
 {
 namespace util
@@ -34,12 +37,40 @@ enum CopyFlags : int
     COPY_FOLLOW_SYMLINKS     = 0x8
 };
 
-bool copy_data_fd(int fd_source, int fd_target);
+enum class CopyStrategy
+{
+    // Nothing was copied
+    None,
+    CopyFileRange,
+    Sendfile,
+    Splice,
+    ReadWrite,
+};
+
+struct CopyStats
+{
+    // Number of bytes copied
+    uint64_t bytes = 0;
+    // Strategy that copied the data (or failed)
+    CopyStrategy strategy = CopyStrategy::None;
+};
+
+/*!
+ * \brief Callback to select paths to copy with copy_dir()
+ *
+ * \param path Path relative to the source directory
+ * \return Whether to copy the path (and its contents, for directories)
+ */
+typedef std::function<bool(const std::string &path)> CopyFilter;
+
+bool copy_data_fd(int fd_source, int fd_target, CopyStats *stats = nullptr);
 bool copy_xattrs(const std::string &source, const std::string &target);
+bool fcopy_xattrs(int fd_source, int fd_target);
 bool copy_stat(const std::string &source, const std::string &target);
 bool copy_contents(const std::string &source, const std::string &target);
 bool copy_file(const std::string &source, const std::string &target, int flags);
-bool copy_dir(const std::string &source, const std::string &target, int flags);
+bool copy_dir(const std::string &source, const std::string &target, int flags,
+              const CopyFilter &filter = nullptr);
 
 }
 }
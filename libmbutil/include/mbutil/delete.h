@@ -20,13 +20,27 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace mb
 {
 namespace util
 {
 
-bool delete_recursive(const std::string &path);
+enum DeleteFlags : int
+{
+    // Move the files into a trash directory and delete them in a background
+    // process
+    DELETE_ASYNC          = 0x1,
+    // For delete_contents(), remove the directory too if it is empty
+    // afterwards
+    DELETE_REMOVE_EMPTY   = 0x2,
+};
+
+bool delete_recursive(const std::string &path, int flags = 0);
+bool delete_contents(const std::string &path,
+                     const std::vector<std::string> &exclusions,
+                     int flags = 0);
 
 }
 }
\ No newline at end of file
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/stat.h>
+
+#include "mbutil/hash.h"
+
+namespace mb
+{
+namespace util
+{
+
+struct DigestCacheKey
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+
+    bool operator==(const DigestCacheKey &other) const;
+};
+
+struct DigestCacheKeyHash
+{
+    size_t operator()(const DigestCacheKey &key) const;
+};
+
+/*!
+ * \brief Persistent cache of file digests keyed by inode metadata
+ *
+ * An entry is only returned if the device, inode number, size, mtime, and
+ * ctime of the file all match the values at the time the file was hashed. Any
+ * write to the file changes its ctime, which cannot be set from userspace, so
+ * a changed file is always rehashed.
+ *
+ * The cache file and its parent directory must be owned by the current user
+ * and must not be writable by anyone else. Otherwise, the cache is not loaded
+ * or saved.
+ */
+class DigestCache
+{
+public:
+    explicit DigestCache(std::string path);
+
+    bool load();
+    bool save();
+
+    bool lookup(const struct stat &sb, HashAlgorithm algorithm,
+                std::vector<unsigned char> *digest);
+    void insert(const struct stat &sb, HashAlgorithm algorithm,
+                const std::vector<unsigned char> &digest);
+    void remove(const struct stat &sb);
+
+    static DigestCacheKey key_for(const struct stat &sb);
+
+private:
+    struct Entry
+    {
+        HashAlgorithm algorithm;
+        std::vector<unsigned char> digest;
+        // Value of _clock when the entry was last used
+        uint64_t stamp;
+    };
+
+    std::string _path;
+    std::unordered_map<DigestCacheKey, Entry, DigestCacheKeyHash> _entries;
+    uint64_t _clock;
+    // Wall clock time when the cache was created
+    int64_t _created_ns;
+    bool _dirty;
+};
+
+}
+}
@@ -20,6 +20,10 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
 
 #include <openssl/sha.h>
 
@@ -28,6 +32,45 @@ namespace mb
 namespace util
 {
 
+enum class HashAlgorithm
+{
+    SHA1,
+    SHA256,
+    SHA512,
+};
+
+/*!
+ * \brief Data to hash with hash_files()
+ *
+ * Exactly one of \a data, \a fd, or \a path is used, in that order.
+ */
+struct HashInput
+{
+    // Data in memory
+    const void *data = nullptr;
+    size_t size = 0;
+    // Open file. It is read from offset 0 with pread() and is not closed.
+    int fd = -1;
+    // Path to open
+    std::string path;
+};
+
+struct HashResult
+{
+    // 0 if the input was hashed successfully. Otherwise, the errno value.
+    int error = 0;
+    std::vector<unsigned char> digest;
+    // Number of bytes hashed
+    uint64_t size = 0;
+    // Time spent reading and hashing the input
+    uint64_t time_ns = 0;
+};
+
+size_t hash_digest_size(HashAlgorithm algorithm);
+
+bool hash_files(const std::vector<HashInput> &inputs, HashAlgorithm algorithm,
+                std::vector<HashResult> *results, unsigned int threads = 0);
+
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH]);
 
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Attributes to apply with apply_metadata_recursive()
+ *
+ * Fields that are left at their default values are not changed.
+ */
+struct Metadata
+{
+    // Owner or -1
+    uid_t uid = static_cast<uid_t>(-1);
+    // Group or -1
+    gid_t gid = static_cast<gid_t>(-1);
+    // Permission bits (not applied to symlinks) or -1
+    mode_t mode = static_cast<mode_t>(-1);
+    // SELinux label or empty string
+    std::string context;
+};
+
+bool apply_metadata_recursive(const std::string &path,
+                              const Metadata &metadata);
+
+}
+}
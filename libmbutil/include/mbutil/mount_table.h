@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Entry from /proc/self/mountinfo
+ *
+ * Paths are unescaped and the " (deleted)" suffix is removed from mountpoints
+ * that no longer exist.
+ */
+struct MountEntry
+{
+    int id;
+    int parent_id;
+    dev_t dev;
+    // Root of the mount within the filesystem
+    std::string root;
+    std::string target;
+    std::string options;
+    std::string fs_type;
+    std::string source;
+    std::string super_options;
+    // Number of ancestors in the mount tree
+    unsigned int depth;
+};
+
+/*!
+ * \brief Cached snapshot of the mount table
+ *
+ * /proc/self/mountinfo is kept open and is only reparsed when poll() reports
+ * that the mount table changed (or when the process has changed its mount
+ * namespace or root directory). Lookups by mountpoint use a hash table.
+ * Thread-safe.
+ */
+class MountTable
+{
+public:
+    MountTable();
+    ~MountTable();
+
+    MountTable(const MountTable &) = delete;
+    MountTable & operator=(const MountTable &) = delete;
+
+    bool entries(std::vector<MountEntry> *entries_out);
+    bool find(const std::string &mountpoint, MountEntry *entry_out);
+    bool is_mounted(const std::string &mountpoint);
+
+    static void sort_for_unmount(std::vector<MountEntry> *entries);
+
+    static MountTable & instance();
+
+private:
+    bool update();
+    bool reopen();
+    bool load();
+
+    std::mutex _lock;
+    int _fd;
+    pid_t _pid;
+    // Identity of the mount namespace and root directory that the fd reflects
+    dev_t _ns_dev;
+    ino_t _ns_ino;
+    dev_t _root_dev;
+    ino_t _root_ino;
+    bool _valid;
+    std::vector<MountEntry> _entries;
+    // Mountpoint -> index of the topmost entry
+    std::unordered_map<std::string, size_t> _index;
+};
+
+}
+}
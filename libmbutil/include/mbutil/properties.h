@@ -21,6 +21,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "mbutil/integer.h"
 #include "mbutil/external/system_properties.h"
@@ -77,6 +78,10 @@ bool file_get_property(const std::string &path,
                        const std::string &key,
                        std::string *out,
                        const std::string &default_value);
+bool file_get_properties(const std::string &path,
+                         const std::vector<std::string> &keys,
+                         std::vector<std::string> *values,
+                         const std::string &default_value = std::string());
 bool file_get_all_properties(const std::string &path,
                              std::unordered_map<std::string, std::string> *map);
 bool file_write_properties(const std::string &path,
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Parsed property file
+ *
+ * Keys and values are stored in a single buffer and are indexed by an
+ * open-addressed hash table. If a key appears multiple times, get() returns the
+ * first value and get_all() returns the last value, which matches the behavior
+ * of file_get_property() and file_get_all_properties().
+ */
+class PropertyFile
+{
+public:
+    PropertyFile(const char *data, size_t size);
+
+    bool get(const std::string &key, std::string *value) const;
+    void get_all(std::unordered_map<std::string, std::string> *map) const;
+
+private:
+    struct Entry
+    {
+        uint32_t key_offset;
+        uint32_t key_size;
+        uint32_t value_offset;
+        uint32_t value_size;
+    };
+
+    const Entry * find(const char *key, size_t size) const;
+
+    std::string _pool;
+    std::vector<Entry> _entries;
+    // Index into _entries plus one (0 if empty). The size is a power of 2.
+    std::vector<uint32_t> _slots;
+};
+
+/*!
+ * \brief Cache of parsed property files
+ *
+ * Files are keyed by path, device, inode, size, mtime, and ctime. A file is
+ * stat'ed on every lookup and is only reparsed if it has changed. Thread-safe.
+ */
+class PropertyFileCache
+{
+public:
+    PropertyFileCache();
+
+    PropertyFileCache(const PropertyFileCache &) = delete;
+    PropertyFileCache & operator=(const PropertyFileCache &) = delete;
+
+    std::shared_ptr<const PropertyFile> get(const std::string &path);
+
+    static PropertyFileCache & instance();
+
+private:
+    struct CachedFile
+    {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        // Value of _clock when the file was last used
+        uint64_t stamp;
+        std::shared_ptr<const PropertyFile> file;
+    };
+
+    std::mutex _lock;
+    std::unordered_map<std::string, CachedFile> _files;
+    uint64_t _clock;
+};
+
+}
+}
@@ -19,7 +19,12 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+
+#include <cstddef>
 
 #include <sepol/policydb/policydb.h>
 
@@ -46,14 +51,48 @@ enum class SELinuxAttr
     SOCKCREATE,
 };
 
+/*!
+ * \brief Cache of interned SELinux labels
+ *
+ * Labels are read into a stack buffer and looked up in the cache without
+ * allocating memory. Each distinct label is stored once, so labels returned by
+ * the same cache can be compared by pointer. Thread-safe.
+ */
+class SelinuxLabelCache
+{
+public:
+    typedef const std::string * Label;
+
+    SelinuxLabelCache() = default;
+
+    SelinuxLabelCache(const SelinuxLabelCache &) = delete;
+    SelinuxLabelCache & operator=(const SelinuxLabelCache &) = delete;
+
+    Label intern(const char *context, size_t size);
+    Label intern(const std::string &context);
+
+    bool fget(int fd, Label *label);
+    bool lget(const std::string &path, Label *label);
+    bool lget_at(int dirfd, const std::string &name, Label *label);
+
+private:
+    std::mutex _lock;
+    // Keyed by hash of the label
+    std::unordered_multimap<size_t, std::unique_ptr<std::string>> _labels;
+};
+
 bool selinux_read_policy(const std::string &path, policydb_t *pdb);
 bool selinux_write_policy(const std::string &path, policydb_t *pdb);
 bool selinux_get_context(const std::string &path, std::string *context);
 bool selinux_lget_context(const std::string &path, std::string *context);
 bool selinux_fget_context(int fd, std::string *context);
+bool selinux_lget_context_at(int dirfd, const std::string &name,
+                             std::string *context);
 bool selinux_set_context(const std::string &path, const std::string &context);
 bool selinux_lset_context(const std::string &path, const std::string &context);
 bool selinux_fset_context(int fd, const std::string &context);
+bool selinux_lset_context_at(int dirfd, const std::string &name,
+                             const std::string &context);
 bool selinux_set_context_recursive(const std::string &path,
                                    const std::string &context);
 bool selinux_lset_context_recursive(const std::string &path,
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+
+#include <pthread.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Work-stealing pool of worker threads
+ *
+ * Each worker has its own task queue. Tasks submitted from outside the pool are
+ * distributed round-robin across the queues and tasks submitted by a worker go
+ * to that worker's queue. A worker runs its newest task first (for locality)
+ * and, when its queue is empty, steals the oldest task from another worker.
+ *
+ * If no threads could be started, tasks run synchronously in submit().
+ */
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    unsigned int size() const;
+
+    void submit(Task task);
+    void wait(size_t max_pending = 0);
+
+    static unsigned int default_size();
+
+private:
+    struct Worker
+    {
+        ThreadPool *pool;
+        size_t index;
+        pthread_t tid;
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    static void * worker_thread(void *data);
+
+    bool pop_task(size_t index, Task *task);
+    size_t current_worker() const;
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    size_t _next;
+
+    std::mutex _lock;
+    std::condition_variable _work_cond;
+    std::condition_variable _done_cond;
+    // Tasks sitting in queues
+    size_t _queued;
+    // Tasks that were submitted, but have not finished running
+    size_t _pending;
+    bool _stop;
+};
+
+}
+}
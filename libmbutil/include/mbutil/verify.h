@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <pthread.h>
+
+#include <openssl/sha.h>
+
+namespace mb
+{
+namespace util
+{
+
+struct VerifyExtent
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+/*!
+ * \brief Hash data while it is being written
+ *
+ * The digest covers the written extents in the order they were written.
+ * Contiguous writes are merged into a single extent.
+ */
+class WriteDigest
+{
+public:
+    WriteDigest();
+
+    void update(const void *data, size_t size, uint64_t offset);
+    void finish(unsigned char digest[SHA512_DIGEST_LENGTH]);
+
+    const std::vector<VerifyExtent> & extents() const;
+
+private:
+    SHA512_CTX _ctx;
+    std::vector<VerifyExtent> _extents;
+};
+
+/*!
+ * \brief Read back written data in the background and compare digests
+ *
+ * Files are read with O_DIRECT (if supported) so that the data comes from the
+ * device and not the page cache. A reader thread and a hasher thread are
+ * connected by a small ring of large buffers so that reading the next chunk
+ * overlaps with hashing the previous one. Since verification runs in the
+ * background, the caller can write the next target in the meantime.
+ *
+ * Jobs are verified in the order they are submitted. The destructor waits for
+ * pending jobs.
+ */
+class ReadBackVerifier
+{
+public:
+    ReadBackVerifier(size_t chunk_size = 8 * 1024 * 1024,
+                     size_t chunk_count = 3);
+    ~ReadBackVerifier();
+
+    ReadBackVerifier(const ReadBackVerifier &) = delete;
+    ReadBackVerifier & operator=(const ReadBackVerifier &) = delete;
+
+    bool submit(const std::string &path, std::vector<VerifyExtent> extents,
+                const unsigned char digest[SHA512_DIGEST_LENGTH]);
+    bool wait(std::vector<std::string> *failed = nullptr);
+
+private:
+    struct Job;
+    struct Chunk;
+
+    static void * reader_thread(void *data);
+    static void * hasher_thread(void *data);
+
+    bool start();
+    void stop();
+    bool read_job(Job *job);
+    void push_chunk(const Chunk &chunk);
+
+    size_t _chunk_size;
+    size_t _chunk_count;
+    std::vector<char *> _buffers;
+
+    bool _started;
+    pthread_t _reader_tid;
+    pthread_t _hasher_tid;
+
+    std::mutex _lock;
+    std::condition_variable _cond;
+    std::deque<Job *> _jobs;
+    std::deque<Chunk> _chunks;
+    std::deque<char *> _free;
+    std::vector<std::string> _failed;
+    size_t _pending;
+    bool _stop;
+};
+
+}
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Directory tree walker that operates on directory file descriptors
+ *
+ * Unlike FTSWrapper, entries are not addressed by full paths. Each directory
+ * is kept open while its children are visited and the hooks receive the
+ * parent directory's fd and the entry's name, which can be passed directly to
+ * the `*at()` family of syscalls. Directories are read with getdents64 and the
+ * entry type comes from `d_type`, so entries are only stat'ed when a hook asks
+ * for it (or when the filesystem does not report the type).
+ *
+ * One file descriptor is open per level of the tree that is currently being
+ * visited.
+ */
+class TreeWalker
+{
+private:
+    struct Frame;
+
+public:
+    enum Flags : int
+    {
+        // Follow symlinks while traversing (WARNING: dangerous!)
+        WALK_FollowSymlinks             = 0x1,
+        // If tree contains a mountpoint, traverse its contents
+        WALK_CrossMountPointBoundaries  = 0x2,
+    };
+
+    enum Action : int
+    {
+        // Hook succeeded
+        WALK_OK                         = 0x0,
+        // Hook failed (run() will return false)
+        WALK_Fail                       = 0x1,
+        // Do not descend into the directory (only useful for
+        // on_reached_directory_pre(). on_reached_directory_post() will not be
+        // called for the directory)
+        WALK_Skip                       = 0x2,
+        // Stop traversal
+        WALK_Stop                       = 0x4,
+    };
+
+    class Entry
+    {
+    public:
+        // Parent directory fd (AT_FDCWD for the root)
+        int dirfd;
+        // Name relative to dirfd (the input path for the root)
+        const char *name;
+        // DT_* type of the entry. With WALK_FollowSymlinks, this is the type
+        // of the symlink target unless the symlink is dangling.
+        unsigned char type;
+        // Depth relative to the root (0 for the root)
+        int depth;
+        // fd of the directory itself (only valid for directories)
+        int fd;
+
+        const std::string & path() const;
+        const struct stat * stat() const;
+
+    private:
+        Entry(const Frame *parent, int dirfd, const char *name,
+              unsigned char type, int depth, bool follow);
+
+        const Frame *_parent;
+        bool _follow;
+        mutable bool _have_path;
+        mutable std::string _path;
+        mutable int _stat_ret;
+        mutable struct stat _sb;
+
+        friend class TreeWalker;
+    };
+
+    TreeWalker(std::string path, int flags);
+    virtual ~TreeWalker();
+
+    TreeWalker(const TreeWalker &) = delete;
+    TreeWalker & operator=(const TreeWalker &) = delete;
+
+    bool run();
+    std::string error();
+
+    virtual int on_reached_directory_pre(const Entry &entry);
+    virtual int on_reached_directory_post(const Entry &entry);
+    virtual int on_reached_file(const Entry &entry);
+    virtual int on_reached_symlink(const Entry &entry);
+    virtual int on_reached_special_file(const Entry &entry);
+
+protected:
+    void set_error(const char *fmt, ...)
+            __attribute__((format(printf, 2, 3)));
+
+    // Input path
+    std::string _path;
+    // Input flags
+    int _flags;
+    // Error message (valid only if run() returned false)
+    std::string _error_msg;
+
+private:
+    int visit(Entry &entry, const Frame *parent);
+    int walk_directory(const Entry &entry, const Frame &frame);
+    bool read_directory(int fd, std::vector<char> *names,
+                        std::vector<unsigned char> *types);
+
+    bool _ran;
+    bool _failed;
+    int _saved_errno;
+    dev_t _root_dev;
+    std::vector<char> _buf;
+};
+
+}
+}
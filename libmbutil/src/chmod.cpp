@@ -20,69 +20,59 @@
 #include "mbutil/chmod.h"
 
 #include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/fts.h"
-#include "mbutil/string.h"
+#include "mbutil/walk.h"
 
 namespace mb
 {
 namespace util
 {
 
-class RecursiveChmod : public FTSWrapper {
+class RecursiveChmod : public TreeWalker {
 public:
     RecursiveChmod(std::string path, mode_t perms)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : TreeWalker(path, 0),
         _perms(perms)
     {
     }
 
-    virtual int on_reached_directory_pre() override
+    virtual int on_reached_directory_post(const Entry &entry) override
     {
-        // Do nothing. Need depth-first search, so directories are deleted in
-        // on_reached_directory_post()
-        return Action::FTS_OK;
+        // Directories are changed after their contents in case the new
+        // permissions do not allow traversal
+        return chmod_path(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_directory_post() override
+    virtual int on_reached_file(const Entry &entry) override
     {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chmod_path(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_file() override
-    {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_symlink() override
+    virtual int on_reached_symlink(const Entry &entry) override
     {
         // Avoid security issue
-        LOGW("%s: Not setting permissions on symlink",
-             _curr->fts_path);
-        return Action::FTS_Skip;
+        LOGW("%s: Not setting permissions on symlink", entry.path().c_str());
+        return Action::WALK_OK;
     }
 
-    virtual int on_reached_special_file() override
+    virtual int on_reached_special_file(const Entry &entry) override
     {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chmod_path(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
 private:
     mode_t _perms;
 
-    bool chmod_path()
+    bool chmod_path(const Entry &entry)
     {
-        if (::chmod(_curr->fts_accpath, _perms) < 0) {
-            char *msg = mb_format("%s: Failed to chmod: %s",
-                                  _curr->fts_path, strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
+        if (fchmodat(entry.dirfd, entry.name, _perms, 0) < 0) {
+            set_error("%s: Failed to chmod: %s",
+                      entry.path().c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
             return false;
         }
@@ -20,15 +20,15 @@
 #include "mbutil/chown.h"
 
 #include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/fts.h"
-#include "mbutil/string.h"
+#include "mbutil/walk.h"
 
 namespace mb
 {
@@ -47,35 +47,35 @@ static bool chown_internal(const std::string &path,
     }
 }
 
-class RecursiveChown : public FTSWrapper {
+class RecursiveChown : public TreeWalker {
 public:
     RecursiveChown(std::string path, uid_t uid, gid_t gid,
                    bool follow_symlinks)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : TreeWalker(path, 0),
         _uid(uid),
         _gid(gid),
         _follow_symlinks(follow_symlinks)
     {
     }
 
-    virtual int on_reached_directory_post() override
+    virtual int on_reached_directory_post(const Entry &entry) override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_file() override
+    virtual int on_reached_file(const Entry &entry) override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_symlink() override
+    virtual int on_reached_symlink(const Entry &entry) override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_special_file() override
+    virtual int on_reached_special_file(const Entry &entry) override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
 private:
@@ -83,15 +83,12 @@ private:
     gid_t _gid;
     bool _follow_symlinks;
 
-    bool chown_path()
+    bool chown_path(const Entry &entry)
     {
-        if (!chown_internal(_curr->fts_accpath, _uid, _gid, _follow_symlinks)) {
-            char *msg = mb_format("%s: Failed to chown: %s",
-                                  _curr->fts_path, strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
+        if (fchownat(entry.dirfd, entry.name, _uid, _gid,
+                     _follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) < 0) {
+            set_error("%s: Failed to chown: %s",
+                      entry.path().c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
             return false;
         }
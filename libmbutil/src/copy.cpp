@@ -19,21 +19,31 @@
 
 #include "mbutil/copy.h"
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <dirent.h>
 #include <fcntl.h>
-#include <fts.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
+#include <pthread.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
 #include "mbutil/path.h"
 #include "mbutil/string.h"
+#include "mbutil/thread_pool.h"
+
+#define SELINUX_XATTR           "security.selinux"
 
 // WARNING: Everything operates on paths, so it's subject to race conditions
 // Directory copy operations will not cross mountpoint boundaries
@@ -43,26 +53,291 @@ namespace mb
 namespace util
 {
 
-bool copy_data_fd(int fd_source, int fd_target)
+// Maximum size of a single copy_file_range(), sendfile(), or splice() call
+#define COPY_CHUNK_SIZE         (64 * 1024 * 1024)
+// Size of the pipe used for splice()
+#define COPY_PIPE_SIZE          (1024 * 1024)
+// Bounds for the read()/write() buffer size, which is a multiple of the block
+// size
+#define COPY_BUF_BLOCKS         64
+#define COPY_BUF_MIN_SIZE       (64 * 1024)
+#define COPY_BUF_MAX_SIZE       (1024 * 1024)
+
+namespace
 {
-    char buf[10240];
-    ssize_t nread;
 
-    while ((nread = read(fd_source, buf, sizeof buf)) > 0) {
-        char *out_ptr = buf;
-        ssize_t nwritten;
+enum class CopyResult
+{
+    // All data was copied
+    Done,
+    // Strategy is not supported for these fds and nothing was copied
+    Unsupported,
+    Failed,
+};
 
-        do {
-            if ((nwritten = write(fd_target, out_ptr, nread)) < 0) {
-                return false;
+}
+
+static bool is_unsupported_error(int error)
+{
+    return error == ENOSYS || error == EXDEV || error == EINVAL
+            || error == EOPNOTSUPP || error == EBADF;
+}
+
+/*!
+ * \brief Copy with copy_file_range()
+ *
+ * The kernel can copy the data without bouncing it through userspace (or
+ * reflink it on filesystems that support it).
+ */
+static CopyResult copy_with_range(int fd_source, int fd_target,
+                                  uint64_t *copied)
+{
+#ifdef __NR_copy_file_range
+    uint64_t total = 0;
+
+    while (true) {
+        ssize_t n = syscall(__NR_copy_file_range, fd_source, nullptr,
+                            fd_target, nullptr, COPY_CHUNK_SIZE, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (total == 0 && is_unsupported_error(errno)) {
+                return CopyResult::Unsupported;
+            }
+            return CopyResult::Failed;
+        } else if (n == 0) {
+            // Pseudo-filesystems report a size of 0, so fall back in case this
+            // is not actually an empty file
+            return total > 0 ? CopyResult::Done : CopyResult::Unsupported;
+        }
+        total += n;
+        *copied += n;
+    }
+#else
+    (void) fd_source;
+    (void) fd_target;
+    (void) copied;
+    return CopyResult::Unsupported;
+#endif
+}
+
+/*!
+ * \brief Copy with sendfile()
+ *
+ * This works for any target, but requires a source that can be mmap'ed.
+ */
+static CopyResult copy_with_sendfile(int fd_source, int fd_target,
+                                     uint64_t *copied)
+{
+    uint64_t total = 0;
+
+    while (true) {
+        ssize_t n = sendfile(fd_target, fd_source, nullptr, COPY_CHUNK_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (total == 0 && is_unsupported_error(errno)) {
+                return CopyResult::Unsupported;
+            }
+            return CopyResult::Failed;
+        } else if (n == 0) {
+            return total > 0 ? CopyResult::Done : CopyResult::Unsupported;
+        }
+        total += n;
+        *copied += n;
+    }
+}
+
+/*!
+ * \brief Copy with splice() through an intermediate pipe
+ *
+ * Data that has been moved into the pipe cannot be recovered, so once the
+ * first chunk has been spliced, failures are not reported as unsupported.
+ */
+static CopyResult copy_with_splice(int fd_source, int fd_target,
+                                   uint64_t *copied)
+{
+    int pipe_fds[2];
+
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        return CopyResult::Unsupported;
+    }
+
+    auto close_pipe = finally([&]{
+        int saved_errno = errno;
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        errno = saved_errno;
+    });
+
+    // Just a hint. The default pipe size is only 64 KiB.
+    int pipe_size = fcntl(pipe_fds[1], F_SETPIPE_SZ, COPY_PIPE_SIZE);
+    if (pipe_size <= 0) {
+        pipe_size = 64 * 1024;
+    }
+
+    uint64_t total = 0;
+
+    while (true) {
+        ssize_t n = splice(fd_source, nullptr, pipe_fds[1], nullptr, pipe_size,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (total == 0 && is_unsupported_error(errno)) {
+                return CopyResult::Unsupported;
+            }
+            return CopyResult::Failed;
+        } else if (n == 0) {
+            return total > 0 ? CopyResult::Done : CopyResult::Unsupported;
+        }
+
+        while (n > 0) {
+            ssize_t m = splice(pipe_fds[0], nullptr, fd_target, nullptr, n,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return CopyResult::Failed;
+            } else if (m == 0) {
+                errno = EIO;
+                return CopyResult::Failed;
+            }
+            n -= m;
+            total += m;
+            *copied += m;
+        }
+    }
+}
+
+/*!
+ * \brief Copy with read() and write() through a page-aligned buffer
+ */
+static CopyResult copy_with_buffer(int fd_source, int fd_target,
+                                   size_t block_size, uint64_t *copied)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t buf_size = std::min<size_t>(std::max<size_t>(
+            block_size * COPY_BUF_BLOCKS, COPY_BUF_MIN_SIZE), COPY_BUF_MAX_SIZE);
+    buf_size = (buf_size + page_size - 1) / page_size * page_size;
+
+    void *buf;
+    int ret = posix_memalign(&buf, page_size, buf_size);
+    if (ret != 0) {
+        errno = ret;
+        return CopyResult::Failed;
+    }
+
+    auto free_buf = finally([&]{
+        free(buf);
+    });
+
+    while (true) {
+        ssize_t nread = read(fd_source, buf, buf_size);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return CopyResult::Failed;
+        } else if (nread == 0) {
+            return CopyResult::Done;
+        }
+
+        char *out_ptr = static_cast<char *>(buf);
+
+        while (nread > 0) {
+            ssize_t nwritten = write(fd_target, out_ptr, nread);
+            if (nwritten < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return CopyResult::Failed;
             }
 
             nread -= nwritten;
             out_ptr += nwritten;
-        } while (nread > 0);
+            *copied += nwritten;
+        }
+    }
+}
+
+/*!
+ * \brief Copy data from the current offset of one fd to another
+ *
+ * The fastest available strategy is used: copy_file_range(), then sendfile(),
+ * then splice() through a pipe, and finally read() and write() with a large
+ * buffer sized from the block size. If the target is a regular file, space for
+ * the data is preallocated with fallocate() (without changing the file size).
+ *
+ * \param fd_source Source fd
+ * \param fd_target Target fd
+ * \param[out] stats Number of bytes copied and strategy used (optional)
+ *
+ * \return True if all data was copied. Otherwise, false with errno set
+ *         appropriately.
+ */
+bool copy_data_fd(int fd_source, int fd_target, CopyStats *stats)
+{
+    CopyStats local_stats;
+    if (!stats) {
+        stats = &local_stats;
+    }
+    stats->bytes = 0;
+    stats->strategy = CopyStrategy::None;
+
+    struct stat sb_source;
+    struct stat sb_target;
+    bool have_source = fstat(fd_source, &sb_source) == 0;
+    bool have_target = fstat(fd_target, &sb_target) == 0;
+    size_t block_size = 0;
+
+    if (have_source) {
+        block_size = std::max<size_t>(block_size, sb_source.st_blksize);
+    }
+    if (have_target) {
+        block_size = std::max<size_t>(block_size, sb_target.st_blksize);
     }
 
-    return nread == 0;
+    // These are just hints, so errors don't matter
+    if (have_source && S_ISREG(sb_source.st_mode)) {
+        posix_fadvise(fd_source, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        off_t offset_source = lseek(fd_source, 0, SEEK_CUR);
+        off_t offset_target = lseek(fd_target, 0, SEEK_CUR);
+
+        if (have_target && S_ISREG(sb_target.st_mode) && offset_source >= 0
+                && offset_target >= 0 && sb_source.st_size > offset_source) {
+            fallocate(fd_target, FALLOC_FL_KEEP_SIZE, offset_target,
+                      sb_source.st_size - offset_source);
+        }
+    }
+
+    static const struct {
+        CopyStrategy strategy;
+        CopyResult (*func)(int, int, uint64_t *);
+    } strategies[] = {
+        { CopyStrategy::CopyFileRange, &copy_with_range },
+        { CopyStrategy::Sendfile, &copy_with_sendfile },
+        { CopyStrategy::Splice, &copy_with_splice },
+    };
+
+    for (auto const &s : strategies) {
+        switch (s.func(fd_source, fd_target, &stats->bytes)) {
+        case CopyResult::Done:
+            stats->strategy = s.strategy;
+            return true;
+        case CopyResult::Failed:
+            stats->strategy = s.strategy;
+            return false;
+        case CopyResult::Unsupported:
+            break;
+        }
+    }
+
+    stats->strategy = CopyStrategy::ReadWrite;
+    return copy_with_buffer(fd_source, fd_target, block_size, &stats->bytes)
+            == CopyResult::Done;
 }
 
 static bool copy_data(const std::string &source, const std::string &target)
@@ -95,16 +370,94 @@ static bool copy_data(const std::string &source, const std::string &target)
     return true;
 }
 
-bool copy_xattrs(const std::string &source, const std::string &target)
+namespace
+{
+
+/*!
+ * \brief Buffers for copying xattrs
+ *
+ * Each thread has its own set, which grows to fit the largest list of names and
+ * value seen by the thread.
+ */
+struct XattrBuffers
 {
-    ssize_t size;
     std::vector<char> names;
-    char *end_names;
-    char *name;
     std::vector<char> value;
+};
+
+}
+
+static pthread_once_t xattr_buffers_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xattr_buffers_key;
+
+static void free_xattr_buffers(void *data)
+{
+    delete static_cast<XattrBuffers *>(data);
+}
+
+static void create_xattr_buffers_key()
+{
+    pthread_key_create(&xattr_buffers_key, &free_xattr_buffers);
+}
+
+static XattrBuffers * get_xattr_buffers()
+{
+    pthread_once(&xattr_buffers_once, &create_xattr_buffers_key);
+
+    XattrBuffers *buffers =
+            static_cast<XattrBuffers *>(pthread_getspecific(xattr_buffers_key));
+    if (!buffers) {
+        buffers = new XattrBuffers();
+        buffers->names.resize(1024);
+        buffers->value.resize(1024);
+        pthread_setspecific(xattr_buffers_key, buffers);
+    }
+
+    return buffers;
+}
+
+/*!
+ * \brief Call a listxattr/getxattr-like function, growing the buffer if needed
+ *
+ * The existing buffer is tried first, so the size only needs to be queried if
+ * the buffer is too small.
+ */
+template<typename XattrFn>
+static ssize_t read_xattr(XattrFn fn, std::vector<char> *buf)
+{
+    while (true) {
+        ssize_t size = fn(buf->data(), buf->size());
+        if (size >= 0 || errno != ERANGE) {
+            return size;
+        }
+
+        size = fn(nullptr, 0);
+        if (size < 0) {
+            return size;
+        }
+
+        // Leave room for the value to grow before the next call
+        buf->resize(size + size / 2 + 1);
+    }
+}
+
+/*!
+ * \brief Copy all xattrs using the xattr functions for paths or fds
+ *
+ * The SELinux label is not set if the target already has the same label, which
+ * is common when the target inherits the label from its parent directory.
+ */
+template<typename ListFn, typename GetFn, typename GetTargetFn, typename SetFn>
+static bool copy_xattrs_impl(ListFn list_fn, GetFn get_fn,
+                             GetTargetFn get_target_fn, SetFn set_fn,
+                             const std::string &source,
+                             const std::string &target)
+{
+    XattrBuffers *buffers = get_xattr_buffers();
+    ssize_t size;
 
     // xattr names are in a NULL-separated list
-    size = llistxattr(source.c_str(), nullptr, 0);
+    size = read_xattr(list_fn, &buffers->names);
     if (size < 0) {
         if (errno == ENOTSUP) {
             LOGV("%s: xattrs not supported on source filesystem",
@@ -117,40 +470,35 @@ bool copy_xattrs(const std::string &source, const std::string &target)
         }
     }
 
-    names.resize(size + 1);
-
-    size = llistxattr(source.c_str(), names.data(), size);
-    if (size < 0) {
-        LOGE("%s: Failed to list xattrs on second try: %s",
-             source.c_str(), strerror(errno));
-        return false;
-    } else {
-        names[size] = '\0';
-        end_names = names.data() + size;
-    }
+    // The value buffer may be reallocated, but the names buffer is not used
+    // for anything else until the loop finishes
+    const char *end_names = buffers->names.data() + size;
 
-    for (name = names.data(); name != end_names; name = strchr(name, '\0') + 1) {
+    for (const char *name = buffers->names.data(); name < end_names;
+            name += strlen(name) + 1) {
         if (!*name) {
             continue;
         }
 
-        size = lgetxattr(source.c_str(), name, nullptr, 0);
+        size = read_xattr([&](void *value, size_t value_size) {
+            return get_fn(name, value, value_size);
+        }, &buffers->value);
         if (size < 0) {
             LOGW("%s: Failed to get attribute '%s': %s",
                  source.c_str(), name, strerror(errno));
             continue;
         }
 
-        value.resize(size);
-
-        size = lgetxattr(source.c_str(), name, value.data(), size);
-        if (size < 0) {
-            LOGW("%s: Failed to get attribute '%s' on second try: %s",
-                 source.c_str(), name, strerror(errno));
-            continue;
+        if (strcmp(name, SELINUX_XATTR) == 0) {
+            char label[256];
+            ssize_t label_size = get_target_fn(name, label, sizeof(label));
+            if (label_size == size
+                    && memcmp(label, buffers->value.data(), size) == 0) {
+                continue;
+            }
         }
 
-        if (lsetxattr(target.c_str(), name, value.data(), size, 0) < 0) {
+        if (set_fn(name, buffers->value.data(), size) < 0) {
             if (errno == ENOTSUP) {
                 LOGV("%s: xattrs not supported on target filesystem",
                      target.c_str());
@@ -166,6 +514,56 @@ bool copy_xattrs(const std::string &source, const std::string &target)
     return true;
 }
 
+bool copy_xattrs(const std::string &source, const std::string &target)
+{
+    return copy_xattrs_impl(
+        [&](char *list, size_t size) {
+            return llistxattr(source.c_str(), list, size);
+        },
+        [&](const char *name, void *value, size_t size) {
+            return lgetxattr(source.c_str(), name, value, size);
+        },
+        [&](const char *name, void *value, size_t size) {
+            return lgetxattr(target.c_str(), name, value, size);
+        },
+        [&](const char *name, const void *value, size_t size) {
+            return lsetxattr(target.c_str(), name, value, size, 0);
+        },
+        source, target);
+}
+
+static bool copy_xattrs_fd(int fd_source, int fd_target,
+                           const std::string &source, const std::string &target)
+{
+    return copy_xattrs_impl(
+        [&](char *list, size_t size) {
+            return flistxattr(fd_source, list, size);
+        },
+        [&](const char *name, void *value, size_t size) {
+            return fgetxattr(fd_source, name, value, size);
+        },
+        [&](const char *name, void *value, size_t size) {
+            return fgetxattr(fd_target, name, value, size);
+        },
+        [&](const char *name, const void *value, size_t size) {
+            return fsetxattr(fd_target, name, value, size, 0);
+        },
+        source, target);
+}
+
+/*!
+ * \brief Same as copy_xattrs(), but operating on open file descriptors
+ *
+ * Buffers are reused across calls on the same thread, so copying the xattrs of
+ * many files does not allocate memory for every file and attribute.
+ */
+bool fcopy_xattrs(int fd_source, int fd_target)
+{
+    return copy_xattrs_fd(fd_source, fd_target,
+                          "<fd " + std::to_string(fd_source) + ">",
+                          "<fd " + std::to_string(fd_target) + ">");
+}
+
 bool copy_stat(const std::string &source, const std::string &target)
 {
     struct stat sb;
@@ -191,6 +589,26 @@ bool copy_stat(const std::string &source, const std::string &target)
     return true;
 }
 
+/*!
+ * \brief Same as copy_stat(), but operating on an open file descriptor
+ */
+static bool copy_stat_fd(const struct stat &sb, int fd_target,
+                         const std::string &target)
+{
+    if (fchown(fd_target, sb.st_uid, sb.st_gid) < 0) {
+        LOGE("%s: Failed to chown: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fchmod(fd_target, sb.st_mode & (S_ISUID | S_ISGID | S_ISVTX
+                                      | S_IRWXU | S_IRWXG | S_IRWXO)) < 0) {
+        LOGE("%s: Failed to chmod: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 bool copy_contents(const std::string &source, const std::string &target)
 {
     int fd_source = -1;
@@ -321,395 +739,606 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
     return true;
 }
 
+// Use more threads than CPUs since copying is mostly I/O bound and flash
+// storage performs best with many requests in flight
+#define COPY_DIR_MAX_THREADS    8
+// Maximum number of entries waiting to be copied. Each one holds a reference to
+// its directory's fds, so this also bounds the number of open fds.
+#define COPY_DIR_MAX_PENDING    256
+
+namespace
+{
+
+/*!
+ * \brief Open source and target directories
+ *
+ * Entries are copied relative to these fds, so paths are only resolved once per
+ * directory. The fds are closed when the last entry referencing the directory
+ * has been copied.
+ */
+struct CopyDirFds
+{
+    int source_fd = -1;
+    int target_fd = -1;
+    std::string source_path;
+    std::string target_path;
+
+    ~CopyDirFds()
+    {
+        if (source_fd >= 0) {
+            close(source_fd);
+        }
+        if (target_fd >= 0) {
+            close(target_fd);
+        }
+    }
+};
 
-class RecursiveCopier : public FTSWrapper {
+/*!
+ * \brief Recursive copy with a directory-scanning producer and a pool of
+ *        copy threads
+ *
+ * The calling thread walks the source tree depth-first, creating each target
+ * directory before its entries are queued. Files, symlinks, and special files
+ * are copied by the worker threads. Once all entries have been copied, the
+ * directory attributes are applied in reverse order (children before parents)
+ * so that restrictive modes do not prevent the copy and so that nothing
+ * modifies a directory after its attributes are set.
+ */
+class ParallelCopier
+{
 public:
-    RecursiveCopier(std::string path, std::string target, int copyflags)
-        : FTSWrapper(path, 0), _copyflags(copyflags), _target(target) {
+    ParallelCopier(const std::string &source, const std::string &target,
+                   int flags, const CopyFilter &filter)
+        : _source(source)
+        , _target(target)
+        , _flags(flags)
+        , _filter(filter)
+        , _pool(std::min(ThreadPool::default_size() * 2,
+                         static_cast<unsigned int>(COPY_DIR_MAX_THREADS)))
+        , _failed(false)
+        , _errno(0)
+    {
     }
 
-    virtual bool on_pre_execute() override
+    bool run();
+
+private:
+    struct PendingDir
     {
-        // This is almost *never* useful, so we won't allow it
-        if (_copyflags & COPY_FOLLOW_SYMLINKS) {
-            _error_msg = "COPY_FOLLOW_SYMLINKS not allowed for recursive copies";
-            LOGE("%s", _error_msg.c_str());
-            return false;
-        }
+        std::shared_ptr<CopyDirFds> parent;
+        std::string name;
+        std::string rel_path;
+    };
 
-        // Create the target directory if it doesn't exist
-        if (mkdir(_target.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
-                && errno != EEXIST) {
-            char *msg = mb_format("%s: Failed to create directory: %s",
-                                  _target.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGE("%s", _error_msg.c_str());
-            return false;
-        }
+    struct PostDir
+    {
+        std::string source_path;
+        std::string target_path;
+    };
 
-        // Ensure target is a directory
+    std::string _source;
+    std::string _target;
+    std::string _root_target;
+    int _flags;
+    const CopyFilter &_filter;
+    ThreadPool _pool;
+    struct stat _sb_target;
+    dev_t _dev;
+
+    std::vector<PendingDir> _dirs;
+    std::vector<PostDir> _post_dirs;
+
+    std::mutex _error_lock;
+    bool _failed;
+    int _errno;
+
+    void set_failed(int error);
+    bool open_dir(const PendingDir &pending,
+                  std::shared_ptr<CopyDirFds> *out);
+    void scan_dir(const std::shared_ptr<CopyDirFds> &dir,
+                  const std::string &rel_path);
+    void copy_entry(const CopyDirFds &dir, const char *name);
+    bool copy_regular_file(const CopyDirFds &dir, const char *name,
+                           const std::string &source,
+                           const std::string &target);
+    void apply_dir_attrs(const PostDir &post);
+};
 
-        if (stat(_target.c_str(), &sb_target) < 0) {
-            char *msg = mb_format("%s: Failed to stat: %s",
-                                  _target.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGE("%s", _error_msg.c_str());
-            return false;
-        }
+void ParallelCopier::set_failed(int error)
+{
+    std::lock_guard<std::mutex> lock(_error_lock);
+    if (!_failed) {
+        _failed = true;
+        _errno = error;
+    }
+}
 
-        if (!S_ISDIR(sb_target.st_mode)) {
-            char *msg = mb_format("%s: Target exists but is not a directory",
-                                  _target.c_str());
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGE("%s", _error_msg.c_str());
-            return false;
-        }
+bool ParallelCopier::run()
+{
+    // This is almost *never* useful, so we won't allow it
+    if (_flags & COPY_FOLLOW_SYMLINKS) {
+        LOGE("COPY_FOLLOW_SYMLINKS not allowed for recursive copies");
+        errno = EINVAL;
+        return false;
+    }
 
-        return true;
+    // Create the target directory if it doesn't exist
+    if (mkdir(_target.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
+            && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             _target.c_str(), strerror(errno));
+        return false;
     }
 
-    virtual int on_changed_path() override
-    {
-        // Make sure we aren't copying the target on top of itself
-        if (sb_target.st_dev == _curr->fts_statp->st_dev
-                && sb_target.st_ino == _curr->fts_statp->st_ino) {
-            char *msg = mb_format("%s: Cannot copy on top of itself",
-                                  _curr->fts_path);
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGE("%s", _error_msg.c_str());
-            return Action::FTS_Fail | Action::FTS_Stop;
-        }
+    // Ensure target is a directory
+    if (stat(_target.c_str(), &_sb_target) < 0) {
+        LOGE("%s: Failed to stat: %s", _target.c_str(), strerror(errno));
+        return false;
+    }
 
-        // According to fts_read()'s manpage, fts_path includes the path given
-        // to fts_open() as a prefix, so 'curr->fts_path + strlen(source)' will
-        // give us a relative path we can append to the target.
-        _curtgtpath.clear();
+    if (!S_ISDIR(_sb_target.st_mode)) {
+        LOGE("%s: Target exists but is not a directory", _target.c_str());
+        errno = ENOTDIR;
+        return false;
+    }
 
-        char *relpath = _curr->fts_path + _path.size();
+    struct stat sb;
+    if (lstat(_source.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", _source.c_str(), strerror(errno));
+        return false;
+    }
 
-        _curtgtpath += _target;
-        if (!(_copyflags & COPY_EXCLUDE_TOP_LEVEL)) {
-            if (_curtgtpath.back() != '/') {
-                _curtgtpath += "/";
-            }
-            _curtgtpath += _root->fts_name;
+    if (!S_ISDIR(sb.st_mode)) {
+        std::string target = _target;
+        if (!(_flags & COPY_EXCLUDE_TOP_LEVEL)) {
+            target += "/";
+            target += base_name(_source);
         }
-        if (_curtgtpath.back() != '/'
-                && *relpath != '/' && *relpath != '\0') {
-            _curtgtpath += "/";
+        return copy_file(_source, target, _flags);
+    }
+
+    _dev = sb.st_dev;
+
+    _root_target = _target;
+    if (!(_flags & COPY_EXCLUDE_TOP_LEVEL)) {
+        if (_root_target.back() != '/') {
+            _root_target += "/";
         }
-        _curtgtpath += relpath;
+        _root_target += base_name(_source);
+    }
+
+    // The root directory is opened relative to the current directory. The
+    // fds are negative, so they are never closed.
+    auto cwd = std::make_shared<CopyDirFds>();
+    cwd->source_fd = AT_FDCWD;
+    cwd->target_fd = AT_FDCWD;
 
-        return Action::FTS_OK;
+    std::shared_ptr<CopyDirFds> root;
+    if (!open_dir({ cwd, std::string(), std::string() }, &root)) {
+        errno = _errno;
+        return false;
     }
 
-    virtual int on_reached_directory_pre() override
-    {
-        // Skip tree?
-        bool skip = false;
-        bool success = true;
-
-        struct stat sb;
-
-        // Create target directory if it doesn't exist
-        if (mkdir(_curtgtpath.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
-                && errno != EEXIST) {
-            char *msg = mb_format("%s: Failed to create directory: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            success = false;
-            skip = true;
-        }
-
-        // Ensure target path is a directory
-        if (!skip && stat(_curtgtpath.c_str(), &sb) == 0
-                && !S_ISDIR(sb.st_mode)) {
-            char *msg = mb_format("%s: Exists but is not a directory",
-                                  _curtgtpath.c_str());
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            success = false;
-            skip = true;
-        }
+    scan_dir(root, std::string());
+    root.reset();
 
-        // If we're skipping, then we have to set the attributes now, since
-        // on_reached_directory_post() won't be called
-        if (skip) {
-            if (!cp_attrs()) {
-                success = false;
-            }
+    while (!_dirs.empty()) {
+        PendingDir pending = std::move(_dirs.back());
+        _dirs.pop_back();
 
-            if (!cp_xattrs()) {
-                success = false;
-            }
+        std::shared_ptr<CopyDirFds> dir;
+        if (open_dir(pending, &dir) && dir) {
+            scan_dir(dir, pending.rel_path);
         }
+    }
+
+    _pool.wait();
 
-        return (skip ? Action::FTS_Skip : 0)
-                | (success ? Action::FTS_OK : Action::FTS_Fail);
+    for (auto it = _post_dirs.rbegin(); it != _post_dirs.rend(); ++it) {
+        apply_dir_attrs(*it);
     }
 
-    virtual int on_reached_directory_post() override
-    {
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+    if (_failed) {
+        errno = _errno;
+        return false;
+    }
+    return true;
+}
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+/*!
+ * \brief Create the target directory and open the source and target
+ *
+ * \param[out] out Set to nullptr if the directory should not be scanned
+ *
+ * \return Whether the directory was successfully created
+ */
+bool ParallelCopier::open_dir(const PendingDir &pending,
+                              std::shared_ptr<CopyDirFds> *out)
+{
+    auto const &parent = *pending.parent;
+    auto dir = std::make_shared<CopyDirFds>();
 
-        return Action::FTS_OK;
+    if (parent.source_fd == AT_FDCWD) {
+        dir->source_path = _source;
+        dir->target_path = _root_target;
+    } else {
+        dir->source_path = parent.source_path + "/" + pending.name;
+        dir->target_path = parent.target_path + "/" + pending.name;
     }
 
-    virtual int on_reached_file() override
-    {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
+    const char *source_name = parent.source_fd == AT_FDCWD
+            ? dir->source_path.c_str() : pending.name.c_str();
+    const char *target_name = parent.target_fd == AT_FDCWD
+            ? dir->target_path.c_str() : pending.name.c_str();
 
-        // Copy file contents
-        if (!copy_data(_curr->fts_accpath, _curtgtpath)) {
-            char *msg = mb_format("%s: Failed to copy data: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
+    *out = nullptr;
 
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+    dir->source_fd = openat(parent.source_fd, source_name,
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir->source_fd < 0) {
+        LOGW("%s: Failed to open directory: %s",
+             dir->source_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return false;
+    }
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+    struct stat sb;
+    if (fstat(dir->source_fd, &sb) < 0) {
+        LOGW("%s: Failed to stat: %s",
+             dir->source_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return false;
+    }
 
-        return Action::FTS_OK;
+    // Make sure we aren't copying the target on top of itself
+    if (sb.st_dev == _sb_target.st_dev && sb.st_ino == _sb_target.st_ino) {
+        LOGE("%s: Cannot copy on top of itself", dir->source_path.c_str());
+        set_failed(EINVAL);
+        return false;
     }
 
-    virtual int on_reached_symlink() override
-    {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        // Find current symlink target
-        std::string symlink_path;
-        if (!read_link(_curr->fts_accpath, &symlink_path)) {
-            char *msg = mb_format("%s: Failed to read symlink path: %s",
-                                  _curr->fts_accpath, strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
+    // Create target directory if it doesn't exist
+    if (mkdirat(parent.target_fd, target_name,
+                S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST) {
+        LOGW("%s: Failed to create directory: %s",
+             dir->target_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return false;
+    }
 
-        // Create new symlink
-        if (symlink(symlink_path.c_str(), _curtgtpath.c_str()) < 0) {
-            char *msg = mb_format("%s: Failed to create symlink: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
+    // Ensure target path is a directory
+    dir->target_fd = openat(parent.target_fd, target_name,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir->target_fd < 0) {
+        LOGW("%s: Failed to open directory: %s",
+             dir->target_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return false;
+    }
 
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+    _post_dirs.push_back({ dir->source_path, dir->target_path });
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+    // Directory copy operations will not cross mountpoint boundaries. Like
+    // fts with FTS_XDEV, the mountpoint itself is copied, but not its contents.
+    if (sb.st_dev == _dev) {
+        *out = std::move(dir);
+    }
+
+    return true;
+}
 
-        return Action::FTS_OK;
+/*!
+ * \brief Queue all entries in a directory
+ *
+ * Subdirectories are added to the stack of directories to scan. Everything
+ * else is copied by the thread pool.
+ */
+void ParallelCopier::scan_dir(const std::shared_ptr<CopyDirFds> &dir,
+                              const std::string &rel_path)
+{
+    // fdopendir() takes ownership of the fd
+    int fd = dup(dir->source_fd);
+    if (fd < 0) {
+        LOGW("%s: Failed to dup fd: %s",
+             dir->source_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return;
     }
 
-    virtual int on_reached_block_device() override
-    {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
+    DIR *dp = fdopendir(fd);
+    if (!dp) {
+        LOGW("%s: Failed to open directory: %s",
+             dir->source_path.c_str(), strerror(errno));
+        set_failed(errno);
+        close(fd);
+        return;
+    }
 
-        if (mknod(_curtgtpath.c_str(), S_IFBLK | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
-            char *msg = mb_format("%s: Failed to create block device: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
+    auto close_dp = finally([&]{
+        closedir(dp);
+    });
 
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+    // Subdirectories are pushed in reverse so they are scanned in readdir order
+    size_t dirs_begin = _dirs.size();
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+    struct dirent *ent;
+    while ((errno = 0, ent = readdir(dp))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
         }
 
-        return Action::FTS_OK;
-    }
+        std::string entry_path = rel_path;
+        if (!entry_path.empty()) {
+            entry_path += "/";
+        }
+        entry_path += ent->d_name;
 
-    virtual int on_reached_character_device() override
-    {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
+        if (_filter && !_filter(entry_path)) {
+            continue;
         }
 
-        if (mknod(_curtgtpath.c_str(), S_IFCHR | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
-            char *msg = mb_format("%s: Failed to create character device: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat sb;
+            if (fstatat(dir->source_fd, ent->d_name, &sb,
+                        AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode)) {
+                type = DT_DIR;
             }
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
         }
 
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+        if (type == DT_DIR) {
+            _dirs.push_back({ dir, ent->d_name, std::move(entry_path) });
+        } else if (type == DT_SOCK) {
+            LOGD("%s/%s: Skipping socket",
+                 dir->source_path.c_str(), ent->d_name);
+        } else {
+            _pool.wait(COPY_DIR_MAX_PENDING);
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+            std::shared_ptr<CopyDirFds> ref = dir;
+            std::string name = ent->d_name;
+            _pool.submit([this, ref, name]{
+                copy_entry(*ref, name.c_str());
+            });
         }
+    }
+    if (errno != 0) {
+        LOGW("%s: Failed to read directory: %s",
+             dir->source_path.c_str(), strerror(errno));
+        set_failed(errno);
+    }
+
+    std::reverse(_dirs.begin() + dirs_begin, _dirs.end());
+}
+
+/*!
+ * \brief Copy a non-directory entry (runs on a worker thread)
+ */
+void ParallelCopier::copy_entry(const CopyDirFds &dir, const char *name)
+{
+    std::string source = dir.source_path + "/" + name;
+    std::string target = dir.target_path + "/" + name;
 
-        return Action::FTS_OK;
+    // Remove existing file
+    if (unlinkat(dir.target_fd, name, 0) < 0 && errno != ENOENT) {
+        LOGW("%s: Failed to remove old path: %s",
+             target.c_str(), strerror(errno));
+        set_failed(errno);
+        return;
     }
 
-    virtual int on_reached_fifo() override
-    {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
+    struct stat sb;
+    if (fstatat(dir.source_fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        LOGW("%s: Failed to stat: %s", source.c_str(), strerror(errno));
+        set_failed(errno);
+        return;
+    }
+
+    switch (sb.st_mode & S_IFMT) {
+    case S_IFREG:
+        if (!copy_regular_file(dir, name, source, target)) {
+            set_failed(errno);
+        }
+        return;
+
+    case S_IFLNK: {
+        std::vector<char> buf(sb.st_size > 0 ? sb.st_size + 1 : PATH_MAX);
+        ssize_t n = readlinkat(dir.source_fd, name, buf.data(), buf.size());
+        if (n < 0 || static_cast<size_t>(n) == buf.size()) {
+            LOGW("%s: Failed to read symlink path: %s",
+                 source.c_str(), n < 0 ? strerror(errno) : "Truncated");
+            set_failed(n < 0 ? errno : ENAMETOOLONG);
+            return;
         }
+        buf[n] = '\0';
 
-        if (mkfifo(_curtgtpath.c_str(), S_IRWXU) < 0) {
-            char *msg = mb_format("%s: Failed to create FIFO pipe: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
+        if (symlinkat(buf.data(), dir.target_fd, name) < 0) {
+            LOGW("%s: Failed to create symlink: %s",
+                 target.c_str(), strerror(errno));
+            set_failed(errno);
+            return;
         }
+        break;
+    }
 
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
+    case S_IFBLK:
+    case S_IFCHR:
+    case S_IFIFO:
+        if (mknodat(dir.target_fd, name, (sb.st_mode & S_IFMT) | S_IRWXU,
+                    sb.st_rdev) < 0) {
+            LOGW("%s: Failed to create %s: %s", target.c_str(),
+                 S_ISBLK(sb.st_mode) ? "block device"
+                         : S_ISCHR(sb.st_mode) ? "character device"
+                         : "FIFO pipe",
+                 strerror(errno));
+            set_failed(errno);
+            return;
         }
+        break;
+
+    default:
+        LOGD("%s: Skipping unsupported file type", source.c_str());
+        return;
+    }
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+    // Symlinks and special files cannot be opened without side effects, so
+    // their attributes are set by name
+    if (_flags & COPY_ATTRIBUTES) {
+        if (fchownat(dir.target_fd, name, sb.st_uid, sb.st_gid,
+                     AT_SYMLINK_NOFOLLOW) < 0
+                || (!S_ISLNK(sb.st_mode) && fchmodat(
+                        dir.target_fd, name, sb.st_mode & (S_ISUID | S_ISGID
+                                | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO),
+                        0) < 0)) {
+            LOGW("%s: Failed to copy attributes: %s",
+                 target.c_str(), strerror(errno));
+            set_failed(errno);
+            return;
         }
+    }
+    if ((_flags & COPY_XATTRS) && !copy_xattrs(source, target)) {
+        LOGW("%s: Failed to copy xattrs: %s",
+             target.c_str(), strerror(errno));
+        set_failed(errno);
+    }
+}
 
-        return Action::FTS_OK;
+bool ParallelCopier::copy_regular_file(const CopyDirFds &dir, const char *name,
+                                       const std::string &source,
+                                       const std::string &target)
+{
+    int fd_source = openat(dir.source_fd, name,
+                           O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd_source < 0) {
+        LOGW("%s: Failed to open: %s", source.c_str(), strerror(errno));
+        return false;
     }
 
-    virtual int on_reached_socket() override
-    {
-        LOGD("%s: Skipping socket", _curr->fts_accpath);
-        return Action::FTS_Skip;
+    auto close_source_fd = finally([&] {
+        close(fd_source);
+    });
+
+    struct stat sb;
+    if (fstat(fd_source, &sb) < 0) {
+        LOGW("%s: Failed to stat: %s", source.c_str(), strerror(errno));
+        return false;
     }
 
-private:
-    int _copyflags;
-    std::string _target;
-    struct stat sb_target;
-    std::string _curtgtpath;
+    int fd_target = openat(dir.target_fd, name,
+                           O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd_target < 0) {
+        LOGW("%s: Failed to open: %s", target.c_str(), strerror(errno));
+        return false;
+    }
 
-    bool remove_existing_file()
-    {
-        // Remove existing file
-        if (unlink(_curtgtpath.c_str()) < 0 && errno != ENOENT) {
-            char *msg = mb_format("%s: Failed to remove old path: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
+    auto close_target_fd = finally([&] {
+        close(fd_target);
+    });
+
+    if (!copy_data_fd(fd_source, fd_target)) {
+        LOGW("%s: Failed to copy data: %s", target.c_str(), strerror(errno));
+        return false;
     }
 
-    bool cp_attrs()
-    {
-        if ((_copyflags & COPY_ATTRIBUTES)
-                && !copy_stat(_curr->fts_accpath, _curtgtpath)) {
-            char *msg = mb_format("%s: Failed to copy attributes: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
+    if ((_flags & COPY_ATTRIBUTES) && !copy_stat_fd(sb, fd_target, target)) {
+        LOGW("%s: Failed to copy attributes: %s",
+             target.c_str(), strerror(errno));
+        return false;
     }
 
-    bool cp_xattrs()
-    {
-        if ((_copyflags & COPY_XATTRS)
-                && !copy_xattrs(_curr->fts_accpath, _curtgtpath)) {
-            char *msg = mb_format("%s: Failed to copy xattrs: %s",
-                                  _curtgtpath.c_str(), strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
+    if ((_flags & COPY_XATTRS)
+            && !copy_xattrs_fd(fd_source, fd_target, source, target)) {
+        LOGW("%s: Failed to copy xattrs: %s",
+             target.c_str(), strerror(errno));
+        return false;
     }
-};
 
+    return true;
+}
 
-// Copy as much as possible
-bool copy_dir(const std::string &source, const std::string &target, int flags)
+void ParallelCopier::apply_dir_attrs(const PostDir &post)
 {
-    mode_t old_umask = umask(0);
+    if (!(_flags & (COPY_ATTRIBUTES | COPY_XATTRS))) {
+        return;
+    }
+
+    int fd_source = open(post.source_path.c_str(),
+                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd_source < 0) {
+        LOGW("%s: Failed to open directory: %s",
+             post.source_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return;
+    }
+
+    auto close_source_fd = finally([&] {
+        close(fd_source);
+    });
 
-    RecursiveCopier copier(source, target, flags);
-    bool ret = copier.run();
+    int fd_target = open(post.target_path.c_str(),
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd_target < 0) {
+        LOGW("%s: Failed to open directory: %s",
+             post.target_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return;
+    }
 
-    umask(old_umask);
+    auto close_target_fd = finally([&] {
+        close(fd_target);
+    });
+
+    struct stat sb;
+    if (fstat(fd_source, &sb) < 0) {
+        LOGW("%s: Failed to stat: %s",
+             post.source_path.c_str(), strerror(errno));
+        set_failed(errno);
+        return;
+    }
+
+    if ((_flags & COPY_ATTRIBUTES)
+            && !copy_stat_fd(sb, fd_target, post.target_path)) {
+        LOGW("%s: Failed to copy attributes: %s",
+             post.target_path.c_str(), strerror(errno));
+        set_failed(errno);
+    }
+
+    if ((_flags & COPY_XATTRS) && !copy_xattrs_fd(
+            fd_source, fd_target, post.source_path, post.target_path)) {
+        LOGW("%s: Failed to copy xattrs: %s",
+             post.target_path.c_str(), strerror(errno));
+        set_failed(errno);
+    }
+}
+
+}
+
+/*!
+ * \brief Recursively copy a directory
+ *
+ * Files are copied in parallel by a pool of threads. Like `cp -r`, as much as
+ * possible is copied even if errors occur.
+ *
+ * \param source Source directory
+ * \param target Target directory. It is created if it does not exist.
+ * \param flags \ref CopyFlags
+ * \param filter If not empty, only paths for which the filter returns true are
+ *               copied
+ *
+ * \return Whether everything was successfully copied. errno is set to the
+ *         error that occurred first.
+ */
+bool copy_dir(const std::string &source, const std::string &target, int flags,
+              const CopyFilter &filter)
+{
+    mode_t old_umask = umask(0);
+
+    auto restore_umask = finally([&] {
+        umask(old_umask);
+    });
 
-    return ret;
+    ParallelCopier copier(source, target, flags, filter);
+    return copier.run();
 }
 
 }
@@ -19,81 +19,741 @@
 
 #include "mbutil/delete.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
 #include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/fts.h"
-#include "mbutil/string.h"
+#include "mbutil/finally.h"
+#include "mbutil/path.h"
+#include "mbutil/thread_pool.h"
+
+// Hidden directory that DELETE_ASYNC moves files into. It is created in the
+// parent directory of the files so that they can be renamed. An existing entry
+// with this name is only treated as a trash directory if it looks like one that
+// was created here (see is_trash_dir()).
+#define DELETE_TRASH_DIR        ".mbtool-delete-trash~"
+#define DELETE_TRASH_MODE       0700
+
+#define DELETE_MAX_THREADS      8
+// Subdirectories are handled by the current thread once this many directories
+// per thread are waiting to be processed
+#define DELETE_MAX_QUEUED       2
+// Directories at least this deep do not keep their fd open while their
+// subdirectories are being deleted
+#define DELETE_MAX_OPEN_DEPTH   16
 
 namespace mb
 {
 namespace util
 {
 
-class RecursiveDeleter : public FTSWrapper {
+namespace
+{
+
+/*!
+ * \brief Parallel recursive deleter using directory fds
+ *
+ * Each directory's entries are read in full and then removed with unlinkat().
+ * Subdirectories are handed to a thread pool while there are idle workers and
+ * are otherwise pushed onto the current thread's work list. A directory is
+ * removed from its parent once its last child is done.
+ *
+ * Directories less than DELETE_MAX_OPEN_DEPTH levels deep keep their fd open
+ * until they are removed. Deeper directories close their fd after they are
+ * read and are reopened from the nearest ancestor that still has one when it
+ * is needed again. Neither the stack depth nor the number of open fds is
+ * proportional to the depth of the tree.
+ *
+ * Mountpoints are not descended into. Entries that disappear while deleting
+ * are not treated as errors.
+ */
+class ParallelDeleter
+{
 public:
-    RecursiveDeleter(std::string path)
-        : FTSWrapper(path, FTS_GroupSpecialFiles)
+    ParallelDeleter()
+        : _queued(0)
+        , _failed(false)
+        , _saved_errno(0)
     {
     }
 
-    virtual int on_reached_directory_pre() override
+    bool delete_contents(int fd, const std::string &path,
+                         const std::vector<std::string> &exclusions)
+    {
+        struct stat sb;
+        if (fstat(fd, &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        _dev = sb.st_dev;
+
+        auto root = std::make_shared<Dir>();
+        root->name = path;
+        root->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (root->fd < 0) {
+            LOGE("%s: Failed to dup fd: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        run(std::move(root), &exclusions);
+
+        if (_pool) {
+            _pool->wait();
+        }
+
+        if (_failed) {
+            errno = _saved_errno;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Dir
+    {
+        std::shared_ptr<Dir> parent;
+        // Name relative to the parent (full path for the root)
+        std::string name;
+        unsigned int depth = 0;
+        // Only valid while the directory is being read or, if it is less than
+        // DELETE_MAX_OPEN_DEPTH levels deep, until it is removed
+        int fd = -1;
+        // The directory's own scan plus one for each unfinished subdirectory
+        std::atomic<unsigned int> pending{1};
+    };
+
+    dev_t _dev;
+    std::unique_ptr<ThreadPool> _pool;
+    std::atomic<unsigned int> _queued;
+
+    std::mutex _error_lock;
+    bool _failed;
+    int _saved_errno;
+
+    static void append_component(std::string &path, const std::string &name)
     {
-        // Do nothing. Need depth-first search, so directories are deleted in
-        // on_reached_directory_post()
-        return Action::FTS_OK;
+        if (!path.empty() && path.back() != '/') {
+            path += '/';
+        }
+        path += name;
     }
 
-    virtual int on_reached_directory_post() override
+    static std::string get_path(const Dir &dir, const char *name)
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        std::vector<const Dir *> chain;
+        for (const Dir *d = &dir; d; d = d->parent.get()) {
+            chain.push_back(d);
+        }
+
+        std::string path;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            append_component(path, (*it)->name);
+        }
+        if (name) {
+            append_component(path, name);
+        }
+        return path;
     }
 
-    virtual int on_reached_file() override
+    void report(const Dir &dir, const char *name, const char *action)
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        int saved_errno = errno;
+
+        LOGE("%s: Failed to %s: %s", get_path(dir, name).c_str(), action,
+             strerror(saved_errno));
+
+        std::lock_guard<std::mutex> lock(_error_lock);
+        if (!_failed) {
+            _failed = true;
+            _saved_errno = saved_errno;
+        }
     }
 
-    virtual int on_reached_symlink() override
+    /*!
+     * \brief Get an fd for a directory
+     *
+     * If the directory's fd was closed, it is reopened one component at a
+     * time from the nearest ancestor that has an open fd. The root always has
+     * one until it is finished. In that case, \p owned is set to true and the
+     * caller must close the returned fd.
+     *
+     * \return Directory fd or -1 with the error reported
+     */
+    int get_fd(const Dir &dir, bool *owned)
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        *owned = false;
+        if (dir.fd >= 0) {
+            return dir.fd;
+        }
+
+        std::vector<const Dir *> chain;
+        const Dir *ancestor = &dir;
+        for (; ancestor->fd < 0; ancestor = ancestor->parent.get()) {
+            chain.push_back(ancestor);
+        }
+
+        int fd = ancestor->fd;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            int new_fd = openat(fd, (*it)->name.c_str(),
+                                O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                                        | O_CLOEXEC);
+            int saved_errno = errno;
+
+            if (*owned) {
+                close(fd);
+            }
+            if (new_fd < 0) {
+                errno = saved_errno;
+                if (errno != ENOENT) {
+                    report(*(*it)->parent, (*it)->name.c_str(),
+                           "open directory");
+                }
+                *owned = false;
+                return -1;
+            }
+
+            fd = new_fd;
+            *owned = true;
+        }
+
+        return fd;
     }
 
-    virtual int on_reached_special_file() override
+    void run(std::shared_ptr<Dir> dir,
+             const std::vector<std::string> *exclusions)
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        // Subdirectories that did not fit in the thread pool's queue
+        std::vector<std::shared_ptr<Dir>> work;
+        work.push_back(std::move(dir));
+
+        while (!work.empty()) {
+            auto next = std::move(work.back());
+            work.pop_back();
+
+            process(std::move(next), exclusions, &work);
+            exclusions = nullptr;
+        }
     }
 
-private:
-    bool delete_path()
+    void process(std::shared_ptr<Dir> dir,
+                 const std::vector<std::string> *exclusions,
+                 std::vector<std::shared_ptr<Dir>> *work)
+    {
+        std::vector<std::string> subdirs;
+
+        if (dir->fd < 0 && !open_dir(*dir)) {
+            release(std::move(dir));
+            return;
+        }
+
+        std::vector<std::string> names;
+        std::vector<unsigned char> types;
+
+        if (read_entries(*dir, &names, &types)) {
+            for (size_t i = 0; i < names.size(); ++i) {
+                std::string &name = names[i];
+
+                if (exclusions && std::find(exclusions->begin(),
+                                            exclusions->end(), name)
+                        != exclusions->end()) {
+                    continue;
+                }
+
+                unsigned char type = types[i];
+                if (type == DT_UNKNOWN) {
+                    struct stat sb;
+                    if (fstatat(dir->fd, name.c_str(), &sb,
+                                AT_SYMLINK_NOFOLLOW) < 0) {
+                        if (errno != ENOENT) {
+                            report(*dir, name.c_str(), "stat");
+                        }
+                        continue;
+                    }
+                    type = IFTODT(sb.st_mode);
+                }
+
+                if (type == DT_DIR) {
+                    subdirs.push_back(std::move(name));
+                } else if (unlinkat(dir->fd, name.c_str(), 0) < 0
+                        && errno != ENOENT) {
+                    report(*dir, name.c_str(), "remove");
+                }
+            }
+        }
+
+        // Close it before the children are dispatched so that they never see
+        // a stale fd
+        if (dir->depth >= DELETE_MAX_OPEN_DEPTH) {
+            close(dir->fd);
+            dir->fd = -1;
+        }
+
+        for (auto &name : subdirs) {
+            auto child = std::make_shared<Dir>();
+            child->parent = dir;
+            child->name = std::move(name);
+            child->depth = dir->depth + 1;
+            ++dir->pending;
+
+            // Only the calling thread can get here before the pool exists
+            if (!_pool) {
+                _pool.reset(new ThreadPool(std::min<unsigned int>(
+                        ThreadPool::default_size(), DELETE_MAX_THREADS)));
+            }
+
+            if (_queued < _pool->size() * DELETE_MAX_QUEUED) {
+                ++_queued;
+                _pool->submit([this, child] {
+                    --_queued;
+                    run(child, nullptr);
+                });
+            } else {
+                work->push_back(std::move(child));
+            }
+        }
+
+        release(std::move(dir));
+    }
+
+    bool open_dir(Dir &dir)
     {
-        if (remove(_curr->fts_accpath) < 0) {
-            char *msg = mb_format("%s: Failed to remove: %s",
-                                  _curr->fts_path, strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
+        bool owned;
+        int parent_fd = get_fd(*dir.parent, &owned);
+        if (parent_fd < 0) {
+            return false;
+        }
+
+        dir.fd = openat(parent_fd, dir.name.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int saved_errno = errno;
+
+        if (owned) {
+            close(parent_fd);
+        }
+
+        if (dir.fd < 0) {
+            errno = saved_errno;
+            if (errno != ENOENT) {
+                report(*dir.parent, dir.name.c_str(), "open directory");
             }
-            LOGE("%s", _error_msg.c_str());
             return false;
         }
+
+        struct stat sb;
+        if (fstat(dir.fd, &sb) < 0) {
+            report(dir, nullptr, "stat");
+            return false;
+        } else if (sb.st_dev != _dev) {
+            // Mountpoint. Removing it will fail with EBUSY.
+            return false;
+        }
+
         return true;
     }
+
+    void release(std::shared_ptr<Dir> dir)
+    {
+        // Iterative so that finishing a deep chain of directories does not
+        // recurse, including when the Dir objects are destroyed
+        while (dir && --dir->pending == 0) {
+            if (dir->fd >= 0) {
+                close(dir->fd);
+                dir->fd = -1;
+            }
+
+            auto parent = std::move(dir->parent);
+
+            if (parent) {
+                bool owned;
+                int parent_fd = get_fd(*parent, &owned);
+                if (parent_fd >= 0) {
+                    if (unlinkat(parent_fd, dir->name.c_str(),
+                                 AT_REMOVEDIR) < 0 && errno != ENOENT) {
+                        report(*parent, dir->name.c_str(), "remove");
+                    }
+                    if (owned) {
+                        close(parent_fd);
+                    }
+                }
+            }
+
+            dir = std::move(parent);
+        }
+    }
+
+    bool read_entries(const Dir &dir, std::vector<std::string> *names,
+                      std::vector<unsigned char> *types)
+    {
+        // Read everything before deleting since removing entries while
+        // iterating is not reliable on all filesystems
+        int fd = fcntl(dir.fd, F_DUPFD_CLOEXEC, 0);
+        DIR *dp = fd >= 0 ? fdopendir(fd) : nullptr;
+        if (!dp) {
+            report(dir, nullptr, "open directory");
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+
+        struct dirent *ent;
+        while ((errno = 0, ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            names->push_back(ent->d_name);
+            types->push_back(ent->d_type);
+        }
+
+        bool ret = errno == 0;
+        if (!ret) {
+            report(dir, nullptr, "read directory");
+        }
+
+        closedir(dp);
+        return ret;
+    }
 };
 
-bool delete_recursive(const std::string &path)
+}
+
+static bool delete_contents_sync(const std::string &path,
+                                 const std::vector<std::string> &exclusions)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open directory: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    return ParallelDeleter().delete_contents(fd, path, exclusions);
+}
+
+/*!
+ * \brief Check if a path is a trash directory created by move_to_trash()
+ */
+static bool is_trash_dir(const std::string &trash)
 {
     struct stat sb;
-    if (stat(path.c_str(), &sb) < 0 && errno == ENOENT) {
+    return lstat(trash.c_str(), &sb) == 0
+            && S_ISDIR(sb.st_mode)
+            && sb.st_uid == geteuid()
+            && (sb.st_mode & 07777) == DELETE_TRASH_MODE;
+}
+
+/*!
+ * \brief Delete the contents of a trash directory and then the directory
+ *
+ * The directory is locked so that multiple background processes using the
+ * same trash directory don't compete. If \p remove_parent is true, the
+ * directory containing the trash is removed too if it is empty afterwards.
+ */
+static bool empty_trash(const std::string &trash, bool remove_parent)
+{
+    int fd = open(trash.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    if (flock(fd, LOCK_EX) < 0) {
+        return false;
+    }
+
+    bool ret = ParallelDeleter().delete_contents(fd, trash, {});
+
+    // Fails if another process has moved more files in since. That process
+    // will clean them up.
+    if (rmdir(trash.c_str()) == 0 && remove_parent) {
+        // Fails if the directory is not empty, which is fine
+        rmdir(dir_name(trash).c_str());
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Delete a trash directory in a detached background process
+ *
+ * The process is double forked so that it is not left as a zombie and so that
+ * it keeps running after the caller exits. Inherited file descriptors (other
+ * than stdio) are closed so that eg. sockets are not kept open.
+ *
+ * \warning The caller must be single threaded.
+ */
+static bool spawn_empty_trash(const std::string &trash, bool remove_parent)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        return false;
+    } else if (pid == 0) {
+        pid = fork();
+        if (pid == 0) {
+            DIR *dp = opendir("/proc/self/fd");
+            if (dp) {
+                std::vector<int> fds;
+                struct dirent *ent;
+                while ((ent = readdir(dp))) {
+                    int fd = atoi(ent->d_name);
+                    if (fd > STDERR_FILENO && fd != dirfd(dp)) {
+                        fds.push_back(fd);
+                    }
+                }
+                closedir(dp);
+
+                for (int fd : fds) {
+                    close(fd);
+                }
+            }
+
+            empty_trash(trash, remove_parent);
+            _exit(EXIT_SUCCESS);
+        }
+        _exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/*!
+ * \brief Move entries of a directory into its trash directory and delete them
+ *        in the background
+ *
+ * \param parent Directory containing the entries
+ * \param names Names of the entries in \p parent
+ * \param remove_parent Whether to remove \p parent if it is empty once the
+ *                      trash is deleted
+ *
+ * \return Whether every entry was moved. Entries that were moved before a
+ *         failure are still deleted in the background.
+ */
+static bool move_to_trash(const std::string &parent,
+                          const std::vector<std::string> &names,
+                          bool remove_parent)
+{
+    static std::atomic<unsigned int> counter{0};
+
+    std::string trash(parent);
+    trash += '/';
+    trash += DELETE_TRASH_DIR;
+
+    bool moved_all = true;
+    bool moved_any = false;
+
+    for (auto const &name : names) {
+        if (name.empty() || name == "." || name == ".." || name == "/") {
+            moved_all = false;
+            break;
+        }
+
+        std::string source(parent);
+        source += '/';
+        source += name;
+
+        // The trash directory might be removed by a background process that
+        // just finished
+        bool moved = false;
+        for (int attempt = 0; attempt < 2 && !moved; ++attempt) {
+            if (mkdir(trash.c_str(), DELETE_TRASH_MODE) < 0
+                    && (errno != EEXIST || !is_trash_dir(trash))) {
+                break;
+            }
+
+            char target[64];
+            snprintf(target, sizeof(target), "/%ld.%d.%u",
+                     static_cast<long>(time(nullptr)), getpid(), counter++);
+
+            moved = rename(source.c_str(), (trash + target).c_str()) == 0;
+        }
+
+        if (!moved) {
+            LOGW("%s: Failed to move to %s: %s",
+                 source.c_str(), trash.c_str(), strerror(errno));
+            moved_all = false;
+            break;
+        }
+
+        moved_any = true;
+    }
+
+    if (!moved_any && moved_all && remove_parent) {
+        // Nothing to delete. Fails if the trash is still being deleted.
+        rmdir(parent.c_str());
+    }
+
+    if (moved_any && !spawn_empty_trash(trash, remove_parent && moved_all)) {
+        // Can't delete in the background, so do it now
+        moved_all = empty_trash(trash, false) && moved_all;
+    }
+
+    return moved_all;
+}
+
+/*!
+ * \brief Recursively delete a path
+ *
+ * Symlinks are not followed and mountpoints are not descended into.
+ *
+ * With DELETE_ASYNC, the path is renamed into a trash directory in its parent
+ * directory and is deleted by a background process. The function returns once
+ * the path no longer exists. If the rename is not possible (eg. for a
+ * mountpoint), the path is deleted synchronously.
+ *
+ * \warning DELETE_ASYNC forks and must only be used by single threaded
+ *          processes.
+ *
+ * \return True if the path was deleted or does not exist. Otherwise, false
+ *         with errno set.
+ */
+bool delete_recursive(const std::string &path, int flags)
+{
+    struct stat sb;
+    if (lstat(path.c_str(), &sb) < 0) {
         // Don't fail if directory does not exist
+        return errno == ENOENT;
+    }
+
+    if ((flags & DELETE_ASYNC) && S_ISDIR(sb.st_mode)
+            && move_to_trash(dir_name(path), { base_name(path) }, false)) {
         return true;
     }
 
-    RecursiveDeleter deleter(path);
-    return deleter.run();
+    if (!S_ISDIR(sb.st_mode)) {
+        if (unlink(path.c_str()) < 0) {
+            LOGE("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    bool ret = delete_contents_sync(path, {});
+    if (rmdir(path.c_str()) < 0 && ret) {
+        LOGE("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+        ret = false;
+    }
+    return ret;
+}
+
+/*!
+ * \brief Delete the contents of a directory
+ *
+ * This behaves like delete_recursive() for every entry in the directory,
+ * except for the first-level entries listed in \p exclusions. The directory
+ * itself is kept.
+ *
+ * With DELETE_ASYNC, the trash directory is created inside \p path and is
+ * excluded from the deletion. Otherwise, a trash directory left behind by an
+ * interrupted background process is deleted too.
+ *
+ * With DELETE_REMOVE_EMPTY, \p path is removed if it is empty afterwards. When
+ * deleting asynchronously, this is done by the background process once the
+ * trash directory is gone.
+ *
+ * \return True if every entry was deleted or the directory does not exist.
+ *         Otherwise, false with errno set.
+ */
+bool delete_contents(const std::string &path,
+                     const std::vector<std::string> &exclusions,
+                     int flags)
+{
+    struct stat sb;
+    if (stat(path.c_str(), &sb) < 0) {
+        // Don't fail if directory does not exist
+        return errno == ENOENT;
+    }
+
+    std::string trash(path);
+    trash += '/';
+    trash += DELETE_TRASH_DIR;
+
+    std::vector<std::string> new_exclusions(exclusions);
+
+    bool has_trash = is_trash_dir(trash);
+
+    if ((flags & DELETE_ASYNC) && has_trash) {
+        // Never compete with a background process
+        new_exclusions.push_back(DELETE_TRASH_DIR);
+    } else if (has_trash) {
+        // Trash left behind by a background process that was killed. Wait for
+        // any running process to finish with it.
+        empty_trash(trash, false);
+    }
+
+    if (flags & DELETE_ASYNC) {
+        std::vector<std::string> names;
+
+        DIR *dp = opendir(path.c_str());
+        if (dp) {
+            struct dirent *ent;
+            while ((ent = readdir(dp))) {
+                if (strcmp(ent->d_name, ".") != 0
+                        && strcmp(ent->d_name, "..") != 0
+                        && strcmp(ent->d_name, DELETE_TRASH_DIR) != 0
+                        && std::find(new_exclusions.begin(),
+                                     new_exclusions.end(), ent->d_name)
+                                == new_exclusions.end()) {
+                    names.push_back(ent->d_name);
+                }
+            }
+            closedir(dp);
+
+            // Anything that could not be moved is deleted below
+            if (move_to_trash(path, names,
+                              (flags & DELETE_REMOVE_EMPTY) != 0)) {
+                return true;
+            }
+
+            if (std::find(new_exclusions.begin(), new_exclusions.end(),
+                          DELETE_TRASH_DIR) == new_exclusions.end()
+                    && is_trash_dir(trash)) {
+                new_exclusions.push_back(DELETE_TRASH_DIR);
+            }
+        }
+    }
+
+    bool ret = delete_contents_sync(path, new_exclusions);
+
+    if (ret && (flags & DELETE_REMOVE_EMPTY)) {
+        // Fails if there are exclusions or if the trash is still being deleted
+        rmdir(path.c_str());
+    }
+
+    return ret;
 }
 
 }
@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/digest_cache.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+#include "mbutil/path.h"
+
+#define DIGEST_CACHE_MAGIC              "MBDIGEST"
+#define DIGEST_CACHE_VERSION            1
+// Maximum number of entries kept when saving
+#define DIGEST_CACHE_MAX_ENTRIES        256
+// Files whose ctime is this close to the creation of the cache are not cached.
+// Timestamps have a coarse granularity, so a write in the same tick as the
+// previous one might not change the ctime.
+#define DIGEST_CACHE_RACY_NS            1000000000LL
+
+namespace mb
+{
+namespace util
+{
+
+struct DiskHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t clock;
+};
+
+struct DiskEntry
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t stamp;
+    uint32_t algorithm;
+    uint32_t digest_size;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+};
+
+bool DigestCacheKey::operator==(const DigestCacheKey &other) const
+{
+    return dev == other.dev
+            && ino == other.ino
+            && size == other.size
+            && mtime_ns == other.mtime_ns
+            && ctime_ns == other.ctime_ns;
+}
+
+size_t DigestCacheKeyHash::operator()(const DigestCacheKey &key) const
+{
+    std::hash<uint64_t> h;
+    size_t result = h(key.dev);
+    result = result * 31 + h(key.ino);
+    result = result * 31 + h(key.size);
+    result = result * 31 + h(static_cast<uint64_t>(key.mtime_ns));
+    result = result * 31 + h(static_cast<uint64_t>(key.ctime_ns));
+    return result;
+}
+
+static int64_t timespec_to_ns(const struct timespec &ts)
+{
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*!
+ * \brief Check that nobody but the current user can modify a path
+ */
+static bool is_private(const std::string &path, const struct stat &sb)
+{
+    if (sb.st_uid != geteuid()) {
+        LOGW("%s: Not owned by uid %u", path.c_str(), geteuid());
+        return false;
+    }
+    if (sb.st_mode & (S_IWGRP | S_IWOTH)) {
+        LOGW("%s: Writable by group or others (mode %o)",
+             path.c_str(), sb.st_mode & 07777);
+        return false;
+    }
+    return true;
+}
+
+static bool is_private_dir(const std::string &path)
+{
+    std::string dir = dir_name(path);
+    struct stat sb;
+
+    if (stat(dir.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!S_ISDIR(sb.st_mode) || !is_private(dir, sb)) {
+        errno = EPERM;
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_fully(int fd, void *buf, size_t size)
+{
+    char *ptr = static_cast<char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = read(fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EINVAL;
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_fully(int fd, const void *buf, size_t size)
+{
+    const char *ptr = static_cast<const char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create an empty cache
+ *
+ * \param path Path to the cache file. The cache is not read until load() is
+ *             called.
+ */
+DigestCache::DigestCache(std::string path)
+    : _path(std::move(path))
+    , _clock(0)
+    , _dirty(false)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    _created_ns = timespec_to_ns(now);
+}
+
+/*!
+ * \brief Load entries from the cache file
+ *
+ * A missing cache file is not an error. If the file is corrupt or has unsafe
+ * ownership or permissions, the cache is left empty.
+ *
+ * \return True if the cache was loaded or does not exist. Otherwise, false
+ *         with errno set appropriately.
+ */
+bool DigestCache::load()
+{
+    _entries.clear();
+    _clock = 0;
+    _dirty = false;
+
+    int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        LOGE("%s: Failed to open: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // A hard link would allow the file to be modified through another path
+    if (!S_ISREG(sb.st_mode) || sb.st_nlink != 1 || !is_private(_path, sb)
+            || !is_private_dir(_path)) {
+        LOGW("%s: Ignoring cache file with unsafe permissions", _path.c_str());
+        errno = EPERM;
+        return false;
+    }
+
+    DiskHeader header;
+    if (!read_fully(fd, &header, sizeof(header))) {
+        LOGE("%s: Failed to read header: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (memcmp(header.magic, DIGEST_CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != DIGEST_CACHE_VERSION
+            || header.count > DIGEST_CACHE_MAX_ENTRIES
+            || static_cast<uint64_t>(sb.st_size) != sizeof(header)
+                    + header.count * sizeof(DiskEntry)
+                    + SHA256_DIGEST_LENGTH) {
+        LOGW("%s: Ignoring invalid cache file", _path.c_str());
+        errno = EINVAL;
+        return false;
+    }
+
+    std::vector<DiskEntry> disk_entries(header.count);
+    unsigned char expected[SHA256_DIGEST_LENGTH];
+    unsigned char actual[SHA256_DIGEST_LENGTH];
+
+    if (!read_fully(fd, disk_entries.data(),
+                    disk_entries.size() * sizeof(DiskEntry))
+            || !read_fully(fd, expected, sizeof(expected))) {
+        LOGE("%s: Failed to read entries: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &header, sizeof(header));
+    SHA256_Update(&ctx, disk_entries.data(),
+                  disk_entries.size() * sizeof(DiskEntry));
+    SHA256_Final(actual, &ctx);
+
+    if (memcmp(expected, actual, sizeof(actual)) != 0) {
+        LOGW("%s: Ignoring cache file with bad checksum", _path.c_str());
+        errno = EINVAL;
+        return false;
+    }
+
+    for (const DiskEntry &de : disk_entries) {
+        HashAlgorithm algorithm = static_cast<HashAlgorithm>(de.algorithm);
+        if (de.digest_size != hash_digest_size(algorithm)) {
+            continue;
+        }
+
+        DigestCacheKey key{de.dev, de.ino, de.size, de.mtime_ns, de.ctime_ns};
+        Entry &entry = _entries[key];
+        entry.algorithm = algorithm;
+        entry.digest.assign(de.digest, de.digest + de.digest_size);
+        entry.stamp = de.stamp;
+    }
+
+    _clock = header.clock;
+
+    return true;
+}
+
+/*!
+ * \brief Atomically write the cache file if it has changed
+ *
+ * Only the most recently used entries are kept.
+ *
+ * \return True if the cache was written or did not need to be written.
+ *         Otherwise, false with errno set appropriately.
+ */
+bool DigestCache::save()
+{
+    if (!_dirty) {
+        return true;
+    }
+
+    if (!is_private_dir(_path)) {
+        LOGW("%s: Not saving cache to unsafe directory", _path.c_str());
+        return false;
+    }
+
+    std::vector<DiskEntry> disk_entries;
+    disk_entries.reserve(_entries.size());
+
+    for (auto const &item : _entries) {
+        DiskEntry de;
+        memset(&de, 0, sizeof(de));
+        de.dev = item.first.dev;
+        de.ino = item.first.ino;
+        de.size = item.first.size;
+        de.mtime_ns = item.first.mtime_ns;
+        de.ctime_ns = item.first.ctime_ns;
+        de.stamp = item.second.stamp;
+        de.algorithm = static_cast<uint32_t>(item.second.algorithm);
+        de.digest_size = item.second.digest.size();
+        memcpy(de.digest, item.second.digest.data(), de.digest_size);
+        disk_entries.push_back(de);
+    }
+
+    // Most recently used first
+    std::sort(disk_entries.begin(), disk_entries.end(),
+              [](const DiskEntry &a, const DiskEntry &b) {
+        return a.stamp > b.stamp;
+    });
+    if (disk_entries.size() > DIGEST_CACHE_MAX_ENTRIES) {
+        disk_entries.resize(DIGEST_CACHE_MAX_ENTRIES);
+    }
+
+    DiskHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DIGEST_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DIGEST_CACHE_VERSION;
+    header.count = disk_entries.size();
+    header.clock = _clock;
+
+    unsigned char checksum[SHA256_DIGEST_LENGTH];
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &header, sizeof(header));
+    SHA256_Update(&ctx, disk_entries.data(),
+                  disk_entries.size() * sizeof(DiskEntry));
+    SHA256_Final(checksum, &ctx);
+
+    std::string temp_path(_path);
+    temp_path += ".tmp";
+
+    if (unlink(temp_path.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    int fd = open(temp_path.c_str(),
+                  O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ret = write_fully(fd, &header, sizeof(header))
+            && write_fully(fd, disk_entries.data(),
+                           disk_entries.size() * sizeof(DiskEntry))
+            && write_fully(fd, checksum, sizeof(checksum))
+            && fsync(fd) == 0;
+    if (!ret) {
+        LOGE("%s: Failed to write: %s", temp_path.c_str(), strerror(errno));
+    }
+
+    if (close(fd) < 0 && ret) {
+        LOGE("%s: Failed to close: %s", temp_path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    if (ret && rename(temp_path.c_str(), _path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s",
+             temp_path.c_str(), _path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    if (!ret) {
+        int saved_errno = errno;
+        unlink(temp_path.c_str());
+        errno = saved_errno;
+        return false;
+    }
+
+    _dirty = false;
+    return true;
+}
+
+/*!
+ * \brief Look up the cached digest of a file
+ *
+ * \param sb Result of fstat() on the file
+ * \param algorithm Hash algorithm
+ * \param[out] digest Cached digest
+ *
+ * \return True if the file is a regular file and its metadata matches a cached
+ *         entry for \p algorithm. Otherwise, false.
+ */
+bool DigestCache::lookup(const struct stat &sb, HashAlgorithm algorithm,
+                         std::vector<unsigned char> *digest)
+{
+    if (!S_ISREG(sb.st_mode)) {
+        return false;
+    }
+
+    auto it = _entries.find(key_for(sb));
+    if (it == _entries.end() || it->second.algorithm != algorithm) {
+        return false;
+    }
+
+    it->second.stamp = ++_clock;
+    _dirty = true;
+
+    *digest = it->second.digest;
+    return true;
+}
+
+/*!
+ * \brief Add or replace the cached digest of a file
+ *
+ * Files other than regular files are not cached. Files that were changed
+ * shortly before the cache was created are not cached either since another
+ * write in the same timestamp tick would go unnoticed. Thus, the cache must be
+ * created before the files are stat'ed and hashed.
+ *
+ * \param sb Result of fstat() on the file before it was read. The caller should
+ *           check that the metadata did not change while the file was read.
+ * \param algorithm Hash algorithm
+ * \param digest Digest of the file contents
+ */
+void DigestCache::insert(const struct stat &sb, HashAlgorithm algorithm,
+                         const std::vector<unsigned char> &digest)
+{
+    if (!S_ISREG(sb.st_mode) || digest.size() != hash_digest_size(algorithm)) {
+        return;
+    }
+
+    DigestCacheKey key = key_for(sb);
+
+    if (key.mtime_ns > _created_ns - DIGEST_CACHE_RACY_NS
+            || key.ctime_ns > _created_ns - DIGEST_CACHE_RACY_NS) {
+        remove(sb);
+        return;
+    }
+
+    Entry &entry = _entries[key];
+    entry.algorithm = algorithm;
+    entry.digest = digest;
+    entry.stamp = ++_clock;
+    _dirty = true;
+}
+
+/*!
+ * \brief Remove the cached digest of a file
+ */
+void DigestCache::remove(const struct stat &sb)
+{
+    if (_entries.erase(key_for(sb)) > 0) {
+        _dirty = true;
+    }
+}
+
+DigestCacheKey DigestCache::key_for(const struct stat &sb)
+{
+    DigestCacheKey key;
+    key.dev = sb.st_dev;
+    key.ino = sb.st_ino;
+    key.size = sb.st_size;
+    key.mtime_ns = timespec_to_ns(sb.st_mtim);
+    key.ctime_ns = timespec_to_ns(sb.st_ctim);
+    return key;
+}
+
+}
+}
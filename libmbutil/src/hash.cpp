@@ -19,67 +19,324 @@
 
 #include "mbutil/hash.h"
 
-#include <memory>
+#include <algorithm>
 
 #include <cerrno>
-#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
+#include "mbutil/thread_pool.h"
+
+// Files are read in large chunks so that each read can be served by a single
+// large I/O request
+#define HASH_BUF_SIZE           (1024 * 1024)
 
 namespace mb
 {
 namespace util
 {
 
-/*!
- * \brief Compute SHA512 hash of a file
- *
- * \param path Path to file
- * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
- *               computed hash value
- *
- * \return true on success, false on failure and errno set appropriately
- */
-bool sha512_hash(const std::string &path,
-                 unsigned char digest[SHA512_DIGEST_LENGTH])
+namespace
+{
+
+class HashContext
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+public:
+    explicit HashContext(HashAlgorithm algorithm) : _algorithm(algorithm)
+    {
+    }
+
+    bool init()
+    {
+        switch (_algorithm) {
+        case HashAlgorithm::SHA1:
+            return SHA1_Init(&_ctx.sha1);
+        case HashAlgorithm::SHA256:
+            return SHA256_Init(&_ctx.sha256);
+        case HashAlgorithm::SHA512:
+            return SHA512_Init(&_ctx.sha512);
+        }
         return false;
     }
 
-    unsigned char buf[10240];
-    size_t n;
+    bool update(const void *data, size_t size)
+    {
+        switch (_algorithm) {
+        case HashAlgorithm::SHA1:
+            return SHA1_Update(&_ctx.sha1, data, size);
+        case HashAlgorithm::SHA256:
+            return SHA256_Update(&_ctx.sha256, data, size);
+        case HashAlgorithm::SHA512:
+            return SHA512_Update(&_ctx.sha512, data, size);
+        }
+        return false;
+    }
 
-    SHA512_CTX ctx;
-    if (!SHA512_Init(&ctx)) {
-        LOGE("openssl: SHA512_Init() failed");
+    bool final(unsigned char *digest)
+    {
+        switch (_algorithm) {
+        case HashAlgorithm::SHA1:
+            return SHA1_Final(digest, &_ctx.sha1);
+        case HashAlgorithm::SHA256:
+            return SHA256_Final(digest, &_ctx.sha256);
+        case HashAlgorithm::SHA512:
+            return SHA512_Final(digest, &_ctx.sha512);
+        }
         return false;
     }
 
-    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
-        if (!SHA512_Update(&ctx, buf, n)) {
-            LOGE("openssl: SHA512_Update() failed");
+private:
+    HashAlgorithm _algorithm;
+    union
+    {
+        SHA_CTX sha1;
+        SHA256_CTX sha256;
+        SHA512_CTX sha512;
+    } _ctx;
+};
+
+}
+
+static std::string input_name(const HashInput &input)
+{
+    if (input.data) {
+        return "<memory>";
+    } else if (input.fd >= 0) {
+        return "<fd " + std::to_string(input.fd) + ">";
+    } else {
+        return input.path;
+    }
+}
+
+static bool hash_fd(int fd, const std::string &name, HashContext *ctx,
+                    std::vector<unsigned char> *buf, uint64_t *size_out)
+{
+    // Just a hint, so errors (eg. for non-regular files) don't matter
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (buf->empty()) {
+        buf->resize(HASH_BUF_SIZE);
+    }
+
+    uint64_t offset = 0;
+
+    while (true) {
+        ssize_t n = pread64(fd, buf->data(), buf->size(), offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("%s: Failed to read file: %s", name.c_str(), strerror(errno));
             return false;
-        }
-        if (n < sizeof(buf)) {
+        } else if (n == 0) {
             break;
         }
+
+        if (!ctx->update(buf->data(), n)) {
+            LOGE("openssl: Failed to update hash");
+            errno = EIO;
+            return false;
+        }
+
+        offset += n;
+    }
+
+    *size_out = offset;
+    return true;
+}
+
+static pthread_once_t hash_buffer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hash_buffer_key;
+
+static void free_hash_buffer(void *data)
+{
+    delete static_cast<std::vector<unsigned char> *>(data);
+}
+
+static void create_hash_buffer_key()
+{
+    pthread_key_create(&hash_buffer_key, &free_hash_buffer);
+}
+
+/*!
+ * \brief Get the calling thread's read buffer
+ *
+ * The buffer is freed when the thread exits, so this is meant for thread pool
+ * workers.
+ */
+static std::vector<unsigned char> * get_hash_buffer()
+{
+    pthread_once(&hash_buffer_once, &create_hash_buffer_key);
+
+    auto *buf = static_cast<std::vector<unsigned char> *>(
+            pthread_getspecific(hash_buffer_key));
+    if (!buf) {
+        buf = new std::vector<unsigned char>();
+        pthread_setspecific(hash_buffer_key, buf);
     }
 
-    if (ferror(fp.get())) {
-        LOGE("%s: Failed to read file", path.c_str());
+    return buf;
+}
+
+/*!
+ * \brief Hash a single input
+ *
+ * \param buf Read buffer. Allocated on first use so that it can be reused for
+ *            subsequent inputs hashed by the same thread.
+ */
+static void hash_input(const HashInput &input, HashAlgorithm algorithm,
+                       std::vector<unsigned char> *buf, HashResult *result)
+{
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    HashContext ctx(algorithm);
+    bool ret;
+
+    if (!ctx.init()) {
+        LOGE("openssl: Failed to initialize hash");
         errno = EIO;
-        return false;
+        ret = false;
+    } else if (input.data) {
+        ret = ctx.update(input.data, input.size);
+        if (ret) {
+            result->size = input.size;
+        } else {
+            LOGE("openssl: Failed to update hash");
+            errno = EIO;
+        }
+    } else if (input.fd >= 0) {
+        ret = hash_fd(input.fd, input_name(input), &ctx, buf, &result->size);
+    } else {
+        int fd = open(input.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LOGE("%s: Failed to open: %s",
+                 input.path.c_str(), strerror(errno));
+            ret = false;
+        } else {
+            ret = hash_fd(fd, input.path, &ctx, buf, &result->size);
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+        }
+    }
+
+    if (ret) {
+        result->digest.resize(hash_digest_size(algorithm));
+        if (!ctx.final(result->digest.data())) {
+            LOGE("openssl: Failed to finalize hash");
+            errno = EIO;
+            ret = false;
+        }
+    }
+
+    if (!ret) {
+        result->error = errno;
+        result->digest.clear();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->time_ns = static_cast<uint64_t>(end.tv_sec - start.tv_sec)
+            * 1000000000 + end.tv_nsec - start.tv_nsec;
+}
+
+/*!
+ * \brief Get the size of digests produced by a hash algorithm
+ */
+size_t hash_digest_size(HashAlgorithm algorithm)
+{
+    switch (algorithm) {
+    case HashAlgorithm::SHA1:
+        return SHA_DIGEST_LENGTH;
+    case HashAlgorithm::SHA256:
+        return SHA256_DIGEST_LENGTH;
+    case HashAlgorithm::SHA512:
+        return SHA512_DIGEST_LENGTH;
+    }
+    return 0;
+}
+
+/*!
+ * \brief Hash multiple files concurrently
+ *
+ * Each input is hashed by one worker thread. Files are read sequentially with
+ * large pread() calls after hinting the kernel with `POSIX_FADV_SEQUENTIAL`.
+ * Files are not mmap'ed since a file that is truncated while being hashed
+ * would crash the process with SIGBUS.
+ *
+ * \param inputs Data to hash. fd inputs must be seekable.
+ * \param algorithm Hash algorithm
+ * \param[out] results Results in the same order as \p inputs. For inputs that
+ *                     failed, HashResult::error is set and the digest is empty.
+ * \param threads Maximum number of threads. If 0, the number of online CPUs is
+ *                used. No threads are started for a single input.
+ *
+ * \return True if every input was hashed. Otherwise, false with errno set to
+ *         the error of the first input that failed.
+ */
+bool hash_files(const std::vector<HashInput> &inputs, HashAlgorithm algorithm,
+                std::vector<HashResult> *results, unsigned int threads)
+{
+    results->assign(inputs.size(), HashResult());
+
+    if (threads == 0) {
+        threads = ThreadPool::default_size();
+    }
+    threads = std::min<size_t>(threads, inputs.size());
+
+    if (threads <= 1) {
+        std::vector<unsigned char> buf;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            hash_input(inputs[i], algorithm, &buf, &(*results)[i]);
+        }
+    } else {
+        ThreadPool pool(threads);
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            pool.submit([&, i] {
+                hash_input(inputs[i], algorithm, get_hash_buffer(),
+                           &(*results)[i]);
+            });
+        }
+        pool.wait();
     }
 
-    if (!SHA512_Final(digest, &ctx)) {
-        LOGE("openssl: SHA512_Final() failed");
+    for (auto const &result : *results) {
+        if (result.error != 0) {
+            errno = result.error;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute SHA512 hash of a file
+ *
+ * \param path Path to file
+ * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
+ *               computed hash value
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool sha512_hash(const std::string &path,
+                 unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    std::vector<HashInput> inputs(1);
+    inputs[0].path = path;
+
+    std::vector<HashResult> results;
+    if (!hash_files(inputs, HashAlgorithm::SHA512, &results)) {
         return false;
     }
 
+    memcpy(digest, results[0].digest.data(), SHA512_DIGEST_LENGTH);
     return true;
 }
 
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/metadata.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/selinux.h"
+#include "mbutil/thread_pool.h"
+#include "mbutil/walk.h"
+
+// Number of directory entries handled by one task
+#define METADATA_BATCH_SIZE             128
+// Number of entries to process on the calling thread before starting workers.
+// Most trees are small enough that starting threads is not worth it.
+#define METADATA_THREAD_THRESHOLD       2048
+#define METADATA_MAX_THREADS            8
+// Maximum number of tasks queued per worker
+#define METADATA_MAX_PENDING_PER_THREAD 4
+
+namespace mb
+{
+namespace util
+{
+
+namespace
+{
+
+struct DirRef
+{
+    int fd;
+    std::string path;
+
+    DirRef(int fd, std::string path) : fd(fd), path(std::move(path))
+    {
+    }
+
+    ~DirRef()
+    {
+        close(fd);
+    }
+};
+
+typedef std::vector<std::string> NameList;
+
+class MetadataApplier : public TreeWalker
+{
+public:
+    MetadataApplier(std::string path, const Metadata &metadata)
+        : TreeWalker(std::move(path), 0)
+        , _metadata(metadata)
+        , _context(nullptr)
+        , _count(0)
+        , _failed(false)
+        , _saved_errno(0)
+    {
+        if (!_metadata.context.empty()) {
+            _context = _labels.intern(_metadata.context);
+        }
+    }
+
+    bool apply()
+    {
+        bool ret = run();
+        int saved_errno = errno;
+
+        // Wait for the workers
+        _pool.reset();
+
+        if (_failed) {
+            _error_msg = _failed_msg;
+            errno = _saved_errno;
+            return false;
+        }
+
+        errno = saved_errno;
+        return ret;
+    }
+
+    virtual int on_reached_directory_pre(const Entry &entry) override
+    {
+        // Directories are handled on this thread through their fds, which
+        // leaves only the non-directory entries for the workers
+        apply_fd(entry);
+
+        Level level;
+        level.entry = &entry;
+        _levels.push_back(std::move(level));
+
+        return Action::WALK_OK;
+    }
+
+    virtual int on_reached_directory_post(const Entry &entry) override
+    {
+        (void) entry;
+
+        flush(_levels.back());
+        _levels.pop_back();
+
+        return Action::WALK_OK;
+    }
+
+    virtual int on_reached_file(const Entry &entry) override
+    {
+        add_entry(entry);
+        return Action::WALK_OK;
+    }
+
+    virtual int on_reached_symlink(const Entry &entry) override
+    {
+        add_entry(entry);
+        return Action::WALK_OK;
+    }
+
+    virtual int on_reached_special_file(const Entry &entry) override
+    {
+        add_entry(entry);
+        return Action::WALK_OK;
+    }
+
+private:
+    struct Level
+    {
+        const Entry *entry;
+        // Duplicated directory fd that is shared with the tasks (only created
+        // once the workers are started)
+        std::shared_ptr<DirRef> dir;
+        NameList names;
+    };
+
+    const Metadata &_metadata;
+    // Current labels are interned, so they can be compared with the requested
+    // label by pointer without allocating memory for every entry
+    SelinuxLabelCache _labels;
+    SelinuxLabelCache::Label _context;
+    std::vector<Level> _levels;
+    std::unique_ptr<ThreadPool> _pool;
+    size_t _count;
+
+    // First error from any thread
+    std::mutex _error_lock;
+    bool _failed;
+    int _saved_errno;
+    std::string _failed_msg;
+
+    void add_entry(const Entry &entry)
+    {
+        if (_levels.empty()) {
+            // Root is not a directory
+            apply_at(entry.dirfd, entry.name, std::string());
+            return;
+        }
+
+        Level &level = _levels.back();
+        level.names.push_back(entry.name);
+        ++_count;
+
+        if (level.names.size() >= METADATA_BATCH_SIZE) {
+            flush(level);
+        }
+    }
+
+    void flush(Level &level)
+    {
+        if (level.names.empty()) {
+            return;
+        }
+
+        if (!_pool && _count >= METADATA_THREAD_THRESHOLD) {
+            _pool.reset(new ThreadPool(std::min<unsigned int>(
+                    ThreadPool::default_size(), METADATA_MAX_THREADS)));
+        }
+
+        if (_pool && !level.dir) {
+            int fd = fcntl(level.entry->fd, F_DUPFD_CLOEXEC, 0);
+            if (fd >= 0) {
+                level.dir = std::make_shared<DirRef>(
+                        fd, level.entry->path());
+            } else {
+                LOGW("%s: Failed to dup directory fd: %s",
+                     level.entry->path().c_str(), strerror(errno));
+            }
+        }
+
+        if (!level.dir) {
+            apply_batch(level.entry->fd, level.entry->path(), level.names);
+            level.names.clear();
+            return;
+        }
+
+        auto dir = level.dir;
+        auto names = std::make_shared<NameList>(std::move(level.names));
+        level.names.clear();
+
+        // Bound the number of queued batches (and thus the number of open
+        // directory fds)
+        _pool->wait(_pool->size() * METADATA_MAX_PENDING_PER_THREAD);
+        _pool->submit([this, dir, names]{
+            apply_batch(dir->fd, dir->path, *names);
+        });
+    }
+
+    void apply_batch(int dirfd, const std::string &dir_path,
+                     const NameList &names)
+    {
+        for (auto const &name : names) {
+            apply_at(dirfd, name.c_str(), dir_path);
+        }
+    }
+
+    static std::string join(const std::string &dir_path, const char *name)
+    {
+        if (dir_path.empty()) {
+            return name;
+        }
+
+        std::string path(dir_path);
+        if (path.back() != '/') {
+            path += '/';
+        }
+        path += name;
+        return path;
+    }
+
+    void report(const std::string &path, const char *action)
+    {
+        int saved_errno = errno;
+
+        LOGW("%s: Failed to %s: %s", path.c_str(), action,
+             strerror(saved_errno));
+
+        std::lock_guard<std::mutex> lock(_error_lock);
+        if (!_failed) {
+            char *msg = mb_format("%s: Failed to %s: %s", path.c_str(),
+                                  action, strerror(saved_errno));
+            if (msg) {
+                _failed_msg = msg;
+                free(msg);
+            }
+            _failed = true;
+            _saved_errno = saved_errno;
+        }
+    }
+
+    bool needs_chown(const struct stat &sb)
+    {
+        return (_metadata.uid != static_cast<uid_t>(-1)
+                        && sb.st_uid != _metadata.uid)
+                || (_metadata.gid != static_cast<gid_t>(-1)
+                        && sb.st_gid != _metadata.gid);
+    }
+
+    bool needs_chmod(const struct stat &sb, bool chowned)
+    {
+        // chown() may clear the set-user-ID and set-group-ID bits
+        return _metadata.mode != static_cast<mode_t>(-1)
+                && !S_ISLNK(sb.st_mode)
+                && (chowned || (sb.st_mode & 07777) != _metadata.mode);
+    }
+
+    void apply_fd(const Entry &entry)
+    {
+        struct stat sb;
+
+        if (fstat(entry.fd, &sb) < 0) {
+            report(entry.path(), "stat");
+            return;
+        }
+
+        bool chowned = needs_chown(sb);
+        if (chowned && fchown(entry.fd, _metadata.uid, _metadata.gid) < 0) {
+            report(entry.path(), "chown");
+        }
+
+        if (needs_chmod(sb, chowned) && fchmod(entry.fd, _metadata.mode) < 0) {
+            report(entry.path(), "chmod");
+        }
+
+        if (_context) {
+            SelinuxLabelCache::Label label;
+            if ((!_labels.fget(entry.fd, &label) || label != _context)
+                    && !selinux_fset_context(entry.fd, _metadata.context)) {
+                report(entry.path(), "set SELinux label");
+            }
+        }
+    }
+
+    void apply_at(int dirfd, const char *name, const std::string &dir_path)
+    {
+        struct stat sb;
+
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            report(join(dir_path, name), "stat");
+            return;
+        }
+
+        bool chowned = needs_chown(sb);
+        if (chowned && fchownat(dirfd, name, _metadata.uid, _metadata.gid,
+                                AT_SYMLINK_NOFOLLOW) < 0) {
+            report(join(dir_path, name), "chown");
+        }
+
+        if (needs_chmod(sb, chowned)
+                && fchmodat(dirfd, name, _metadata.mode, 0) < 0) {
+            report(join(dir_path, name), "chmod");
+        }
+
+        if (_context && !set_context_at(dirfd, name, dir_path)) {
+            report(join(dir_path, name), "set SELinux label");
+        }
+    }
+
+    bool set_context_at(int dirfd, const char *name,
+                        const std::string &dir_path)
+    {
+        SelinuxLabelCache::Label label;
+
+        if (_labels.lget_at(dirfd, name, &label)) {
+            if (label == _context
+                    || selinux_lset_context_at(dirfd, name,
+                                               _metadata.context)) {
+                return true;
+            }
+        } else if (errno != ENOENT
+                && selinux_lset_context_at(dirfd, name, _metadata.context)) {
+            // Not labeled yet
+            return true;
+        }
+
+        if (errno != ENOENT || dirfd == AT_FDCWD) {
+            return false;
+        }
+
+        // procfs may not be mounted
+        std::string path = join(dir_path, name);
+        return (_labels.lget(path, &label) && label == _context)
+                || selinux_lset_context(path, _metadata.context);
+    }
+};
+
+}
+
+/*!
+ * \brief Recursively apply ownership, permissions, and SELinux label
+ *
+ * All of the attributes are applied in a single traversal of the tree using
+ * fd-relative syscalls. Attributes that already have the requested value are
+ * not changed. Large trees are processed by multiple threads. Symlinks are not
+ * followed and mountpoints are not descended into.
+ *
+ * Failures do not stop the traversal.
+ *
+ * \param path Path to file or directory
+ * \param metadata Attributes to apply
+ *
+ * \return True if all attributes were applied to every entry. Otherwise, false
+ *         with errno set to the error of the first failure.
+ */
+bool apply_metadata_recursive(const std::string &path,
+                              const Metadata &metadata)
+{
+    MetadataApplier applier(path, metadata);
+    return applier.apply();
+}
+
+}
+}
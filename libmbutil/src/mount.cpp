@@ -19,7 +19,7 @@
 
 #include "mbutil/mount.h"
 
-#include <memory>
+#include <algorithm>
 #include <vector>
 
 #include <cerrno>
@@ -29,96 +29,101 @@
 
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
 #include "mbutil/blkid.h"
 #include "mbutil/directory.h"
 #include "mbutil/loopdev.h"
+#include "mbutil/mount_table.h"
 #include "mbutil/string.h"
-#include "external/mntent.h"
 
 #define MAX_UNMOUNT_TRIES 5
 
-#define DELETED_SUFFIX "\\040(deleted)"
-
 namespace mb
 {
 namespace util
 {
 
-static std::string get_deleted_mount_path(const std::string &dir)
+/*!
+ * \brief Unmount a mount table entry
+ *
+ * See umount() for details.
+ */
+static bool umount_entry(const char *target, const std::string &source)
 {
-    struct stat sb;
-    if (lstat(dir.c_str(), &sb) < 0 && errno == ENOENT
-            && mb_ends_with(dir.c_str(), DELETED_SUFFIX)) {
-        return std::string(dir.begin(), dir.end() - strlen(DELETED_SUFFIX));
-    } else {
-        return dir;
+    int ret = ::umount(target);
+
+    int saved_errno = errno;
+
+    if (ret == 0 && !source.empty()) {
+        struct stat sb;
+
+        if (stat(source.c_str(), &sb) == 0
+                && S_ISBLK(sb.st_mode) && major(sb.st_rdev) == 7) {
+            // If the source path is a loop block device, then disassociate it
+            // from the image
+            LOGD("Clearing loop device %s", source.c_str());
+            if (!loopdev_remove_device(source)) {
+                LOGW("Failed to clear loop device: %s", strerror(errno));
+            }
+        }
     }
+
+    errno = saved_errno;
+
+    return ret == 0;
 }
 
-bool is_mounted(const std::string &mountpoint)
+/*!
+ * \brief Unmount entries in an order that unmounts children before parents
+ *
+ * \return Number of entries that failed to unmount
+ */
+static int unmount_entries(std::vector<MountEntry> *entries)
 {
-    autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-    if (!fp) {
-        LOGE("Failed to read /proc/mounts: %s", strerror(errno));
-        return false;
-    }
+    int failed = 0;
 
-    bool found = false;
-    struct mntent ent;
-    char buf[1024];
-    std::string mnt_dir;
+    MountTable::sort_for_unmount(entries);
 
-    while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-        mnt_dir = get_deleted_mount_path(ent.mnt_dir);
-        if (mountpoint == mnt_dir) {
-            found = true;
-            break;
+    for (auto const &entry : *entries) {
+        LOGD("Attempting to unmount %s", entry.target.c_str());
+
+        if (!umount_entry(entry.target.c_str(), entry.source)) {
+            LOGE("%s: Failed to unmount: %s",
+                 entry.target.c_str(), strerror(errno));
+            ++failed;
         }
     }
 
-    return found;
+    return failed;
+}
+
+bool is_mounted(const std::string &mountpoint)
+{
+    return MountTable::instance().is_mounted(mountpoint);
 }
 
 bool unmount_all(const std::string &dir)
 {
-    std::vector<std::string> to_unmount;
+    std::vector<MountEntry> entries;
     int failed;
-    struct mntent ent;
-    char buf[1024];
 
     for (int tries = 0; tries < MAX_UNMOUNT_TRIES; ++tries) {
-        failed = 0;
-        to_unmount.clear();
-
-        autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-        if (!fp) {
-            LOGE("Failed to read /proc/mounts: %s", strerror(errno));
+        if (!MountTable::instance().entries(&entries)) {
+            LOGE("Failed to read mount table: %s", strerror(errno));
             return false;
         }
 
-        while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-            std::string mnt_dir = get_deleted_mount_path(ent.mnt_dir);
-            if (mb_starts_with(mnt_dir.c_str(), dir.c_str())) {
-                to_unmount.push_back(std::move(mnt_dir));
-            }
-        }
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [&](const MountEntry &entry) {
+            return !mb_starts_with(entry.target.c_str(), dir.c_str());
+        }), entries.end());
 
-        // Unmount in reverse order
-        for (auto it = to_unmount.rbegin(); it != to_unmount.rend(); ++it) {
-            LOGD("Attempting to unmount %s", it->c_str());
-
-            if (!util::umount(it->c_str())) {
-                LOGE("%s: Failed to unmount: %s",
-                     it->c_str(), strerror(errno));
-                ++failed;
-            }
-        }
+        failed = unmount_entries(&entries);
 
         // No more matching mount points
         if (failed == 0) {
@@ -207,8 +212,8 @@ bool mount(const char *source, const char *target, const char *fstype,
  * This function takes the same arguments as umount(2), but returns true on
  * success and false on failure.
  *
- * This function will /proc/mounts for the mountpoint (using an exact string
- * compare). If the source path of the mountpoint is a block device and the
+ * This function will look up the mountpoint in the mount table (using an exact
+ * string compare). If the source path of the mountpoint is a block device and the
  * block device is a loop device, then it will be disassociated from the
  * previously attached file. Note that the return value of
  * loopdev_remove_device() is ignored and this function will always return true
@@ -220,44 +225,16 @@ bool mount(const char *source, const char *target, const char *fstype,
  */
 bool umount(const char *target)
 {
-    struct mntent ent;
+    MountEntry entry;
     std::string source;
-    std::string mnt_dir;
-
-    autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-    if (fp) {
-        char buf[1024];
-        while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-            mnt_dir = get_deleted_mount_path(ent.mnt_dir);
-            if (mnt_dir == target) {
-                source = ent.mnt_fsname;
-            }
-        }
-    } else {
-        LOGW("Failed to read /proc/mounts: %s", strerror(errno));
-    }
-
-    int ret = ::umount(target);
 
-    int saved_errno = errno;
-
-    if (!source.empty()) {
-        struct stat sb;
-
-        if (stat(source.c_str(), &sb) == 0
-                && S_ISBLK(sb.st_mode) && major(sb.st_rdev) == 7) {
-            // If the source path is a loop block device, then disassociate it
-            // from the image
-            LOGD("Clearing loop device %s", source.c_str());
-            if (!loopdev_remove_device(source)) {
-                LOGW("Failed to clear loop device: %s", strerror(errno));
-            }
-        }
+    if (MountTable::instance().find(target, &entry)) {
+        source = entry.source;
+    } else if (errno != ENOENT) {
+        LOGW("Failed to read mount table: %s", strerror(errno));
     }
 
-    errno = saved_errno;
-
-    return ret == 0;
+    return umount_entry(target, source);
 }
 
 uint64_t mount_get_total_size(const char *path)
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/mount_table.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+
+#define MOUNTINFO_PATH          "/proc/self/mountinfo"
+#define MOUNT_NS_PATH           "/proc/self/ns/mnt"
+
+#define DELETED_SUFFIX          " (deleted)"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Decode octal escapes (eg. `\040` for a space) in a mountinfo field
+ */
+static std::string unescape(const char *str, size_t size)
+{
+    std::string result;
+    result.reserve(size);
+
+    for (size_t i = 0; i < size; ++i) {
+        if (str[i] == '\\' && i + 3 < size
+                && str[i + 1] >= '0' && str[i + 1] <= '3'
+                && str[i + 2] >= '0' && str[i + 2] <= '7'
+                && str[i + 3] >= '0' && str[i + 3] <= '7') {
+            result += static_cast<char>(((str[i + 1] - '0') << 6)
+                    | ((str[i + 2] - '0') << 3) | (str[i + 3] - '0'));
+            i += 3;
+        } else {
+            result += str[i];
+        }
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Split a line into space-separated fields
+ */
+static void split_fields(char *line, std::vector<char *> *fields)
+{
+    fields->clear();
+
+    char *saveptr;
+    for (char *field = strtok_r(line, " ", &saveptr); field;
+            field = strtok_r(nullptr, " ", &saveptr)) {
+        fields->push_back(field);
+    }
+}
+
+/*!
+ * \brief Parse a line of /proc/self/mountinfo
+ *
+ * The format is:
+ *
+ *     <id> <parent id> <major>:<minor> <root> <mountpoint> <options>
+ *         [<optional fields>...] - <fs type> <source> <super options>
+ */
+static bool parse_line(char *line, std::vector<char *> *fields,
+                       MountEntry *entry)
+{
+    split_fields(line, fields);
+
+    // Find separator after the optional fields
+    size_t sep = 6;
+    while (sep < fields->size() && strcmp((*fields)[sep], "-") != 0) {
+        ++sep;
+    }
+    if (fields->size() < 6 || sep + 2 >= fields->size()) {
+        return false;
+    }
+
+    unsigned int major;
+    unsigned int minor;
+    char *end;
+
+    entry->id = strtol((*fields)[0], &end, 10);
+    if (*end) {
+        return false;
+    }
+    entry->parent_id = strtol((*fields)[1], &end, 10);
+    if (*end) {
+        return false;
+    }
+    if (sscanf((*fields)[2], "%u:%u", &major, &minor) != 2) {
+        return false;
+    }
+    entry->dev = makedev(major, minor);
+
+    auto field = [&](size_t i) {
+        return unescape((*fields)[i], strlen((*fields)[i]));
+    };
+
+    entry->root = field(3);
+    entry->target = field(4);
+    entry->options = field(5);
+    entry->fs_type = field(sep + 1);
+    entry->source = field(sep + 2);
+    entry->super_options = sep + 3 < fields->size()
+            ? field(sep + 3) : std::string();
+    entry->depth = 0;
+
+    // Mountpoints that were deleted have a suffix appended
+    const size_t suffix_len = strlen(DELETED_SUFFIX);
+    struct stat sb;
+    if (entry->target.size() > suffix_len
+            && entry->target.compare(entry->target.size() - suffix_len,
+                                     suffix_len, DELETED_SUFFIX) == 0
+            && lstat(entry->target.c_str(), &sb) < 0 && errno == ENOENT) {
+        entry->target.resize(entry->target.size() - suffix_len);
+    }
+
+    return true;
+}
+
+MountTable::MountTable()
+    : _fd(-1)
+    , _pid(0)
+    , _ns_dev(0)
+    , _ns_ino(0)
+    , _root_dev(0)
+    , _root_ino(0)
+    , _valid(false)
+{
+}
+
+MountTable::~MountTable()
+{
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+/*!
+ * \brief Get a copy of all entries in mount order
+ */
+bool MountTable::entries(std::vector<MountEntry> *entries_out)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (!update()) {
+        return false;
+    }
+
+    *entries_out = _entries;
+    return true;
+}
+
+/*!
+ * \brief Find the topmost mount at a mountpoint
+ *
+ * \return True if \p mountpoint is mounted. Otherwise, false with errno set to
+ *         ENOENT if it is not mounted or to another value if the mount table
+ *         could not be read.
+ */
+bool MountTable::find(const std::string &mountpoint, MountEntry *entry_out)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (!update()) {
+        return false;
+    }
+
+    auto it = _index.find(mountpoint);
+    if (it == _index.end()) {
+        errno = ENOENT;
+        return false;
+    }
+
+    if (entry_out) {
+        *entry_out = _entries[it->second];
+    }
+    return true;
+}
+
+bool MountTable::is_mounted(const std::string &mountpoint)
+{
+    return find(mountpoint, nullptr);
+}
+
+/*!
+ * \brief Sort entries so that they can be unmounted in order
+ *
+ * Entries are sorted by decreasing depth in the mount tree, so every mount is
+ * unmounted before the mount it is on top of. Mounts at the same depth are
+ * unmounted in reverse mount order.
+ */
+void MountTable::sort_for_unmount(std::vector<MountEntry> *entries)
+{
+    std::sort(entries->begin(), entries->end(),
+              [](const MountEntry &a, const MountEntry &b) {
+        if (a.depth != b.depth) {
+            return a.depth > b.depth;
+        }
+        return a.id > b.id;
+    });
+}
+
+/*!
+ * \brief Shared instance used by the mount functions in mount.h
+ */
+MountTable & MountTable::instance()
+{
+    static MountTable table;
+    return table;
+}
+
+/*!
+ * \brief Reparse the mount table if it has changed
+ */
+bool MountTable::update()
+{
+    struct stat sb_ns;
+    struct stat sb_root;
+
+    // The open fd keeps reporting the mount namespace and root directory that
+    // the process had when it was opened. If they can't be checked (eg. on
+    // kernels older than 3.8), the table is always reread.
+    if (stat(MOUNT_NS_PATH, &sb_ns) < 0 || stat("/", &sb_root) < 0) {
+        _valid = reopen() && load();
+        return _valid;
+    }
+
+    if (_fd < 0 || _pid != getpid()
+            || _ns_dev != sb_ns.st_dev || _ns_ino != sb_ns.st_ino
+            || _root_dev != sb_root.st_dev || _root_ino != sb_root.st_ino) {
+        if (!reopen()) {
+            return false;
+        }
+        _ns_dev = sb_ns.st_dev;
+        _ns_ino = sb_ns.st_ino;
+        _root_dev = sb_root.st_dev;
+        _root_ino = sb_root.st_ino;
+    } else if (_valid) {
+        // The kernel reports POLLPRI (and POLLERR) once after each change to
+        // the mount table
+        struct pollfd pfd;
+        pfd.fd = _fd;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+
+        int ret = poll(&pfd, 1, 0);
+        if (ret == 0) {
+            return true;
+        } else if (ret < 0 || (pfd.revents & POLLNVAL)) {
+            if (!reopen()) {
+                return false;
+            }
+        }
+    }
+
+    _valid = load();
+    return _valid;
+}
+
+bool MountTable::reopen()
+{
+    if (_fd >= 0) {
+        close(_fd);
+    }
+
+    _valid = false;
+    _fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+    if (_fd < 0) {
+        LOGE("%s: Failed to open: %s", MOUNTINFO_PATH, strerror(errno));
+        return false;
+    }
+
+    _pid = getpid();
+    return true;
+}
+
+/*!
+ * \brief Read and parse the mount table from the open fd
+ */
+bool MountTable::load()
+{
+    std::string data;
+    char buf[16384];
+
+    if (lseek(_fd, 0, SEEK_SET) < 0) {
+        LOGE("%s: Failed to seek: %s", MOUNTINFO_PATH, strerror(errno));
+        return false;
+    }
+
+    while (true) {
+        ssize_t n = read(_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("%s: Failed to read: %s", MOUNTINFO_PATH, strerror(errno));
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        data.append(buf, n);
+    }
+
+    std::vector<MountEntry> entries;
+    std::vector<char *> fields;
+    char *saveptr;
+
+    for (char *line = strtok_r(&data[0], "\n", &saveptr); line;
+            line = strtok_r(nullptr, "\n", &saveptr)) {
+        MountEntry entry;
+        if (!parse_line(line, &fields, &entry)) {
+            LOGW("%s: Skipping malformed line", MOUNTINFO_PATH);
+            continue;
+        }
+        entries.push_back(std::move(entry));
+    }
+
+    std::unordered_map<int, size_t> ids;
+    std::unordered_map<std::string, size_t> index;
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ids[entries[i].id] = i;
+        // Later entries are on top of earlier ones
+        index[entries[i].target] = i;
+    }
+
+    // Compute the depths in a single pass. Parents are normally listed before
+    // their children, but that's not guaranteed after mounts are moved, so
+    // walk up the tree for entries whose parent's depth is not known yet.
+    std::vector<int> depths(entries.size(), -1);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        std::vector<size_t> chain;
+        size_t cur = i;
+
+        while (depths[cur] < 0) {
+            chain.push_back(cur);
+            auto it = ids.find(entries[cur].parent_id);
+            if (it == ids.end() || it->second == cur
+                    || chain.size() > entries.size()) {
+                // Root of the tree (or of the part that is visible)
+                depths[cur] = 0;
+                chain.pop_back();
+                break;
+            }
+            cur = it->second;
+        }
+
+        int depth = depths[cur];
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            depths[*it] = ++depth;
+        }
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i].depth = depths[i];
+    }
+
+    _entries.swap(entries);
+    _index.swap(index);
+
+    return true;
+}
+
+}
+}
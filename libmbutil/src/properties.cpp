@@ -32,10 +32,9 @@
 #endif
 
 #include "mbcommon/common.h"
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
-#include "mbutil/finally.h"
+#include "mbutil/property_cache.h"
 #include "mbutil/string.h"
 
 #define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
@@ -367,93 +366,58 @@ bool file_get_property(const std::string &path,
                        std::string *out,
                        const std::string &default_value)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "r"));
-    if (!fp) {
+    auto file = PropertyFileCache::instance().get(path);
+    if (!file) {
         return false;
     }
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read;
-
-    auto free_line = finally([&] {
-        free(line);
-    });
-
-    while ((read = getline(&line, &len, fp.get())) >= 0) {
-        if (line[0] == '\0' || line[0] == '#') {
-            // Skip empty and comment lines
-            continue;
-        }
-
-        char *equals = strchr(line, '=');
-        if (!equals) {
-            // No equals in line
-            continue;
-        }
+    if (!file->get(key, out)) {
+        *out = default_value;
+    }
+    return true;
+}
 
-        if ((size_t)(equals - line) != key.size()) {
-            // Key is not the same length
-            continue;
-        }
+/*!
+ * \brief Get the values of multiple properties from a file
+ *
+ * The file is only parsed once for all of the keys.
+ *
+ * \param[in] path Path to property file
+ * \param[in] keys Property keys
+ * \param[out] values Output values in the same order as \p keys
+ * \param[in] default_value Value to use for keys that do not exist
+ *
+ * \return True if the file could be read. Otherwise, false with errno set.
+ */
+bool file_get_properties(const std::string &path,
+                         const std::vector<std::string> &keys,
+                         std::vector<std::string> *values,
+                         const std::string &default_value)
+{
+    auto file = PropertyFileCache::instance().get(path);
+    if (!file) {
+        return false;
+    }
 
-        if (mb_starts_with(line, key.c_str())) {
-            // Strip newline
-            if (line[read - 1] == '\n') {
-                line[read - 1] = '\0';
-                --read;
-            }
+    values->resize(keys.size());
 
-            out->assign(equals + 1);
-            return true;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!file->get(keys[i], &(*values)[i])) {
+            (*values)[i] = default_value;
         }
     }
-
-    *out = default_value;
     return true;
 }
 
 bool file_get_all_properties(const std::string &path,
                              std::unordered_map<std::string, std::string> *map)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "r"));
-    if (!fp) {
+    auto file = PropertyFileCache::instance().get(path);
+    if (!file) {
         return false;
     }
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read;
-
-    auto free_line = finally([&] {
-        free(line);
-    });
-
-    std::unordered_map<std::string, std::string> tempMap;
-
-    while ((read = getline(&line, &len, fp.get())) >= 0) {
-        if (line[0] == '\0' || line[0] == '#') {
-            // Skip empty and comment lines
-            continue;
-        }
-
-        char *equals = strchr(line, '=');
-        if (!equals) {
-            // No equals in line
-            continue;
-        }
-
-        // Strip newline
-        if (line[read - 1] == '\n') {
-            line[read - 1] = '\0';
-            --read;
-        }
-
-        *equals = '\0';
-        tempMap[line] = equals + 1;
-    }
-
-    map->swap(tempMap);
+    file->get_all(map);
     return true;
 }
 
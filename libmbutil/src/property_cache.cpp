@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/property_cache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbutil/finally.h"
+
+// Maximum number of files to keep parsed
+#define PROPERTY_CACHE_MAX_FILES        32
+// Files whose mtime or ctime is this close to the time they were read are not
+// cached. Timestamps have a coarse granularity, so a write in the same tick
+// might not change them.
+#define PROPERTY_CACHE_RACY_NS          1000000000LL
+
+namespace mb
+{
+namespace util
+{
+
+// FNV-1a
+static uint32_t hash_key(const char *key, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(key[i])) * 16777619u;
+    }
+    return hash;
+}
+
+static int64_t timespec_to_ns(const struct timespec &ts)
+{
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*!
+ * \brief Parse property file contents
+ *
+ * Lines are parsed the same way as file_get_property() and
+ * file_get_all_properties(): empty lines, comments, and lines without an equals
+ * sign are skipped and only the trailing newline is stripped from values.
+ */
+PropertyFile::PropertyFile(const char *data, size_t size)
+{
+    _pool.reserve(size);
+
+    const char *end = data + size;
+
+    for (const char *line = data; line < end;) {
+        const char *nl = static_cast<const char *>(
+                memchr(line, '\n', end - line));
+        const char *line_end = nl ? nl : end;
+        const char *next = nl ? nl + 1 : end;
+
+        // Lines are treated as C strings
+        const char *nul = static_cast<const char *>(
+                memchr(line, '\0', line_end - line));
+        if (nul) {
+            line_end = nul;
+        }
+
+        const char *equals = static_cast<const char *>(
+                memchr(line, '=', line_end - line));
+
+        if (line != line_end && *line != '#' && equals) {
+            Entry entry;
+            entry.key_offset = _pool.size();
+            entry.key_size = equals - line;
+            _pool.append(line, equals - line);
+            entry.value_offset = _pool.size();
+            entry.value_size = line_end - equals - 1;
+            _pool.append(equals + 1, line_end - equals - 1);
+            _entries.push_back(entry);
+        }
+
+        line = next;
+    }
+
+    // Keep the load factor at or below 50%
+    size_t capacity = 16;
+    while (capacity < _entries.size() * 2) {
+        capacity *= 2;
+    }
+    _slots.assign(capacity, 0);
+
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const Entry &entry = _entries[i];
+        const char *key = _pool.data() + entry.key_offset;
+
+        // The first occurrence of a key wins
+        if (find(key, entry.key_size)) {
+            continue;
+        }
+
+        size_t slot = hash_key(key, entry.key_size) & (capacity - 1);
+        while (_slots[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        _slots[slot] = i + 1;
+    }
+}
+
+const PropertyFile::Entry * PropertyFile::find(const char *key,
+                                               size_t size) const
+{
+    size_t mask = _slots.size() - 1;
+    size_t slot = hash_key(key, size) & mask;
+
+    while (_slots[slot] != 0) {
+        const Entry &entry = _entries[_slots[slot] - 1];
+        if (entry.key_size == size
+                && memcmp(_pool.data() + entry.key_offset, key, size) == 0) {
+            return &entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return nullptr;
+}
+
+/*!
+ * \brief Get the value of the first occurrence of a key
+ *
+ * \return True if the key exists. Otherwise, false.
+ */
+bool PropertyFile::get(const std::string &key, std::string *value) const
+{
+    const Entry *entry = find(key.data(), key.size());
+    if (!entry) {
+        return false;
+    }
+
+    value->assign(_pool.data() + entry->value_offset, entry->value_size);
+    return true;
+}
+
+/*!
+ * \brief Get all properties
+ */
+void PropertyFile::get_all(std::unordered_map<std::string, std::string> *map) const
+{
+    std::unordered_map<std::string, std::string> temp;
+    temp.reserve(_entries.size());
+
+    for (auto const &entry : _entries) {
+        temp[std::string(_pool.data() + entry.key_offset, entry.key_size)]
+                .assign(_pool.data() + entry.value_offset, entry.value_size);
+    }
+
+    map->swap(temp);
+}
+
+PropertyFileCache::PropertyFileCache() : _clock(0)
+{
+}
+
+/*!
+ * \brief Get a parsed property file
+ *
+ * Regular files are read and parsed once. The cached copy is used until the
+ * file's metadata changes. Other files (eg. in procfs) are read and parsed on
+ * every call.
+ *
+ * \return Parsed file or nullptr with errno set if the file could not be read
+ */
+std::shared_ptr<const PropertyFile> PropertyFileCache::get(const std::string &path)
+{
+    struct stat sb;
+
+    if (stat(path.c_str(), &sb) == 0) {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        auto it = _files.find(path);
+        if (it != _files.end()
+                && it->second.dev == static_cast<uint64_t>(sb.st_dev)
+                && it->second.ino == static_cast<uint64_t>(sb.st_ino)
+                && it->second.size == static_cast<uint64_t>(sb.st_size)
+                && it->second.mtime_ns == timespec_to_ns(sb.st_mtim)
+                && it->second.ctime_ns == timespec_to_ns(sb.st_ctim)) {
+            it->second.stamp = ++_clock;
+            return it->second.file;
+        }
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    auto close_fd = finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    if (fstat(fd, &sb) < 0) {
+        return nullptr;
+    }
+
+    std::string data;
+    char buf[4096];
+
+    if (S_ISREG(sb.st_mode)) {
+        data.reserve(sb.st_size);
+    }
+
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return nullptr;
+        } else if (n == 0) {
+            break;
+        }
+        data.append(buf, n);
+    }
+
+    std::shared_ptr<const PropertyFile> file =
+            std::make_shared<PropertyFile>(data.data(), data.size());
+
+    // Don't cache the file if it changed size while it was being read
+    if (!S_ISREG(sb.st_mode)
+            || data.size() != static_cast<uint64_t>(sb.st_size)) {
+        return file;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t racy_ns = timespec_to_ns(now) - PROPERTY_CACHE_RACY_NS;
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (timespec_to_ns(sb.st_mtim) > racy_ns
+            || timespec_to_ns(sb.st_ctim) > racy_ns) {
+        _files.erase(path);
+        return file;
+    }
+
+    if (_files.size() >= PROPERTY_CACHE_MAX_FILES
+            && _files.find(path) == _files.end()) {
+        // Evict the least recently used file
+        auto oldest = _files.begin();
+        for (auto it = _files.begin(); it != _files.end(); ++it) {
+            if (it->second.stamp < oldest->second.stamp) {
+                oldest = it;
+            }
+        }
+        _files.erase(oldest);
+    }
+
+    CachedFile &cached = _files[path];
+    cached.dev = sb.st_dev;
+    cached.ino = sb.st_ino;
+    cached.size = sb.st_size;
+    cached.mtime_ns = timespec_to_ns(sb.st_mtim);
+    cached.ctime_ns = timespec_to_ns(sb.st_ctim);
+    cached.stamp = ++_clock;
+    cached.file = file;
+
+    return file;
+}
+
+/*!
+ * \brief Shared instance used by the property file functions in properties.h
+ */
+PropertyFileCache & PropertyFileCache::instance()
+{
+    static PropertyFileCache cache;
+    return cache;
+}
+
+}
+}
@@ -20,6 +20,7 @@
 #include "mbutil/selinux.h"
 
 #include <cerrno>
+#include <cstdio>
 #include <cstring>
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -32,7 +33,7 @@
 
 #include "mblog/logging.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
+#include "mbutil/walk.h"
 
 #define SELINUX_XATTR           "security.selinux"
 
@@ -44,50 +45,213 @@ namespace mb
 namespace util
 {
 
-class RecursiveSetContext : public FTSWrapper {
+/*!
+ * \brief Get a path that refers to a directory entry relative to a directory fd
+ *
+ * There is no *xattrat() syscall, so this goes through the directory's fd in
+ * procfs to avoid having the kernel resolve the directory's full path.
+ */
+static std::string fd_relative_path(int dirfd, const std::string &name)
+{
+    if (dirfd == AT_FDCWD) {
+        return name;
+    }
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/proc/self/fd/%d/", dirfd);
+
+    std::string path(buf);
+    path += name;
+    return path;
+}
+
+/*!
+ * \brief Read the SELinux label using a getxattr-like function
+ *
+ * The label is read into a stack buffer first, so only labels that do not fit
+ * need a second call to query the size.
+ */
+template<typename GetXattrFn>
+static bool read_context(GetXattrFn getxattr_fn, std::string *context)
+{
+    char buf[256];
+    ssize_t size;
+
+    size = getxattr_fn(buf, sizeof(buf));
+    if (size >= 0) {
+        context->assign(buf, strnlen(buf, size));
+        return true;
+    } else if (errno != ERANGE) {
+        return false;
+    }
+
+    std::vector<char> value;
+
+    size = getxattr_fn(nullptr, 0);
+    if (size < 0) {
+        return false;
+    }
+
+    value.resize(size);
+
+    size = getxattr_fn(value.data(), size);
+    if (size < 0) {
+        return false;
+    }
+
+    context->assign(value.data(), strnlen(value.data(), size));
+
+    return true;
+}
+
+class RecursiveSetContext : public TreeWalker {
 public:
     RecursiveSetContext(std::string path, std::string context,
                         bool follow_symlinks)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : TreeWalker(path, 0),
         _context(std::move(context)),
         _follow_symlinks(follow_symlinks)
     {
     }
 
-    virtual int on_reached_directory_post() override
+    virtual int on_reached_directory_post(const Entry &entry) override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return selinux_fset_context(entry.fd, _context)
+                ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_file() override
+    virtual int on_reached_file(const Entry &entry) override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_symlink() override
+    virtual int on_reached_symlink(const Entry &entry) override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
-    virtual int on_reached_special_file() override
+    virtual int on_reached_special_file(const Entry &entry) override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context(entry) ? Action::WALK_OK : Action::WALK_Fail;
     }
 
 private:
     std::string _context;
     bool _follow_symlinks;
 
-    bool set_context()
+    bool set_context(const Entry &entry)
+    {
+        if (set_context_path(fd_relative_path(entry.dirfd, entry.name))) {
+            return true;
+        } else if (errno != ENOENT || entry.dirfd == AT_FDCWD) {
+            return false;
+        }
+
+        // procfs may not be mounted
+        return set_context_path(entry.path());
+    }
+
+    bool set_context_path(const std::string &path)
     {
         if (_follow_symlinks) {
-            return selinux_set_context(_curr->fts_accpath, _context);
+            return selinux_set_context(path, _context);
         } else {
-            return selinux_lset_context(_curr->fts_accpath, _context);
+            return selinux_lset_context(path, _context);
         }
     }
 };
 
+/*!
+ * \brief Read the SELinux label using a getxattr-like function and intern it
+ */
+template<typename GetXattrFn>
+static bool read_label(GetXattrFn getxattr_fn, SelinuxLabelCache *cache,
+                       SelinuxLabelCache::Label *label)
+{
+    char buf[256];
+    ssize_t size;
+
+    size = getxattr_fn(buf, sizeof(buf));
+    if (size >= 0) {
+        *label = cache->intern(buf, strnlen(buf, size));
+        return true;
+    } else if (errno != ERANGE) {
+        return false;
+    }
+
+    std::string context;
+    if (!read_context(getxattr_fn, &context)) {
+        return false;
+    }
+
+    *label = cache->intern(context);
+    return true;
+}
+
+/*!
+ * \brief Get the interned copy of a label, adding it if necessary
+ */
+SelinuxLabelCache::Label SelinuxLabelCache::intern(const char *context,
+                                                   size_t size)
+{
+    // FNV-1a
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(context[i])) * 16777619u;
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    auto range = _labels.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const std::string &s = *it->second;
+        if (s.size() == size && memcmp(s.data(), context, size) == 0) {
+            return &s;
+        }
+    }
+
+    auto it = _labels.emplace(hash, std::unique_ptr<std::string>(
+            new std::string(context, size)));
+    return it->second.get();
+}
+
+SelinuxLabelCache::Label SelinuxLabelCache::intern(const std::string &context)
+{
+    return intern(context.data(), context.size());
+}
+
+/*!
+ * \brief Get the interned SELinux label of an open file
+ */
+bool SelinuxLabelCache::fget(int fd, Label *label)
+{
+    return read_label([&](void *value, size_t size) {
+        return fgetxattr(fd, SELINUX_XATTR, value, size);
+    }, this, label);
+}
+
+/*!
+ * \brief Get the interned SELinux label of a path without following symlinks
+ */
+bool SelinuxLabelCache::lget(const std::string &path, Label *label)
+{
+    return read_label([&](void *value, size_t size) {
+        return lgetxattr(path.c_str(), SELINUX_XATTR, value, size);
+    }, this, label);
+}
+
+/*!
+ * \brief Get the interned SELinux label of a directory entry without following
+ *        symlinks
+ *
+ * \note This requires procfs to be mounted unless \p dirfd is AT_FDCWD.
+ */
+bool SelinuxLabelCache::lget_at(int dirfd, const std::string &name,
+                                Label *label)
+{
+    return lget(fd_relative_path(dirfd, name), label);
+}
+
 bool selinux_read_policy(const std::string &path, policydb_t *pdb)
 {
     struct policy_file pf;
@@ -197,71 +361,34 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
 
 bool selinux_get_context(const std::string &path, std::string *context)
 {
-    ssize_t size;
-    std::vector<char> value;
-
-    size = getxattr(path.c_str(), SELINUX_XATTR, nullptr, 0);
-    if (size < 0) {
-        return false;
-    }
-
-    value.resize(size);
-
-    size = getxattr(path.c_str(), SELINUX_XATTR, value.data(), size);
-    if (size < 0) {
-        return false;
-    }
-
-    value.push_back('\0');
-    *context = value.data();
-
-    return true;
+    return read_context([&](void *value, size_t size) {
+        return getxattr(path.c_str(), SELINUX_XATTR, value, size);
+    }, context);
 }
 
 bool selinux_lget_context(const std::string &path, std::string *context)
 {
-    ssize_t size;
-    std::vector<char> value;
-
-    size = lgetxattr(path.c_str(), SELINUX_XATTR, nullptr, 0);
-    if (size < 0) {
-        return false;
-    }
-
-    value.resize(size);
-
-    size = lgetxattr(path.c_str(), SELINUX_XATTR, value.data(), size);
-    if (size < 0) {
-        return false;
-    }
-
-    value.push_back('\0');
-    *context = value.data();
-
-    return true;
+    return read_context([&](void *value, size_t size) {
+        return lgetxattr(path.c_str(), SELINUX_XATTR, value, size);
+    }, context);
 }
 
 bool selinux_fget_context(int fd, std::string *context)
 {
-    ssize_t size;
-    std::vector<char> value;
-
-    size = fgetxattr(fd, SELINUX_XATTR, nullptr, 0);
-    if (size < 0) {
-        return false;
-    }
-
-    value.resize(size);
-
-    size = fgetxattr(fd, SELINUX_XATTR, value.data(), size);
-    if (size < 0) {
-        return false;
-    }
-
-    value.push_back('\0');
-    *context = value.data();
+    return read_context([&](void *value, size_t size) {
+        return fgetxattr(fd, SELINUX_XATTR, value, size);
+    }, context);
+}
 
-    return true;
+/*!
+ * \brief Get the SELinux label of a directory entry without following symlinks
+ *
+ * \note This requires procfs to be mounted unless \p dirfd is AT_FDCWD.
+ */
+bool selinux_lget_context_at(int dirfd, const std::string &name,
+                             std::string *context)
+{
+    return selinux_lget_context(fd_relative_path(dirfd, name), context);
 }
 
 bool selinux_set_context(const std::string &path, const std::string &context)
@@ -282,6 +409,17 @@ bool selinux_fset_context(int fd, const std::string &context)
                      context.c_str(), context.size() + 1, 0) == 0;
 }
 
+/*!
+ * \brief Set the SELinux label of a directory entry without following symlinks
+ *
+ * \note This requires procfs to be mounted unless \p dirfd is AT_FDCWD.
+ */
+bool selinux_lset_context_at(int dirfd, const std::string &name,
+                             const std::string &context)
+{
+    return selinux_lset_context(fd_relative_path(dirfd, name), context);
+}
+
 bool selinux_set_context_recursive(const std::string &path,
                                    const std::string &context)
 {
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/thread_pool.h"
+
+#include <cstring>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Create worker threads
+ *
+ * \param threads Number of threads. If 0, default_size() threads are created.
+ */
+ThreadPool::ThreadPool(unsigned int threads)
+    : _next(0)
+    , _queued(0)
+    , _pending(0)
+    , _stop(false)
+{
+    if (threads == 0) {
+        threads = default_size();
+    }
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        std::unique_ptr<Worker> worker(new Worker());
+        worker->pool = this;
+        worker->index = _workers.size();
+
+        // Workers only look at _workers after being woken up by submit(), so
+        // it is safe to append while earlier workers are running
+        int ret = pthread_create(&worker->tid, nullptr, &worker_thread,
+                                 worker.get());
+        if (ret != 0) {
+            LOGW("Failed to create worker thread: %s", strerror(ret));
+            break;
+        }
+
+        _workers.push_back(std::move(worker));
+    }
+}
+
+/*!
+ * \brief Wait for all tasks and stop the worker threads
+ */
+ThreadPool::~ThreadPool()
+{
+    wait();
+
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stop = true;
+    }
+    _work_cond.notify_all();
+
+    for (auto &worker : _workers) {
+        pthread_join(worker->tid, nullptr);
+    }
+}
+
+/*!
+ * \brief Get number of worker threads
+ */
+unsigned int ThreadPool::size() const
+{
+    return _workers.size();
+}
+
+/*!
+ * \brief Number of online CPUs (at least 1)
+ */
+unsigned int ThreadPool::default_size()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/*!
+ * \brief Queue a task
+ *
+ * This can be called from within a task.
+ */
+void ThreadPool::submit(Task task)
+{
+    if (_workers.empty()) {
+        task();
+        return;
+    }
+
+    size_t index = current_worker();
+    if (index == _workers.size()) {
+        std::lock_guard<std::mutex> lock(_lock);
+        index = _next++ % _workers.size();
+    }
+
+    // Count the task before it becomes visible so that a worker can never
+    // finish it before it is counted
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        ++_queued;
+        ++_pending;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_workers[index]->lock);
+        _workers[index]->tasks.push_back(std::move(task));
+    }
+
+    _work_cond.notify_one();
+}
+
+/*!
+ * \brief Wait for submitted tasks to finish
+ *
+ * \param max_pending Return once at most this many tasks are queued or running.
+ *                    Producers can use this to bound how far ahead of the
+ *                    workers they get.
+ */
+void ThreadPool::wait(size_t max_pending)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _done_cond.wait(lock, [&]{ return _pending <= max_pending; });
+}
+
+size_t ThreadPool::current_worker() const
+{
+    pthread_t self = pthread_self();
+
+    for (size_t i = 0; i < _workers.size(); ++i) {
+        if (pthread_equal(_workers[i]->tid, self)) {
+            return i;
+        }
+    }
+
+    return _workers.size();
+}
+
+/*!
+ * \brief Take the newest task from a worker's queue or steal the oldest task
+ *        from another worker
+ */
+bool ThreadPool::pop_task(size_t index, Task *task)
+{
+    {
+        Worker &worker = *_workers[index];
+        std::lock_guard<std::mutex> lock(worker.lock);
+        if (!worker.tasks.empty()) {
+            *task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < _workers.size(); ++i) {
+        Worker &victim = *_workers[(index + i) % _workers.size()];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.tasks.empty()) {
+            *task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void * ThreadPool::worker_thread(void *data)
+{
+    Worker *worker = static_cast<Worker *>(data);
+    ThreadPool *pool = worker->pool;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool->_lock);
+            pool->_work_cond.wait(lock, [&]{
+                return pool->_stop || pool->_queued > 0;
+            });
+            if (pool->_queued == 0) {
+                break;
+            }
+        }
+
+        Task task;
+        if (!pool->pop_task(worker->index, &task)) {
+            // Another worker took it first or the task has been counted, but
+            // not pushed yet
+            sched_yield();
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pool->_lock);
+            --pool->_queued;
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(pool->_lock);
+            --pool->_pending;
+        }
+        // wait() may be waiting for a non-zero count, so always notify
+        pool->_done_cond.notify_all();
+    }
+
+    return nullptr;
+}
+
+}
+}
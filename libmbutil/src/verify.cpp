@@ -0,0 +1,435 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/verify.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+#include "mbutil/time.h"
+
+// O_DIRECT requires the buffer address, file offset, and size to be aligned to
+// the logical block size of the device
+#define VERIFY_ALIGNMENT        4096
+
+namespace mb
+{
+namespace util
+{
+
+WriteDigest::WriteDigest()
+{
+    SHA512_Init(&_ctx);
+}
+
+/*!
+ * \brief Add written data to the digest
+ *
+ * \param data Data that was written
+ * \param size Size of \a data
+ * \param offset Offset in the output file that \a data was written to
+ */
+void WriteDigest::update(const void *data, size_t size, uint64_t offset)
+{
+    if (size == 0) {
+        return;
+    }
+
+    SHA512_Update(&_ctx, data, size);
+
+    if (!_extents.empty()
+            && _extents.back().offset + _extents.back().size == offset) {
+        _extents.back().size += size;
+    } else {
+        _extents.push_back({ offset, size });
+    }
+}
+
+void WriteDigest::finish(unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    SHA512_Final(digest, &_ctx);
+}
+
+const std::vector<VerifyExtent> & WriteDigest::extents() const
+{
+    return _extents;
+}
+
+struct ReadBackVerifier::Job
+{
+    std::string path;
+    std::vector<VerifyExtent> extents;
+    unsigned char expected[SHA512_DIGEST_LENGTH];
+
+    // Only touched by the hasher thread
+    SHA512_CTX ctx;
+    uint64_t bytes = 0;
+    struct timespec start;
+
+    // Set by the reader thread before the last chunk is pushed
+    int error = 0;
+};
+
+struct ReadBackVerifier::Chunk
+{
+    Job *job;
+    // nullptr for the end-of-job marker
+    char *buf;
+    // Data starts at buf + skip since O_DIRECT reads begin at an aligned offset
+    size_t skip;
+    size_t size;
+    bool last;
+};
+
+ReadBackVerifier::ReadBackVerifier(size_t chunk_size, size_t chunk_count)
+    : _chunk_size((std::max<size_t>(chunk_size, VERIFY_ALIGNMENT)
+            + VERIFY_ALIGNMENT - 1) / VERIFY_ALIGNMENT * VERIFY_ALIGNMENT)
+    , _chunk_count(std::max<size_t>(chunk_count, 2))
+    , _started(false)
+    , _pending(0)
+    , _stop(false)
+{
+}
+
+ReadBackVerifier::~ReadBackVerifier()
+{
+    if (_started) {
+        wait();
+        stop();
+    }
+
+    for (char *buf : _buffers) {
+        free(buf);
+    }
+}
+
+bool ReadBackVerifier::start()
+{
+    for (size_t i = _buffers.size(); i < _chunk_count; ++i) {
+        void *ptr;
+        int ret = posix_memalign(&ptr, VERIFY_ALIGNMENT, _chunk_size);
+        if (ret != 0) {
+            errno = ret;
+            return false;
+        }
+        _buffers.push_back(static_cast<char *>(ptr));
+        _free.push_back(static_cast<char *>(ptr));
+    }
+
+    _stop = false;
+
+    int ret = pthread_create(&_reader_tid, nullptr, &reader_thread, this);
+    if (ret != 0) {
+        errno = ret;
+        return false;
+    }
+
+    ret = pthread_create(&_hasher_tid, nullptr, &hasher_thread, this);
+    if (ret != 0) {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+        }
+        _cond.notify_all();
+        pthread_join(_reader_tid, nullptr);
+        errno = ret;
+        return false;
+    }
+
+    _started = true;
+    return true;
+}
+
+void ReadBackVerifier::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stop = true;
+    }
+    _cond.notify_all();
+
+    pthread_join(_reader_tid, nullptr);
+    pthread_join(_hasher_tid, nullptr);
+
+    _started = false;
+}
+
+/*!
+ * \brief Queue a file for verification
+ *
+ * The data in \a extents of \a path is read back in the background and its
+ * SHA512 digest is compared with \a digest. The data must have already been
+ * synced to \a path.
+ *
+ * \return Whether the job was queued. errno is set on failure.
+ */
+bool ReadBackVerifier::submit(const std::string &path,
+                              std::vector<VerifyExtent> extents,
+                              const unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    if (!_started && !start()) {
+        return false;
+    }
+
+    Job *job = new Job();
+    job->path = path;
+    job->extents = std::move(extents);
+    memcpy(job->expected, digest, SHA512_DIGEST_LENGTH);
+    SHA512_Init(&job->ctx);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _jobs.push_back(job);
+        ++_pending;
+    }
+    _cond.notify_all();
+
+    return true;
+}
+
+/*!
+ * \brief Wait for all submitted jobs to be verified
+ *
+ * \param[out] failed If not nullptr, the paths of the files that could not be
+ *                    read back or whose digests did not match since the last
+ *                    call to wait()
+ *
+ * \return Whether all files were successfully verified
+ */
+bool ReadBackVerifier::wait(std::vector<std::string> *failed)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _cond.wait(lock, [&]{ return _pending == 0; });
+
+    bool ret = _failed.empty();
+    if (failed) {
+        *failed = std::move(_failed);
+    }
+    _failed.clear();
+
+    return ret;
+}
+
+void ReadBackVerifier::push_chunk(const Chunk &chunk)
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _chunks.push_back(chunk);
+    }
+    _cond.notify_all();
+}
+
+bool ReadBackVerifier::read_job(Job *job)
+{
+    bool direct = true;
+    int fd = open(job->path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // Filesystem does not support O_DIRECT
+        direct = false;
+        fd = open(job->path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        job->error = errno;
+        LOGE("%s: Failed to open: %s", job->path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        close(fd);
+    });
+
+    for (const VerifyExtent &extent : job->extents) {
+        uint64_t pos = extent.offset;
+        uint64_t end = extent.offset + extent.size;
+
+        while (pos < end) {
+            char *buf;
+
+            {
+                std::unique_lock<std::mutex> lock(_lock);
+                _cond.wait(lock, [&]{ return !_free.empty(); });
+                buf = _free.front();
+                _free.pop_front();
+            }
+
+            uint64_t base = direct
+                    ? pos / VERIFY_ALIGNMENT * VERIFY_ALIGNMENT : pos;
+            size_t skip = pos - base;
+            size_t size = std::min<uint64_t>(_chunk_size - skip, end - pos);
+            size_t needed = skip + size;
+            size_t len = direct
+                    ? (needed + VERIFY_ALIGNMENT - 1)
+                            / VERIFY_ALIGNMENT * VERIFY_ALIGNMENT
+                    : needed;
+            size_t total = 0;
+
+            while (total < needed) {
+                ssize_t n = pread64(fd, buf + total, len - total,
+                                    base + total);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    } else if (errno == EINVAL && direct) {
+                        int flags = fcntl(fd, F_GETFL);
+                        if (flags >= 0
+                                && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                            direct = false;
+                            len = needed;
+                            continue;
+                        }
+                    }
+                    job->error = errno;
+                } else if (n == 0) {
+                    job->error = EIO;
+                }
+
+                if (job->error != 0) {
+                    LOGE("%s: Failed to read at offset %" PRIu64 ": %s",
+                         job->path.c_str(), base + total,
+                         strerror(job->error));
+
+                    {
+                        std::lock_guard<std::mutex> lock(_lock);
+                        _free.push_back(buf);
+                    }
+                    _cond.notify_all();
+
+                    return false;
+                }
+
+                total += n;
+            }
+
+            push_chunk({ job, buf, skip, size, false });
+            pos += size;
+        }
+    }
+
+    return true;
+}
+
+void * ReadBackVerifier::reader_thread(void *data)
+{
+    ReadBackVerifier *verifier = static_cast<ReadBackVerifier *>(data);
+
+    while (true) {
+        Job *job;
+
+        {
+            std::unique_lock<std::mutex> lock(verifier->_lock);
+            verifier->_cond.wait(lock, [&]{
+                return verifier->_stop || !verifier->_jobs.empty();
+            });
+            if (verifier->_jobs.empty()) {
+                break;
+            }
+            job = verifier->_jobs.front();
+            verifier->_jobs.pop_front();
+        }
+
+        verifier->read_job(job);
+        verifier->push_chunk({ job, nullptr, 0, 0, true });
+    }
+
+    return nullptr;
+}
+
+void * ReadBackVerifier::hasher_thread(void *data)
+{
+    ReadBackVerifier *verifier = static_cast<ReadBackVerifier *>(data);
+
+    while (true) {
+        Chunk chunk;
+
+        {
+            std::unique_lock<std::mutex> lock(verifier->_lock);
+            verifier->_cond.wait(lock, [&]{
+                return verifier->_stop || !verifier->_chunks.empty();
+            });
+            if (verifier->_chunks.empty()) {
+                break;
+            }
+            chunk = verifier->_chunks.front();
+            verifier->_chunks.pop_front();
+        }
+
+        Job *job = chunk.job;
+
+        if (chunk.buf) {
+            SHA512_Update(&job->ctx, chunk.buf + chunk.skip, chunk.size);
+            job->bytes += chunk.size;
+
+            {
+                std::lock_guard<std::mutex> lock(verifier->_lock);
+                verifier->_free.push_back(chunk.buf);
+            }
+            verifier->_cond.notify_all();
+        }
+
+        if (!chunk.last) {
+            continue;
+        }
+
+        unsigned char digest[SHA512_DIGEST_LENGTH];
+        SHA512_Final(digest, &job->ctx);
+
+        bool ok = job->error == 0
+                && memcmp(digest, job->expected, SHA512_DIGEST_LENGTH) == 0;
+
+        if (job->error != 0) {
+            LOGE("%s: Could not read back written data", job->path.c_str());
+        } else if (!ok) {
+            LOGE("%s: Read back data does not match written data",
+                 job->path.c_str());
+        } else {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            LOGD("%s: Verified %" PRIu64 " bytes in %" PRId64 "ms",
+                 job->path.c_str(), job->bytes,
+                 timespec_diff_ms(job->start, now));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(verifier->_lock);
+            if (!ok) {
+                verifier->_failed.push_back(job->path);
+            }
+            --verifier->_pending;
+        }
+        verifier->_cond.notify_all();
+
+        delete job;
+    }
+
+    return nullptr;
+}
+
+}
+}
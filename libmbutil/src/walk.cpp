@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/walk.h"
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+
+#define GETDENTS_BUF_SIZE       (32 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+struct TreeWalker::Frame
+{
+    const Frame *parent;
+    const Entry *entry;
+    dev_t dev;
+    ino_t ino;
+};
+
+TreeWalker::Entry::Entry(const Frame *parent, int dirfd, const char *name,
+                         unsigned char type, int depth, bool follow)
+    : dirfd(dirfd)
+    , name(name)
+    , type(type)
+    , depth(depth)
+    , fd(-1)
+    , _parent(parent)
+    , _follow(follow)
+    , _have_path(false)
+    , _stat_ret(1)
+{
+}
+
+/*!
+ * \brief Get the full path of the entry
+ *
+ * The path is only built the first time this is called.
+ */
+const std::string & TreeWalker::Entry::path() const
+{
+    if (!_have_path) {
+        if (_parent) {
+            _path = _parent->entry->path();
+            if (_path.empty() || _path.back() != '/') {
+                _path += '/';
+            }
+        }
+        _path += name;
+        _have_path = true;
+    }
+    return _path;
+}
+
+/*!
+ * \brief Get the stat buffer of the entry
+ *
+ * The entry is only stat'ed the first time this is called. Symlinks are not
+ * followed unless WALK_FollowSymlinks was specified.
+ *
+ * \return Stat buffer or nullptr with errno set if the entry could not be
+ *         stat'ed
+ */
+const struct stat * TreeWalker::Entry::stat() const
+{
+    if (_stat_ret > 0) {
+        _stat_ret = fstatat(dirfd, name, &_sb,
+                            _follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0 ? errno : 0;
+    }
+    if (_stat_ret != 0) {
+        errno = _stat_ret;
+        return nullptr;
+    }
+    return &_sb;
+}
+
+TreeWalker::TreeWalker(std::string path, int flags)
+    : _path(std::move(path))
+    , _flags(flags)
+    , _ran(false)
+    , _failed(false)
+    , _saved_errno(0)
+    , _root_dev(0)
+{
+}
+
+TreeWalker::~TreeWalker()
+{
+}
+
+bool TreeWalker::run()
+{
+    if (_ran) {
+        _error_msg = "Already ran";
+        return false;
+    }
+    _ran = true;
+
+    _buf.resize(GETDENTS_BUF_SIZE);
+
+    Entry root(nullptr, AT_FDCWD, _path.c_str(), DT_UNKNOWN, 0,
+               _flags & WALK_FollowSymlinks);
+    visit(root, nullptr);
+
+    _buf.clear();
+    _buf.shrink_to_fit();
+
+    if (_failed) {
+        errno = _saved_errno;
+        return false;
+    }
+    return true;
+}
+
+std::string TreeWalker::error()
+{
+    return _error_msg;
+}
+
+int TreeWalker::on_reached_directory_pre(const Entry &entry)
+{
+    (void) entry;
+    return Action::WALK_OK;
+}
+
+int TreeWalker::on_reached_directory_post(const Entry &entry)
+{
+    (void) entry;
+    return Action::WALK_OK;
+}
+
+int TreeWalker::on_reached_file(const Entry &entry)
+{
+    (void) entry;
+    return Action::WALK_OK;
+}
+
+int TreeWalker::on_reached_symlink(const Entry &entry)
+{
+    (void) entry;
+    return Action::WALK_OK;
+}
+
+int TreeWalker::on_reached_special_file(const Entry &entry)
+{
+    (void) entry;
+    return Action::WALK_OK;
+}
+
+void TreeWalker::set_error(const char *fmt, ...)
+{
+    int saved_errno = errno;
+
+    va_list ap;
+    va_start(ap, fmt);
+    char *msg = mb_format_v(fmt, ap);
+    va_end(ap);
+
+    if (msg) {
+        _error_msg = msg;
+        free(msg);
+    }
+
+    errno = saved_errno;
+}
+
+/*!
+ * \brief Visit an entry and, if it is a directory, its children
+ *
+ * \return WALK_Stop if the traversal should stop. Otherwise, WALK_OK.
+ */
+int TreeWalker::visit(Entry &entry, const Frame *parent)
+{
+    bool follow = _flags & WALK_FollowSymlinks;
+    struct stat sb;
+    int result;
+
+    // Only stat if the type is unknown or if we need the symlink target's type
+    if (entry.type == DT_UNKNOWN || (follow && entry.type == DT_LNK)) {
+        const struct stat *entry_sb = entry.stat();
+        if (entry_sb) {
+            entry.type = IFTODT(entry_sb->st_mode);
+        } else if (follow && entry.type == DT_LNK && errno == ENOENT) {
+            // Dangling symlink
+        } else if (follow && entry.type == DT_UNKNOWN && errno == ENOENT
+                && fstatat(entry.dirfd, entry.name, &sb,
+                           AT_SYMLINK_NOFOLLOW) == 0) {
+            // Dangling symlink where the filesystem does not report d_type
+            entry.type = DT_LNK;
+        } else {
+            set_error("%s: Failed to stat: %s",
+                      entry.path().c_str(), strerror(errno));
+            _failed = true;
+            _saved_errno = errno;
+            return Action::WALK_OK;
+        }
+    }
+
+    if (entry.type != DT_DIR) {
+        switch (entry.type) {
+        case DT_REG:
+            result = on_reached_file(entry);
+            break;
+        case DT_LNK:
+            result = on_reached_symlink(entry);
+            break;
+        default:
+            result = on_reached_special_file(entry);
+            break;
+        }
+
+        if (result & Action::WALK_Fail) {
+            _failed = true;
+            _saved_errno = errno;
+        }
+        return result & Action::WALK_Stop;
+    }
+
+    entry.fd = openat(entry.dirfd, entry.name,
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC
+                      | (follow ? 0 : O_NOFOLLOW));
+    if (entry.fd < 0) {
+        set_error("%s: Failed to open directory: %s",
+                  entry.path().c_str(), strerror(errno));
+        _failed = true;
+        _saved_errno = errno;
+        return Action::WALK_OK;
+    }
+
+    if (fstat(entry.fd, &sb) < 0) {
+        set_error("%s: Failed to stat: %s",
+                  entry.path().c_str(), strerror(errno));
+        _failed = true;
+        _saved_errno = errno;
+        close(entry.fd);
+        entry.fd = -1;
+        return Action::WALK_OK;
+    }
+
+    if (!parent) {
+        _root_dev = sb.st_dev;
+    }
+
+    // Skip directory cycles, which can only be reached by following symlinks
+    for (const Frame *f = parent; f; f = f->parent) {
+        if (f->dev == sb.st_dev && f->ino == sb.st_ino) {
+            close(entry.fd);
+            entry.fd = -1;
+            return Action::WALK_OK;
+        }
+    }
+
+    Frame frame;
+    frame.parent = parent;
+    frame.entry = &entry;
+    frame.dev = sb.st_dev;
+    frame.ino = sb.st_ino;
+
+    result = on_reached_directory_pre(entry);
+    if (result & Action::WALK_Fail) {
+        _failed = true;
+        _saved_errno = errno;
+    }
+    if (!(result & (Action::WALK_Skip | Action::WALK_Stop))) {
+        // Mountpoints are reported, but not descended into
+        if ((_flags & WALK_CrossMountPointBoundaries)
+                || sb.st_dev == _root_dev) {
+            result = walk_directory(entry, frame);
+        }
+
+        if (!(result & Action::WALK_Stop)) {
+            result = on_reached_directory_post(entry);
+            if (result & Action::WALK_Fail) {
+                _failed = true;
+                _saved_errno = errno;
+            }
+        }
+    }
+
+    close(entry.fd);
+    entry.fd = -1;
+
+    return result & Action::WALK_Stop;
+}
+
+int TreeWalker::walk_directory(const Entry &entry, const Frame &frame)
+{
+    std::vector<char> names;
+    std::vector<unsigned char> types;
+
+    // Read all of the names before visiting the children so that the hooks are
+    // free to modify the directory (eg. when deleting)
+    if (!read_directory(entry.fd, &names, &types)) {
+        set_error("%s: Failed to read directory: %s",
+                  entry.path().c_str(), strerror(errno));
+        _failed = true;
+        _saved_errno = errno;
+        return Action::WALK_OK;
+    }
+
+    const char *name = names.data();
+    for (unsigned char type : types) {
+        Entry child(&frame, entry.fd, name, type, entry.depth + 1,
+                    _flags & WALK_FollowSymlinks);
+        if (visit(child, &frame) & Action::WALK_Stop) {
+            return Action::WALK_Stop;
+        }
+        name += strlen(name) + 1;
+    }
+
+    return Action::WALK_OK;
+}
+
+/*!
+ * \brief Read all entries of a directory with getdents64
+ *
+ * \param[out] names NULL-separated names (excluding "." and "..")
+ * \param[out] types DT_* type for each name
+ */
+bool TreeWalker::read_directory(int fd, std::vector<char> *names,
+                                std::vector<unsigned char> *types)
+{
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, _buf.data(), _buf.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            return true;
+        }
+
+        for (long pos = 0; pos < n;) {
+            auto const *d = reinterpret_cast<const struct dirent64 *>(
+                    _buf.data() + pos);
+            pos += d->d_reclen;
+
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0'
+                    || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+
+            names->insert(names->end(), d->d_name,
+                          d->d_name + strlen(d->d_name) + 1);
+            types->push_back(d->d_type);
+        }
+    }
+}
+
+}
+}
@@ -31,6 +31,7 @@
 #include "mbutil/chown.h"
 #include "mbutil/directory.h"
 #include "mbutil/fts.h"
+#include "mbutil/metadata.h"
 #include "mbutil/selinux.h"
 
 #define APP_SHARING_DATA_DIR            "/data/multiboot/_appsharing/data"
@@ -132,12 +133,14 @@ bool AppSyncManager::create_shared_data_directory(const std::string &pkg, uid_t
 
 bool AppSyncManager::fix_shared_data_permissions()
 {
-    std::string context("u:object_r:app_data_file:s0");
-    util::selinux_lget_context("/data/data/com.android.systemui", &context);
+    util::Metadata metadata;
+    metadata.context = "u:object_r:app_data_file:s0";
+    util::selinux_lget_context("/data/data/com.android.systemui",
+                               &metadata.context);
 
-    if (!util::selinux_lset_context_recursive(_as_data_dir, context)) {
+    if (!util::apply_metadata_recursive(_as_data_dir, metadata)) {
         LOGW("%s: Failed to set context recursively to %s: %s",
-             _as_data_dir.c_str(), context.c_str(), strerror(errno));
+             _as_data_dir.c_str(), metadata.context.c_str(), strerror(errno));
         return false;
     }
 
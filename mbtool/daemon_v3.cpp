@@ -36,12 +36,12 @@
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
 #include "mbutil/string.h"
+#include "mbutil/walk.h"
 
 #include "init.h"
 #include "packages.h"
@@ -705,43 +705,43 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     return v3_send_response(fd, builder);
 }
 
-class DirectorySizeGetter : public util::FTSWrapper {
+class DirectorySizeGetter : public util::TreeWalker {
 public:
     DirectorySizeGetter(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : TreeWalker(path, 0),
         _exclusions(std::move(exclusions)),
         _total(0)
     {
     }
 
-    virtual int on_changed_path() override
+    virtual int on_reached_directory_pre(const Entry &entry) override
     {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::FTS_Skip;
-            }
-        }
-
-        return Action::FTS_OK;
+        return is_excluded(entry) ? Action::WALK_Skip : Action::WALK_OK;
     }
 
-    virtual int on_reached_file() override
+    virtual int on_reached_file(const Entry &entry) override
     {
-        dev_t dev = _curr->fts_statp->st_dev;
-        ino_t ino = _curr->fts_statp->st_ino;
+        if (is_excluded(entry)) {
+            return Action::WALK_OK;
+        }
+
+        // Only regular files are stat'ed
+        const struct stat *sb = entry.stat();
+        if (!sb) {
+            set_error("%s: Failed to stat: %s",
+                      entry.path().c_str(), strerror(errno));
+            return Action::WALK_Fail;
+        }
 
         // If this file has been visited before (hard link), then skip it
-        if (_links.find(dev) != _links.end()
-                && _links[dev].find(ino) != _links[dev].end()) {
-            return Action::FTS_OK;
+        if (sb->st_nlink > 1
+                && !_links[sb->st_dev].emplace(sb->st_ino).second) {
+            return Action::WALK_OK;
         }
 
-        _total += _curr->fts_statp->st_size;
-        _links[dev].emplace(ino);
+        _total += sb->st_size;
 
-        return Action::FTS_OK;
+        return Action::WALK_OK;
     }
 
     uint64_t total() const {
@@ -752,6 +752,13 @@ private:
     std::vector<std::string> _exclusions;
     std::unordered_map<dev_t, std::unordered_set<ino_t>> _links;
     uint64_t _total;
+
+    bool is_excluded(const Entry &entry)
+    {
+        // Exclude first-level entries
+        return entry.depth == 1 && std::find(_exclusions.begin(),
+                _exclusions.end(), entry.name) != _exclusions.end();
+    }
 };
 
 static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
@@ -1252,7 +1259,9 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    // Wipe the selected targets
+    // Wipe the selected targets. Everything except the MultiBoot directory is
+    // moved out of the way and deleted by a background process so that the
+    // request returns quickly.
     std::vector<int16_t> succeeded;
     std::vector<int16_t> failed;
 
@@ -1267,13 +1276,13 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
             bool success = false;
 
             if (target == v3::MbWipeTarget_SYSTEM) {
-                success = wipe_system(rom);
+                success = wipe_system(rom, true);
             } else if (target == v3::MbWipeTarget_CACHE) {
-                success = wipe_cache(rom);
+                success = wipe_cache(rom, true);
             } else if (target == v3::MbWipeTarget_DATA) {
-                success = wipe_data(rom);
+                success = wipe_data(rom, true);
             } else if (target == v3::MbWipeTarget_DALVIK_CACHE) {
-                success = wipe_dalvik_cache(rom);
+                success = wipe_dalvik_cache(rom, true);
             } else if (target == v3::MbWipeTarget_MULTIBOOT) {
                 success = wipe_multiboot(rom);
             } else {
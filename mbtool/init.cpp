@@ -944,11 +944,14 @@ static bool disable_spota()
 {
     static const char *spota_dir = "/data/security/spota";
 
-    std::unordered_map<std::string, std::string> props;
-    util::file_get_all_properties("/system/build.prop", &props);
-
-    if (strcasecmp(props["ro.product.manufacturer"].c_str(), "samsung") != 0
-            && strcasecmp(props["ro.product.brand"].c_str(), "samsung") != 0) {
+    std::vector<std::string> props;
+    util::file_get_properties("/system/build.prop",
+                              { "ro.product.manufacturer", "ro.product.brand" },
+                              &props);
+
+    if (props.size() != 2
+            || (strcasecmp(props[0].c_str(), "samsung") != 0
+            && strcasecmp(props[1].c_str(), "samsung") != 0)) {
         // Not a Samsung device
         LOGV("Not mounting empty tmpfs over: %s", spota_dir);
         return true;
@@ -27,7 +27,6 @@
 
 // Linux/posix
 #include <fcntl.h>
-#include <mntent.h>
 #include <signal.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -66,6 +65,7 @@
 #include "mbutil/fstab.h"
 #include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
+#include "mbutil/mount_table.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
@@ -791,32 +791,29 @@ bool Installer::change_root(const std::string &path)
         return false;
     }
 
-    // Unmount everything besides our chroot dir
+    // Unmount everything besides our chroot dir. This only affects our
+    // private mount namespace, so plain umount(2) is used. util::umount()
+    // would also clear loop devices, which are shared with the parent
+    // namespace.
     {
-        std::vector<std::string> to_unmount;
-        struct mntent ent;
-        char buf[1024];
+        std::vector<util::MountEntry> entries;
 
-        autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-        if (!fp) {
-            LOGE("%s: Failed to read file: %s",
-                 "/proc/mounts", strerror(errno));
+        if (!util::MountTable::instance().entries(&entries)) {
+            LOGE("Failed to read mount table: %s", strerror(errno));
             return false;
         }
 
-        while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-            if (strcmp(ent.mnt_dir, "/") != 0
-                    && !mb_starts_with(ent.mnt_dir, path.c_str())) {
-                to_unmount.push_back(ent.mnt_dir);
-            }
-        }
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [&](const util::MountEntry &entry) {
+            return entry.target == "/"
+                    || mb_starts_with(entry.target.c_str(), path.c_str());
+        }), entries.end());
 
-        // Close procfs fd
-        fp.reset();
+        // Nested mounts are unmounted first
+        util::MountTable::sort_for_unmount(&entries);
 
-        // Unmount in reverse order
-        for (auto it = to_unmount.rbegin(); it != to_unmount.rend(); ++it) {
-            log_umount(it->c_str());
+        for (auto const &entry : entries) {
+            log_umount(entry.target.c_str());
         }
     }
 
@@ -21,15 +21,14 @@
 
 #include <cerrno>
 #include <cstring>
+#include <grp.h>
+#include <pwd.h>
 #include <sys/stat.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/chmod.h"
-#include "mbutil/chown.h"
 #include "mbutil/copy.h"
 #include "mbutil/file.h"
-#include "mbutil/fts.h"
+#include "mbutil/metadata.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 
@@ -37,123 +36,6 @@
 namespace mb
 {
 
-class CopySystem : public util::FTSWrapper {
-public:
-    CopySystem(std::string path, std::string target)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _target(std::move(target))
-    {
-    }
-
-    virtual int on_changed_path() override
-    {
-        // We'll set attrs and xattrs after visiting children
-        if (_curr->fts_level == 0) {
-            return Action::FTS_OK;
-        }
-
-        // We only care about the first level
-        if (_curr->fts_level != 1) {
-            return Action::FTS_Next;
-        }
-
-        // Don't copy multiboot directory
-        if (strcmp(_curr->fts_name, "multiboot") == 0) {
-            return Action::FTS_Skip;
-        }
-
-        _curtgtpath.clear();
-        _curtgtpath += _target;
-        _curtgtpath += "/";
-        _curtgtpath += _curr->fts_name;
-
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_pre() override
-    {
-        if (_curr->fts_level == 0) {
-            return Action::FTS_OK;
-        }
-
-        // _target is the correct parameter here (or pathbuf and
-        // COPY_EXCLUDE_TOP_LEVEL flag)
-        if (!util::copy_dir(_curr->fts_accpath, _target,
-                            util::COPY_ATTRIBUTES | util::COPY_XATTRS)) {
-            char *msg = mb_format("%s: Failed to copy directory: %s",
-                                  _curr->fts_path, strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Skip | Action::FTS_Fail;
-        }
-        return Action::FTS_Skip;
-    }
-
-    virtual int on_reached_directory_post() override
-    {
-        if (_curr->fts_level == 0) {
-            if (!util::copy_stat(_curr->fts_accpath, _target)) {
-                LOGE("%s: Failed to copy attributes: %s",
-                     _target.c_str(), strerror(errno));
-                return Action::FTS_Fail;
-            }
-            if (!util::copy_xattrs(_curr->fts_accpath, _target)) {
-                LOGE("%s: Failed to copy xattrs: %s",
-                     _target.c_str(), strerror(errno));
-                return Action::FTS_Fail;
-            }
-        }
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_file() override
-    {
-        if (_curr->fts_level == 0) {
-            return Action::FTS_OK;
-        }
-        return copy_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_symlink() override
-    {
-        if (_curr->fts_level == 0) {
-            return Action::FTS_OK;
-        }
-        return copy_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_special_file() override
-    {
-        if (_curr->fts_level == 0) {
-            return Action::FTS_OK;
-        }
-        return copy_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-private:
-    std::string _target;
-    std::string _curtgtpath;
-
-    bool copy_path()
-    {
-        if (!util::copy_file(_curr->fts_accpath, _curtgtpath,
-                             util::COPY_ATTRIBUTES | util::COPY_XATTRS)) {
-            char *msg = mb_format("%s: Failed to copy file: %s",
-                                  _curr->fts_path, strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
-    }
-};
-
 /*!
  * \brief Copy /system directory excluding multiboot files
  *
@@ -162,8 +44,15 @@ private:
  */
 bool copy_system(const std::string &source, const std::string &target)
 {
-    CopySystem fts(source, target);
-    return fts.run();
+    // Don't copy multiboot directory
+    auto filter = [](const std::string &path) {
+        return path != "multiboot";
+    };
+
+    return util::copy_dir(source, target,
+                          util::COPY_ATTRIBUTES | util::COPY_XATTRS
+                                  | util::COPY_EXCLUDE_TOP_LEVEL,
+                          filter);
 }
 
 /*!
@@ -180,22 +69,26 @@ bool fix_multiboot_permissions(void)
 {
     util::create_empty_file(MULTIBOOT_DIR "/.nomedia");
 
-    if (!util::chown(MULTIBOOT_DIR, "media_rw", "media_rw",
-                     util::CHOWN_RECURSIVE)) {
-        LOGE("Failed to chown %s", MULTIBOOT_DIR);
-        return false;
-    }
+    util::Metadata metadata;
+    metadata.mode = 0775;
 
-    if (!util::chmod(MULTIBOOT_DIR, 0775, util::CHMOD_RECURSIVE)) {
-        LOGE("Failed to chmod %s", MULTIBOOT_DIR);
+    errno = 0;
+    struct passwd *pw = getpwnam("media_rw");
+    struct group *gr = pw ? getgrnam("media_rw") : nullptr;
+    if (!pw || !gr) {
+        LOGE("Failed to look up media_rw user and group: %s",
+             strerror(errno ? errno : EINVAL));
         return false;
     }
+    metadata.uid = pw->pw_uid;
+    metadata.gid = gr->gr_gid;
+
+    // Don't fail if SELinux is not supported
+    util::selinux_lget_context(INTERNAL_STORAGE, &metadata.context);
 
-    std::string context;
-    if (util::selinux_lget_context(INTERNAL_STORAGE, &context)
-            && !util::selinux_lset_context_recursive(MULTIBOOT_DIR, context)) {
-        LOGE("%s: Failed to set context to %s: %s",
-             MULTIBOOT_DIR, context.c_str(), strerror(errno));
+    if (!util::apply_metadata_recursive(MULTIBOOT_DIR, metadata)) {
+        LOGE("%s: Failed to fix permissions: %s",
+             MULTIBOOT_DIR, strerror(errno));
         return false;
     }
 
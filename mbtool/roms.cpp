@@ -24,14 +24,14 @@
 #include <cstdlib>
 #include <cstring>
 #include <dirent.h>
-#include <mntent.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/mount.h"
+#include "mbutil/mount_table.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
 
@@ -509,26 +509,25 @@ std::string Roms::get_extsd_partition()
     static const char *prefix_storage = "/storage/";
 
     // Look for mounted MMC partitions
-    autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-    if (fp) {
-        struct mntent ent;
-        char buf[1024];
+    std::vector<util::MountEntry> entries;
+    if (util::MountTable::instance().entries(&entries)) {
         struct stat sb;
 
-        while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
+        for (auto const &entry : entries) {
             // Skip useless mounts
-            if (!mb_starts_with(ent.mnt_dir, prefix_mnt)) {
+            if (!mb_starts_with(entry.target.c_str(), prefix_mnt)) {
                 continue;
             }
 
-            if (stat(ent.mnt_fsname, &sb) < 0) {
-                LOGW("%s: Failed to stat: %s", ent.mnt_fsname, strerror(errno));
+            if (stat(entry.source.c_str(), &sb) < 0) {
+                LOGW("%s: Failed to stat: %s",
+                     entry.source.c_str(), strerror(errno));
                 continue;
             }
 
             if (major(sb.st_rdev) == 179) {
                 std::string path(prefix_storage);
-                path += ent.mnt_dir + strlen(prefix_mnt);
+                path += entry.target.c_str() + strlen(prefix_mnt);
 
                 if (util::is_mounted(path)) {
                     return path;
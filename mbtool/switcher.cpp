@@ -21,8 +21,11 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/sha.h>
 
@@ -31,17 +34,21 @@
 #include "mbutil/chmod.h"
 #include "mbutil/chown.h"
 #include "mbutil/copy.h"
+#include "mbutil/digest_cache.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/hash.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
+#include "mbutil/verify.h"
 
 #include "multiboot.h"
 #include "roms.h"
 
 #define CHECKSUMS_PATH "/data/multiboot/checksums.prop"
+#define DIGEST_CACHE_PATH "/data/multiboot/digests.cache"
 
 namespace mb
 {
@@ -176,10 +183,121 @@ struct Flashable
     std::string block_dev;
     std::string expected_hash;
     std::string hash;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
     unsigned char *data = nullptr;
     std::size_t size = 0;
+    // Metadata of the image when it was read
+    struct stat sb;
+    // Whether the metadata did not change while the image was read
+    bool unchanged = false;
 };
 
+/*!
+ * \brief Read an image into memory
+ *
+ * The image's metadata is recorded before it is read and compared afterwards
+ * so that the digest cache is only used for images that were not modified in
+ * the meantime.
+ *
+ * \return True if the image was read. Otherwise, false with errno set
+ *         appropriately.
+ */
+static bool read_image(Flashable *f)
+{
+    int fd = open(f->image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    struct stat sb_after;
+
+    if (fstat(fd, &f->sb) < 0) {
+        return false;
+    }
+
+    std::size_t size = f->sb.st_size;
+    unsigned char *data = static_cast<unsigned char *>(malloc(size));
+    if (!data && size > 0) {
+        return false;
+    }
+
+    std::size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, data + total, size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                // File was truncated
+                errno = EIO;
+            }
+            free(data);
+            return false;
+        }
+        total += n;
+    }
+
+    if (fstat(fd, &sb_after) < 0) {
+        free(data);
+        return false;
+    }
+
+    f->data = data;
+    f->size = size;
+    f->unchanged = util::DigestCache::key_for(f->sb)
+            == util::DigestCache::key_for(sb_after);
+
+    return true;
+}
+
+/*!
+ * \brief Write an image to a block device and sync it
+ *
+ * \return True if the image was successfully written. Otherwise, false with
+ *         errno set appropriately.
+ */
+static bool write_image(const std::string &path, const unsigned char *data,
+                        std::size_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    if (fd < 0) {
+        return false;
+    }
+
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return false;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    // The data must reach the device before it can be read back
+    if (fsync(fd) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return false;
+    }
+
+    return close(fd) == 0;
+}
+
 /*!
  * \brief Perform non-recursive search for a block device
  *
@@ -350,20 +468,73 @@ SwitchRomResult switch_rom(const char *id, const char *boot_blockdev,
     std::unordered_map<std::string, std::string> props;
     checksums_read(&props);
 
+    // The cache must be loaded before the images are stat'ed
+    util::DigestCache digest_cache(get_raw_path(DIGEST_CACHE_PATH));
+    if (!digest_cache.load()) {
+        LOGW("Failed to load digest cache. All images will be hashed");
+    }
+
     for (Flashable &f : flashables) {
         // If memory becomes an issue, an alternative method is to create a
         // temporary directory in /data/multiboot/ that's only writable by root
         // and copy the images there.
-        if (!util::file_read_all(f.image, &f.data, &f.size)) {
+        if (!read_image(&f)) {
             LOGE("%s: Failed to read image: %s",
                  f.image.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
         }
+    }
+
+    // Get actual sha512sums. Images that have not changed since they were last
+    // hashed use the cached digest and the rest are hashed concurrently.
+    std::vector<std::vector<unsigned char>> digests(flashables.size());
+    std::vector<util::HashInput> hash_inputs;
+    std::vector<std::size_t> hash_indexes;
+    std::vector<util::HashResult> hash_results;
 
-        // Get actual sha512sum
-        unsigned char digest[SHA512_DIGEST_LENGTH];
-        SHA512(f.data, f.size, digest);
-        f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+    for (std::size_t i = 0; i < flashables.size(); ++i) {
+        Flashable &f = flashables[i];
+
+        if (f.unchanged && digest_cache.lookup(
+                f.sb, util::HashAlgorithm::SHA512, &digests[i])) {
+            LOGD("%s: Using cached digest", f.image.c_str());
+            continue;
+        }
+
+        hash_inputs.emplace_back();
+        hash_inputs.back().data = f.data;
+        hash_inputs.back().size = f.size;
+        hash_indexes.push_back(i);
+    }
+
+    if (!util::hash_files(hash_inputs, util::HashAlgorithm::SHA512,
+                          &hash_results)) {
+        LOGE("Failed to hash images: %s", strerror(errno));
+        return SwitchRomResult::FAILED;
+    }
+
+    for (std::size_t i = 0; i < hash_indexes.size(); ++i) {
+        Flashable &f = flashables[hash_indexes[i]];
+
+        digests[hash_indexes[i]] = hash_results[i].digest;
+
+        if (f.unchanged) {
+            digest_cache.insert(f.sb, util::HashAlgorithm::SHA512,
+                                hash_results[i].digest);
+        } else {
+            digest_cache.remove(f.sb);
+        }
+    }
+
+    if (!digest_cache.save()) {
+        LOGW("Failed to save digest cache");
+    }
+
+    for (std::size_t i = 0; i < flashables.size(); ++i) {
+        Flashable &f = flashables[i];
+
+        memcpy(f.digest, digests[i].data(), SHA512_DIGEST_LENGTH);
+        f.hash = util::hex_string(f.digest, SHA512_DIGEST_LENGTH);
 
         if (force_update_checksums) {
             checksums_update(&props, id, util::base_name(f.image), f.hash);
@@ -394,15 +565,26 @@ SwitchRomResult switch_rom(const char *id, const char *boot_blockdev,
         }
     }
 
-    // Now we can flash the images
+    // Now we can flash the images. Each image is read back from the block
+    // device in the background while the next one is being written.
+    util::ReadBackVerifier verifier;
+
     for (Flashable &f : flashables) {
-        // Cast is okay. The data is just passed to fwrite (ie. no signed
-        // extension issues)
-        if (!util::file_write_data(f.block_dev, (char *) f.data, f.size)) {
+        if (!write_image(f.block_dev, f.data, f.size)) {
             LOGE("%s: Failed to write image: %s",
                  f.block_dev.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
         }
+
+        if (!verifier.submit(f.block_dev, { { 0, f.size } }, f.digest)) {
+            LOGW("%s: Failed to queue verification: %s",
+                 f.block_dev.c_str(), strerror(errno));
+        }
+    }
+
+    if (!verifier.wait()) {
+        LOGE("Flashed images do not match the original images");
+        return SwitchRomResult::FAILED;
     }
 
     if (force_update_checksums) {
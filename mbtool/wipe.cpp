@@ -19,15 +19,11 @@
 
 #include "wipe.h"
 
-#include <algorithm>
-
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/delete.h"
-#include "mbutil/fts.h"
 #include "mbutil/mount.h"
 #include "mbutil/string.h"
 
@@ -36,88 +32,34 @@
 namespace mb
 {
 
-class WipeDirectory : public util::FTSWrapper {
-public:
-    WipeDirectory(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _exclusions(std::move(exclusions))
-    {
-    }
-
-    virtual int on_changed_path() override
-    {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::FTS_Skip;
-            }
-        }
-
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_pre() override
-    {
-        // Do nothing. Need depth-first search, so directories are deleted
-        // in FTS_DP
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_post() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_symlink() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_special_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-private:
-    std::vector<std::string> _exclusions;
-
-    bool delete_path()
-    {
-        if (_curr->fts_level >= 1 && remove(_curr->fts_accpath) < 0) {
-            char *msg = mb_format("%s: Failed to remove: %s",
-                                  _curr->fts_path, strerror(errno));
-            if (msg) {
-                _error_msg = msg;
-                free(msg);
-            }
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
-    }
-};
-
-bool wipe_directory(const std::string &directory,
-                    const std::vector<std::string> &exclusions)
+static bool delete_directory_contents(const std::string &directory,
+                                      const std::vector<std::string> &exclusions,
+                                      int flags)
 {
-    struct stat sb;
-    if (stat(directory.c_str(), &sb) < 0 && errno == ENOENT) {
-        // Don't fail if directory does not exist
-        return true;
-    }
-
     std::vector<std::string> new_exclusions{ "multiboot" };
     new_exclusions.insert(new_exclusions.end(),
                           exclusions.begin(), exclusions.end());
 
-    WipeDirectory wd(directory, std::move(new_exclusions));
-    return wd.run();
+    return util::delete_contents(directory, new_exclusions, flags);
+}
+
+bool wipe_directory(const std::string &directory,
+                    const std::vector<std::string> &exclusions,
+                    bool async)
+{
+    return delete_directory_contents(directory, exclusions,
+                                     async ? util::DELETE_ASYNC : 0);
+}
+
+/*!
+ * \brief Get the flags for wiping a ROM's directory
+ *
+ * The directory is removed if it is empty afterwards. With \p async, this
+ * happens in the background process once the deleted files are gone.
+ */
+static int rom_wipe_flags(bool async)
+{
+    return util::DELETE_REMOVE_EMPTY | (async ? util::DELETE_ASYNC : 0);
 }
 
 /*!
@@ -160,12 +102,14 @@ static bool log_wipe_file(const std::string &path)
  *       deletion does not follow symlinks.
  *
  * \param mountpoint Mountpoint root to wipe
- * \param wipe_media Whether the first-level "media" path should be deleted
+ * \param exclusions First-level paths that should not be deleted
+ * \param flags util::DeleteFlags for util::delete_contents()
  *
  * \return True if the path was wiped or doesn't exist. False, otherwise
  */
 static bool log_wipe_directory(const std::string &mountpoint,
-                               const std::vector<std::string> &exclusions)
+                               const std::vector<std::string> &exclusions,
+                               int flags)
 {
     if (exclusions.empty()) {
         LOGV("Wiping directory %s", mountpoint.c_str());
@@ -189,20 +133,20 @@ static bool log_wipe_directory(const std::string &mountpoint,
         return false;
     }
 
-    bool ret = wipe_directory(mountpoint, exclusions);
+    bool ret = delete_directory_contents(mountpoint, exclusions, flags);
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-static bool log_delete_recursive(const std::string &path)
+static bool log_delete_recursive(const std::string &path, bool async)
 {
     LOGV("Recursively deleting %s", path.c_str());
-    bool ret = util::delete_recursive(path);
+    bool ret = util::delete_recursive(path, async ? util::DELETE_ASYNC : 0);
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-bool wipe_system(const std::shared_ptr<Rom> &rom)
+bool wipe_system(const std::shared_ptr<Rom> &rom, bool async)
 {
     std::string path = rom->full_system_path();
     if (path.empty()) {
@@ -219,14 +163,13 @@ bool wipe_system(const std::shared_ptr<Rom> &rom)
 
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, {});
-        // Try removing ROM's /system if it's empty
-        remove(path.c_str());
+        // ROM's /system is removed if it's empty
+        ret = log_wipe_directory(path, {}, rom_wipe_flags(async));
     }
     return ret;
 }
 
-bool wipe_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_cache(const std::shared_ptr<Rom> &rom, bool async)
 {
     std::string path = rom->full_cache_path();
     if (path.empty()) {
@@ -238,14 +181,13 @@ bool wipe_cache(const std::shared_ptr<Rom> &rom)
     if (rom->cache_is_image) {
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, {});
-        // Try removing ROM's /cache if it's empty
-        remove(path.c_str());
+        // ROM's /cache is removed if it's empty
+        ret = log_wipe_directory(path, {}, rom_wipe_flags(async));
     }
     return ret;
 }
 
-bool wipe_data(const std::shared_ptr<Rom> &rom)
+bool wipe_data(const std::shared_ptr<Rom> &rom, bool async)
 {
     std::string path = rom->full_data_path();
     if (path.empty()) {
@@ -257,15 +199,15 @@ bool wipe_data(const std::shared_ptr<Rom> &rom)
     if (rom->data_is_image) {
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, { "media" });
-        // Try removing ROM's /data/media and /data if they're empty
+        // Try removing ROM's /data/media if it's empty. This must happen
+        // first so that /data can be removed if it's empty afterwards.
         remove((path + "/media").c_str());
-        remove(path.c_str());
+        ret = log_wipe_directory(path, { "media" }, rom_wipe_flags(async));
     }
     return ret;
 }
 
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom, bool async)
 {
     if (rom->data_is_image || rom->cache_is_image) {
         LOGE("Wiping dalvik-cache for ROMs that use data or cache images is "
@@ -292,8 +234,8 @@ bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
     // util::delete_recursive() returns true if the path does not
     // exist (ie. returns false only on errors), which is exactly
     // what we want
-    return log_delete_recursive(data_path)
-            && log_delete_recursive(cache_path);
+    return log_delete_recursive(data_path, async)
+            && log_delete_recursive(cache_path, async);
 }
 
 bool wipe_multiboot(const std::shared_ptr<Rom> &rom)
@@ -302,7 +244,7 @@ bool wipe_multiboot(const std::shared_ptr<Rom> &rom)
     std::string multiboot_path(MULTIBOOT_DIR);
     multiboot_path += '/';
     multiboot_path += rom->id;
-    return log_delete_recursive(multiboot_path);
+    return log_delete_recursive(multiboot_path, false);
 }
 
 }
@@ -25,11 +25,12 @@ namespace mb
 {
 
 bool wipe_directory(const std::string &directory,
-                    const std::vector<std::string> &exclusions);
-bool wipe_system(const std::shared_ptr<Rom> &rom);
-bool wipe_cache(const std::shared_ptr<Rom> &rom);
-bool wipe_data(const std::shared_ptr<Rom> &rom);
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom);
+                    const std::vector<std::string> &exclusions,
+                    bool async = false);
+bool wipe_system(const std::shared_ptr<Rom> &rom, bool async = false);
+bool wipe_cache(const std::shared_ptr<Rom> &rom, bool async = false);
+bool wipe_data(const std::shared_ptr<Rom> &rom, bool async = false);
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom, bool async = false);
 bool wipe_multiboot(const std::shared_ptr<Rom> &rom);
 
 }
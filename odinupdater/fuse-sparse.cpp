@@ -1,5 +1,6 @@
 #define FUSE_USE_VERSION 26
 
+#include <algorithm>
 #include <new>
 
 #include <cerrno>
@@ -10,17 +11,20 @@
 
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 // fuse
 #include <fuse/fuse.h>
 
 // libmbcommon
+#include "mbcommon/endian.h"
 #include "mbcommon/file.h"
 #include "mbcommon/file/filename.h"
 
 // libmbsparse
 #include "mbsparse/sparse.h"
+#include "mbsparse/sparse_seekable.h"
 
 #ifdef __ANDROID__
 #define OFF_T loff_t
@@ -28,16 +32,36 @@
 #define OFF_T off_t
 #endif
 
+// Size of the per-thread cache of the source file. Reads of the source file
+// smaller than this are served from (and fill) the calling thread's cache.
+#define READ_CACHE_SIZE         (128 * 1024)
+
 static char source_fd_path[50];
+static int source_fd = -1;
 static uint64_t sparse_size;
 
 struct context
 {
     SparseCtx *sctx;
     MbFile *file;
-    pthread_mutex_t mutex;
+    // Set instead of the above if the source is a seekable container
+    SparseSeekableCtx *seekable;
+};
+
+// Opened once at startup. Only the immutable chunk index is used afterwards, so
+// fuse_read() can be called concurrently without any locking. The seekable
+// container's frame cache is internally locked.
+static context sparse_ctx;
+
+struct read_cache
+{
+    uint64_t offset;
+    uint64_t size;
+    char data[READ_CACHE_SIZE];
 };
 
+static pthread_key_t read_cache_key;
+
 /*!
  * \brief Open callback for sparseOpen()
  */
@@ -105,82 +129,93 @@ static bool cb_seek(int64_t offset, int whence, void *userData)
 }
 
 /*!
- * \brief Open callback for fuse
+ * \brief Read from the source file without using or changing the file position
  */
-static int fuse_open(const char *path, fuse_file_info *fi)
+static bool pread_fully(void *buf, uint64_t size, uint64_t offset,
+                        uint64_t *bytesRead)
 {
-    (void) path;
-
-    if (fi->flags & (O_WRONLY | O_RDWR)) {
-        return -EROFS;
+    uint64_t total = 0;
+    while (size > 0) {
+        ssize_t n = pread64(source_fd, buf, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: Failed to read: %s\n",
+                    source_fd_path, strerror(errno));
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        size -= n;
+        offset += n;
+        total += n;
+        buf = static_cast<char *>(buf) + n;
     }
+    *bytesRead = total;
+    return true;
+}
 
-    context *ctx = new(std::nothrow) context();
-    if (!ctx) {
-        return -ENOMEM;
-    }
+static void free_read_cache(void *data)
+{
+    delete static_cast<read_cache *>(data);
+}
 
-    ctx->sctx = sparseCtxNew();
-    if (!ctx->sctx) {
-        delete ctx;
-        return -ENOMEM;
-    }
+/*!
+ * \brief Positional read callback for sparseReadAt()
+ *
+ * Small reads go through the calling thread's cache so that a series of small
+ * reads from the same region of the source file only results in one pread().
+ */
+static bool cb_pread(void *buf, uint64_t size, uint64_t offset,
+                     uint64_t *bytesRead, void *userData)
+{
+    (void) userData;
 
-    ctx->file = mb_file_new();
-    if (!ctx->file) {
-        sparseCtxFree(ctx->sctx);
-        delete ctx;
-        return -ENOMEM;
+    if (size >= READ_CACHE_SIZE) {
+        return pread_fully(buf, size, offset, bytesRead);
     }
 
-    if (!sparseOpen(ctx->sctx, &cb_open, &cb_close, &cb_read, &cb_seek, nullptr,
-                    ctx)) {
-        sparseCtxFree(ctx->sctx);
-        mb_file_free(ctx->file);
-        delete ctx;
-        return -EIO;
+    read_cache *cache = static_cast<read_cache *>(
+            pthread_getspecific(read_cache_key));
+    if (!cache) {
+        cache = new(std::nothrow) read_cache();
+        if (!cache || pthread_setspecific(read_cache_key, cache) != 0) {
+            delete cache;
+            return pread_fully(buf, size, offset, bytesRead);
+        }
     }
 
-    fi->fh = reinterpret_cast<uint64_t>(ctx);
+    if (offset < cache->offset
+            || offset + size > cache->offset + cache->size) {
+        cache->size = 0;
+        if (!pread_fully(cache->data, sizeof(cache->data), offset,
+                         &cache->size)) {
+            return false;
+        }
+        cache->offset = offset;
+    }
 
-    return 0;
+    *bytesRead = std::min<uint64_t>(size, cache->offset + cache->size - offset);
+    memcpy(buf, cache->data + (offset - cache->offset), *bytesRead);
+    return true;
 }
 
 /*!
- * \brief Release callback for fuse
+ * \brief Open callback for fuse
  */
-static int fuse_release(const char *path, fuse_file_info *fi)
+static int fuse_open(const char *path, fuse_file_info *fi)
 {
     (void) path;
 
-    context *ctx = reinterpret_cast<context *>(fi->fh);
-    sparseCtxFree(ctx->sctx);
-    mb_file_free(ctx->file);
-    delete ctx;
-
-    return 0;
-}
-
-/*!
- * \brief Read from sparse file
- *
- * \warning Bad stuff will happen if \a ctx->mutex is not locked when this
- *          function is called
- */
-static int fuse_read_locked(context *ctx, char *buf, size_t size,
-                            OFF_T offset)
-{
-    // Seek to position
-    if (!sparseSeek(ctx->sctx, offset, SEEK_SET)) {
-        return -1;
+    if (fi->flags & (O_WRONLY | O_RDWR)) {
+        return -EROFS;
     }
 
-    uint64_t bytes_read;
-    if (!sparseRead(ctx->sctx, buf, size, &bytes_read)) {
-        return -1;
-    }
+    // The sparse file never changes
+    fi->keep_cache = 1;
 
-    return bytes_read;
+    return 0;
 }
 
 /*!
@@ -190,14 +225,20 @@ static int fuse_read(const char *path, char *buf, size_t size, OFF_T offset,
                      fuse_file_info *fi)
 {
     (void) path;
+    (void) fi;
 
-    context *ctx = reinterpret_cast<context *>(fi->fh);
-
-    pthread_mutex_lock(&ctx->mutex);
-    int ret = fuse_read_locked(ctx, buf, size, offset);
-    pthread_mutex_unlock(&ctx->mutex);
+    uint64_t bytes_read;
+    if (sparse_ctx.seekable) {
+        if (!sparseSeekableReadAt(sparse_ctx.seekable, buf, size, offset,
+                                  &bytes_read)) {
+            return -EIO;
+        }
+    } else if (!sparseReadAt(sparse_ctx.sctx, buf, size, offset, &bytes_read,
+                             &cb_pread, nullptr)) {
+        return -EIO;
+    }
 
-    return ret;
+    return bytes_read;
 }
 
 /*!
@@ -214,49 +255,77 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
 }
 
 /*!
- * \brief Get size of sparse file (needed for fuse_getattr())
+ * \brief Open seekable container and load its frame index
  */
-static int get_sparse_file_size()
+static int open_seekable_file()
 {
-    context *ctx = new(std::nothrow) context();
-    if (!ctx) {
-        return -ENOMEM;
+    struct stat sb;
+    if (fstat(source_fd, &sb) < 0) {
+        fprintf(stderr, "%s: Failed to stat: %s\n",
+                source_fd_path, strerror(errno));
+        return -errno;
     }
 
-    ctx->sctx = sparseCtxNew();
-    if (!ctx->sctx) {
-        delete ctx;
+    sparse_ctx.seekable = sparseSeekableCtxNew();
+    if (!sparse_ctx.seekable) {
         return -ENOMEM;
     }
 
-    ctx->file = mb_file_new();
-    if (!ctx->file) {
-        sparseCtxFree(ctx->sctx);
-        delete ctx;
+    if (!sparseSeekableOpen(sparse_ctx.seekable, &cb_pread, sb.st_size,
+                            nullptr)
+            || !sparseSeekableSize(sparse_ctx.seekable, &sparse_size)) {
+        sparseSeekableCtxFree(sparse_ctx.seekable);
+        sparse_ctx.seekable = nullptr;
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*!
+ * \brief Open sparse file and index all of its chunks
+ */
+static int open_sparse_file()
+{
+    uint32_t magic;
+    uint64_t n;
+    if (pread_fully(&magic, sizeof(magic), 0, &n) && n == sizeof(magic)
+            && mb_le32toh(magic) == SPARSE_SEEKABLE_MAGIC) {
+        return open_seekable_file();
+    }
+
+    sparse_ctx.sctx = sparseCtxNew();
+    if (!sparse_ctx.sctx) {
         return -ENOMEM;
     }
 
-    if (!sparseOpen(ctx->sctx, &cb_open, &cb_close, &cb_read, &cb_seek, nullptr,
-                    ctx)) {
-        sparseCtxFree(ctx->sctx);
-        mb_file_free(ctx->file);
-        delete ctx;
-        return -EIO;
+    sparse_ctx.file = mb_file_new();
+    if (!sparse_ctx.file) {
+        sparseCtxFree(sparse_ctx.sctx);
+        return -ENOMEM;
     }
 
-    if (!sparseSize(ctx->sctx, &sparse_size)) {
-        sparseCtxFree(ctx->sctx);
-        mb_file_free(ctx->file);
-        delete ctx;
+    if (!sparseOpen(sparse_ctx.sctx, &cb_open, &cb_close, &cb_read, &cb_seek,
+                    nullptr, &sparse_ctx)
+            || !sparseSize(sparse_ctx.sctx, &sparse_size)) {
+        sparseCtxFree(sparse_ctx.sctx);
+        mb_file_free(sparse_ctx.file);
         return -EIO;
     }
 
-    sparseCtxFree(ctx->sctx);
-    mb_file_free(ctx->file);
-    delete ctx;
     return 0;
 }
 
+static void close_sparse_file()
+{
+    if (sparse_ctx.seekable) {
+        sparseSeekableCtxFree(sparse_ctx.seekable);
+    } else {
+        sparseCtxFree(sparse_ctx.sctx);
+        mb_file_free(sparse_ctx.file);
+    }
+}
+
 struct arg_ctx
 {
     char *source_file = nullptr;
@@ -342,8 +411,15 @@ int main(int argc, char *argv[])
         }
         snprintf(source_fd_path, sizeof(source_fd_path),
                  "/proc/self/fd/%d", fd);
+        source_fd = fd;
+
+        // Opening a seekable container already reads through the cache
+        if (pthread_key_create(&read_cache_key, &free_read_cache) != 0) {
+            close(fd);
+            return EXIT_FAILURE;
+        }
 
-        if (get_sparse_file_size() < 0) {
+        if (open_sparse_file() < 0) {
             close(fd);
             return EXIT_FAILURE;
         }
@@ -354,11 +430,13 @@ int main(int argc, char *argv[])
     fuse_oper.getattr = fuse_getattr;
     fuse_oper.open    = fuse_open;
     fuse_oper.read    = fuse_read;
-    fuse_oper.release = fuse_release;
 
+    // fuse runs multithreaded by default (unless -s is passed), which lets
+    // the kernel's parallel readahead requests be served concurrently
     int fuse_ret = fuse_main(args.argc, args.argv, &fuse_oper, nullptr);
 
     if (!arg_ctx.show_help) {
+        close_sparse_file();
         close(fd);
     }
 
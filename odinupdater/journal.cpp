@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "journal.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include "mbutil/finally.h"
+
+// The journal is a small text file:
+//
+//   odinupdater-journal 1
+//   <zip size> <zip mtime>
+//   <target> <entry> <offset> <complete>
+//   ...
+#define JOURNAL_MAGIC           "odinupdater-journal"
+#define JOURNAL_VERSION         1
+
+#define JOURNAL_MAX_FIELD       255
+
+/*!
+ * \brief Load journal
+ *
+ * \return Whether a valid journal was loaded. If false, \a journal is left
+ *         empty.
+ */
+bool journal_load(const char *path, Journal *journal)
+{
+    *journal = Journal();
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        return false;
+    }
+
+    auto close_fp = mb::util::finally([&]{
+        fclose(fp);
+    });
+
+    char magic[32];
+    int version;
+    uint64_t zip_size;
+    int64_t zip_mtime;
+
+    if (fscanf(fp, "%31s %d", magic, &version) != 2
+            || strcmp(magic, JOURNAL_MAGIC) != 0
+            || version != JOURNAL_VERSION
+            || fscanf(fp, "%" SCNu64 " %" SCNd64, &zip_size, &zip_mtime) != 2) {
+        return false;
+    }
+
+    Journal result;
+    result.zip_size = zip_size;
+    result.zip_mtime = zip_mtime;
+
+    char target[JOURNAL_MAX_FIELD + 1];
+    char entry[JOURNAL_MAX_FIELD + 1];
+    uint64_t offset;
+    int complete;
+    int n;
+
+    while ((n = fscanf(fp, "%255s %255s %" SCNu64 " %d",
+                       target, entry, &offset, &complete)) == 4) {
+        result.records.push_back({ target, entry, offset, complete != 0 });
+    }
+
+    if (n != EOF || ferror(fp)) {
+        return false;
+    }
+
+    *journal = std::move(result);
+    return true;
+}
+
+static bool sync_parent_dir(const char *path)
+{
+    std::string copy(path);
+    int fd = open(dirname(&copy[0]), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ret = fsync(fd) == 0;
+    close(fd);
+    return ret;
+}
+
+/*!
+ * \brief Atomically replace the journal
+ *
+ * The journal is written to a temporary file, synced, and renamed over the
+ * old journal so that an interruption never leaves a partially written
+ * journal behind.
+ *
+ * \return Whether the journal was durably written. errno is set on failure.
+ */
+bool journal_save(const char *path, const Journal &journal)
+{
+    std::string temp_path(path);
+    temp_path += ".tmp";
+
+    FILE *fp = fopen(temp_path.c_str(), "we");
+    if (!fp) {
+        return false;
+    }
+
+    fprintf(fp, "%s %d\n", JOURNAL_MAGIC, JOURNAL_VERSION);
+    fprintf(fp, "%" PRIu64 " %" PRId64 "\n",
+            journal.zip_size, journal.zip_mtime);
+    for (const JournalRecord &record : journal.records) {
+        fprintf(fp, "%s %s %" PRIu64 " %d\n", record.target.c_str(),
+                record.entry.c_str(), record.offset, record.complete ? 1 : 0);
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        int saved_errno = errno;
+        fclose(fp);
+        unlink(temp_path.c_str());
+        errno = saved_errno;
+        return false;
+    }
+
+    if (fclose(fp) != 0 || rename(temp_path.c_str(), path) < 0) {
+        int saved_errno = errno;
+        unlink(temp_path.c_str());
+        errno = saved_errno;
+        return false;
+    }
+
+    return sync_parent_dir(path);
+}
+
+/*!
+ * \brief Get journal record for a target, creating it if needed
+ *
+ * If a record exists for \a target, but for a different zip entry, it is reset.
+ */
+JournalRecord * journal_get(Journal *journal, const char *target,
+                            const char *entry)
+{
+    for (JournalRecord &record : journal->records) {
+        if (record.target == target) {
+            if (record.entry != entry) {
+                record.entry = entry;
+                record.offset = 0;
+                record.complete = false;
+            }
+            return &record;
+        }
+    }
+
+    journal->records.push_back({ target, entry, 0, false });
+    return &journal->records.back();
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+/*!
+ * \brief Flashing progress of a single target
+ *
+ * All data for offsets below \a offset has been written and synced to
+ * \a target. Since the writer stage writes the output in increasing offset
+ * order, this is enough to resume flashing.
+ */
+struct JournalRecord
+{
+    // Output file (block device)
+    std::string target;
+    // Zip entry that is being flashed to the target
+    std::string entry;
+    uint64_t offset;
+    bool complete;
+};
+
+/*!
+ * \brief Checkpoint journal for a zip file
+ *
+ * The journal is only valid for the zip file with the same size and
+ * modification time.
+ */
+struct Journal
+{
+    uint64_t zip_size = 0;
+    int64_t zip_mtime = 0;
+    std::vector<JournalRecord> records;
+};
+
+bool journal_load(const char *path, Journal *journal);
+bool journal_save(const char *path, const Journal &journal);
+
+// The returned pointer is valid until the next call to journal_get()
+JournalRecord * journal_get(Journal *journal, const char *target,
+                            const char *entry);
@@ -17,6 +17,7 @@
  * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -27,12 +28,18 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+// libmbcommon
+#include "mbcommon/endian.h"
+
 // libmbsparse
 #include "mbsparse/sparse.h"
+#include "mbsparse/sparse_flash.h"
+#include "mbsparse/sparse_seekable.h"
 
 // libmbdevice
 #include "mbdevice/json.h"
@@ -44,15 +51,34 @@
 #include "mbutil/finally.h"
 #include "mbutil/mount.h"
 #include "mbutil/properties.h"
+#include "mbutil/verify.h"
 
 // minizip
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "journal.h"
+#include "pipeline.h"
+
 #define DEBUG_SKIP_FLASH_SYSTEM 0
 #define DEBUG_SKIP_FLASH_CSC    0
 #define DEBUG_SKIP_FLASH_BOOT   0
 
+// Write to block devices with O_DIRECT
+#define USE_DIRECT_IO           1
+
+// Number and size of the buffers between each pipeline stage
+#define PIPELINE_BUF_COUNT      4
+#define PIPELINE_BUF_SIZE       (4 * 1024 * 1024)
+
+// Checkpoint journal for resuming interrupted flashes. This must be on a
+// persistent partition that is not being flashed.
+#define JOURNAL_FILE            "/cache/odinupdater.journal"
+// Sync the output and update the journal after this many bytes
+#define CHECKPOINT_INTERVAL     (64 * 1024 * 1024)
+// Read back and compare this many bytes before the checkpoint when resuming
+#define RESUME_VERIFY_SIZE      (8 * 1024 * 1024)
+
 #define SYSTEM_SPARSE_FILE      "system.img.sparse"
 #define CACHE_SPARSE_FILE       "cache.img.sparse"
 #define BOOT_IMAGE_FILE         "boot.img"
@@ -88,6 +114,12 @@ static char sales_code[10];
 static std::string system_block_dev;
 static std::string boot_block_dev;
 
+static Journal journal;
+static bool journal_enabled;
+
+// Reads back flashed block devices in the background
+static mb::util::ReadBackVerifier verifier;
+
 MB_PRINTF(1, 2)
 void ui_print(const char *fmt, ...)
 {
@@ -368,25 +400,577 @@ static bool cb_zip_read(void *buf, uint64_t size, uint64_t *bytes_read,
     return true;
 }
 
-#if DEBUG_SKIP_FLASH_SYSTEM
-MB_UNUSED
+struct SparseProgress
+{
+    uint64_t old_bytes = 0;
+};
+
+static void cb_sparse_progress(uint64_t bytes, uint64_t total, void *user_data)
+{
+    SparseProgress *progress = static_cast<SparseProgress *>(user_data);
+
+    // Rate limit: update progress only after difference exceeds 0.1%
+    double old_ratio = (double) progress->old_bytes / total;
+    double new_ratio = (double) bytes / total;
+    if (new_ratio - old_ratio >= 0.001) {
+        set_progress(new_ratio);
+        progress->old_bytes = bytes;
+    }
+}
+
+/*!
+ * \brief Load the checkpoint journal if it belongs to the current zip file
+ */
+static void load_journal()
+{
+    struct stat sb;
+
+    journal_enabled = false;
+
+    if (stat(zip_file, &sb) < 0) {
+        error("%s: Failed to stat: %s", zip_file, strerror(errno));
+        return;
+    }
+
+    if (journal_load(JOURNAL_FILE, &journal)
+            && journal.zip_size == static_cast<uint64_t>(sb.st_size)
+            && journal.zip_mtime == sb.st_mtime) {
+        info("Loaded checkpoint journal from %s", JOURNAL_FILE);
+    } else {
+        journal = Journal();
+        journal.zip_size = sb.st_size;
+        journal.zip_mtime = sb.st_mtime;
+    }
+
+    journal_enabled = true;
+}
+
+/*!
+ * \brief Save the checkpoint journal
+ *
+ * Failures are not fatal. Flashing just won't be resumable.
+ */
+static void save_journal()
+{
+    if (journal_enabled && !journal_save(JOURNAL_FILE, journal)) {
+        error("WARNING: %s: Failed to save journal: %s",
+              JOURNAL_FILE, strerror(errno));
+        journal_enabled = false;
+    }
+}
+
+static bool is_block_device(const char *path)
+{
+    struct stat sb;
+    return stat(path, &sb) == 0 && S_ISBLK(sb.st_mode);
+}
+
+/*!
+ * \brief Get the journal record for flashing a zip entry to a block device
+ *
+ * \return Journal record or nullptr if the target cannot be resumed
+ */
+static JournalRecord * get_journal_record(const char *zip_filename,
+                                          const char *out_filename)
+{
+    // Regular files are truncated when they are opened, so they can't be
+    // resumed
+    if (!journal_enabled || !is_block_device(out_filename)) {
+        return nullptr;
+    }
+
+    return journal_get(&journal, out_filename, zip_filename);
+}
+
+struct WriterData
+{
+    // Only used for raw files. The progress of sparse files is reported by
+    // the expansion stage.
+    SparseProgress progress;
+    uint64_t total = 0;
+
+    JournalRecord *record = nullptr;
+
+    // Digest of the data written to a block device
+    mb::util::WriteDigest digest;
+};
+
+static void cb_writer_progress(uint64_t bytes, void *user_data)
+{
+    WriterData *data = static_cast<WriterData *>(user_data);
+
+    if (data->total > 0) {
+        cb_sparse_progress(bytes, data->total, &data->progress);
+    }
+}
+
+// Called on the writer thread. The main thread does not touch the journal
+// while the pipeline is running.
+static void cb_writer_checkpoint(uint64_t offset, void *user_data)
+{
+    WriterData *data = static_cast<WriterData *>(user_data);
+
+    data->record->offset = offset;
+    save_journal();
+}
+
+/*!
+ * \brief Set up the writer to resume from and update the journal record
+ */
+static void setup_checkpoints(PipelineWriter *writer, WriterData *data)
+{
+    JournalRecord *record = data->record;
+
+    if (!record) {
+        return;
+    }
+
+    if (record->offset > 0) {
+        writer->resume_offset = record->offset;
+        writer->verify_offset = record->offset > RESUME_VERIFY_SIZE
+                ? (record->offset - RESUME_VERIFY_SIZE)
+                        / PIPELINE_ALIGNMENT * PIPELINE_ALIGNMENT
+                : 0;
+
+        ui_print("Resuming interrupted flash at %" PRIu64 " MiB",
+                 record->offset / 1024 / 1024);
+    }
+
+    writer->checkpoint_interval = CHECKPOINT_INTERVAL;
+    writer->checkpoint_cb = &cb_writer_checkpoint;
+    writer->user_data = data;
+}
+
+/*!
+ * \brief Discard the checkpoint after the data before it failed verification
+ */
+static void reset_checkpoint(WriterData *data, const char *out_filename)
+{
+    error("%s: Previously flashed data does not match the checkpoint journal",
+          out_filename);
+    ui_print("Could not resume. Flashing from the beginning");
+
+    data->record->offset = 0;
+    save_journal();
+}
+
+static void complete_checkpoint(WriterData *data)
+{
+    if (data->record) {
+        data->record->complete = true;
+        save_journal();
+    }
+}
+
+/*!
+ * \brief Hash the data written to block devices so that it can be verified
+ */
+static void setup_verification(PipelineWriter *writer, WriterData *data,
+                               const char *out_filename)
+{
+    if (is_block_device(out_filename)) {
+        writer->digest = &data->digest;
+    }
+}
+
+/*!
+ * \brief Read back the written data in the background
+ *
+ * This overlaps with flashing the next target. finish_verification() must be
+ * called before the target is mounted or modified.
+ */
+static void queue_verification(PipelineWriter *writer, WriterData *data,
+                               const char *out_filename)
+{
+    if (!writer->digest) {
+        return;
+    }
+
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    data->digest.finish(digest);
+
+    if (!verifier.submit(out_filename, data->digest.extents(), digest)) {
+        error("WARNING: %s: Failed to queue verification: %s",
+              out_filename, strerror(errno));
+    }
+}
+
+/*!
+ * \brief Wait for the flashed data to be read back and compared
+ *
+ * If a target does not match what was written, its checkpoint is discarded so
+ * that it will be flashed from the beginning next time.
+ */
+static bool finish_verification()
+{
+    std::vector<std::string> failed;
+
+    if (verifier.wait(&failed)) {
+        return true;
+    }
+
+    for (const std::string &path : failed) {
+        error("%s: Flashed data could not be verified", path.c_str());
+
+        for (JournalRecord &record : journal.records) {
+            if (record.target == path) {
+                record.offset = 0;
+                record.complete = false;
+            }
+        }
+    }
+
+    save_journal();
+
+    return false;
+}
+
+/*!
+ * \brief Open the output file for the writer stage
+ *
+ * If \a read_back is true, the file is also opened for reading so that the
+ * writer can verify previously written data when resuming.
+ *
+ * Block devices are opened with O_DIRECT (if enabled) so that the writes
+ * bypass the page cache. Otherwise, the writer would mostly be filling the page
+ * cache and the real cost of the writes would be paid at close().
+ */
+static int open_output(const char *path, bool read_back, bool *direct)
+{
+    int flags = O_CREAT | O_TRUNC | O_CLOEXEC | O_LARGEFILE
+            | (read_back ? O_RDWR : O_WRONLY);
+
+    *direct = false;
+
+#if USE_DIRECT_IO
+    struct stat sb;
+    if (stat(path, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+        int fd = open64(path, flags | O_DIRECT, 0600);
+        if (fd >= 0) {
+            *direct = true;
+            return fd;
+        }
+        info("%s: Failed to open with O_DIRECT: %s", path, strerror(errno));
+    }
 #endif
-static ExtractResult extract_sparse_file(const char *zip_filename,
-                                         const char *out_filename)
+
+    return open64(path, flags, 0600);
+}
+
+struct DecompressStage
 {
+    archive *a;
+    const char *zip_filename;
+    BufferRing *ring;
+    PipelineStats stats;
+    bool failed = false;
+};
+
+/*!
+ * \brief Thread entry point for the decompression stage
+ *
+ * Reads the current archive entry into buffers from the ring. The buffers are
+ * filled completely (except for the last one) so that the following stages
+ * always see large, aligned blocks of data.
+ */
+static void * decompress_thread(void *data)
+{
+    DecompressStage *stage = static_cast<DecompressStage *>(data);
+    double start = pipeline_now();
+    PipelineBuffer *buf;
+
+    while ((buf = stage->ring->acquire())) {
+        la_ssize_t n = 0;
+
+        buf->offset = stage->stats.bytes;
+
+        while (buf->size < buf->capacity
+                && (n = archive_read_data(stage->a, buf->data + buf->size,
+                                          buf->capacity - buf->size)) > 0) {
+            buf->size += n;
+        }
+
+        if (n < 0) {
+            error("libarchive: %s: Failed to read %s: %s",
+                  zip_file, stage->zip_filename,
+                  archive_error_string(stage->a));
+            stage->failed = true;
+            stage->ring->abort();
+            break;
+        }
+
+        stage->stats.bytes += buf->size;
+        stage->ring->commit(buf);
+
+        if (n == 0 && buf->size < buf->capacity) {
+            stage->ring->finish();
+            break;
+        }
+    }
+
+    stage->stats.total_secs = pipeline_now() - start;
+    stage->stats.wait_secs = stage->ring->producer_wait();
+
+    return nullptr;
+}
+
+struct RingReader
+{
+    BufferRing *ring;
+    PipelineBuffer *buf = nullptr;
+    size_t pos = 0;
+};
+
+static bool cb_ring_read(void *buf, uint64_t size, uint64_t *bytes_read,
+                         void *user_data)
+{
+    RingReader *reader = static_cast<RingReader *>(user_data);
+    uint64_t total = 0;
+
+    while (size > 0) {
+        if (!reader->buf) {
+            reader->buf = reader->ring->take();
+            reader->pos = 0;
+
+            if (!reader->buf) {
+                if (reader->ring->aborted()) {
+                    return false;
+                }
+                // EOF
+                break;
+            }
+        }
+
+        size_t n = std::min<uint64_t>(size, reader->buf->size - reader->pos);
+        memcpy(buf, reader->buf->data + reader->pos, n);
+        reader->pos += n;
+        total += n;
+        size -= n;
+        buf = static_cast<char *>(buf) + n;
+
+        if (reader->pos == reader->buf->size) {
+            reader->ring->release(reader->buf);
+            reader->buf = nullptr;
+        }
+    }
+
+    *bytes_read = total;
+    return true;
+}
+
+struct RingWriter
+{
+    BufferRing *ring;
+    PipelineBuffer *buf = nullptr;
+    // Data below this offset is not needed by the writer when resuming
+    uint64_t skip_below = 0;
+    SparseProgress progress;
+};
+
+/*!
+ * \brief Write callback for sparseFlashCb()
+ *
+ * Contiguous writes are coalesced into the ring's buffers, so the writer stage
+ * only sees large writes. Don't care chunks are never passed here, so they
+ * become gaps between buffers.
+ */
+static bool cb_ring_write(const void *data, uint64_t size, uint64_t offset,
+                          void *user_data)
+{
+    RingWriter *writer = static_cast<RingWriter *>(user_data);
+
+    if (offset + size <= writer->skip_below) {
+        return true;
+    } else if (offset < writer->skip_below) {
+        data = static_cast<const char *>(data) + (writer->skip_below - offset);
+        size -= writer->skip_below - offset;
+        offset = writer->skip_below;
+    }
+
+    while (size > 0) {
+        if (writer->buf && (writer->buf->size == writer->buf->capacity
+                || writer->buf->offset + writer->buf->size != offset)) {
+            writer->ring->commit(writer->buf);
+            writer->buf = nullptr;
+        }
+
+        if (!writer->buf) {
+            writer->buf = writer->ring->acquire();
+            if (!writer->buf) {
+                return false;
+            }
+            writer->buf->offset = offset;
+        }
+
+        size_t n = std::min<uint64_t>(
+                size, writer->buf->capacity - writer->buf->size);
+        memcpy(writer->buf->data + writer->buf->size, data, n);
+        writer->buf->size += n;
+        offset += n;
+        size -= n;
+        data = static_cast<const char *>(data) + n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Zero callback for sparseFlashCb()
+ *
+ * Zero-filled ranges are passed to the writer stage as zero records instead of
+ * being expanded, so that the writer can use BLKZEROOUT on block devices.
+ */
+static bool cb_ring_zero(uint64_t size, uint64_t offset, void *user_data)
+{
+    RingWriter *writer = static_cast<RingWriter *>(user_data);
+
+    if (offset + size <= writer->skip_below) {
+        return true;
+    } else if (offset < writer->skip_below) {
+        size -= writer->skip_below - offset;
+        offset = writer->skip_below;
+    }
+
+    if (writer->buf) {
+        writer->ring->commit(writer->buf);
+        writer->buf = nullptr;
+    }
+
+    while (size > 0) {
+        PipelineBuffer *buf = writer->ring->acquire();
+        if (!buf) {
+            return false;
+        }
+
+        buf->zero = true;
+        buf->offset = offset;
+        buf->size = std::min<uint64_t>(size, PIPELINE_MAX_ZERO_SIZE);
+        offset += buf->size;
+        size -= buf->size;
+
+        writer->ring->commit(buf);
+    }
+
+    return true;
+}
+
+static void cb_ring_progress(uint64_t bytes, uint64_t total, void *user_data)
+{
+    RingWriter *writer = static_cast<RingWriter *>(user_data);
+    cb_sparse_progress(bytes, total, &writer->progress);
+}
+
+struct SeekableStream
+{
+    RingReader *reader;
+    RingWriter *writer;
+    uint64_t total = 0;
+};
+
+static bool cb_seekable_read(void *buf, uint64_t size, uint64_t *bytes_read,
+                             void *user_data)
+{
+    SeekableStream *stream = static_cast<SeekableStream *>(user_data);
+    return cb_ring_read(buf, size, bytes_read, stream->reader);
+}
+
+static bool cb_seekable_write(const void *data, uint64_t size, uint64_t offset,
+                              void *user_data)
+{
+    SeekableStream *stream = static_cast<SeekableStream *>(user_data);
+    return cb_ring_write(data, size, offset, stream->writer);
+}
+
+static bool cb_seekable_zero(uint64_t size, uint64_t offset, void *user_data)
+{
+    SeekableStream *stream = static_cast<SeekableStream *>(user_data);
+    return cb_ring_zero(size, offset, stream->writer);
+}
+
+static void cb_seekable_progress(uint64_t bytes, uint64_t total,
+                                 void *user_data)
+{
+    SeekableStream *stream = static_cast<SeekableStream *>(user_data);
+    stream->total = total;
+    cb_ring_progress(bytes, total, stream->writer);
+}
+
+/*!
+ * \brief Check if the entry is a seekable compressed sparse container
+ *
+ * The first buffer of the ring is kept in \a reader, so nothing is consumed.
+ */
+static bool is_seekable_container(RingReader *reader)
+{
+    if (!reader->buf) {
+        reader->buf = reader->ring->take();
+        reader->pos = 0;
+    }
+
+    uint32_t magic;
+    if (!reader->buf || reader->buf->size < sizeof(magic)) {
+        return false;
+    }
+
+    memcpy(&magic, reader->buf->data, sizeof(magic));
+    return mb_le32toh(magic) == SPARSE_SEEKABLE_MAGIC;
+}
+
+static void print_stats(const char *name, const PipelineStats *stats,
+                        size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        double active = stats[i].total_secs - stats[i].wait_secs;
+        double mib = (double) stats[i].bytes / 1024 / 1024;
+
+        info("%s: [%s] %.1f MiB in %.2fs (%.1f MiB/s while active,"
+             " %.2fs waiting)", name, stats[i].name, mib, stats[i].total_secs,
+             active > 0 ? mib / active : 0.0, stats[i].wait_secs);
+    }
+}
+
+static bool start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    int ret = pthread_create(thread, nullptr, fn, arg);
+    if (ret != 0) {
+        error("Failed to create thread: %s", strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Flash a sparse file from the zip
+ *
+ * This runs a three stage pipeline joined by buffer rings:
+ *
+ *   [decompress thread] -> [sparse expansion (this thread)] -> [writer thread]
+ *
+ * so that decompression, sparse processing, and writing to the block device
+ * all happen concurrently.
+ *
+ * If resuming from a checkpoint fails because the previously written data does
+ * not match, \a restart is set to true and the checkpoint is reset.
+ */
+static ExtractResult extract_sparse_file_once(const char *zip_filename,
+                                              const char *out_filename,
+                                              bool *restart)
+{
+    WriterData data;
+    data.record = get_journal_record(zip_filename, out_filename);
+    if (data.record && data.record->complete) {
+        ui_print("%s was already flashed. Skipping", zip_filename);
+        return ExtractResult::OK;
+    }
+
     ScopedArchive a{archive_read_new(), &archive_read_free};
     ScopedSparseCtx ctx{sparseCtxNew(), &sparseCtxFree};
-    char buf[10240];
-    uint64_t n;
-    bool sparse_ret;
+    BufferRing input(PIPELINE_BUF_COUNT, PIPELINE_BUF_SIZE);
+    BufferRing output(PIPELINE_BUF_COUNT, PIPELINE_BUF_SIZE);
     int fd;
-    uint64_t cur_bytes = 0;
-    uint64_t max_bytes = 0;
-    uint64_t old_bytes = 0;
-    double old_ratio;
-    double new_ratio;
+    bool direct;
 
-    if (!a || !ctx) {
+    if (!a || !ctx || !input.valid() || !output.valid()) {
         error("Out of memory");
         return ExtractResult::ERROR;
     }
@@ -401,14 +985,8 @@ static ExtractResult extract_sparse_file(const char *zip_filename,
         return result;
     }
 
-    if (!sparseOpen(ctx.get(), nullptr, nullptr, &cb_zip_read, nullptr, nullptr,
-                    a.get())) {
-        error("Failed to open sparse file");
-        return ExtractResult::ERROR;
-    }
-
-    fd = open64(out_filename,
-                O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE, 0600);
+    fd = open_output(out_filename, data.record && data.record->offset > 0,
+                     &direct);
     if (fd < 0) {
         error("%s: Failed to open: %s", out_filename, strerror(errno));
         return ExtractResult::ERROR;
@@ -418,56 +996,139 @@ static ExtractResult extract_sparse_file(const char *zip_filename,
         close(fd);
     });
 
-    sparseSize(ctx.get(), &max_bytes);
+    DecompressStage decompress;
+    decompress.a = a.get();
+    decompress.zip_filename = zip_filename;
+    decompress.ring = &input;
+    decompress.stats.name = "decompress";
+
+    PipelineWriter writer;
+    writer.fd = fd;
+    writer.direct = direct;
+    writer.ring = &output;
+    writer.stats.name = "write";
+    setup_checkpoints(&writer, &data);
+    setup_verification(&writer, &data, out_filename);
+
+    RingReader reader;
+    reader.ring = &input;
+
+    RingWriter expander;
+    expander.ring = &output;
+    expander.skip_below = writer.verify_offset;
+
+    PipelineStats expand_stats;
+    expand_stats.name = "expand";
+
+    pthread_t decompress_tid;
+    pthread_t writer_tid;
+
+    if (!start_thread(&decompress_tid, &decompress_thread, &decompress)) {
+        return ExtractResult::ERROR;
+    }
+    if (!start_thread(&writer_tid, &pipeline_write_thread, &writer)) {
+        input.abort();
+        pthread_join(decompress_tid, nullptr);
+        return ExtractResult::ERROR;
+    }
 
     set_progress(0);
 
-    while ((sparse_ret = sparseRead(ctx.get(), buf, sizeof(buf), &n)) && n > 0) {
-        // Rate limit: update progress only after difference exceeds 0.1%
-        old_ratio = (double) old_bytes / max_bytes;
-        new_ratio = (double) cur_bytes / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
-            old_bytes = cur_bytes;
+    double start = pipeline_now();
+
+    // Images with CRC32 chunks or an image checksum are verified while they are
+    // being flashed
+    sparseSetVerifyCrc32(ctx.get(), true);
+
+    // Only raw and fill chunks are written. Don't care chunks are skipped and
+    // zero-filled chunks are zeroed by the writer stage.
+    bool ret;
+    if (is_seekable_container(&reader)) {
+        // Compressed frames are expanded in parallel. Each frame's CRC32 is
+        // always verified.
+        SeekableStream stream;
+        stream.reader = &reader;
+        stream.writer = &expander;
+
+        ret = sparseSeekableFlashStream(&cb_seekable_read, &cb_seekable_write,
+                                        &cb_seekable_zero,
+                                        &cb_seekable_progress, 0, &stream);
+        expand_stats.bytes = stream.total;
+    } else {
+        ret = sparseOpen(ctx.get(), nullptr, nullptr, &cb_ring_read, nullptr,
+                         nullptr, &reader)
+                && sparseFlashCb(ctx.get(), &cb_ring_write, &cb_ring_zero,
+                                 &cb_ring_progress, &expander);
+        if (ret) {
+            sparseSize(ctx.get(), &expand_stats.bytes);
+        }
+    }
+    if (ret) {
+        if (expander.buf) {
+            output.commit(expander.buf);
         }
+        output.finish();
+    } else {
+        output.abort();
+    }
 
-        char *out_ptr = buf;
-        ssize_t nwritten;
+    // The decompress stage may still be blocked if the sparse file did not
+    // consume the entire entry
+    input.abort();
 
-        do {
-            if ((nwritten = write(fd, out_ptr, n)) < 0) {
-                error("%s: Failed to write: %s",
-                      out_filename, strerror(errno));
-                return ExtractResult::ERROR;
-            }
+    pthread_join(decompress_tid, nullptr);
+    pthread_join(writer_tid, nullptr);
 
-            n -= nwritten;
-            out_ptr += nwritten;
-            cur_bytes += nwritten;
-        } while (n > 0);
-    }
-    if (!sparse_ret) {
-        error("Failed to read sparse file %s", zip_filename);
+    expand_stats.total_secs = pipeline_now() - start;
+    expand_stats.wait_secs = input.consumer_wait() + output.producer_wait();
+
+    if (writer.verify_failed) {
+        reset_checkpoint(&data, out_filename);
+        *restart = true;
+        return ExtractResult::ERROR;
+    } else if (decompress.failed) {
+        return ExtractResult::ERROR;
+    } else if (writer.error != 0) {
+        error("%s: Failed to write at offset %" PRIu64 ": %s", out_filename,
+              writer.error_offset, strerror(writer.error));
+        return ExtractResult::ERROR;
+    } else if (!ret) {
+        error("Failed to write sparse file %s to %s",
+              zip_filename, out_filename);
         return ExtractResult::ERROR;
     }
 
+    PipelineStats stats[] = { decompress.stats, expand_stats, writer.stats };
+    print_stats(zip_filename, stats, sizeof(stats) / sizeof(stats[0]));
+
+    complete_checkpoint(&data);
+    queue_verification(&writer, &data, out_filename);
+
     return ExtractResult::OK;
 }
 
-static ExtractResult extract_raw_file(const char *zip_filename,
-                                      const char *out_filename)
+/*!
+ * \brief Extract a file from the zip
+ *
+ * Like extract_sparse_file(), but without the sparse expansion stage.
+ */
+static ExtractResult extract_raw_file_once(const char *zip_filename,
+                                           const char *out_filename,
+                                           bool *restart)
 {
+    WriterData data;
+    data.record = get_journal_record(zip_filename, out_filename);
+    if (data.record && data.record->complete) {
+        ui_print("%s was already flashed. Skipping", zip_filename);
+        return ExtractResult::OK;
+    }
+
     ScopedArchive a{archive_read_new(), &archive_read_free};
-    char buf[10240];
-    la_ssize_t n;
+    BufferRing ring(PIPELINE_BUF_COUNT, PIPELINE_BUF_SIZE);
     int fd;
-    uint64_t cur_bytes = 0;
-    uint64_t max_bytes = 0;
-    uint64_t old_bytes = 0;
-    double old_ratio;
-    double new_ratio;
+    bool direct;
 
-    if (!a) {
+    if (!a || !ring.valid()) {
         error("Out of memory");
         return ExtractResult::ERROR;
     }
@@ -482,10 +1143,8 @@ static ExtractResult extract_raw_file(const char *zip_filename,
         return result;
     }
 
-    max_bytes = archive_entry_size(entry);
-
-    fd = open64(out_filename,
-                O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE, 0600);
+    fd = open_output(out_filename, data.record && data.record->offset > 0,
+                     &direct);
     if (fd < 0) {
         error("%s: Failed to open: %s", out_filename, strerror(errno));
         return ExtractResult::ERROR;
@@ -495,40 +1154,85 @@ static ExtractResult extract_raw_file(const char *zip_filename,
         close(fd);
     });
 
-    set_progress(0);
+    data.total = archive_entry_size(entry);
 
-    while ((n = archive_read_data(a.get(), buf, sizeof(buf))) > 0) {
-        // Rate limit: update progress only after difference exceeds 0.1%
-        old_ratio = (double) old_bytes / max_bytes;
-        new_ratio = (double) cur_bytes / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
-            old_bytes = cur_bytes;
-        }
+    DecompressStage decompress;
+    decompress.a = a.get();
+    decompress.zip_filename = zip_filename;
+    decompress.ring = &ring;
+    decompress.stats.name = "decompress";
 
-        char *out_ptr = buf;
-        ssize_t nwritten;
+    PipelineWriter writer;
+    writer.fd = fd;
+    writer.direct = direct;
+    writer.ring = &ring;
+    writer.progress_cb = &cb_writer_progress;
+    writer.user_data = &data;
+    writer.stats.name = "write";
+    setup_checkpoints(&writer, &data);
+    setup_verification(&writer, &data, out_filename);
 
-        do {
-            if ((nwritten = write(fd, out_ptr, n)) < 0) {
-                error("%s: Failed to write: %s",
-                      out_filename, strerror(errno));
-                return ExtractResult::ERROR;
-            }
+    pthread_t writer_tid;
+
+    set_progress(0);
 
-            n -= nwritten;
-            out_ptr += nwritten;
-        } while (n > 0);
+    if (!start_thread(&writer_tid, &pipeline_write_thread, &writer)) {
+        return ExtractResult::ERROR;
     }
-    if (n != 0) {
-        error("libarchive: %s: Failed to read %s: %s",
-              zip_file, zip_filename, archive_error_string(a.get()));
+
+    decompress_thread(&decompress);
+
+    pthread_join(writer_tid, nullptr);
+
+    if (writer.verify_failed) {
+        reset_checkpoint(&data, out_filename);
+        *restart = true;
+        return ExtractResult::ERROR;
+    } else if (decompress.failed) {
+        return ExtractResult::ERROR;
+    } else if (writer.error != 0) {
+        error("%s: Failed to write at offset %" PRIu64 ": %s", out_filename,
+              writer.error_offset, strerror(writer.error));
         return ExtractResult::ERROR;
     }
 
+    PipelineStats stats[] = { decompress.stats, writer.stats };
+    print_stats(zip_filename, stats, sizeof(stats) / sizeof(stats[0]));
+
+    complete_checkpoint(&data);
+    queue_verification(&writer, &data, out_filename);
+
     return ExtractResult::OK;
 }
 
+#if DEBUG_SKIP_FLASH_SYSTEM
+MB_UNUSED
+#endif
+static ExtractResult extract_sparse_file(const char *zip_filename,
+                                         const char *out_filename)
+{
+    bool restart = false;
+    ExtractResult result = extract_sparse_file_once(
+            zip_filename, out_filename, &restart);
+    if (restart) {
+        // The checkpoint has been reset, so this cannot restart again
+        result = extract_sparse_file_once(zip_filename, out_filename, &restart);
+    }
+    return result;
+}
+
+static ExtractResult extract_raw_file(const char *zip_filename,
+                                      const char *out_filename)
+{
+    bool restart = false;
+    ExtractResult result = extract_raw_file_once(
+            zip_filename, out_filename, &restart);
+    if (restart) {
+        result = extract_raw_file_once(zip_filename, out_filename, &restart);
+    }
+    return result;
+}
+
 static bool copy_dir_if_exists(const char *source_dir,
                                const char *target_dir)
 {
@@ -786,6 +1490,12 @@ static ExtractResult flash_csc()
         retry_unmount(TEMP_CACHE_MOUNT_DIR, 5);
     });
 
+    // The system image must not be modified while it is being read back
+    if (!finish_verification()) {
+        error("Failed to verify system image");
+        return ExtractResult::ERROR;
+    }
+
     // Mount system
     if (!mount_system()) {
         error("Failed to mount system");
@@ -842,6 +1552,9 @@ static bool flash_zip()
         return false;
     }
 
+    // Resume from where a previous interrupted attempt left off
+    load_journal();
+
 #if !DEBUG_SKIP_FLASH_SYSTEM || !DEBUG_SKIP_FLASH_CSC || !DEBUG_SKIP_FLASH_BOOT
     ExtractResult result;
 #endif
@@ -891,6 +1604,16 @@ static bool flash_zip()
     ui_print("Successfully flashed boot image");
 #endif
 
+    ui_print("Verifying flashed data");
+    if (!finish_verification()) {
+        ui_print("Failed to verify flashed data");
+        return false;
+    }
+
+    if (unlink(JOURNAL_FILE) < 0 && errno != ENOENT) {
+        error("%s: Failed to remove: %s", JOURNAL_FILE, strerror(errno));
+    }
+
     ui_print("---");
     ui_print("Flashing completed. The bootloader");
     ui_print("and non-system partitions were left");
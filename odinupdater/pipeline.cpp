@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+// Size of the zero-filled buffer used for zero records
+#define PIPELINE_ZERO_BUF_SIZE  (1024 * 1024)
+
+double pipeline_now()
+{
+    using namespace std::chrono;
+    return duration_cast<duration<double>>(
+            steady_clock::now().time_since_epoch()).count();
+}
+
+BufferRing::BufferRing(size_t count, size_t capacity)
+    : _buffers(count)
+    , _valid(true)
+    , _finished(false)
+    , _aborted(false)
+    , _producer_wait(0)
+    , _consumer_wait(0)
+{
+    for (PipelineBuffer &buf : _buffers) {
+        void *ptr;
+        if (posix_memalign(&ptr, PIPELINE_ALIGNMENT, capacity) != 0) {
+            buf.data = nullptr;
+            _valid = false;
+            continue;
+        }
+
+        buf.data = static_cast<char *>(ptr);
+        buf.capacity = capacity;
+        buf.size = 0;
+        buf.offset = 0;
+        buf.zero = false;
+        _free.push_back(&buf);
+    }
+}
+
+BufferRing::~BufferRing()
+{
+    for (PipelineBuffer &buf : _buffers) {
+        free(buf.data);
+    }
+}
+
+bool BufferRing::valid() const
+{
+    return _valid;
+}
+
+/*!
+ * \brief Get an empty buffer, blocking until one is available
+ *
+ * \return Empty buffer or nullptr if the ring was aborted
+ */
+PipelineBuffer * BufferRing::acquire()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    double start = pipeline_now();
+
+    _cond.wait(lock, [&]{ return _aborted || !_free.empty(); });
+    _producer_wait += pipeline_now() - start;
+
+    if (_aborted) {
+        return nullptr;
+    }
+
+    PipelineBuffer *buf = _free.front();
+    _free.pop_front();
+    buf->size = 0;
+    buf->offset = 0;
+    buf->zero = false;
+    return buf;
+}
+
+/*!
+ * \brief Pass a filled buffer to the consumer
+ *
+ * Empty buffers are returned to the free list instead.
+ */
+void BufferRing::commit(PipelineBuffer *buf)
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (buf->size == 0) {
+            _free.push_back(buf);
+        } else {
+            _filled.push_back(buf);
+        }
+    }
+    _cond.notify_all();
+}
+
+/*!
+ * \brief Indicate that the producer will not commit any more buffers
+ */
+void BufferRing::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _finished = true;
+    }
+    _cond.notify_all();
+}
+
+/*!
+ * \brief Get the next filled buffer, blocking until one is available
+ *
+ * \return Filled buffer or nullptr if the producer has finished and all
+ *         buffers have been consumed or if the ring was aborted
+ */
+PipelineBuffer * BufferRing::take()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    double start = pipeline_now();
+
+    _cond.wait(lock, [&]{ return _aborted || _finished || !_filled.empty(); });
+    _consumer_wait += pipeline_now() - start;
+
+    if (_aborted || _filled.empty()) {
+        return nullptr;
+    }
+
+    PipelineBuffer *buf = _filled.front();
+    _filled.pop_front();
+    return buf;
+}
+
+/*!
+ * \brief Return a consumed buffer to the producer
+ */
+void BufferRing::release(PipelineBuffer *buf)
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _free.push_back(buf);
+    }
+    _cond.notify_all();
+}
+
+/*!
+ * \brief Stop the pipeline
+ *
+ * All blocked and future calls to acquire() and take() return nullptr. This is
+ * used to propagate errors in either direction and to stop a producer that the
+ * consumer no longer needs data from.
+ */
+void BufferRing::abort()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _aborted = true;
+    }
+    _cond.notify_all();
+}
+
+bool BufferRing::aborted()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _aborted;
+}
+
+double BufferRing::producer_wait()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _producer_wait;
+}
+
+double BufferRing::consumer_wait()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _consumer_wait;
+}
+
+static bool disable_direct_io(PipelineWriter *writer)
+{
+    int flags = fcntl(writer->fd, F_GETFL);
+    if (flags < 0 || fcntl(writer->fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+        return false;
+    }
+    writer->direct = false;
+    return true;
+}
+
+static bool write_fully_at(PipelineWriter *writer, const char *data,
+                           size_t size, uint64_t offset)
+{
+    // O_DIRECT requires the offset and size to be aligned to the logical block
+    // size. Only the last write of a raw image is typically misaligned.
+    if (writer->direct && (offset % PIPELINE_ALIGNMENT != 0
+            || size % PIPELINE_ALIGNMENT != 0)
+            && !disable_direct_io(writer)) {
+        writer->error = errno;
+        writer->error_offset = offset;
+        return false;
+    }
+
+    while (size > 0) {
+        ssize_t n = pwrite64(writer->fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EINVAL && writer->direct
+                    && disable_direct_io(writer)) {
+                continue;
+            }
+            writer->error = errno;
+            writer->error_offset = offset;
+            return false;
+        }
+
+        data += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+static bool read_fully_at(PipelineWriter *writer, char *data, size_t size,
+                          uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = pread64(writer->fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EINVAL && writer->direct
+                    && disable_direct_io(writer)) {
+                continue;
+            }
+            writer->error = errno;
+            writer->error_offset = offset;
+            return false;
+        } else if (n == 0) {
+            writer->error = EIO;
+            writer->error_offset = offset;
+            return false;
+        }
+
+        data += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compare the data with what is already in the output file
+ */
+static bool verify_at(PipelineWriter *writer, const char *data, size_t size,
+                      uint64_t offset)
+{
+    if (size == 0) {
+        return true;
+    }
+
+    void *ptr;
+    if (posix_memalign(&ptr, PIPELINE_ALIGNMENT, size) != 0) {
+        writer->error = ENOMEM;
+        writer->error_offset = offset;
+        return false;
+    }
+
+    char *buf = static_cast<char *>(ptr);
+    bool ret = read_fully_at(writer, buf, size, offset);
+
+    if (ret && memcmp(buf, data, size) != 0) {
+        writer->verify_failed = true;
+        ret = false;
+    }
+
+    free(buf);
+    return ret;
+}
+
+/*!
+ * \brief Zero a range of the output
+ *
+ * BLKZEROOUT lets the device zero the range without transferring the data.
+ * It is only attempted for block devices and falls back to writing zeros.
+ */
+static bool zero_fully_at(PipelineWriter *writer, uint64_t size,
+                          uint64_t offset)
+{
+    if (size == 0) {
+        return true;
+    }
+
+#ifdef BLKZEROOUT
+    struct stat sb;
+    if (offset % 512 == 0 && size % 512 == 0
+            && fstat(writer->fd, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+        uint64_t range[2] = { offset, size };
+        if (ioctl(writer->fd, BLKZEROOUT, &range) == 0) {
+            return true;
+        }
+    }
+#endif
+
+    while (size > 0) {
+        size_t n = std::min<uint64_t>(size, PIPELINE_ZERO_BUF_SIZE);
+        if (!write_fully_at(writer, writer->zero_buf, n, offset)) {
+            return false;
+        }
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Process a zero record
+ *
+ * This is the same as process_buffer(), except that zeros are verified,
+ * hashed, and written in pieces of the zero buffer's size.
+ */
+static bool process_zero(PipelineWriter *writer, const PipelineBuffer *buf)
+{
+    if (!writer->zero_buf) {
+        void *ptr;
+        if (posix_memalign(&ptr, PIPELINE_ALIGNMENT,
+                           PIPELINE_ZERO_BUF_SIZE) != 0) {
+            writer->error = ENOMEM;
+            writer->error_offset = buf->offset;
+            return false;
+        }
+        memset(ptr, 0, PIPELINE_ZERO_BUF_SIZE);
+        writer->zero_buf = static_cast<char *>(ptr);
+    }
+
+    uint64_t begin = buf->offset;
+    uint64_t end = buf->offset + buf->size;
+
+    begin = std::max(begin, std::min(end, writer->verify_offset));
+    uint64_t verify_end = std::min(end, std::max(begin,
+                                                 writer->resume_offset));
+
+    for (uint64_t offset = begin; offset < verify_end;) {
+        size_t n = std::min<uint64_t>(verify_end - offset,
+                                      PIPELINE_ZERO_BUF_SIZE);
+        if (!verify_at(writer, writer->zero_buf, n, offset)) {
+            return false;
+        }
+        offset += n;
+    }
+
+    if (!zero_fully_at(writer, end - verify_end, verify_end)) {
+        return false;
+    }
+
+    if (writer->digest) {
+        for (uint64_t offset = begin; offset < end;) {
+            size_t n = std::min<uint64_t>(end - offset,
+                                          PIPELINE_ZERO_BUF_SIZE);
+            writer->digest->update(writer->zero_buf, n, offset);
+            offset += n;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write a buffer, skipping or verifying the parts that were already
+ *        written before resuming
+ */
+static bool process_buffer(PipelineWriter *writer, const PipelineBuffer *buf)
+{
+    if (buf->zero) {
+        return process_zero(writer, buf);
+    }
+
+    uint64_t begin = buf->offset;
+    uint64_t end = buf->offset + buf->size;
+
+    // Already written and not verified
+    begin = std::max(begin, std::min(end, writer->verify_offset));
+
+    // Already written, but needs to be verified
+    uint64_t verify_end = std::min(end, std::max(begin,
+                                                 writer->resume_offset));
+    if (!verify_at(writer, buf->data + (begin - buf->offset),
+                   verify_end - begin, begin)
+            || !write_fully_at(writer, buf->data + (verify_end - buf->offset),
+                               end - verify_end, verify_end)) {
+        return false;
+    }
+
+    if (writer->digest) {
+        writer->digest->update(buf->data + (begin - buf->offset),
+                               end - begin, begin);
+    }
+
+    return true;
+}
+
+static bool sync_output(PipelineWriter *writer)
+{
+    // Not all outputs can be synced (eg. pipes)
+    if (fdatasync(writer->fd) < 0 && errno != EINVAL) {
+        writer->error = errno;
+        writer->error_offset = writer->stats.bytes;
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Thread entry point for the writer stage
+ *
+ * On failure, \a PipelineWriter::error is set and the ring is aborted.
+ *
+ * \param data PipelineWriter
+ */
+void * pipeline_write_thread(void *data)
+{
+    PipelineWriter *writer = static_cast<PipelineWriter *>(data);
+    double start = pipeline_now();
+    uint64_t checkpoint = writer->resume_offset;
+    PipelineBuffer *buf;
+
+    while ((buf = writer->ring->take())) {
+        bool ret = process_buffer(writer, buf);
+        size_t size = buf->size;
+        uint64_t end = buf->offset + buf->size;
+        writer->ring->release(buf);
+
+        if (!ret) {
+            writer->ring->abort();
+            break;
+        }
+
+        writer->stats.bytes += size;
+
+        if (writer->checkpoint_interval > 0 && writer->checkpoint_cb
+                && end >= checkpoint + writer->checkpoint_interval) {
+            if (!sync_output(writer)) {
+                writer->ring->abort();
+                break;
+            }
+            writer->checkpoint_cb(end, writer->user_data);
+            checkpoint = end;
+        }
+
+        if (writer->progress_cb) {
+            writer->progress_cb(writer->stats.bytes, writer->user_data);
+        }
+    }
+
+    if (writer->error == 0 && !writer->ring->aborted()) {
+        sync_output(writer);
+    }
+
+    free(writer->zero_buf);
+    writer->zero_buf = nullptr;
+
+    writer->stats.total_secs = pipeline_now() - start;
+    writer->stats.wait_secs = writer->ring->consumer_wait();
+
+    return nullptr;
+}
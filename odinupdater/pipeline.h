@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbutil/verify.h"
+
+// Alignment of pipeline buffers. This satisfies the O_DIRECT requirements of
+// every block device we care about.
+#define PIPELINE_ALIGNMENT      4096
+
+// Maximum size of the range covered by a single zero record
+#define PIPELINE_MAX_ZERO_SIZE  (1024 * 1024 * 1024)
+
+struct PipelineBuffer
+{
+    char *data;
+    size_t capacity;
+    // Number of valid bytes in data (or number of zeros if zero is true)
+    size_t size;
+    // Offset in the output file that the data belongs to
+    uint64_t offset;
+    // If true, the buffer is a record for a range of zeros and data is not
+    // used. size can exceed capacity.
+    bool zero;
+};
+
+/*!
+ * \brief Bounded queue of preallocated buffers between two pipeline stages
+ *
+ * There must be exactly one producer thread and one consumer thread. The
+ * producer acquires empty buffers with acquire() and passes them on with
+ * commit(). The consumer receives them with take() and returns them with
+ * release(). Since the number of buffers is fixed, a fast stage blocks once it
+ * is a full ring ahead of a slow stage.
+ */
+class BufferRing
+{
+public:
+    BufferRing(size_t count, size_t capacity);
+    ~BufferRing();
+
+    BufferRing(const BufferRing &) = delete;
+    BufferRing & operator=(const BufferRing &) = delete;
+
+    bool valid() const;
+
+    // Producer side
+    PipelineBuffer * acquire();
+    void commit(PipelineBuffer *buf);
+    void finish();
+
+    // Consumer side
+    PipelineBuffer * take();
+    void release(PipelineBuffer *buf);
+
+    void abort();
+    bool aborted();
+
+    // Time spent blocked in acquire() and take(), respectively
+    double producer_wait();
+    double consumer_wait();
+
+private:
+    std::vector<PipelineBuffer> _buffers;
+    bool _valid;
+
+    std::mutex _lock;
+    std::condition_variable _cond;
+    std::deque<PipelineBuffer *> _free;
+    std::deque<PipelineBuffer *> _filled;
+    bool _finished;
+    bool _aborted;
+
+    double _producer_wait;
+    double _consumer_wait;
+};
+
+struct PipelineStats
+{
+    const char *name;
+    // Bytes processed by the stage
+    uint64_t bytes = 0;
+    // Wall clock time of the stage
+    double total_secs = 0;
+    // Time the stage spent waiting for its neighbors
+    double wait_secs = 0;
+};
+
+typedef void (*PipelineProgressCb)(uint64_t bytes, void *user_data);
+typedef void (*PipelineCheckpointCb)(uint64_t offset, void *user_data);
+
+/*!
+ * \brief Writer stage: writes buffers from a ring to a file descriptor
+ *
+ * If \a direct is true, \a fd was opened with O_DIRECT. O_DIRECT is turned off
+ * for the remainder of the file if a write is not suitably aligned or the
+ * kernel rejects it.
+ *
+ * When resuming an interrupted flash, data below \a resume_offset is not
+ * written again. Data in [\a verify_offset, \a resume_offset) is read back and
+ * compared instead (\a fd must be readable). If it does not match,
+ * \a verify_failed is set and the ring is aborted.
+ *
+ * If \a checkpoint_interval is nonzero, the output is synced after roughly
+ * every \a checkpoint_interval bytes and \a checkpoint_cb is called with the
+ * offset below which all data is durably written. This relies on the buffers
+ * arriving in increasing offset order.
+ *
+ * If \a digest is not nullptr, all data that is written or verified is added
+ * to it so that it can be read back and compared after the writer finishes.
+ *
+ * Zero records are zeroed with BLKZEROOUT if \a fd is a block device. If that
+ * is not possible, zeros are written instead.
+ */
+struct PipelineWriter
+{
+    int fd;
+    bool direct = false;
+    BufferRing *ring;
+
+    uint64_t resume_offset = 0;
+    uint64_t verify_offset = 0;
+    bool verify_failed = false;
+
+    uint64_t checkpoint_interval = 0;
+    PipelineCheckpointCb checkpoint_cb = nullptr;
+
+    mb::util::WriteDigest *digest = nullptr;
+
+    // Zero-filled buffer for zero records. Allocated when first needed.
+    char *zero_buf = nullptr;
+
+    PipelineProgressCb progress_cb = nullptr;
+    void *user_data = nullptr;
+
+    PipelineStats stats;
+
+    // errno and output offset of the failed write, if any
+    int error = 0;
+    uint64_t error_offset = 0;
+};
+
+double pipeline_now();
+
+void * pipeline_write_thread(void *writer);